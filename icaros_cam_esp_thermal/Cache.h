@@ -0,0 +1,109 @@
+/*++
+
+Module Name:
+
+    cache.h
+
+Abstract:
+
+    This file contains the definitions for the forwarded query response
+    cache.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+#pragma once
+
+EXTERN_C_START
+
+#define ESP_TZ_CACHE_ENTRIES 16
+#define ESP_TZ_CACHE_MAX_INPUT 32
+#define ESP_TZ_CACHE_MAX_RESPONSE 256
+
+#define ESP_TZ_ACPI_METHOD(A, B, C, D)                                      \
+    ((ULONG)(UCHAR)(A) | ((ULONG)(UCHAR)(B) << 8) |                         \
+     ((ULONG)(UCHAR)(C) << 16) | ((ULONG)(UCHAR)(D) << 24))
+
+//
+// A response is cached under its IOCTL and the whole input buffer of the
+// query. Every invalidation bumps Generation, so a response that was in
+// flight across an invalidation is not stored.
+//
+
+typedef struct {
+    BOOLEAN Valid;
+    ULONG IoControlCode;
+    ULONG InputLength;
+    UCHAR Input[ESP_TZ_CACHE_MAX_INPUT];
+    ULONG Length;
+    UCHAR Data[ESP_TZ_CACHE_MAX_RESPONSE];
+} ESP_TZ_CACHE_ENTRY, * PESP_TZ_CACHE_ENTRY;
+
+typedef struct {
+    WDFSPINLOCK Lock;
+    ULONG Generation;
+    ULONG Next;                     // Round-robin replacement index.
+    volatile LONG64 Hits;
+    volatile LONG64 Misses;
+    volatile LONG64 Invalidations;
+    ESP_TZ_CACHE_ENTRY Entries[ESP_TZ_CACHE_ENTRIES];
+} ESP_TZ_CACHE, * PESP_TZ_CACHE;
+
+//
+// Context attached to a forwarded request whose response is to be cached,
+// or which updates the policy behind the cached responses. The input is
+// copied when the request is forwarded, since a buffered response
+// overwrites it.
+//
+
+typedef struct {
+    ULONG IoControlCode;
+    ULONG InputLength;
+    UCHAR Input[ESP_TZ_CACHE_MAX_INPUT];
+    ULONG Generation;
+    BOOLEAN Invalidate;             // Policy update; invalidate on completion.
+} ESP_TZ_CACHE_REQUEST_CONTEXT, * PESP_TZ_CACHE_REQUEST_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE(ESP_TZ_CACHE_REQUEST_CONTEXT);
+
+NTSTATUS
+CameraESPTZCacheInitialize(
+    _In_ WDFDEVICE Device,
+    _Out_ PESP_TZ_CACHE Cache
+    );
+
+VOID
+CameraESPTZCacheInvalidate(
+    _Inout_ PESP_TZ_CACHE Cache
+    );
+
+BOOLEAN
+CameraESPTZCacheLookup(
+    _In_ PESP_TZ_CACHE Cache,
+    _In_ WDFREQUEST Request,
+    _In_ ULONG IoControlCode,
+    _In_reads_bytes_opt_(InputLength) PVOID Input,
+    _In_ ULONG InputLength
+    );
+
+VOID
+CameraESPTZCacheInsert(
+    _In_ PESP_TZ_CACHE Cache,
+    _In_ PESP_TZ_CACHE_REQUEST_CONTEXT Context,
+    _In_reads_bytes_(Length) PVOID Buffer,
+    _In_ ULONG Length
+    );
+
+VOID
+CameraESPTZForwardRequest(
+    _In_ WDFDEVICE Device,
+    _In_ WDFREQUEST Request,
+    _In_ ULONG IoControlCode
+    );
+
+EVT_WDF_REQUEST_COMPLETION_ROUTINE CameraESPTZEvtCacheRequestCompletion;
+
+EXTERN_C_END
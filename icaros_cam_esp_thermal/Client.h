@@ -0,0 +1,69 @@
+/*++
+
+Module Name:
+
+    client.h
+
+Abstract:
+
+    This file contains the definitions for per-client waiter tracking.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+#pragma once
+
+EXTERN_C_START
+
+#define ESP_TZ_CLIENT_DEFAULT_WAITER_QUOTA 64
+
+//
+// One client per open file object, plus a device default client for
+// requests that arrive without one. Waiters counts the client's requests in
+// the pending queue. The bounds and expiration are the tightest over those
+// requests as of the last scan; they are protected by the QueueLock along
+// with the device client list.
+//
+
+typedef struct _ESP_TZ_CLIENT {
+    LIST_ENTRY Link;
+    volatile LONG Waiters;
+    ULONG LowerBound;
+    ULONG UpperBound;
+    LONGLONG NextExpiration;        // System time, MAXLONGLONG if none.
+} ESP_TZ_CLIENT, * PESP_TZ_CLIENT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(ESP_TZ_CLIENT, ClientGetContext);
+
+VOID
+CameraESPTZClientInitialize(
+    _Out_ PESP_TZ_CLIENT Client
+    );
+
+PESP_TZ_CLIENT
+CameraESPTZClientFromRequest(
+    _In_ WDFDEVICE Device,
+    _In_ WDFREQUEST Request
+    );
+
+VOID
+CameraESPTZClientResetBounds(
+    _In_ WDFDEVICE Device
+    );
+
+VOID
+CameraESPTZClientAddBounds(
+    _Inout_ PESP_TZ_CLIENT Client,
+    _In_ ULONG LowerBound,
+    _In_ ULONG UpperBound,
+    _In_ LONGLONG Expiration
+    );
+
+EVT_WDF_DEVICE_FILE_CREATE CameraESPTZEvtDeviceFileCreate;
+EVT_WDF_FILE_CLEANUP CameraESPTZEvtFileCleanup;
+EVT_WDF_IO_QUEUE_IO_CANCELED_ON_QUEUE CameraESPTZEvtPendingRequestCanceled;
+
+EXTERN_C_END
@@ -33,13 +33,165 @@ Revision History:
 #include <wdmguid.h>
 #include <poclass.h>
 #include "Public.h"
+#include "Queue.h"
+#include "Filter.h"
+#include "Model.h"
+#include "Stats.h"
+#include "Recorder.h"
+#include "LowLatency.h"
+#include "Cache.h"
+#include "TripPoints.h"
+#include "Client.h"
+#include "History.h"
+#include "MultiWait.h"
+#include "Scheduler.h"
+#include "Mailbox.h"
+#include "Lock.h"
 
 //----------------------------------------------------------------- Definitions
 
+//
+// A published temperature with the interrupt time it was sampled at and the
+// number of samples pushed up to it.
+//
+
+typedef struct {
+    ULONG Temperature;
+    ULONGLONG Time;
+    ULONGLONG Sequence;
+} ESP_TZ_SAMPLE, * PESP_TZ_SAMPLE;
+
+//
+// Directions the published temperature has moved in since the last scan
+// started. A waiter left pending was checked against a temperature strictly
+// inside its bounds, so with no fall its lower bound cannot have been
+// reached since, and with no rise its upper bound cannot have been.
+//
+
+#define ESP_TZ_TREND_RISING     0x1
+#define ESP_TZ_TREND_FALLING    0x2
+
+//
+// Milliseconds without I/O before an idle device is powered down.
+//
+
+#define ESP_TZ_IDLE_DEFAULT_TIMEOUT 5000
+
+//
+// The published sample, saved to the device hardware key when the device is
+// stopped or removed. A device created again starts from it instead of the
+// reset temperature, as long as the sample is no older than
+// SavedStateMaximumAge seconds. The thresholds are not saved; they only
+// matter to waiters, and the first scan sets them.
+//
+
+#define ESP_TZ_SAVED_STATE_VALUE L"SavedSensorState"
+#define ESP_TZ_SAVED_STATE_VERSION 2
+#define ESP_TZ_SAVED_STATE_DEFAULT_MAXIMUM_AGE 300
+
+typedef struct {
+    ULONG Version;
+    ULONG Temperature;
+    ULONGLONG SystemTime;           // Of the sample.
+    ULONGLONG Sequence;
+} ESP_TZ_SAVED_STATE, * PESP_TZ_SAVED_STATE;
+
+//
+// A pending queue scan in progress. A scan runs in slices of one QueueLock
+// hold each; between slices the next request to visit is kept referenced,
+// with the sample the scan checks against and the bounds gathered so far.
+// Protected by the QueueLock.
+//
+
+typedef struct {
+    BOOLEAN Active;
+    BOOLEAN TripPointCrossed;
+    WDFREQUEST Request;             // Next request to visit, NULL at the end.
+    ESP_TZ_SAMPLE Sample;
+    ULONG Trend;                    // ESP_TZ_TREND_* up to Sample.
+    ULONG Generation;               // Of this scan, never zero.
+    ULONG LowerBound;
+    ULONG UpperBound;
+    LONGLONG NextExpiration;
+} ESP_TZ_SCAN_CURSOR, * PESP_TZ_SCAN_CURSOR;
+
 typedef struct {
     WDFQUEUE    PendingRequestQueue;
-    WDFWAITLOCK QueueLock;
+    ESP_TZ_CLASS_QUEUE ClassQueues[EspTzQueueClassMaximum];
+    ESP_TZ_IOCTL_COUNTERS IoctlCounters[ESP_TZ_IOCTL_SLOT_COUNT + 1];
+    ESP_TZ_STATS Stats;
+    ESP_TZ_RECORDER Recorder;
+    ESP_TZ_LOW_LATENCY LowLatency;
+    ESP_TZ_CACHE Cache;
+    ESP_TZ_HISTORY History;
+    ESP_TZ_MAILBOX Mailbox;
+    ESP_TZ_LOCK QueueLock;
     WDFWORKITEM InterruptWorker;
+    WDFTIMER    DeadlineTimer;          // Earliest pending request expiration.
+    ESP_TZ_SCAN_SCHEDULER Scheduler;
+    ESP_TZ_SCAN_CURSOR ScanCursor;
+
+    //
+    // Open clients, protected by the QueueLock. The default client stands in
+    // for requests without a file object and is always on the list.
+    //
+
+    LIST_ENTRY  ClientList;
+    ESP_TZ_CLIENT DefaultClient;
+    ULONG       ClientWaiterQuota;
+
+    //
+    // Pending queue scan counters. Protected by the QueueLock, except
+    // FastPathHits which is updated without it. The QueueLock keeps its own
+    // contention and hold time counters.
+    //
+
+    struct {
+        ULONGLONG Scans[EspTzScanTriggerMaximum];
+        ULONGLONG WaitersVisited;
+        ULONGLONG RetiredSatisfied;
+        ULONGLONG RetiredExpired;
+        ULONGLONG Restarts;
+        ULONGLONG OneSidedScans;
+        volatile LONG64 FastPathHits;
+        ULONGLONG CrossingTime;             // Crossing delivered by this scan.
+    } ScanStats;
+
+    //
+    // Contention and interrupt path counters. The contention and interrupt
+    // counts are updated with interlocked operations; the Sensor.Lock hold
+    // time is protected by the Sensor.Lock.
+    //
+
+    struct {
+        volatile LONG64 SensorLockContentions;
+        volatile LONG64 InterruptsRaised;
+        volatile LONG64 InterruptWorkerRuns;
+        volatile LONG64 CrossingTime;       // Earliest undelivered crossing.
+        ULONGLONG MaximumSensorLockHoldTime;
+        ULONGLONG SensorLockAcquireTime;
+    } LoadStats;
+
+    //
+    // Runtime idle state. Waiters counts the requests in the pending queue
+    // over all clients. While it is zero nothing consumes the virtual
+    // interrupt, so thresholds are not evaluated and the deadline and model
+    // timers are left stopped. SensorIdle notes that the sensor side has
+    // seen it, and is protected by the Sensor.Lock; the counters are updated
+    // with interlocked operations.
+    //
+
+    struct {
+        volatile LONG Waiters;
+        BOOLEAN SensorIdle;
+        ULONG Timeout;                      // S0 idle, milliseconds, 0 if never.
+        volatile LONG64 Entries;
+        volatile LONG64 Exits;
+        volatile LONG64 SkippedEvaluations;
+        volatile LONG64 DeadlineWakeups;
+        volatile LONG64 ModelWakeups;
+        volatile LONG64 PowerUps;
+    } Idle;
 
     //
     // Virtual temperature sensor internal state. This portion of the context
@@ -53,6 +205,14 @@ typedef struct {
         ULONG       LowerBound;
         ULONG       UpperBound;
         ULONG       Temperature;
+        ULONG       RawTemperature;
+        ULONGLONG   SampleTime;         // Interrupt time of Temperature.
+        ULONGLONG   Sequence;           // Samples pushed.
+        ULONG       Trend;              // ESP_TZ_TREND_* since the last scan.
+        ESP_TZ_FILTER Filter;
+        ESP_TZ_THERMAL_MODEL Model;
+        ESP_TZ_TRIP_POINTS TripPoints;
+        WDFTIMER    ModelTimer;
         WDFWAITLOCK Lock;
     } Sensor;
 } FDO_DATA, * PFDO_DATA;
@@ -63,6 +223,13 @@ typedef struct {
     LARGE_INTEGER ExpirationTime;
     ULONG HighTemperature;
     ULONG LowTemperature;
+    ULONGLONG QueuedTime;           // Interrupt time, 100ns units.
+    WDFREQUEST Next;                // Detached list link, see CameraESPTZDrainPendingQueue.
+    PESP_TZ_CLIENT Client;
+    PMULTI_WAIT_CONTEXT MultiWait;  // NULL for a single wait.
+    ULONG Slot;                     // IOCTL dispatch slot, for accounting.
+    ULONG ScanGeneration;           // Of the last scan to check it, or zero.
+    BOOLEAN ExtendedResult;         // Multi-wait or ESP_TZ_READ_RESULT output.
 } READ_REQUEST_CONTEXT, * PREAD_REQUEST_CONTEXT;
 
 WDF_DECLARE_CONTEXT_TYPE(READ_REQUEST_CONTEXT);
@@ -84,6 +251,37 @@ CameraESPTZAddReadRequest(
     _In_ WDFREQUEST ReadRequest
 );
 
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+CameraESPTZPendReadRequest(
+    _In_ WDFDEVICE Device,
+    _In_ WDFREQUEST Request,
+    _In_ ULONG Slot,
+    _In_ ULONG LowTemperature,
+    _In_ ULONG HighTemperature,
+    _In_ LARGE_INTEGER ExpirationTime,
+    _In_opt_ PMULTI_WAIT_CONTEXT MultiWait
+);
+
+NTSTATUS
+CameraESPTZWriteReadResult(
+    _In_ WDFREQUEST Request,
+    _In_ ULONG LowTemperature,
+    _In_ ULONG HighTemperature,
+    _In_ PESP_TZ_SAMPLE Sample,
+    _In_ BOOLEAN TripPointCrossed,
+    _Out_ PULONG BytesReturned
+);
+
+NTSTATUS
+CameraESPTZFormatReadResult(
+    _In_ WDFREQUEST Request,
+    _In_ PREAD_REQUEST_CONTEXT Context,
+    _In_ PESP_TZ_SAMPLE Sample,
+    _In_ BOOLEAN TripPointCrossed,
+    _Out_ PULONG BytesReturned
+);
+
 _IRQL_requires_(PASSIVE_LEVEL)
 BOOLEAN
 CameraESPTZAreConstraintsSatisfied(
@@ -97,9 +295,12 @@ _IRQL_requires_(PASSIVE_LEVEL)
 VOID
 CameraESPTZCheckQueuedRequest(
     _In_ WDFDEVICE Device,
-    _In_ ULONG Temperature,
+    _In_ PESP_TZ_SAMPLE Sample,
+    _In_ ULONG Trend,
+    _In_ BOOLEAN TripPointCrossed,
     _Inout_ PULONG LowerBound,
     _Inout_ PULONG UpperBound,
+    _Inout_ PLONGLONG NextExpiration,
     _In_ WDFREQUEST Request
 );
 
@@ -108,12 +309,55 @@ CameraESPTZEvtExpiredRequestTimer(
     WDFTIMER Timer
 );
 
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+CameraESPTZAcquireSensorLock(
+    _In_ PFDO_DATA DevExt
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+CameraESPTZReleaseSensorLock(
+    _In_ PFDO_DATA DevExt
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+CameraESPTZAcquireQueueLock(
+    _In_ PFDO_DATA DevExt
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+CameraESPTZReleaseQueueLock(
+    _In_ PFDO_DATA DevExt
+);
+
 _IRQL_requires_(PASSIVE_LEVEL)
 NTSTATUS
 CameraESPTZScanPendingQueue(
+    _In_ WDFDEVICE Device,
+    _In_ ULONG Reasons
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+CameraESPTZContinueScan(
+    _In_ WDFDEVICE Device
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+CameraESPTZDrainPendingQueue(
     _In_ WDFDEVICE Device
 );
 
+VOID
+CameraESPTZSetDeadline(
+    _In_ WDFDEVICE Device,
+    _In_ LONGLONG NextExpiration
+);
+
 VOID
 CameraESPTZCameraOffNotification(
     WDFDEVICE Device,
@@ -126,10 +370,124 @@ CameraESPTZCameraOnNotification(
     WDFREQUEST Request
 );
 
+VOID
+CameraESPTZSetCameraState(
+    _In_ WDFDEVICE Device,
+    _In_ BOOLEAN CameraOn
+);
+
+VOID
+CameraESPTZScheduleModelCrossing(
+    _In_ PFDO_DATA DevExt,
+    _In_ ULONGLONG CurrentTime
+);
+
+VOID
+CameraESPTZCheckModelCrossing(
+    _In_ WDFDEVICE Device
+);
+
+VOID
+CameraESPTZEvtModelCrossingTimer(
+    WDFTIMER Timer
+);
+
+VOID
+CameraESPTZReadSample(
+    _In_ WDFDEVICE Device,
+    _Out_ PESP_TZ_SAMPLE Sample
+);
+
+VOID
+CameraESPTZReadSampleTrend(
+    _In_ WDFDEVICE Device,
+    _Out_ PESP_TZ_SAMPLE Sample,
+    _Out_opt_ PULONG Trend
+);
+
+BOOLEAN
+CameraESPTZIsThresholdCrossed(
+    _In_ PFDO_DATA DevExt
+);
+
+VOID
+CameraESPTZPublishTemperature(
+    _In_ PFDO_DATA DevExt,
+    _In_ ULONG Temperature
+);
+
+BOOLEAN
+CameraESPTZAddWaiter(
+    _In_ PFDO_DATA DevExt,
+    _Inout_ PESP_TZ_CLIENT Client
+);
+
+BOOLEAN
+CameraESPTZRemoveWaiters(
+    _In_ PFDO_DATA DevExt,
+    _Inout_ PESP_TZ_CLIENT Client,
+    _In_ LONG Count
+);
+
+BOOLEAN
+CameraESPTZLeaveIdle(
+    _In_ PFDO_DATA DevExt
+);
+
+VOID
+CameraESPTZAssignIdleSettings(
+    _In_ WDFDEVICE Device
+);
+
+VOID
+CameraESPTZSaveSensorState(
+    _In_ WDFDEVICE Device
+);
+
+VOID
+CameraESPTZRestoreSensorState(
+    _In_ PFDO_DATA DevExt,
+    _In_ WDFKEY Key,
+    _In_ ULONG MaximumAge
+);
+
+ULONG
+CameraESPTZReadTemperature(
+    _In_ WDFDEVICE Device
+);
+
+VOID
+CameraESPTZSetVirtualInterruptThresholds(
+    _In_ WDFDEVICE Device,
+    _In_ ULONG LowerBound,
+    _In_ ULONG UpperBound
+);
+
+VOID
+CameraESPTZTemperatureInterrupt(
+    _In_ WDFDEVICE Device
+);
+
+EVT_WDF_WORKITEM CameraESPTZInterruptWorker;
+
+EVT_WDF_DEVICE_SELF_MANAGED_IO_INIT CameraESPTZEvtDeviceSelfManagedIoInit;
+
+EVT_WDF_DEVICE_SELF_MANAGED_IO_CLEANUP CameraESPTZEvtDeviceSelfManagedIoCleanup;
+
+EVT_WDF_DEVICE_D0_ENTRY CameraESPTZEvtDeviceD0Entry;
+
+EVT_WDF_DEVICE_D0_EXIT CameraESPTZEvtDeviceD0Exit;
+
 VOID
 CameraESPTZSetTemperature(
     WDFDEVICE Device,
     WDFREQUEST ReadRequest
 );
 
+VOID
+CameraESPTZSetTemperatures(
+    _In_ WDFDEVICE Device,
+    _In_ WDFREQUEST Request
+);
+
 EXTERN_C_END
@@ -0,0 +1,90 @@
+/*++
+
+Module Name:
+
+    filter.h
+
+Abstract:
+
+    This file contains the definitions for the sample filter applied to raw
+    temperature pushes before the virtual sensor publishes them.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+#pragma once
+
+EXTERN_C_START
+
+//
+// Largest supported median window. The window is kept small and odd so the
+// median can be taken with a bounded insertion sort on every sample.
+//
+
+#define ESP_TZ_FILTER_MEDIAN_MAX_WINDOW 7
+
+//
+// Fixed point shift used by the exponential and Kalman filter states.
+//
+
+#define ESP_TZ_FILTER_FRACTION_BITS 8
+
+typedef enum _ESP_TZ_FILTER_MODE {
+    EspTzFilterNone = 0,
+    EspTzFilterMedian = 1,
+    EspTzFilterExponential = 2,
+    EspTzFilterKalman = 3,
+    EspTzFilterModeMaximum
+} ESP_TZ_FILTER_MODE;
+
+typedef struct {
+    ESP_TZ_FILTER_MODE Mode;
+    BOOLEAN Primed;
+
+    union {
+        struct {
+            ULONG Window;
+            ULONG Next;
+            ULONG Count;
+            ULONG Samples[ESP_TZ_FILTER_MEDIAN_MAX_WINDOW];
+        } Median;
+
+        struct {
+            ULONG Alpha;            // Weight of a new sample, in 1/256.
+            LONGLONG State;         // Fixed point estimate.
+        } Exponential;
+
+        struct {
+            ULONG ProcessNoise;     // Q, in (0.1K)^2.
+            ULONG MeasurementNoise; // R, in (0.1K)^2.
+            LONGLONG Estimate;      // Fixed point estimate.
+            LONGLONG Variance;      // Fixed point estimate variance.
+        } Kalman;
+    } u;
+} ESP_TZ_FILTER, * PESP_TZ_FILTER;
+
+VOID
+CameraESPTZFilterInitialize(
+    _Out_ PESP_TZ_FILTER Filter,
+    _In_ ULONG Mode,
+    _In_ ULONG Window,
+    _In_ ULONG Alpha,
+    _In_ ULONG ProcessNoise,
+    _In_ ULONG MeasurementNoise
+    );
+
+VOID
+CameraESPTZFilterReset(
+    _Inout_ PESP_TZ_FILTER Filter
+    );
+
+ULONG
+CameraESPTZFilterSample(
+    _Inout_ PESP_TZ_FILTER Filter,
+    _In_ ULONG Sample
+    );
+
+EXTERN_C_END
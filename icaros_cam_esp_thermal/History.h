@@ -0,0 +1,87 @@
+/*++
+
+Module Name:
+
+    history.h
+
+Abstract:
+
+    This file contains the definitions for the temperature history store.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+#pragma once
+
+EXTERN_C_START
+
+#define ESP_TZ_HISTORY_RAW_BLOCKS       128         // 32KB of encoded samples.
+#define ESP_TZ_HISTORY_MINUTE_RECORDS   (24 * 60)   // One day.
+#define ESP_TZ_HISTORY_HOUR_RECORDS     (30 * 24)   // Thirty days.
+
+//
+// Worst case encoding of one sample: a 64 bit time delta and a 32 bit
+// temperature delta.
+//
+
+#define ESP_TZ_HISTORY_MAX_SAMPLE_LENGTH (10 + 5)
+
+//
+// A summary tier keeps a ring of closed periods plus the period still being
+// accumulated, which is reported as the newest record.
+//
+
+typedef struct {
+    PESP_TZ_HISTORY_SUMMARY Records;
+    ULONG Size;
+    ULONG Head;                     // Oldest record.
+    ULONG Count;
+    ULONGLONG Period;               // 100ns units.
+    ULONGLONG PendingStart;
+    ULONGLONG PendingSum;
+    ULONG PendingMinimum;
+    ULONG PendingMaximum;
+    ULONG PendingCount;
+} ESP_TZ_HISTORY_TIER, * PESP_TZ_HISTORY_TIER;
+
+//
+// Raw samples are appended to the newest block of a ring of fixed-size
+// blocks; when the ring is full the oldest block is reused. The summary
+// tiers are fed from the same samples so their means are exact. Everything
+// is protected by Lock.
+//
+
+typedef struct {
+    WDFSPINLOCK Lock;
+    PESP_TZ_HISTORY_BLOCK Blocks;
+    ULONG BlockHead;                // Oldest block.
+    ULONG BlockCount;               // Blocks in use, the newest is open.
+    ULONGLONG LastTime;             // Milliseconds, last sample encoded.
+    ULONG LastTemperature;
+    ESP_TZ_HISTORY_TIER Tiers[ESP_TZ_HISTORY_TIERS];   // Raw tier unused.
+} ESP_TZ_HISTORY, * PESP_TZ_HISTORY;
+
+NTSTATUS
+CameraESPTZHistoryInitialize(
+    _In_ WDFDEVICE Device,
+    _Out_ PESP_TZ_HISTORY History
+    );
+
+VOID
+CameraESPTZHistoryRecord(
+    _Inout_ PESP_TZ_HISTORY History,
+    _In_ ULONG Temperature,
+    _In_ ULONGLONG SampleTime
+    );
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+CameraESPTZQueryHistory(
+    _In_ WDFDEVICE Device,
+    _In_ WDFREQUEST Request
+    );
+
+EXTERN_C_END
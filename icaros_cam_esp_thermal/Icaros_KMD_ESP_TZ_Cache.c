@@ -0,0 +1,535 @@
+/*++
+
+Module Name:
+
+	cache.c
+
+Abstract:
+
+	This file contains the forwarded query response cache.
+
+	The thermal framework and ACPI repeat the same thermal zone queries
+	(trip points, time constants, cooling policy) although their answers
+	only change with the device power state or an explicit policy update.
+	Successful responses to those queries are kept per device, and later
+	identical queries are completed from the cache without a trip down the
+	stack.
+
+Environment:
+
+	Kernel-mode Driver Framework
+
+--*/
+
+#include "Device.h"
+#include "Debug.h"
+#include <acpiioct.h>
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, CameraESPTZCacheInitialize)
+#endif
+
+typedef enum _ESP_TZ_CACHE_CLASS {
+	EspTzCacheNone = 0,
+	EspTzCacheQuery,
+	EspTzCachePolicyUpdate
+} ESP_TZ_CACHE_CLASS;
+
+NTSTATUS
+CameraESPTZCacheInitialize(
+	_In_ WDFDEVICE Device,
+	_Out_ PESP_TZ_CACHE Cache
+)
+
+/*++
+
+Routine Description:
+
+	This routine initializes an empty response cache.
+
+Arguments:
+
+	Device - Supplies a handle to the device.
+
+	Cache - Supplies the cache to initialize.
+
+Return Value:
+
+	NTSTATUS.
+
+--*/
+
+{
+	WDF_OBJECT_ATTRIBUTES Attributes;
+	NTSTATUS Status;
+
+	PAGED_CODE();
+
+	RtlZeroMemory(Cache, sizeof(*Cache));
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&Attributes);
+	Attributes.ParentObject = Device;
+	Status = WdfSpinLockCreate(&Attributes, &Cache->Lock);
+	if (!NT_SUCCESS(Status)) {
+		EspDbgPrintlEx(0, "ESP KMD TZ", "Cache WdfSpinLockCreate() Failed. 0x%x", Status);
+	}
+
+	return Status;
+}
+
+VOID
+CameraESPTZCacheInvalidate(
+	_Inout_ PESP_TZ_CACHE Cache
+)
+
+/*++
+
+Routine Description:
+
+	This routine drops every cached response. Responses still in flight
+	are not stored when they complete.
+
+Arguments:
+
+	Cache - Supplies the cache.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	ULONG Index;
+
+	WdfSpinLockAcquire(Cache->Lock);
+	Cache->Generation += 1;
+	for (Index = 0; Index < ESP_TZ_CACHE_ENTRIES; Index += 1) {
+		Cache->Entries[Index].Valid = FALSE;
+	}
+
+	WdfSpinLockRelease(Cache->Lock);
+	InterlockedIncrement64(&Cache->Invalidations);
+}
+
+static
+ESP_TZ_CACHE_CLASS
+CameraESPTZCacheClassify(
+	_In_ WDFREQUEST Request,
+	_In_ ULONG IoControlCode,
+	_Outptr_result_bytebuffer_maybenull_(*InputLength) PVOID* Input,
+	_Out_ PULONG InputLength
+)
+
+/*++
+
+Routine Description:
+
+	This routine determines whether a forwarded request is an idempotent
+	query, a policy update, or neither.
+
+	Only ACPI methods without arguments whose result is fixed by the
+	firmware for a given power state are treated as queries. _SCP changes
+	the cooling policy the other thermal zone methods report.
+	IOCTL_THERMAL_QUERY_INFORMATION is not a query in this sense, since its
+	response carries the current temperature and its time stamp.
+
+Arguments:
+
+	Request - Supplies a handle to the request.
+
+	IoControlCode - Supplies the I/O control code.
+
+	Input - Receives the input buffer of a query, which is part of its cache
+		key, or NULL if it has none.
+
+	InputLength - Receives the length of the input buffer of a query.
+
+Return Value:
+
+	ESP_TZ_CACHE_CLASS.
+
+--*/
+
+{
+	PACPI_EVAL_INPUT_BUFFER EvalInput;
+	size_t Length;
+	NTSTATUS Status;
+
+	*Input = NULL;
+	*InputLength = 0;
+	switch (IoControlCode) {
+	case IOCTL_THERMAL_READ_POLICY:
+		Status = WdfRequestRetrieveInputBuffer(Request, 0, Input, &Length);
+		if (!NT_SUCCESS(Status)) {
+			*Input = NULL;
+			return EspTzCacheQuery;
+		}
+
+		//
+		// A query whose input does not fit a cache entry is just forwarded.
+		//
+
+		if (Length > ESP_TZ_CACHE_MAX_INPUT) {
+			*Input = NULL;
+			return EspTzCacheNone;
+		}
+
+		*InputLength = (ULONG)Length;
+		return EspTzCacheQuery;
+
+	case IOCTL_THERMAL_SET_COOLING_POLICY:
+	case IOCTL_THERMAL_SET_PASSIVE_LIMIT:
+		return EspTzCachePolicyUpdate;
+
+	case IOCTL_ACPI_EVAL_METHOD:
+		break;
+
+	default:
+		return EspTzCacheNone;
+	}
+
+	Status = WdfRequestRetrieveInputBuffer(Request, sizeof(ACPI_EVAL_INPUT_BUFFER), &EvalInput, &Length);
+	if (!NT_SUCCESS(Status) || (EvalInput->Signature != ACPI_EVAL_INPUT_BUFFER_SIGNATURE)) {
+		return EspTzCacheNone;
+	}
+
+	switch (EvalInput->MethodNameAsUlong) {
+	case ESP_TZ_ACPI_METHOD('_', 'S', 'C', 'P'):
+		return EspTzCachePolicyUpdate;
+
+	case ESP_TZ_ACPI_METHOD('_', 'C', 'R', 'T'):
+	case ESP_TZ_ACPI_METHOD('_', 'H', 'O', 'T'):
+	case ESP_TZ_ACPI_METHOD('_', 'P', 'S', 'V'):
+	case ESP_TZ_ACPI_METHOD('_', 'T', 'C', '1'):
+	case ESP_TZ_ACPI_METHOD('_', 'T', 'C', '2'):
+	case ESP_TZ_ACPI_METHOD('_', 'T', 'S', 'P'):
+	case ESP_TZ_ACPI_METHOD('_', 'T', 'Z', 'P'):
+		if (Length != sizeof(ACPI_EVAL_INPUT_BUFFER)) {
+			return EspTzCacheNone;
+		}
+
+		*Input = EvalInput;
+		*InputLength = sizeof(ACPI_EVAL_INPUT_BUFFER);
+		return EspTzCacheQuery;
+
+	default:
+		return EspTzCacheNone;
+	}
+}
+
+BOOLEAN
+CameraESPTZCacheLookup(
+	_In_ PESP_TZ_CACHE Cache,
+	_In_ WDFREQUEST Request,
+	_In_ ULONG IoControlCode,
+	_In_reads_bytes_opt_(InputLength) PVOID Input,
+	_In_ ULONG InputLength
+)
+
+/*++
+
+Routine Description:
+
+	This routine completes a query from the cache if its response is
+	present and fits the output buffer.
+
+Arguments:
+
+	Cache - Supplies the cache.
+
+	Request - Supplies a handle to the request.
+
+	IoControlCode - Supplies the I/O control code.
+
+	Input - Supplies the input buffer of the query.
+
+	InputLength - Supplies the length of the input buffer.
+
+Return Value:
+
+	TRUE if the request was completed, FALSE otherwise.
+
+--*/
+
+{
+	PVOID Buffer;
+	PESP_TZ_CACHE_ENTRY Entry;
+	ULONG Index;
+	size_t Length;
+	ULONG ResponseLength;
+	NTSTATUS Status;
+
+	Buffer = NULL;
+	Length = 0;
+	Status = WdfRequestRetrieveOutputBuffer(Request, 0, &Buffer, &Length);
+	if (!NT_SUCCESS(Status)) {
+		Length = 0;
+	}
+
+	ResponseLength = MAXULONG;
+	WdfSpinLockAcquire(Cache->Lock);
+	for (Index = 0; Index < ESP_TZ_CACHE_ENTRIES; Index += 1) {
+		Entry = &Cache->Entries[Index];
+		if ((Entry->Valid != FALSE) &&
+			(Entry->IoControlCode == IoControlCode) &&
+			(Entry->InputLength == InputLength) &&
+			(RtlCompareMemory(Entry->Input, Input, InputLength) == InputLength)) {
+
+			//
+			// A buffer too small for the response is left to the lower driver
+			// so the caller sees its usual overflow status.
+			//
+
+			if (Entry->Length <= Length) {
+				RtlCopyMemory(Buffer, Entry->Data, Entry->Length);
+				ResponseLength = Entry->Length;
+			}
+
+			break;
+		}
+	}
+
+	WdfSpinLockRelease(Cache->Lock);
+
+	if (ResponseLength == MAXULONG) {
+		InterlockedIncrement64(&Cache->Misses);
+		return FALSE;
+	}
+
+	InterlockedIncrement64(&Cache->Hits);
+	WdfRequestCompleteWithInformation(Request, STATUS_SUCCESS, ResponseLength);
+	return TRUE;
+}
+
+VOID
+CameraESPTZCacheInsert(
+	_In_ PESP_TZ_CACHE Cache,
+	_In_ PESP_TZ_CACHE_REQUEST_CONTEXT Context,
+	_In_reads_bytes_(Length) PVOID Buffer,
+	_In_ ULONG Length
+)
+
+/*++
+
+Routine Description:
+
+	This routine stores a response unless the cache was invalidated while
+	the request was in flight.
+
+Arguments:
+
+	Cache - Supplies the cache.
+
+	Context - Supplies the cache context of the completed request.
+
+	Buffer - Supplies the response.
+
+	Length - Supplies the length of the response.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	PESP_TZ_CACHE_ENTRY Entry;
+	ULONG Index;
+
+	WdfSpinLockAcquire(Cache->Lock);
+	if (Cache->Generation != Context->Generation) {
+		goto CacheInsertEnd;
+	}
+
+	Entry = NULL;
+	for (Index = 0; Index < ESP_TZ_CACHE_ENTRIES; Index += 1) {
+		if ((Cache->Entries[Index].Valid != FALSE) &&
+			(Cache->Entries[Index].IoControlCode == Context->IoControlCode) &&
+			(Cache->Entries[Index].InputLength == Context->InputLength) &&
+			(RtlCompareMemory(Cache->Entries[Index].Input,
+				Context->Input,
+				Context->InputLength) == Context->InputLength)) {
+
+			Entry = &Cache->Entries[Index];
+			break;
+		}
+	}
+
+	if (Entry == NULL) {
+		Entry = &Cache->Entries[Cache->Next];
+		Cache->Next = (Cache->Next + 1) % ESP_TZ_CACHE_ENTRIES;
+	}
+
+	Entry->IoControlCode = Context->IoControlCode;
+	Entry->InputLength = Context->InputLength;
+	RtlCopyMemory(Entry->Input, Context->Input, Context->InputLength);
+	Entry->Length = Length;
+	RtlCopyMemory(Entry->Data, Buffer, Length);
+	Entry->Valid = TRUE;
+
+CacheInsertEnd:
+
+	WdfSpinLockRelease(Cache->Lock);
+}
+
+VOID
+CameraESPTZEvtCacheRequestCompletion(
+	_In_ WDFREQUEST Request,
+	_In_ WDFIOTARGET Target,
+	_In_ PWDF_REQUEST_COMPLETION_PARAMS Params,
+	_In_ WDFCONTEXT Context
+)
+
+/*++
+
+Routine Description:
+
+	This routine is invoked when the lower driver completes a query or a
+	policy update sent through the cache. It stores a successful query
+	response, or invalidates the cache after a policy update, and then
+	completes the request.
+
+Arguments:
+
+	Request - Supplies a handle to the request.
+
+	Target - Supplies a handle to the lower target.
+
+	Params - Supplies the completion parameters.
+
+	Context - Supplies a handle to the device.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	PVOID Buffer;
+	PESP_TZ_CACHE_REQUEST_CONTEXT CacheContext;
+	PFDO_DATA DevExt;
+	ULONG_PTR Information;
+	size_t Length;
+	NTSTATUS Status;
+
+	UNREFERENCED_PARAMETER(Target);
+
+	DevExt = GetDeviceExtension((WDFDEVICE)Context);
+	CacheContext = WdfObjectGetTypedContext(Request, ESP_TZ_CACHE_REQUEST_CONTEXT);
+	Status = Params->IoStatus.Status;
+	Information = Params->IoStatus.Information;
+
+	if (CacheContext->Invalidate != FALSE) {
+		CameraESPTZCacheInvalidate(&DevExt->Cache);
+
+	} else if ((Status == STATUS_SUCCESS) &&
+		(Information <= ESP_TZ_CACHE_MAX_RESPONSE)) {
+
+		//
+		// A request formatted with its current type does not fill in the
+		// output memory of the completion parameters; the response is in
+		// the request's own output buffer.
+		//
+
+		Buffer = NULL;
+		Length = 0;
+		if (NT_SUCCESS(WdfRequestRetrieveOutputBuffer(Request, 0, &Buffer, &Length)) &&
+			(Information <= Length)) {
+
+			CameraESPTZCacheInsert(&DevExt->Cache, CacheContext, Buffer, (ULONG)Information);
+		}
+	}
+
+	WdfRequestCompleteWithInformation(Request, Status, Information);
+}
+
+VOID
+CameraESPTZForwardRequest(
+	_In_ WDFDEVICE Device,
+	_In_ WDFREQUEST Request,
+	_In_ ULONG IoControlCode
+)
+
+/*++
+
+Routine Description:
+
+	This routine forwards a request the driver does not handle to the lower
+	target. Cached queries are completed locally; other queries and policy
+	updates are sent with a completion routine so the cache can observe
+	them. Everything else is sent and forgotten.
+
+Arguments:
+
+	Device - Supplies a handle to the device.
+
+	Request - Supplies a handle to the request.
+
+	IoControlCode - Supplies the I/O control code.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	WDF_OBJECT_ATTRIBUTES Attributes;
+	PESP_TZ_CACHE_REQUEST_CONTEXT CacheContext;
+	ESP_TZ_CACHE_CLASS Class;
+	PFDO_DATA DevExt;
+	PVOID Input;
+	ULONG InputLength;
+	WDF_REQUEST_SEND_OPTIONS Options;
+	WDF_REQUEST_SEND_OPTIONS* SendOptions;
+	NTSTATUS Status;
+
+	DevExt = GetDeviceExtension(Device);
+	Class = CameraESPTZCacheClassify(Request, IoControlCode, &Input, &InputLength);
+	if (Class == EspTzCachePolicyUpdate) {
+		CameraESPTZCacheInvalidate(&DevExt->Cache);
+
+	} else if ((Class == EspTzCacheQuery) &&
+		(CameraESPTZCacheLookup(&DevExt->Cache, Request, IoControlCode, Input, InputLength) != FALSE)) {
+
+		return;
+	}
+
+	WDF_REQUEST_SEND_OPTIONS_INIT(&Options, WDF_REQUEST_SEND_OPTION_SEND_AND_FORGET);
+	SendOptions = &Options;
+	WdfRequestFormatRequestUsingCurrentType(Request);
+
+	if (Class != EspTzCacheNone) {
+		WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&Attributes, ESP_TZ_CACHE_REQUEST_CONTEXT);
+		Status = WdfObjectAllocateContext(Request, &Attributes, &CacheContext);
+
+		//
+		// Without a context the request is still forwarded; its response is
+		// just not cached.
+		//
+
+		if (NT_SUCCESS(Status)) {
+			CacheContext->IoControlCode = IoControlCode;
+			CacheContext->InputLength = InputLength;
+			if (InputLength != 0) {
+				RtlCopyMemory(CacheContext->Input, Input, InputLength);
+			}
+
+			CacheContext->Generation = DevExt->Cache.Generation;
+			CacheContext->Invalidate = (Class == EspTzCachePolicyUpdate) ? TRUE : FALSE;
+			WdfRequestSetCompletionRoutine(Request, CameraESPTZEvtCacheRequestCompletion, Device);
+			SendOptions = WDF_NO_SEND_OPTIONS;
+
+		} else {
+			EspDbgPrintlEx(0, "ESP KMD TZ", "Cache WdfObjectAllocateContext() Failed. 0x%x", Status);
+		}
+	}
+
+	if (WdfRequestSend(Request, WdfDeviceGetIoTarget(Device), SendOptions) == FALSE) {
+		Status = WdfRequestGetStatus(Request);
+		EspDbgPrintlEx(0, "ESP KMD TZ", "WdfRequestSend() Failed. Request Status = 0x%x\n", Status);
+		WdfRequestComplete(Request, Status);
+	}
+}
@@ -0,0 +1,398 @@
+/*++
+
+Module Name:
+
+	client.c
+
+Abstract:
+
+	This file contains per-client waiter tracking.
+
+	Every open handle gets a client context that counts its pending reads
+	against a quota and keeps the tightest bounds over them. When a handle
+	is cleaned up, its reads are pulled from the pending queue by file
+	object and the device thresholds are rebuilt from the remaining
+	clients, without walking the queue.
+
+Environment:
+
+	Kernel-mode Driver Framework
+
+--*/
+
+#include "Device.h"
+#include "Debug.h"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, CameraESPTZEvtDeviceFileCreate)
+#endif
+
+VOID
+CameraESPTZClientInitialize(
+	_Out_ PESP_TZ_CLIENT Client
+)
+
+/*++
+
+Routine Description:
+
+	This routine initializes a client with no waiters.
+
+Arguments:
+
+	Client - Supplies the client to initialize.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	InitializeListHead(&Client->Link);
+	Client->Waiters = 0;
+	Client->LowerBound = 0;
+	Client->UpperBound = (ULONG)-1;
+	Client->NextExpiration = MAXLONGLONG;
+}
+
+PESP_TZ_CLIENT
+CameraESPTZClientFromRequest(
+	_In_ WDFDEVICE Device,
+	_In_ WDFREQUEST Request
+)
+
+/*++
+
+Routine Description:
+
+	This routine returns the client that issued a request.
+
+Arguments:
+
+	Device - Supplies a handle to the device.
+
+	Request - Supplies a handle to the request.
+
+Return Value:
+
+	The client of the request's file object, or the device default client.
+
+--*/
+
+{
+	WDFFILEOBJECT FileObject;
+
+	FileObject = WdfRequestGetFileObject(Request);
+	if (FileObject == NULL) {
+		return &GetDeviceExtension(Device)->DefaultClient;
+	}
+
+	return ClientGetContext(FileObject);
+}
+
+VOID
+CameraESPTZClientResetBounds(
+	_In_ WDFDEVICE Device
+)
+
+/*++
+
+Routine Description:
+
+	This routine clears the bounds of every client ahead of a scan.
+
+	N.B. This routine requires the QueueLock be held.
+
+Arguments:
+
+	Device - Supplies a handle to the device.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	PESP_TZ_CLIENT Client;
+	PFDO_DATA DevExt;
+	PLIST_ENTRY Entry;
+
+	DevExt = GetDeviceExtension(Device);
+	for (Entry = DevExt->ClientList.Flink; Entry != &DevExt->ClientList; Entry = Entry->Flink) {
+		Client = CONTAINING_RECORD(Entry, ESP_TZ_CLIENT, Link);
+		Client->LowerBound = 0;
+		Client->UpperBound = (ULONG)-1;
+		Client->NextExpiration = MAXLONGLONG;
+	}
+}
+
+VOID
+CameraESPTZClientAddBounds(
+	_Inout_ PESP_TZ_CLIENT Client,
+	_In_ ULONG LowerBound,
+	_In_ ULONG UpperBound,
+	_In_ LONGLONG Expiration
+)
+
+/*++
+
+Routine Description:
+
+	This routine tightens a client's bounds with one of its requests.
+
+	N.B. This routine requires the QueueLock be held.
+
+Arguments:
+
+	Client - Supplies the client.
+
+	LowerBound - Supplies the request's lower temperature bound.
+
+	UpperBound - Supplies the request's upper temperature bound.
+
+	Expiration - Supplies the request's expiration, in system time, or -1.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	if (Client->LowerBound < LowerBound) {
+		Client->LowerBound = LowerBound;
+	}
+
+	if (Client->UpperBound > UpperBound) {
+		Client->UpperBound = UpperBound;
+	}
+
+	if ((Expiration != -1LL /* INFINITE */) && (Expiration < Client->NextExpiration)) {
+		Client->NextExpiration = Expiration;
+	}
+}
+
+VOID
+CameraESPTZEvtDeviceFileCreate(
+	_In_ WDFDEVICE Device,
+	_In_ WDFREQUEST Request,
+	_In_ WDFFILEOBJECT FileObject
+)
+
+/*++
+
+Routine Description:
+
+	This routine is invoked when a handle is opened. It registers a client
+	for the new file object.
+
+Arguments:
+
+	Device - Supplies a handle to the device.
+
+	Request - Supplies a handle to the create request.
+
+	FileObject - Supplies a handle to the new file object.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	PESP_TZ_CLIENT Client;
+	PFDO_DATA DevExt;
+
+	PAGED_CODE();
+
+	DevExt = GetDeviceExtension(Device);
+	Client = ClientGetContext(FileObject);
+	CameraESPTZClientInitialize(Client);
+
+	CameraESPTZAcquireQueueLock(DevExt);
+	InsertTailList(&DevExt->ClientList, &Client->Link);
+	CameraESPTZReleaseQueueLock(DevExt);
+
+	WdfRequestComplete(Request, STATUS_SUCCESS);
+}
+
+VOID
+CameraESPTZEvtFileCleanup(
+	_In_ WDFFILEOBJECT FileObject
+)
+
+/*++
+
+Routine Description:
+
+	This routine is invoked when the last handle to a file object is
+	closed. The client's reads are detached from the pending queue in one
+	QueueLock hold and cancelled, and the device thresholds are rebuilt
+	from the bounds the remaining clients had at the last scan.
+
+Arguments:
+
+	FileObject - Supplies a handle to the file object.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	PESP_TZ_CLIENT Client;
+	PREAD_REQUEST_CONTEXT Context;
+	LONG Count;
+	PFDO_DATA DevExt;
+	WDFDEVICE Device;
+	PLIST_ENTRY Entry;
+	WDFREQUEST Head;
+	ULONG LowerBound;
+	LONGLONG NextExpiration;
+	PESP_TZ_CLIENT Other;
+	WDFREQUEST Request;
+	NTSTATUS Status;
+	ULONG UpperBound;
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s >>>",
+		"Icaros_KMD_ESP_TZ_Client.c",
+		252,
+		"CameraESPTZEvtFileCleanup");
+
+	Device = WdfFileObjectGetDevice(FileObject);
+	DevExt = GetDeviceExtension(Device);
+	Client = ClientGetContext(FileObject);
+	Head = NULL;
+	Count = 0;
+
+	CameraESPTZAcquireQueueLock(DevExt);
+	RemoveEntryList(&Client->Link);
+	InitializeListHead(&Client->Link);
+
+	if (Client->Waiters != 0) {
+		for (;;) {
+			Status = WdfIoQueueRetrieveRequestByFileObject(DevExt->PendingRequestQueue,
+				FileObject,
+				&Request);
+
+			if (!NT_SUCCESS(Status)) {
+				break;
+			}
+
+			Context = WdfObjectGetTypedContext(Request, READ_REQUEST_CONTEXT);
+			Context->Next = Head;
+			Head = Request;
+			Count += 1;
+		}
+
+		if (CameraESPTZRemoveWaiters(DevExt, Client, (LONG)Count) != FALSE) {
+			WdfTimerStop(DevExt->DeadlineTimer, FALSE);
+		}
+
+		//
+		// Removing waiters can only relax the thresholds, so the remaining
+		// clients' bounds are all that is needed to rebuild them. A scan
+		// between slices has only gathered part of those bounds; it rebuilds
+		// the thresholds itself when it completes.
+		//
+
+		if (DevExt->ScanCursor.Active != FALSE) {
+			goto EvtFileCleanupRelease;
+		}
+
+		LowerBound = 0;
+		UpperBound = (ULONG)-1;
+		NextExpiration = MAXLONGLONG;
+		for (Entry = DevExt->ClientList.Flink; Entry != &DevExt->ClientList; Entry = Entry->Flink) {
+			Other = CONTAINING_RECORD(Entry, ESP_TZ_CLIENT, Link);
+			if (Other->Waiters == 0) {
+				continue;
+			}
+
+			LowerBound = max(LowerBound, Other->LowerBound);
+			UpperBound = min(UpperBound, Other->UpperBound);
+			NextExpiration = min(NextExpiration, Other->NextExpiration);
+		}
+
+		CameraESPTZSetVirtualInterruptThresholds(Device, LowerBound, UpperBound);
+		CameraESPTZSetDeadline(Device, NextExpiration);
+	}
+
+EvtFileCleanupRelease:
+
+	CameraESPTZReleaseQueueLock(DevExt);
+
+	EspDbgPrintlEx(9, "ESP KMD TZ", "%s : %ld requests cancelled", "CameraESPTZEvtFileCleanup", Count);
+
+	while (Head != NULL) {
+		Request = Head;
+		Context = WdfObjectGetTypedContext(Request, READ_REQUEST_CONTEXT);
+		Head = Context->Next;
+		WdfRequestComplete(Request, STATUS_CANCELLED);
+	}
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s <<<",
+		"Icaros_KMD_ESP_TZ_Client.c",
+		300,
+		"CameraESPTZEvtFileCleanup");
+}
+
+VOID
+CameraESPTZEvtPendingRequestCanceled(
+	_In_ WDFQUEUE Queue,
+	_In_ WDFREQUEST Request
+)
+
+/*++
+
+Routine Description:
+
+	This routine is invoked when a pending read is cancelled while it is in
+	the pending queue. The thresholds are left as they are; they can only
+	be tighter than needed, and the next scan relaxes them.
+
+Arguments:
+
+	Queue - Supplies a handle to the pending queue.
+
+	Request - Supplies a handle to the cancelled request.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	PREAD_REQUEST_CONTEXT Context;
+	WDFDEVICE Device;
+	BOOLEAN Last;
+
+	Device = WdfIoQueueGetDevice(Queue);
+	Context = WdfObjectGetTypedContext(Request, READ_REQUEST_CONTEXT);
+	Last = CameraESPTZRemoveWaiters(GetDeviceExtension(Device),
+		Context->Client,
+		1);
+
+	WdfRequestComplete(Request, STATUS_CANCELLED);
+
+	//
+	// The QueueLock cannot be taken here to stop the deadline timer, since
+	// the request may be cancelled while it is being queued under it. A
+	// deferred scan of the now empty queue stops the timer instead.
+	//
+
+	if (Last != FALSE) {
+		CameraESPTZDeferScan(Device, EspTzScanTimer);
+	}
+}
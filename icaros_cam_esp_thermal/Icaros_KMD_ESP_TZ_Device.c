@@ -17,420 +17,361 @@ Environment:
 #include "Device.h"
 #include "Debug.h"
 
+//
+// Only initialization and teardown are pageable. The wait, check and
+// complete routines run for every request and every virtual interrupt and
+// must stay resident, so a thermal notification never waits on a page fault.
+// Debug builds verify this at load, see CameraESPTZCheckCodePlacement.
+//
+
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text (PAGE, CameraESPTZCreateDevice)
-#pragma alloc_text (PAGE, CameraESPTZAddReadRequest)
-#pragma alloc_text (PAGE, CameraESPTZAreConstraintsSatisfied)
-#pragma alloc_text (PAGE, CameraESPTZCheckQueuedRequest)
-#pragma alloc_text (PAGE, CameraESPTZEvtExpiredRequestTimer)
-#pragma alloc_text (PAGE, CameraESPTZScanPendingQueue)
+#pragma alloc_text (PAGE, CameraESPTZEvtDeviceSelfManagedIoInit)
+#pragma alloc_text (PAGE, CameraESPTZEvtDeviceSelfManagedIoCleanup)
+#pragma alloc_text (PAGE, CameraESPTZAssignIdleSettings)
+#pragma alloc_text (PAGE, CameraESPTZSaveSensorState)
+#pragma alloc_text (PAGE, CameraESPTZRestoreSensorState)
 #endif
 
-ULONG
-CameraESPTZReadTemperature(
-	_In_ WDFDEVICE Device
+BOOLEAN
+CameraESPTZIsThresholdCrossed(
+	_In_ PFDO_DATA DevExt
 )
 
 /*++
 
 Routine Description:
 
-	This routine is invoked to read the current temperature of the device.
-
-Arguments:
+	This routine checks whether the published temperature is at or beyond
+	either virtual interrupt threshold, or has crossed a trip point. Nothing
+	is checked while no waiter is pending.
 
-	Device - Supplies a handle to the device.
+	N.B. This routine requires the Sensor.Lock be held.
 
-	LowerBound - Supplies the temperature below which the device should issue
-		an interrupt.
+Arguments:
 
-	UpperBound - Supplies the temperature above which the device should issue
-		an interrupt.
+	DevExt - Supplies the device extension.
 
 Return Value:
 
-	NTSTATUS
+	TRUE if the virtual interrupt is due, FALSE otherwise.
 
 --*/
 
 {
+	BOOLEAN TripPointCrossed;
 
-	PFDO_DATA DevExt;
-	ULONG Temperature;
+	//
+	// With no waiter pending there is nobody to deliver the interrupt to.
+	// The bracket is left where it is and relocated when a waiter arrives.
+	//
 
-	EspDbgPrintlEx(
-		9,
-		"ESP KMD TZ",
-		"File: %s, Line: %d, Function: %s >>>",
-		"Icaros_KMD_ESP_TZ_Device.c",
-		434,
-		"CameraESPTZReadTemperature");
+	if (ReadNoFence(&DevExt->Idle.Waiters) == 0) {
+		if (DevExt->Idle.SensorIdle == FALSE) {
+			DevExt->Idle.SensorIdle = TRUE;
+			InterlockedIncrement64(&DevExt->Idle.Entries);
+		}
 
-	DevExt = GetDeviceExtension(Device);
-	WdfWaitLockAcquire(DevExt->Sensor.Lock, NULL);
-	Temperature = DevExt->Sensor.Temperature;
-	WdfWaitLockRelease(DevExt->Sensor.Lock);
+		InterlockedIncrementNoFence64(&DevExt->Idle.SkippedEvaluations);
+		return FALSE;
+	}
 
-	EspDbgPrintlEx(
-		9,
-		"ESP KMD TZ",
-		"File: %s, Line: %d, Function: %s <<<",
-		"Icaros_KMD_ESP_TZ_Device.c",
-		441,
-		"CameraESPTZReadTemperature");
+	if ((DevExt->Idle.SensorIdle != FALSE) &&
+		(CameraESPTZLeaveIdle(DevExt) != FALSE)) {
+
+		return TRUE;
+	}
+
+	//
+	// Always locate the sample, so the bracket follows the temperature even
+	// when a waiter threshold fires the interrupt anyway.
+	//
+
+	TripPointCrossed = CameraESPTZTripPointsLocate(&DevExt->Sensor.TripPoints,
+		DevExt->Sensor.Temperature);
 
-	return Temperature;
+	return (TripPointCrossed != FALSE) ||
+		(DevExt->Sensor.Temperature <= DevExt->Sensor.LowerBound) ||
+		(DevExt->Sensor.Temperature >= DevExt->Sensor.UpperBound);
 }
 
 VOID
-CameraESPTZEvtExpiredRequestTimer(
-	WDFTIMER Timer
+CameraESPTZAcquireSensorLock(
+	_In_ PFDO_DATA DevExt
 )
 
 /*++
 
 Routine Description:
 
-	This routine is invoked when a request timer expires. A scan of the pending
-	queue to complete expired and satisfied requests is initiated.
+	This routine acquires the Sensor.Lock, counting contended acquisitions
+	and noting the acquisition time for hold time accounting.
 
 Arguments:
 
-	Timer - Supplies a handle to the timer which expired.
-
---*/
+	DevExt - Supplies the device extension.
 
-{
+Return Value:
 
-	PFDO_DATA DevExt;
-	WDFDEVICE Device;
+	None.
 
-	EspDbgPrintlEx(
-		9,
-		"ESP KMD TZ",
-		"File: %s, Line: %d, Function: %s >>>",
-		"Icaros_KMD_ESP_TZ_Device.c",
-		1044,
-		"CameraESPTZEvtExpiredRequestTimer");
+--*/
 
-	PAGED_CODE();
+{
+	ULONG64 QpcTimeStamp;
+	LONGLONG Timeout;
 
-	Device = (WDFDEVICE)WdfTimerGetParentObject(Timer);
-	DevExt = GetDeviceExtension(Device);
-	WdfWaitLockAcquire(DevExt->QueueLock, NULL);
-	CameraESPTZScanPendingQueue(Device);
-	WdfWaitLockRelease(DevExt->QueueLock);
+	Timeout = 0;
+	if (WdfWaitLockAcquire(DevExt->Sensor.Lock, &Timeout) == STATUS_TIMEOUT) {
+		InterlockedIncrement64(&DevExt->LoadStats.SensorLockContentions);
+		WdfWaitLockAcquire(DevExt->Sensor.Lock, NULL);
+	}
 
-	EspDbgPrintlEx(
-		9,
-		"ESP KMD TZ",
-		"File: %s, Line: %d, Function: %s <<<",
-		"Icaros_KMD_ESP_TZ_Device.c",
-		1053,
-		"CameraESPTZEvtExpiredRequestTimer");
+	DevExt->LoadStats.SensorLockAcquireTime = KeQueryInterruptTimePrecise(&QpcTimeStamp);
 }
 
-_IRQL_requires_(PASSIVE_LEVEL)
 VOID
-CameraESPTZAddReadRequest(
-	_In_ WDFDEVICE Device,
-	_In_ WDFREQUEST ReadRequest
+CameraESPTZReleaseSensorLock(
+	_In_ PFDO_DATA DevExt
 )
 
 /*++
 
 Routine Description:
 
-	Handles IOCTL_THERMAL_READ_TEMPERATURE. If the request can be satisfied,
-	it is completed immediately. Else, adds request to pending request queue.
+	This routine records the Sensor.Lock hold time and releases the lock.
 
 Arguments:
 
-	Device - Supplies a handle to the device that received the request.
+	DevExt - Supplies the device extension.
 
-	ReadRequest - Supplies a handle to the request.
+Return Value:
+
+	None.
 
 --*/
 
 {
-	ULONG BytesReturned;
-	PREAD_REQUEST_CONTEXT Context;
-	WDF_OBJECT_ATTRIBUTES ContextAttributes;
-	PFDO_DATA DevExt;
-	LARGE_INTEGER ExpirationTime;
-	size_t Length;
-	BOOLEAN LockHeld;
-	PULONG RequestTemperature;
-	NTSTATUS Status;
-	ULONG Temperature;
-	WDFTIMER Timer;
-	WDF_OBJECT_ATTRIBUTES TimerAttributes;
-	WDF_TIMER_CONFIG TimerConfig;
-	PTHERMAL_WAIT_READ ThermalWaitRead;
+	ULONGLONG HoldTime;
+	ULONG64 QpcTimeStamp;
 
-	EspDbgPrintlEx(
-		9,
-		"ESP KMD TZ",
-		"File: %s, Line: %d, Function: %s >>>",
-		"Icaros_KMD_ESP_TZ_Device.c",
-		210,
-		"CameraESPTZAddReadRequest");
+	HoldTime = KeQueryInterruptTimePrecise(&QpcTimeStamp) - DevExt->LoadStats.SensorLockAcquireTime;
+	if (HoldTime > DevExt->LoadStats.MaximumSensorLockHoldTime) {
+		DevExt->LoadStats.MaximumSensorLockHoldTime = HoldTime;
+	}
 
-	PAGED_CODE();
+	WdfWaitLockRelease(DevExt->Sensor.Lock);
+}
 
-	DevExt = GetDeviceExtension(Device);
-	BytesReturned = 0;
-	LockHeld = FALSE;
-	Status = WdfRequestRetrieveInputBuffer(ReadRequest,
-		sizeof(THERMAL_WAIT_READ),
-		&ThermalWaitRead,
-		&Length);
+VOID
+CameraESPTZPublishTemperature(
+	_In_ PFDO_DATA DevExt,
+	_In_ ULONG Temperature
+)
 
-	if (!NT_SUCCESS(Status) || Length != sizeof(THERMAL_WAIT_READ)) {
+/*++
 
-		EspDbgPrintlEx(0, "ESP KMD TZ", "%s: This request is malformed, bail.", "CameraESPTZAddReadRequest");
+Routine Description:
 
-		//
-		// This request is malformed, bail.
-		//
+	This routine publishes a new sensor temperature, noting the direction
+	it moved in for the next scan.
 
-		WdfRequestCompleteWithInformation(ReadRequest, Status, BytesReturned);
-		goto AddReadRequestEnd;
-	}
+	N.B. This routine requires the Sensor.Lock be held.
 
+Arguments:
 
-	if (ThermalWaitRead->Timeout != -1 /* INFINITE */) {
+	DevExt - Supplies the device extension.
 
-		EspDbgPrintlEx(
-			9,
-			"ESP KMD TZ",
-			"%s: if (ThermalWaitRead->Timeout != -1 /* INFINITE */ )",
-			"CameraESPTZAddReadRequest");
+	Temperature - Supplies the temperature to publish.
 
-		//
-		// Estimate the system time this request will expire at.
-		//
+Return Value:
 
-		KeQuerySystemTime(&ExpirationTime);
-		ExpirationTime.QuadPart += (ULONGLONG)ThermalWaitRead->Timeout * 10000;
+	None.
 
-		EspDbgPrintlEx(9, "ESP KMD TZ", "ExpirationTime.QuadPart = %d", (int)ExpirationTime.QuadPart);
+--*/
+
+{
+	if (Temperature > DevExt->Sensor.Temperature) {
+		DevExt->Sensor.Trend |= ESP_TZ_TREND_RISING;
+
+	} else if (Temperature < DevExt->Sensor.Temperature) {
+		DevExt->Sensor.Trend |= ESP_TZ_TREND_FALLING;
 	}
-	else {
 
-		EspDbgPrintlEx(9, "ESP KMD TZ", "%s: Value which indicates the request never expires.", "CameraESPTZAddReadRequest");
+	DevExt->Sensor.Temperature = Temperature;
+}
 
-		//
-		// Value which indicates the request never expires.
-		//
+BOOLEAN
+CameraESPTZLeaveIdle(
+	_In_ PFDO_DATA DevExt
+)
 
-		ExpirationTime.QuadPart = -1LL /* INFINITE */;
-	}
+/*++
 
-	//
-	// Handle the immediate timeout case in the fast path.
-	//
+Routine Description:
 
-	Temperature = CameraESPTZReadTemperature(Device);
-	if (CameraESPTZAreConstraintsSatisfied(Temperature,
-		ThermalWaitRead->LowTemperature,
-		ThermalWaitRead->HighTemperature,
-		ExpirationTime)) {
+	This routine brings the sensor side out of idle. The trip point bracket
+	is moved to the published temperature. An ordinary crossing while idle
+	had nobody waiting on it and is dropped, but a temperature at or past
+	the critical trip point is kept for the first waiter to see.
+
+	N.B. This routine requires the Sensor.Lock be held.
 
-		Status = WdfRequestRetrieveOutputBuffer(ReadRequest,
-			sizeof(ULONG),
-			&RequestTemperature,
-			&Length);
+Arguments:
 
-		if (NT_SUCCESS(Status) && Length == sizeof(ULONG)) {
-			EspDbgPrintlEx(9, "ESP KMD TZ", "%s: fast path, temperature %lu", "CameraESPTZAddReadRequest", Temperature);
-			*RequestTemperature = Temperature;
-			BytesReturned = sizeof(ULONG);
+	DevExt - Supplies the device extension.
 
-		}
-		else {
-			Status = STATUS_INVALID_PARAMETER;
-			EspDbgPrintlEx(0, "ESP KMD TZ", "WdfRequestRetrieveOutputBuffer() Failed. 0x%x", Status);
-		}
+Return Value:
 
-		EspDbgPrintlEx(9, "ESP KMD TZ", "Completing fast path IOCTL_THERMAL_READ_TEMPERATURE");
-		WdfRequestCompleteWithInformation(ReadRequest, Status, BytesReturned);
+	TRUE if a critical crossing is pending, in which case the caller raises
+	the virtual interrupt.
+
+--*/
+
+{
+	DevExt->Idle.SensorIdle = FALSE;
+	InterlockedIncrement64(&DevExt->Idle.Exits);
+	if (CameraESPTZTripPointsLocate(&DevExt->Sensor.TripPoints,
+		DevExt->Sensor.Temperature) == FALSE) {
+
+		return FALSE;
 	}
-	else {
 
-		EspDbgPrintlEx(9, "ESP KMD TZ", "%s: Creating request and adding it to pending queue.", "CameraESPTZAddReadRequest");
-		EspDbgPrintlEx(9, "ESP KMD TZ", "%s: DevExt->queueLock LOCK ON", "CameraESPTZAddReadRequest");
+	if (ReadNoFence(&DevExt->Sensor.TripPoints.CriticalCrossed) != 0) {
+		return TRUE;
+	}
 
-		WdfWaitLockAcquire(DevExt->QueueLock, NULL);
-		LockHeld = TRUE;
+	InterlockedExchange(&DevExt->Sensor.TripPoints.Crossed, 0);
+	return FALSE;
+}
 
-		//
-		// Create a context to store request-specific information.
-		//
+BOOLEAN
+CameraESPTZAddWaiter(
+	_In_ PFDO_DATA DevExt,
+	_Inout_ PESP_TZ_CLIENT Client
+)
 
-		WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&ContextAttributes,
-			READ_REQUEST_CONTEXT);
+/*++
 
-		Status = WdfObjectAllocateContext(ReadRequest,
-			&ContextAttributes,
-			&Context);
+Routine Description:
 
-		if (!NT_SUCCESS(Status)) {
-			EspDbgPrintlEx(0, "ESP KMD TZ", "WdfObjectAllocateContext() Failed. 0x%x", Status);
+	This routine counts a waiter about to be queued against its client and
+	the device.
 
-			WdfRequestCompleteWithInformation(ReadRequest,
-				Status,
-				BytesReturned);
+Arguments:
 
-			goto AddReadRequestEnd;
-		}
+	DevExt - Supplies the device extension.
 
-		Context->ExpirationTime.QuadPart = ExpirationTime.QuadPart;
-		Context->LowTemperature = ThermalWaitRead->LowTemperature;
-		Context->HighTemperature = ThermalWaitRead->HighTemperature;
-		if (Context->ExpirationTime.QuadPart != -1LL /* INFINITE */) {
+	Client - Supplies the client the waiter belongs to.
 
-			//
-			// This request eventually expires, create a timer to complete it.
-			//
+Return Value:
 
-			WDF_TIMER_CONFIG_INIT(&TimerConfig, CameraESPTZEvtExpiredRequestTimer);
-			WDF_OBJECT_ATTRIBUTES_INIT(&TimerAttributes);
-			TimerAttributes.ExecutionLevel = WdfExecutionLevelPassive;
-			TimerAttributes.SynchronizationScope = WdfSynchronizationScopeNone;
-			TimerAttributes.ParentObject = Device;
-			Status = WdfTimerCreate(&TimerConfig,
-				&TimerAttributes,
-				&Timer);
+	TRUE if it is the only waiter pending, in which case the caller brings
+	the device out of idle once it is queued.
 
-			if (!NT_SUCCESS(Status)) {
-				EspDbgPrintlEx(0, "ESP KMD TZ", "WdfTimerCreate() Failed. 0x%x", Status);
-				WdfRequestCompleteWithInformation(ReadRequest,
-					Status,
-					BytesReturned);
+--*/
 
-				goto AddReadRequestEnd;
-			}
+{
+	InterlockedIncrement(&Client->Waiters);
+	return (InterlockedIncrement(&DevExt->Idle.Waiters) == 1) ? TRUE : FALSE;
+}
 
-			EspDbgPrintlEx(
-				9,
-				"ESP KMD TZ",
-				"%s:WdfTimerStart(), Timeout = %lu ms",
-				"CameraESPTZAddReadRequest",
-				ThermalWaitRead->Timeout);
+BOOLEAN
+CameraESPTZRemoveWaiters(
+	_In_ PFDO_DATA DevExt,
+	_Inout_ PESP_TZ_CLIENT Client,
+	_In_ LONG Count
+)
 
-			WdfTimerStart(Timer,
-				WDF_REL_TIMEOUT_IN_MS(ThermalWaitRead->Timeout));
+/*++
 
-		}
+Routine Description:
 
-		Status = WdfRequestForwardToIoQueue(ReadRequest,
-			DevExt->PendingRequestQueue);
+	This routine uncounts waiters leaving the pending queue. It may be
+	called at any IRQL up to DISPATCH_LEVEL. Once the last one has left,
+	the sensor side goes idle on its next evaluation.
 
-		if (!NT_SUCCESS(Status)) {
-			EspDbgPrintlEx(0, "ESP KMD TZ", "WdfRequestForwardToIoQueue() Failed. 0x%x", Status);
+	The deadline timer is not stopped here, since only a QueueLock holder
+	can tell it was not armed for a waiter queued right after the count
+	dropped. Callers holding the QueueLock stop it when this routine
+	returns TRUE.
 
-			WdfRequestCompleteWithInformation(ReadRequest,
-				Status,
-				BytesReturned);
+Arguments:
 
-			goto AddReadRequestEnd;
-		}
+	DevExt - Supplies the device extension.
 
-		//
-		// Force a rescan of the queue to update the interrupt thresholds.
-		//
+	Client - Supplies the client the waiters belong to.
 
-		CameraESPTZScanPendingQueue(Device);
-	}
+	Count - Supplies the number of waiters leaving.
 
-AddReadRequestEnd:
+Return Value:
 
-	if (LockHeld == TRUE) {
-		WdfWaitLockRelease(DevExt->QueueLock);
-		EspDbgPrintlEx(9, "ESP KMD TZ", "%s: DevExt->queueLock LOCK OFF", "CameraESPTZAddReadRequest");
-	}
+	TRUE if no waiter is left.
 
-	EspDbgPrintlEx(
-		9,
-		"ESP KMD TZ",
-		"File: %s, Line: %d, Function: %s <<<",
-		"Icaros_KMD_ESP_TZ_Device.c",
-		400,
-		"CameraESPTZAddReadRequest");
-}
+--*/
 
-VOID
-CameraESPTZCameraOffNotification(
-	WDFDEVICE Device,
-	WDFREQUEST Request
-)
 {
-	EspDbgPrintlEx(
-		9,
-		"ESP KMD TZ",
-		"File: %s, Line: %d, Function: %s >>>",
-		"Icaros_KMD_ESP_TZ_Device.c",
-		609,
-		"CameraESPTZCameraOffNotification");
-
-	GetDeviceExtension(Device)->Sensor.Temperature = 2940;
-	WdfRequestComplete(Request, 0);
+	if (Count == 0) {
+		return FALSE;
+	}
 
-	EspDbgPrintlEx(
-		9,
-		"ESP KMD TZ",
-		"File: %s, Line: %d, Function: %s <<<",
-		"Icaros_KMD_ESP_TZ_Device.c",
-		617,
-		"CameraESPTZCameraOffNotification");
+	InterlockedAdd(&Client->Waiters, -Count);
+	return (InterlockedAdd(&DevExt->Idle.Waiters, -Count) == 0) ? TRUE : FALSE;
 }
 
 VOID
-CameraESPTZCameraOnNotification(
-	WDFDEVICE Device,
-	WDFREQUEST Request
+CameraESPTZReadSample(
+	_In_ WDFDEVICE Device,
+	_Out_ PESP_TZ_SAMPLE Sample
 )
-{
-	WDF_DEVICE_STATE PnpDeviceState;
 
-	UNREFERENCED_PARAMETER(Device);
+/*++
 
-	EspDbgPrintlEx(
-		9,
-		"ESP KMD TZ",
-		"File: %s, Line: %d, Function: %s >>>",
-		"Icaros_KMD_ESP_TZ_Device.c",
-		591,
-		"CameraESPTZCameraOnNotification");
-	WDF_DEVICE_STATE_INIT(&PnpDeviceState);
-	WdfRequestComplete(Request, 0);
-	EspDbgPrintlEx(
-		9,
-		"ESP KMD TZ",
-		"File: %s, Line: %d, Function: %s <<<",
-		"Icaros_KMD_ESP_TZ_Device.c",
-		597,
-		"CameraESPTZCameraOnNotification");
+Routine Description:
+
+	This routine is invoked to read the current temperature of the device,
+	along with when it was sampled and the sequence number of the last
+	pushed sample.
+
+Arguments:
+
+	Device - Supplies a handle to the device.
+
+	Sample - Receives the current sample.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	CameraESPTZReadSampleTrend(Device, Sample, NULL);
 }
 
 VOID
-CameraESPTZTemperatureInterrupt(
-	_In_ WDFDEVICE Device
+CameraESPTZReadSampleTrend(
+	_In_ WDFDEVICE Device,
+	_Out_ PESP_TZ_SAMPLE Sample,
+	_Out_opt_ PULONG Trend
 )
 
-
 /*++
 
 Routine Description:
 
-	This routine is invoked to simulate an interrupt from the virtual sensor
-	device. It performs all the work a normal ISR would perform.
+	This routine reads the current sample and, for a scan, the directions
+	the temperature moved in since the previous scan started. The trend
+	restarts from the sample returned.
 
 Arguments:
 
 	Device - Supplies a handle to the device.
 
+	Sample - Receives the current sample.
+
+	Trend - Receives the ESP_TZ_TREND_* mask, if not NULL.
+
 Return Value:
 
 	None.
@@ -446,442 +387,2608 @@ Return Value:
 		"ESP KMD TZ",
 		"File: %s, Line: %d, Function: %s >>>",
 		"Icaros_KMD_ESP_TZ_Device.c",
-		1012,
-		"CameraESPTZTemperatureInterrupt");
+		434,
+		"CameraESPTZReadSampleTrend");
 
 	DevExt = GetDeviceExtension(Device);
-	WdfWorkItemEnqueue(DevExt->InterruptWorker);
+	CameraESPTZAcquireSensorLock(DevExt);
 
-	EspDbgPrintlEx(
-		9,
-		"ESP KMD TZ",
-		"File: %s, Line: %d, Function: %s <<<",
-		"Icaros_KMD_ESP_TZ_Device.c",
-		1017,
-		"CameraESPTZTemperatureInterrupt");
+	//
+	// When the thermal model drives the sensor, the temperature is computed
+	// on demand from the model anchor.
+	//
 
-	return;
-}
+	if (DevExt->Sensor.Model.Enabled != FALSE) {
+		DevExt->Sensor.SampleTime = KeQueryInterruptTime();
+		CameraESPTZPublishTemperature(DevExt,
+			CameraESPTZModelEvaluate(&DevExt->Sensor.Model, DevExt->Sensor.SampleTime));
+	}
 
-VOID
-CameraESPTZSetTemperature(
-	WDFDEVICE Device,
-	WDFREQUEST ReadRequest
-)
-{
-	NTSTATUS Status;
-	PULONG Temperature;
-	ULONG Value;
-	FDO_DATA* DevExt;
-	size_t Length;
-	BOOLEAN Interrupt;
+	Sample->Temperature = DevExt->Sensor.Temperature;
+	Sample->Time = DevExt->Sensor.SampleTime;
+	Sample->Sequence = DevExt->Sensor.Sequence;
+	if (Trend != NULL) {
+		*Trend = DevExt->Sensor.Trend;
+		DevExt->Sensor.Trend = 0;
+	}
 
-	Status = STATUS_SUCCESS;
+	CameraESPTZReleaseSensorLock(DevExt);
 
 	EspDbgPrintlEx(
 		9,
 		"ESP KMD TZ",
-		"File: %s, Line: %d, Function: %s >>>",
+		"File: %s, Line: %d, Function: %s <<<",
 		"Icaros_KMD_ESP_TZ_Device.c",
-		532,
-		"CameraESPTZSetTemperature");
-
-	PAGED_CODE();
-
-	Value = 1;
-	Temperature = &Value;
-	Interrupt = FALSE;
-
-	DevExt = GetDeviceExtension(Device);
-	Status = WdfRequestRetrieveInputBuffer(ReadRequest, 0, &Temperature, &Length);
-
-	if (NT_SUCCESS(Status))
-	{
-		if (Temperature != NULL)
-		{
-			WdfWaitLockAcquire(DevExt->Sensor.Lock, NULL);
-
-			DevExt->Sensor.Temperature = *Temperature;
+		441,
+		"CameraESPTZReadSampleTrend");
+}
 
-			EspDbgPrintlEx(9, "ESP KMD TZ", "%s : Temp %d", "CameraESPTZSetTemperature", DevExt->Sensor.Temperature);
+ULONG
+CameraESPTZReadTemperature(
+	_In_ WDFDEVICE Device
+)
 
-			//
-			// Check to see if the temperature has exceeded either of the thresholds
-			// for noticing a temperature change. If so, the virtual interrupt will
-			// need to be fired.
-			//
+/*++
 
-			if ((DevExt->Sensor.Temperature <= DevExt->Sensor.LowerBound) ||
-				(DevExt->Sensor.Temperature >= DevExt->Sensor.UpperBound)) {
+Routine Description:
 
-				Interrupt = TRUE;
+	This routine is invoked to read the current temperature of the device.
 
-			}
+Arguments:
 
-			WdfWaitLockRelease(DevExt->Sensor.Lock);
+	Device - Supplies a handle to the device.
 
-		}
+Return Value:
 
-		WdfRequestComplete(ReadRequest, Status);
+	The current temperature, in tenths of a Kelvin.
 
-		//
-		// Fire the virtual interrupt outside the lock, to avoid any locking issues.
-		//
+--*/
 
-		if (Interrupt != FALSE) {
-			CameraESPTZTemperatureInterrupt(Device);
-		}
+{
+	ESP_TZ_SAMPLE Sample;
 
-		EspDbgPrintlEx(
-			9,
-			"ESP KMD TZ",
-			"File: %s, Line: %d, Function: %s <<<",
-			"Icaros_KMD_ESP_TZ_Device.c",
-			577,
-			"CameraESPTZSetTemperature");
-	}
-	else
-	{
-		EspDbgPrintlEx(0, "ESP KMD TZ", "WdfRequestRetrieveInputBuffer() Failed. 0x%x", Status);
-		WdfRequestCompleteWithInformation(ReadRequest, Status, 0);
-		EspDbgPrintlEx(
-			9,
-			"ESP KMD TZ",
-			"File: %s, Line: %d, Function: %s <<<",
-			"Icaros_KMD_ESP_TZ_Device.c",
-			549,
-			"CameraESPTZSetTemperature");
-	}
+	CameraESPTZReadSample(Device, &Sample);
+	return Sample.Temperature;
 }
 
 VOID
-CameraESPTZSetVirtualInterruptThresholds(
-	_In_ WDFDEVICE Device,
-	_In_ ULONG LowerBound,
-	_In_ ULONG UpperBound
+CameraESPTZEvtExpiredRequestTimer(
+	WDFTIMER Timer
 )
 
 /*++
 
 Routine Description:
 
-	This routine is invoked to change the thresholds the virtual sensor driver
-	uses to compare against for an interrupt to occur.
+	This routine is invoked when the deadline timer expires. A scan of the
+	pending queue to complete expired and satisfied requests is requested,
+	unless the queue has emptied since the timer was armed.
 
 Arguments:
 
-	Device - Supplies a handle to the device.
-
-	LowerBound - Supplies the temperature below which the device should issue
-		an interrupt.
-
-	UpperBound - Supplies the temperature above which the device should issue
-		an interrupt.
-
-Return Value:
-
-	NTSTATUS
+	Timer - Supplies a handle to the timer which expired.
 
 --*/
 
 {
 
 	PFDO_DATA DevExt;
+	WDFDEVICE Device;
 
 	EspDbgPrintlEx(
 		9,
 		"ESP KMD TZ",
 		"File: %s, Line: %d, Function: %s >>>",
 		"Icaros_KMD_ESP_TZ_Device.c",
-		951,
-		"CameraESPTZSetVirtualInterruptThresholds");
+		1044,
+		"CameraESPTZEvtExpiredRequestTimer");
 
+	Device = (WDFDEVICE)WdfTimerGetParentObject(Timer);
 	DevExt = GetDeviceExtension(Device);
-	WdfWaitLockAcquire(DevExt->Sensor.Lock, NULL);
-
-	DevExt->Sensor.LowerBound = LowerBound;
-	DevExt->Sensor.UpperBound = UpperBound;
-
-	EspDbgPrintlEx(
-		9,
-		"ESP KMD TZ",
-		"%s : LowerBound = %lu, UpperBound = %lu",
-		"CameraESPTZSetVirtualInterruptThresholds",
-		LowerBound,
-		UpperBound);
-
-	WdfWaitLockRelease(DevExt->Sensor.Lock);
+	InterlockedIncrement64(&DevExt->Idle.DeadlineWakeups);
+	if (ReadNoFence(&DevExt->Idle.Waiters) != 0) {
+		CameraESPTZRequestScan(Device, EspTzScanTimer);
+	}
 
 	EspDbgPrintlEx(
 		9,
 		"ESP KMD TZ",
 		"File: %s, Line: %d, Function: %s <<<",
 		"Icaros_KMD_ESP_TZ_Device.c",
-		985,
-		"CameraESPTZSetVirtualInterruptThresholds");
-
-	return;
+		1053,
+		"CameraESPTZEvtExpiredRequestTimer");
 }
 
 _IRQL_requires_(PASSIVE_LEVEL)
-BOOLEAN
-CameraESPTZAreConstraintsSatisfied(
-	_In_ ULONG Temperature,
-	_In_ ULONG LowerBound,
-	_In_ ULONG UpperBound,
-	_In_ LARGE_INTEGER DueTime
+VOID
+CameraESPTZAddReadRequest(
+	_In_ WDFDEVICE Device,
+	_In_ WDFREQUEST ReadRequest
 )
 
 /*++
 
 Routine Description:
 
-	Checks whether a request can be retired.
+	Handles IOCTL_THERMAL_READ_TEMPERATURE. If the request can be satisfied,
+	it is completed immediately. Else, adds request to pending request queue.
 
 Arguments:
 
-	Temperature - Supplies the device's current temperature.
-
-	LowerBound - Supplies the request's lower temperature bound.
-
-	UpperBound - Supplies the request's upper temperature bound.
-
-	DueTime - Supplies when the request expires.
-
-Return Value:
-
-	TRUE - The request is retireable.
+	Device - Supplies a handle to the device that received the request.
 
-	FALSE - The request is not retireable.
+	ReadRequest - Supplies a handle to the request.
 
 --*/
 
 {
-	LARGE_INTEGER CurrentTime;
-
-	PAGED_CODE();
+	ULONG BytesReturned;
+	PFDO_DATA DevExt;
+	LARGE_INTEGER ExpirationTime;
+	size_t Length;
+	ESP_TZ_SAMPLE Sample;
+	NTSTATUS Status;
+	PTHERMAL_WAIT_READ ThermalWaitRead;
 
 	EspDbgPrintlEx(
 		9,
 		"ESP KMD TZ",
 		"File: %s, Line: %d, Function: %s >>>",
 		"Icaros_KMD_ESP_TZ_Device.c",
-		482,
-		"CameraESPTZAreConstraintsSatisfied");
+		210,
+		"CameraESPTZAddReadRequest");
 
-	if (Temperature <= LowerBound || Temperature >= UpperBound) {
+	DevExt = GetDeviceExtension(Device);
+	BytesReturned = 0;
+	Status = WdfRequestRetrieveInputBuffer(ReadRequest,
+		sizeof(THERMAL_WAIT_READ),
+		&ThermalWaitRead,
+		&Length);
 
-		EspDbgPrintlEx(
-			9,
-			"ESP KMD TZ",
-			"File: %s, Line: %d, Function: %s, RETURN: 0x%x <<<",
-			"Icaros_KMD_ESP_TZ_Device.c",
-			489,
-			"CameraESPTZAreConstraintsSatisfied",
-			1);
+	if (!NT_SUCCESS(Status) || Length != sizeof(THERMAL_WAIT_READ)) {
 
-		return TRUE;
+		EspDbgPrintlEx(0, "ESP KMD TZ", "%s: This request is malformed, bail.", "CameraESPTZAddReadRequest");
+
+		//
+		// This request is malformed, bail.
+		//
+
+		WdfRequestCompleteWithInformation(ReadRequest, Status, BytesReturned);
+		goto AddReadRequestEnd;
 	}
 
-	//
-	// Negative due times are meaningless, except for the special value -1,
-	// which represents no timeout.
-	//
 
-	if (DueTime.QuadPart < 0) {
+	if (ThermalWaitRead->Timeout != -1 /* INFINITE */) {
 
 		EspDbgPrintlEx(
 			9,
 			"ESP KMD TZ",
-			"File: %s, Line: %d, Function: %s, RETURN: 0x%x <<<",
-			"Icaros_KMD_ESP_TZ_Device.c",
-			499,
-			"CameraESPTZAreConstraintsSatisfied",
-			0);
+			"%s: if (ThermalWaitRead->Timeout != -1 /* INFINITE */ )",
+			"CameraESPTZAddReadRequest");
 
-		return FALSE;
-	}
+		//
+		// Estimate the system time this request will expire at.
+		//
 
-	KeQuerySystemTime(&CurrentTime);
+		KeQuerySystemTime(&ExpirationTime);
+		ExpirationTime.QuadPart += (ULONGLONG)ThermalWaitRead->Timeout * 10000;
 
-	if ((CurrentTime.QuadPart - DueTime.QuadPart) >= 0) {
+		EspDbgPrintlEx(9, "ESP KMD TZ", "ExpirationTime.QuadPart = %d", (int)ExpirationTime.QuadPart);
+	}
+	else {
+
+		EspDbgPrintlEx(9, "ESP KMD TZ", "%s: Value which indicates the request never expires.", "CameraESPTZAddReadRequest");
 
 		//
-		// This request expired in the past.
+		// Value which indicates the request never expires.
 		//
 
-		EspDbgPrintlEx(
-			9,
-			"ESP KMD TZ",
-			"File: %s, Line: %d, Function: %s, RETURN: 0x%x <<<",
-			"Icaros_KMD_ESP_TZ_Device.c",
-			510,
-			"CameraESPTZAreConstraintsSatisfied",
-			1);
+		ExpirationTime.QuadPart = -1LL /* INFINITE */;
+	}
 
-		return TRUE;
+	//
+	// Handle the immediate timeout case in the fast path.
+	//
+
+	CameraESPTZReadSample(Device, &Sample);
+	if (CameraESPTZAreConstraintsSatisfied(Sample.Temperature,
+		ThermalWaitRead->LowTemperature,
+		ThermalWaitRead->HighTemperature,
+		ExpirationTime)) {
+
+		EspDbgPrintlEx(9, "ESP KMD TZ", "%s: fast path, temperature %lu", "CameraESPTZAddReadRequest", Sample.Temperature);
+
+		//
+		// The output shares the buffered input; the bounds are read first.
+		//
+
+		Status = CameraESPTZWriteReadResult(ReadRequest,
+			ThermalWaitRead->LowTemperature,
+			ThermalWaitRead->HighTemperature,
+			&Sample,
+			FALSE,
+			&BytesReturned);
+
+		InterlockedIncrement64(&DevExt->ScanStats.FastPathHits);
+		EspDbgPrintlEx(9, "ESP KMD TZ", "Completing fast path IOCTL_THERMAL_READ_TEMPERATURE");
+		WdfRequestCompleteWithInformation(ReadRequest, Status, BytesReturned);
+	}
+	else {
+
+		EspDbgPrintlEx(9, "ESP KMD TZ", "%s: Creating request and adding it to pending queue.", "CameraESPTZAddReadRequest");
+
+		CameraESPTZPendReadRequest(Device,
+			ReadRequest,
+			ESP_TZ_IOCTL_SLOT_READ_TEMPERATURE,
+			ThermalWaitRead->LowTemperature,
+			ThermalWaitRead->HighTemperature,
+			ExpirationTime,
+			NULL);
 	}
 
+AddReadRequestEnd:
+
 	EspDbgPrintlEx(
 		9,
 		"ESP KMD TZ",
 		"File: %s, Line: %d, Function: %s <<<",
 		"Icaros_KMD_ESP_TZ_Device.c",
-		514,
-		"CameraESPTZAreConstraintsSatisfied");
-
-	return FALSE;
+		400,
+		"CameraESPTZAddReadRequest");
 }
 
 _IRQL_requires_(PASSIVE_LEVEL)
 VOID
-CameraESPTZCheckQueuedRequest(
+CameraESPTZPendReadRequest(
 	_In_ WDFDEVICE Device,
-	_In_ ULONG Temperature,
-	_Inout_ PULONG LowerBound,
-	_Inout_ PULONG UpperBound,
-	_In_ WDFREQUEST Request
+	_In_ WDFREQUEST Request,
+	_In_ ULONG Slot,
+	_In_ ULONG LowTemperature,
+	_In_ ULONG HighTemperature,
+	_In_ LARGE_INTEGER ExpirationTime,
+	_In_opt_ PMULTI_WAIT_CONTEXT MultiWait
 )
 
 /*++
 
 Routine Description:
 
-	Examines a request and performs one of the following actions:
+	This routine adds a wait that cannot be satisfied yet to the pending
+	queue and requests a scan, or completes the request with an error if it
+	cannot be queued.
 
-	* Retires the request if it is satisfied (the sensor temperature has
-	  exceeded the bounds specified in the request)
+Arguments:
 
-	* Retires the request if it is expired (the timer due time is in the past)
+	Device - Supplies a handle to the device.
 
-	* Tightens the upper and lower bounds if the request remains in the queue.
+	Request - Supplies a handle to the request.
 
-Arguments:
+	Slot - Supplies the IOCTL dispatch slot of the request, for accounting.
 
-	Device - Supplies a handle to the device which owns this request.
+	LowTemperature - Supplies the temperature at or below which the wait
+		is satisfied.
 
-	Temperature - Supplies the current thermal zone temperature.
+	HighTemperature - Supplies the temperature at or above which the wait
+		is satisfied.
 
-	LowerBound - Supplies the lower bound threshold to adjust.
+	ExpirationTime - Supplies the system time the wait expires at, or -1.
 
-	UpperBound - Supplies the upper bound threshold to adjust.
+	MultiWait - Supplies the conditions of a multi-wait, whose union the
+		bounds and expiration stand for, or NULL for a single wait.
 
-	Request - Supplies a handle to the request.
+Return Value:
+
+	None.
 
 --*/
 
 {
-	ULONG BytesReturned;
-	LARGE_INTEGER CurrentTime;
-	PFDO_DATA DevExt;
-	size_t Length;
+	PVOID Buffer;
+	PESP_TZ_CLIENT Client;
 	PREAD_REQUEST_CONTEXT Context;
-	WDFREQUEST RetrievedRequest;
-	PULONG RequestTemperature;
+	WDF_OBJECT_ATTRIBUTES ContextAttributes;
+	BOOLEAN Critical;
+	PFDO_DATA DevExt;
+	BOOLEAN Queued;
+	ULONG64 QpcTimeStamp;
+	BOOLEAN Resume;
 	NTSTATUS Status;
 
-	EspDbgPrintlEx(
-		9,
-		"ESP KMD TZ",
-		"File: %s, Line: %d, Function: %s >>>",
-		"Icaros_KMD_ESP_TZ_Device.c",
-		818,
-		"CameraESPTZCheckQueuedRequest");
+	DevExt = GetDeviceExtension(Device);
+	Critical = FALSE;
+	Queued = FALSE;
+	Resume = FALSE;
 
-	PAGED_CODE();
+	EspDbgPrintlEx(9, "ESP KMD TZ", "%s: DevExt->queueLock LOCK ON", "CameraESPTZPendReadRequest");
 
-	KeQuerySystemTime(&CurrentTime);
-	DevExt = GetDeviceExtension(Device);
-	Context = WdfObjectGetTypedContext(Request, READ_REQUEST_CONTEXT);
+	CameraESPTZAcquireQueueLock(DevExt);
 
-	RetrievedRequest = NULL;
+	Client = CameraESPTZClientFromRequest(Device, Request);
+	if ((ULONG)Client->Waiters >= DevExt->ClientWaiterQuota) {
+		EspDbgPrintlEx(0, "ESP KMD TZ", "%s: client waiter quota of %lu reached.", "CameraESPTZPendReadRequest", DevExt->ClientWaiterQuota);
+		WdfRequestCompleteWithInformation(Request, STATUS_QUOTA_EXCEEDED, 0);
+		goto PendReadRequestEnd;
+	}
 
 	//
-	// Complete the request if:
+	// Create a context to store request-specific information.
 	//
-	// 1. The temperature has exceeded one of the request thresholds.
-	// 2. The request timeout is in the past (but not negative).
+
+	WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&ContextAttributes,
+		READ_REQUEST_CONTEXT);
+
+	Status = WdfObjectAllocateContext(Request,
+		&ContextAttributes,
+		&Context);
+
+	if (!NT_SUCCESS(Status)) {
+		EspDbgPrintlEx(0, "ESP KMD TZ", "WdfObjectAllocateContext() Failed. 0x%x", Status);
+		WdfRequestCompleteWithInformation(Request, Status, 0);
+		goto PendReadRequestEnd;
+	}
+
+	Context->ExpirationTime.QuadPart = ExpirationTime.QuadPart;
+	Context->LowTemperature = LowTemperature;
+	Context->HighTemperature = HighTemperature;
+	Context->QueuedTime = KeQueryInterruptTimePrecise(&QpcTimeStamp);
+	Context->Next = NULL;
+	Context->Client = Client;
+	Context->MultiWait = MultiWait;
+	Context->Slot = Slot;
+	Context->ScanGeneration = 0;
+
+	//
+	// Only a wait whose result can report a trip point is retired by a trip
+	// point crossing; a bare ULONG could not tell it from its own bounds.
+	//
+
+	Context->ExtendedResult = (MultiWait != NULL) ||
+		NT_SUCCESS(WdfRequestRetrieveOutputBuffer(Request,
+			sizeof(ESP_TZ_READ_RESULT),
+			&Buffer,
+			NULL));
+
+	//
+	// Count the waiter before it is queued, where it may be cancelled at
+	// any time.
+	//
+
+	Resume = CameraESPTZAddWaiter(DevExt, Client);
+	Status = WdfRequestForwardToIoQueue(Request,
+		DevExt->PendingRequestQueue);
+
+	if (!NT_SUCCESS(Status)) {
+		EspDbgPrintlEx(0, "ESP KMD TZ", "WdfRequestForwardToIoQueue() Failed. 0x%x", Status);
+		if (CameraESPTZRemoveWaiters(DevExt, Client, 1) != FALSE) {
+			WdfTimerStop(DevExt->DeadlineTimer, FALSE);
+		}
+
+		Resume = FALSE;
+		WdfRequestCompleteWithInformation(Request, Status, 0);
+		goto PendReadRequestEnd;
+	}
+
+	Queued = TRUE;
+
+PendReadRequestEnd:
+
+	CameraESPTZReleaseQueueLock(DevExt);
+	EspDbgPrintlEx(9, "ESP KMD TZ", "%s: DevExt->queueLock LOCK OFF", "CameraESPTZPendReadRequest");
+
+	//
+	// The first waiter wakes the sensor side before the scan it requests
+	// sets the thresholds, so they are evaluated from the next sample on.
+	// A critical temperature reached while idle is delivered right away.
+	//
+
+	if (Resume != FALSE) {
+		CameraESPTZAcquireSensorLock(DevExt);
+		if (DevExt->Idle.SensorIdle != FALSE) {
+			Critical = CameraESPTZLeaveIdle(DevExt);
+		}
+
+		CameraESPTZReleaseSensorLock(DevExt);
+		if (Critical != FALSE) {
+			CameraESPTZTemperatureInterrupt(Device);
+		}
+	}
+
+	//
+	// Request a rescan of the queue to update the interrupt thresholds and
+	// the deadline timer, if this request expires.
+	//
+
+	if (Queued != FALSE) {
+		CameraESPTZRequestScan(Device, EspTzScanEnqueue);
+	}
+}
+
+NTSTATUS
+CameraESPTZWriteReadResult(
+	_In_ WDFREQUEST Request,
+	_In_ ULONG LowTemperature,
+	_In_ ULONG HighTemperature,
+	_In_ PESP_TZ_SAMPLE Sample,
+	_In_ BOOLEAN TripPointCrossed,
+	_Out_ PULONG BytesReturned
+)
+
+/*++
+
+Routine Description:
+
+	This routine writes the result of a single wait to its output buffer.
+	The format is chosen by the buffer size: a ULONG receives the
+	temperature alone, an ESP_TZ_READ_RESULT or larger receives the full
+	result.
+
+Arguments:
+
+	Request - Supplies a handle to the request.
+
+	LowTemperature - Supplies the request's lower temperature bound.
+
+	HighTemperature - Supplies the request's upper temperature bound.
+
+	Sample - Supplies the sample the request is retired with.
+
+	TripPointCrossed - Supplies whether a trip point crossing retired it.
+
+	BytesReturned - Receives the number of bytes written.
+
+Return Value:
+
+	NTSTATUS.
+
+--*/
+
+{
+	PVOID Buffer;
+	size_t Length;
+	ULONG64 QpcTimeStamp;
+	PESP_TZ_READ_RESULT Result;
+	NTSTATUS Status;
+
+	Status = WdfRequestRetrieveOutputBuffer(Request,
+		sizeof(ULONG),
+		&Buffer,
+		&Length);
+
+	if (NT_SUCCESS(Status) && (Length >= sizeof(ESP_TZ_READ_RESULT))) {
+		Result = (PESP_TZ_READ_RESULT)Buffer;
+		if ((Sample->Temperature <= LowTemperature) ||
+			(Sample->Temperature >= HighTemperature)) {
+
+			Result->Reason = EspTzWaitSatisfied;
+
+		} else if (TripPointCrossed != FALSE) {
+			Result->Reason = EspTzWaitTripPoint;
+
+		} else {
+			Result->Reason = EspTzWaitExpired;
+		}
+
+		Result->Temperature = Sample->Temperature;
+		Result->SampleTime = Sample->Time;
+		Result->CompletionTime = KeQueryInterruptTimePrecise(&QpcTimeStamp);
+		Result->Sequence = Sample->Sequence;
+		*BytesReturned = sizeof(ESP_TZ_READ_RESULT);
+		return STATUS_SUCCESS;
+	}
+
+	if (NT_SUCCESS(Status) && (Length == sizeof(ULONG))) {
+		*(PULONG)Buffer = Sample->Temperature;
+		*BytesReturned = sizeof(ULONG);
+		return STATUS_SUCCESS;
+	}
+
 	//
+	// The request's return buffer is malformed.
+	//
+
+	EspDbgPrintlEx(0, "ESP KMD TZ", "WdfRequestRetrieveOutputBuffer() Failed. 0x%x", -1073741811);
+	*BytesReturned = 0;
+	return STATUS_INVALID_PARAMETER;
+}
+
+NTSTATUS
+CameraESPTZFormatReadResult(
+	_In_ WDFREQUEST Request,
+	_In_ PREAD_REQUEST_CONTEXT Context,
+	_In_ PESP_TZ_SAMPLE Sample,
+	_In_ BOOLEAN TripPointCrossed,
+	_Out_ PULONG BytesReturned
+)
+
+/*++
+
+Routine Description:
+
+	This routine writes the result of a retired wait to its output buffer.
+
+Arguments:
+
+	Request - Supplies a handle to the request.
+
+	Context - Supplies the request's context.
+
+	Sample - Supplies the sample the request is retired with.
+
+	TripPointCrossed - Supplies whether a trip point crossing retired it.
+
+	BytesReturned - Receives the number of bytes written.
+
+Return Value:
+
+	NTSTATUS.
+
+--*/
+
+{
+	if (Context->MultiWait != NULL) {
+		return CameraESPTZMultiWaitFormatResult(Request,
+			Context->MultiWait,
+			Sample->Temperature,
+			TripPointCrossed,
+			BytesReturned);
+	}
 
-	if (CameraESPTZAreConstraintsSatisfied(Temperature,
+	return CameraESPTZWriteReadResult(Request,
 		Context->LowTemperature,
 		Context->HighTemperature,
-		Context->ExpirationTime)) {
+		Sample,
+		TripPointCrossed,
+		BytesReturned);
+}
 
-		Status = WdfIoQueueRetrieveFoundRequest(DevExt->PendingRequestQueue,
-			Request,
-			&RetrievedRequest);
+VOID
+CameraESPTZCameraOffNotification(
+	WDFDEVICE Device,
+	WDFREQUEST Request
+)
+{
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s >>>",
+		"Icaros_KMD_ESP_TZ_Device.c",
+		609,
+		"CameraESPTZCameraOffNotification");
 
-		if (!NT_SUCCESS(Status)) {
-			EspDbgPrintlEx(0, "ESP KMD TZ", "WdfIoQueueRetrieveFoundRequest() Failed. 0x%x", Status);
+	CameraESPTZSetCameraState(Device, FALSE);
+	WdfRequestComplete(Request, 0);
 
-			//
-			// Bail, likely because the request disappeared from the
-			// queue.
-			//
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s <<<",
+		"Icaros_KMD_ESP_TZ_Device.c",
+		617,
+		"CameraESPTZCameraOffNotification");
+}
 
-			goto CheckQueuedRequestEnd;
-		}
+VOID
+CameraESPTZCameraOnNotification(
+	WDFDEVICE Device,
+	WDFREQUEST Request
+)
+{
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s >>>",
+		"Icaros_KMD_ESP_TZ_Device.c",
+		591,
+		"CameraESPTZCameraOnNotification");
+
+	CameraESPTZSetCameraState(Device, TRUE);
+	WdfRequestComplete(Request, 0);
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s <<<",
+		"Icaros_KMD_ESP_TZ_Device.c",
+		597,
+		"CameraESPTZCameraOnNotification");
+}
 
-		Status = WdfRequestRetrieveOutputBuffer(RetrievedRequest,
-			sizeof(ULONG),
-			&RequestTemperature,
-			&Length);
+VOID
+CameraESPTZTemperatureInterrupt(
+	_In_ WDFDEVICE Device
+)
+
+
+/*++
+
+Routine Description:
+
+	This routine is invoked to simulate an interrupt from the virtual sensor
+	device. It performs all the work a normal ISR would perform.
+
+Arguments:
+
+	Device - Supplies a handle to the device.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+
+	PFDO_DATA DevExt;
+	ULONG64 QpcTimeStamp;
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s >>>",
+		"Icaros_KMD_ESP_TZ_Device.c",
+		1012,
+		"CameraESPTZTemperatureInterrupt");
+
+	DevExt = GetDeviceExtension(Device);
+	InterlockedIncrement64(&DevExt->LoadStats.InterruptsRaised);
+
+	//
+	// Note the earliest undelivered crossing so the scan that delivers it
+	// can account the crossing-to-completion latency.
+	//
+
+	InterlockedCompareExchange64(&DevExt->LoadStats.CrossingTime,
+		(LONG64)KeQueryInterruptTimePrecise(&QpcTimeStamp),
+		0);
+
+	//
+	// A critical crossing is delivered right here rather than through the
+	// worker, and satisfies every waiter at once.
+	//
+
+	if ((KeGetCurrentIrql() == PASSIVE_LEVEL) &&
+		(InterlockedExchange(&DevExt->Sensor.TripPoints.CriticalCrossed, 0) != 0)) {
+
+		CameraESPTZDrainPendingQueue(Device);
+
+	} else if (ReadPointerAcquire((PVOID*)&DevExt->LowLatency.Thread) != NULL) {
+		CameraESPTZLowLatencySignal(&DevExt->LowLatency, ESP_TZ_LOW_LATENCY_INTERRUPT);
+
+	} else {
+		WdfWorkItemEnqueue(DevExt->InterruptWorker);
+	}
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s <<<",
+		"Icaros_KMD_ESP_TZ_Device.c",
+		1017,
+		"CameraESPTZTemperatureInterrupt");
+
+	return;
+}
+
+VOID
+CameraESPTZScheduleModelCrossing(
+	_In_ PFDO_DATA DevExt,
+	_In_ ULONGLONG CurrentTime
+)
+
+/*++
+
+Routine Description:
+
+	This routine arms the model timer for the next predicted threshold or
+	trip point crossing, or stops it if the modeled trajectory never
+	crosses one or the sensor side is idle.
+
+	N.B. This routine requires the Sensor.Lock be held.
+
+Arguments:
+
+	DevExt - Supplies the device extension.
+
+	CurrentTime - Supplies the current interrupt time.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	ULONGLONG Deadline;
+	ULONG LowerBound;
+	ULONG UpperBound;
+
+	if ((DevExt->Sensor.Model.Enabled == FALSE) ||
+		(DevExt->Sensor.ModelTimer == NULL)) {
+
+		return;
+	}
+
+	if (DevExt->Idle.SensorIdle != FALSE) {
+		WdfTimerStop(DevExt->Sensor.ModelTimer, FALSE);
+		return;
+	}
+
+	LowerBound = DevExt->Sensor.LowerBound;
+	UpperBound = DevExt->Sensor.UpperBound;
+	CameraESPTZTripPointsBounds(&DevExt->Sensor.TripPoints, &LowerBound, &UpperBound);
+	Deadline = CameraESPTZModelNextCrossing(&DevExt->Sensor.Model,
+		CurrentTime,
+		LowerBound,
+		UpperBound);
+
+	if (Deadline == 0) {
+		WdfTimerStop(DevExt->Sensor.ModelTimer, FALSE);
+		return;
+	}
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"%s : next crossing in %lu ms",
+		"CameraESPTZScheduleModelCrossing",
+		(ULONG)((Deadline - CurrentTime) / 10000));
+
+	//
+	// Never re-arm sooner than the minimum delay, so a prediction that lands
+	// just short of the bound cannot spin the timer.
+	//
+
+	WdfTimerStart(DevExt->Sensor.ModelTimer,
+		-(LONGLONG)max(Deadline - CurrentTime, ESP_TZ_MODEL_MINIMUM_DELAY));
+}
+
+VOID
+CameraESPTZCheckModelCrossing(
+	_In_ WDFDEVICE Device
+)
+
+/*++
+
+Routine Description:
+
+	This routine is invoked when the modeled temperature is predicted to
+	cross a virtual interrupt threshold. It fires the virtual interrupt if
+	the crossing happened, or re-arms the model timer otherwise.
+
+Arguments:
+
+	Device - Supplies a handle to the device.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	ULONGLONG CurrentTime;
+	PFDO_DATA DevExt;
+	BOOLEAN Interrupt;
+
+	DevExt = GetDeviceExtension(Device);
+	CurrentTime = KeQueryInterruptTime();
+
+	CameraESPTZAcquireSensorLock(DevExt);
+	CameraESPTZPublishTemperature(DevExt,
+		CameraESPTZModelEvaluate(&DevExt->Sensor.Model, CurrentTime));
+
+	Interrupt = CameraESPTZIsThresholdCrossed(DevExt);
+	if (Interrupt == FALSE) {
+		CameraESPTZScheduleModelCrossing(DevExt, CurrentTime);
+	}
+
+	CameraESPTZReleaseSensorLock(DevExt);
+
+	if (Interrupt != FALSE) {
+		CameraESPTZTemperatureInterrupt(Device);
+	}
+}
+
+VOID
+CameraESPTZEvtModelCrossingTimer(
+	WDFTIMER Timer
+)
+
+/*++
+
+Routine Description:
+
+	This routine is invoked when the model timer expires.
+
+Arguments:
+
+	Timer - Supplies a handle to the timer which expired.
+
+--*/
+
+{
+	WDFDEVICE Device;
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s >>>",
+		"Icaros_KMD_ESP_TZ_Device.c",
+		515,
+		"CameraESPTZEvtModelCrossingTimer");
+
+	Device = (WDFDEVICE)WdfTimerGetParentObject(Timer);
+	InterlockedIncrement64(&GetDeviceExtension(Device)->Idle.ModelWakeups);
+	CameraESPTZCheckModelCrossing(Device);
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s <<<",
+		"Icaros_KMD_ESP_TZ_Device.c",
+		536,
+		"CameraESPTZEvtModelCrossingTimer");
+}
+
+VOID
+CameraESPTZSetCameraState(
+	_In_ WDFDEVICE Device,
+	_In_ BOOLEAN CameraOn
+)
+
+/*++
+
+Routine Description:
+
+	This routine applies a camera power notification to the virtual sensor.
+	With the thermal model enabled the sensor starts heating or cooling from
+	the current temperature. Otherwise, turning the camera off resets the
+	sensor to the ambient temperature.
+
+Arguments:
+
+	Device - Supplies a handle to the device.
+
+	CameraOn - Supplies the new camera power state.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	ULONGLONG CurrentTime;
+	PFDO_DATA DevExt;
+	BOOLEAN Interrupt;
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s >>>",
+		"Icaros_KMD_ESP_TZ_Device.c",
+		566,
+		"CameraESPTZSetCameraState");
+
+	DevExt = GetDeviceExtension(Device);
+	CurrentTime = KeQueryInterruptTime();
+
+	CameraESPTZAcquireSensorLock(DevExt);
+
+	if (DevExt->Sensor.Model.Enabled != FALSE) {
+		CameraESPTZModelSetCameraState(&DevExt->Sensor.Model, CameraOn, CurrentTime);
+		CameraESPTZPublishTemperature(DevExt,
+			CameraESPTZModelEvaluate(&DevExt->Sensor.Model, CurrentTime));
+
+	} else {
+		DevExt->Sensor.Model.CameraOn = CameraOn;
+		if (CameraOn == FALSE) {
+			CameraESPTZPublishTemperature(DevExt, DevExt->Sensor.Model.AmbientTemperature);
+			CameraESPTZModelAnchor(&DevExt->Sensor.Model,
+				DevExt->Sensor.Temperature,
+				CurrentTime);
+		}
+	}
+
+	CameraESPTZFilterReset(&DevExt->Sensor.Filter);
+
+	EspDbgPrintlEx(9, "ESP KMD TZ", "%s : Camera %s, Temp %d", "CameraESPTZSetCameraState", (CameraOn != FALSE) ? "on" : "off", DevExt->Sensor.Temperature);
+
+	Interrupt = CameraESPTZIsThresholdCrossed(DevExt);
+	if (Interrupt == FALSE) {
+		CameraESPTZScheduleModelCrossing(DevExt, CurrentTime);
+	}
+
+	CameraESPTZReleaseSensorLock(DevExt);
+
+	if (Interrupt != FALSE) {
+		CameraESPTZTemperatureInterrupt(Device);
+	}
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s <<<",
+		"Icaros_KMD_ESP_TZ_Device.c",
+		603,
+		"CameraESPTZSetCameraState");
+}
+
+VOID
+CameraESPTZSetTemperature(
+	WDFDEVICE Device,
+	WDFREQUEST ReadRequest
+)
+{
+	NTSTATUS Status;
+	PULONG Temperature;
+	ULONG Value;
+	FDO_DATA* DevExt;
+	size_t Length;
+	BOOLEAN Drain;
+
+	Status = STATUS_SUCCESS;
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s >>>",
+		"Icaros_KMD_ESP_TZ_Device.c",
+		532,
+		"CameraESPTZSetTemperature");
+
+	Value = 1;
+	Temperature = &Value;
+	Drain = FALSE;
+
+	DevExt = GetDeviceExtension(Device);
+	Status = WdfRequestRetrieveInputBuffer(ReadRequest, sizeof(ULONG), &Temperature, &Length);
+
+	if (NT_SUCCESS(Status))
+	{
+		if (Temperature != NULL)
+		{
+			//
+			// Post the sample without taking the Sensor.Lock. The producer
+			// that finds the mailbox empty publishes everything posted up to
+			// then, after completing its own request; the others are done.
+			// With every entry in use, the sample is published directly
+			// behind the ones already posted.
+			//
+
+			if (CameraESPTZMailboxPost(&DevExt->Mailbox, *Temperature, &Drain) == FALSE) {
+				CameraESPTZMailboxPublish(Device, *Temperature);
+			}
+		}
+
+		WdfRequestComplete(ReadRequest, Status);
+
+		if (Drain != FALSE) {
+			CameraESPTZMailboxDrain(Device);
+		}
+
+		EspDbgPrintlEx(
+			9,
+			"ESP KMD TZ",
+			"File: %s, Line: %d, Function: %s <<<",
+			"Icaros_KMD_ESP_TZ_Device.c",
+			577,
+			"CameraESPTZSetTemperature");
+	}
+	else
+	{
+		EspDbgPrintlEx(0, "ESP KMD TZ", "WdfRequestRetrieveInputBuffer() Failed. 0x%x", Status);
+		WdfRequestCompleteWithInformation(ReadRequest, Status, 0);
+		EspDbgPrintlEx(
+			9,
+			"ESP KMD TZ",
+			"File: %s, Line: %d, Function: %s <<<",
+			"Icaros_KMD_ESP_TZ_Device.c",
+			549,
+			"CameraESPTZSetTemperature");
+	}
+}
+
+VOID
+CameraESPTZSetTemperatures(
+	_In_ WDFDEVICE Device,
+	_In_ WDFREQUEST Request
+)
+
+/*++
+
+Routine Description:
+
+	This routine handles IOCTL_ESP_TZ_SET_TEMPERATURES. The sample mailbox
+	is drained first. Every sample of the batch then runs through the
+	filter and is checked against the thresholds and trip points in one
+	Sensor.Lock hold. The model is anchored at the last sample and at most
+	one virtual interrupt is fired for the batch.
+
+Arguments:
+
+	Device - Supplies a handle to the device.
+
+	Request - Supplies a handle to the request.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	PESP_TZ_SAMPLE_BATCH Batch;
+	ULONG Count;
+	ULONGLONG CurrentTime;
+	PFDO_DATA DevExt;
+	ULONG Index;
+	BOOLEAN Interrupt;
+	size_t Length;
+	ULONGLONG Previous;
+	PESP_TZ_TIMED_SAMPLE Sample;
+	NTSTATUS Status;
+	LARGE_INTEGER SystemTime;
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s >>>",
+		"Icaros_KMD_ESP_TZ_Device.c",
+		1202,
+		"CameraESPTZSetTemperatures");
+
+	DevExt = GetDeviceExtension(Device);
+	Interrupt = FALSE;
+	Status = WdfRequestRetrieveInputBuffer(Request,
+		FIELD_OFFSET(ESP_TZ_SAMPLE_BATCH, Samples),
+		&Batch,
+		&Length);
+
+	if (!NT_SUCCESS(Status)) {
+		EspDbgPrintlEx(0, "ESP KMD TZ", "WdfRequestRetrieveInputBuffer() Failed. 0x%x", Status);
+		goto SetTemperaturesEnd;
+	}
+
+	Count = Batch->Count;
+	if ((Batch->Version != ESP_TZ_SAMPLE_BATCH_VERSION) ||
+		(Count == 0) ||
+		(Count > ESP_TZ_MAX_BATCH_SAMPLES) ||
+		(Length < FIELD_OFFSET(ESP_TZ_SAMPLE_BATCH, Samples) + (size_t)Count * sizeof(ESP_TZ_TIMED_SAMPLE))) {
+
+		Status = STATUS_INVALID_PARAMETER;
+		EspDbgPrintlEx(0, "ESP KMD TZ", "%s : Version %lu, Count %lu rejected", "CameraESPTZSetTemperatures", Batch->Version, Count);
+		goto SetTemperaturesEnd;
+	}
+
+	//
+	// Resolve the timestamps before touching the sensor, so a rejected batch
+	// leaves no trace. Samples from the future are taken as current.
+	//
+
+	CurrentTime = KeQueryInterruptTime();
+	KeQuerySystemTime(&SystemTime);
+	Previous = 0;
+	for (Index = 0; Index < Count; Index += 1) {
+		Sample = &Batch->Samples[Index];
+		if ((Sample->Timestamp == 0) || (Sample->Timestamp > CurrentTime)) {
+			Sample->Timestamp = CurrentTime;
+		}
+
+		if (Sample->Timestamp < Previous) {
+			Status = STATUS_INVALID_PARAMETER;
+			EspDbgPrintlEx(0, "ESP KMD TZ", "%s : sample %lu out of order", "CameraESPTZSetTemperatures", Index);
+			goto SetTemperaturesEnd;
+		}
+
+		Previous = Sample->Timestamp;
+	}
+
+	//
+	// Samples already in the mailbox reached the device first; publish them
+	// before the batch so the filter sees them in that order.
+	//
+
+	CameraESPTZMailboxDrain(Device);
+
+	//
+	// The published value of each sample is written back over the raw one,
+	// so the history can be fed after the lock is dropped.
+	//
+
+	CameraESPTZAcquireSensorLock(DevExt);
+	for (Index = 0; Index < Count; Index += 1) {
+		Sample = &Batch->Samples[Index];
+		DevExt->Sensor.RawTemperature = Sample->Temperature;
+		CameraESPTZPublishTemperature(DevExt,
+			CameraESPTZFilterSample(&DevExt->Sensor.Filter, Sample->Temperature));
+
+		Sample->Temperature = DevExt->Sensor.Temperature;
+		if (CameraESPTZIsThresholdCrossed(DevExt) != FALSE) {
+			Interrupt = TRUE;
+		}
+	}
+
+	//
+	// A batch back-dated behind a sample already published through the
+	// mailbox must not move the sample time backwards.
+	//
+
+	DevExt->Sensor.SampleTime = max(DevExt->Sensor.SampleTime, Previous);
+	DevExt->Sensor.Sequence += Count;
+	CameraESPTZModelAnchor(&DevExt->Sensor.Model,
+		DevExt->Sensor.Temperature,
+		DevExt->Sensor.SampleTime);
+
+	if (Interrupt == FALSE) {
+		CameraESPTZScheduleModelCrossing(DevExt, CurrentTime);
+	}
+
+	CameraESPTZReleaseSensorLock(DevExt);
+
+	for (Index = 0; Index < Count; Index += 1) {
+		Sample = &Batch->Samples[Index];
+		CameraESPTZHistoryRecord(&DevExt->History,
+			Sample->Temperature,
+			(ULONGLONG)SystemTime.QuadPart - (CurrentTime - Sample->Timestamp));
+	}
+
+	EspDbgPrintlEx(9, "ESP KMD TZ", "%s : %lu samples, temp %lu, interrupt %d", "CameraESPTZSetTemperatures", Count, Batch->Samples[Count - 1].Temperature, Interrupt);
+
+SetTemperaturesEnd:
+
+	WdfRequestComplete(Request, Status);
+
+	if (Interrupt != FALSE) {
+		CameraESPTZTemperatureInterrupt(Device);
+	}
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s <<<",
+		"Icaros_KMD_ESP_TZ_Device.c",
+		1318,
+		"CameraESPTZSetTemperatures");
+}
+
+VOID
+CameraESPTZSetVirtualInterruptThresholds(
+	_In_ WDFDEVICE Device,
+	_In_ ULONG LowerBound,
+	_In_ ULONG UpperBound
+)
+
+/*++
+
+Routine Description:
+
+	This routine is invoked to change the thresholds the virtual sensor driver
+	uses to compare against for an interrupt to occur.
+
+Arguments:
+
+	Device - Supplies a handle to the device.
+
+	LowerBound - Supplies the temperature below which the device should issue
+		an interrupt.
+
+	UpperBound - Supplies the temperature above which the device should issue
+		an interrupt.
+
+Return Value:
+
+	NTSTATUS
+
+--*/
+
+{
+
+	PFDO_DATA DevExt;
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s >>>",
+		"Icaros_KMD_ESP_TZ_Device.c",
+		951,
+		"CameraESPTZSetVirtualInterruptThresholds");
+
+	DevExt = GetDeviceExtension(Device);
+	CameraESPTZAcquireSensorLock(DevExt);
+
+	DevExt->Sensor.LowerBound = LowerBound;
+	DevExt->Sensor.UpperBound = UpperBound;
+	CameraESPTZScheduleModelCrossing(DevExt, KeQueryInterruptTime());
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"%s : LowerBound = %lu, UpperBound = %lu",
+		"CameraESPTZSetVirtualInterruptThresholds",
+		LowerBound,
+		UpperBound);
+
+	CameraESPTZReleaseSensorLock(DevExt);
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s <<<",
+		"Icaros_KMD_ESP_TZ_Device.c",
+		985,
+		"CameraESPTZSetVirtualInterruptThresholds");
+
+	return;
+}
+
+_IRQL_requires_(PASSIVE_LEVEL)
+BOOLEAN
+CameraESPTZAreConstraintsSatisfied(
+	_In_ ULONG Temperature,
+	_In_ ULONG LowerBound,
+	_In_ ULONG UpperBound,
+	_In_ LARGE_INTEGER DueTime
+)
+
+/*++
+
+Routine Description:
+
+	Checks whether a request can be retired.
+
+Arguments:
+
+	Temperature - Supplies the device's current temperature.
+
+	LowerBound - Supplies the request's lower temperature bound.
+
+	UpperBound - Supplies the request's upper temperature bound.
+
+	DueTime - Supplies when the request expires.
+
+Return Value:
+
+	TRUE - The request is retireable.
+
+	FALSE - The request is not retireable.
+
+--*/
+
+{
+	LARGE_INTEGER CurrentTime;
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s >>>",
+		"Icaros_KMD_ESP_TZ_Device.c",
+		482,
+		"CameraESPTZAreConstraintsSatisfied");
+
+	if (Temperature <= LowerBound || Temperature >= UpperBound) {
+
+		EspDbgPrintlEx(
+			9,
+			"ESP KMD TZ",
+			"File: %s, Line: %d, Function: %s, RETURN: 0x%x <<<",
+			"Icaros_KMD_ESP_TZ_Device.c",
+			489,
+			"CameraESPTZAreConstraintsSatisfied",
+			1);
+
+		return TRUE;
+	}
+
+	//
+	// Negative due times are meaningless, except for the special value -1,
+	// which represents no timeout.
+	//
+
+	if (DueTime.QuadPart < 0) {
+
+		EspDbgPrintlEx(
+			9,
+			"ESP KMD TZ",
+			"File: %s, Line: %d, Function: %s, RETURN: 0x%x <<<",
+			"Icaros_KMD_ESP_TZ_Device.c",
+			499,
+			"CameraESPTZAreConstraintsSatisfied",
+			0);
+
+		return FALSE;
+	}
+
+	KeQuerySystemTime(&CurrentTime);
+
+	if ((CurrentTime.QuadPart - DueTime.QuadPart) >= 0) {
+
+		//
+		// This request expired in the past.
+		//
+
+		EspDbgPrintlEx(
+			9,
+			"ESP KMD TZ",
+			"File: %s, Line: %d, Function: %s, RETURN: 0x%x <<<",
+			"Icaros_KMD_ESP_TZ_Device.c",
+			510,
+			"CameraESPTZAreConstraintsSatisfied",
+			1);
+
+		return TRUE;
+	}
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s <<<",
+		"Icaros_KMD_ESP_TZ_Device.c",
+		514,
+		"CameraESPTZAreConstraintsSatisfied");
+
+	return FALSE;
+}
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+CameraESPTZCheckQueuedRequest(
+	_In_ WDFDEVICE Device,
+	_In_ PESP_TZ_SAMPLE Sample,
+	_In_ ULONG Trend,
+	_In_ BOOLEAN TripPointCrossed,
+	_Inout_ PULONG LowerBound,
+	_Inout_ PULONG UpperBound,
+	_Inout_ PLONGLONG NextExpiration,
+	_In_ WDFREQUEST Request
+)
+
+/*++
+
+Routine Description:
+
+	Examines a request and performs one of the following actions:
+
+	* Retires the request if it is satisfied (the sensor temperature has
+	  exceeded the bounds specified in the request)
+
+	* Retires the request if it is expired (the timer due time is in the past)
+
+	* Retires the request if the temperature crossed a device trip point
+	  and its result can report that
+
+	* Tightens the upper and lower bounds, and brings the next expiration
+	  forward, if the request remains in the queue.
+
+	N.B. The request must have been found in the pending queue under the
+		current QueueLock hold; its client is only known to be alive
+		while the request is queued.
+
+Arguments:
+
+	Device - Supplies a handle to the device which owns this request.
+
+	Sample - Supplies the current thermal zone sample.
+
+	Trend - Supplies the ESP_TZ_TREND_* directions the temperature moved in
+		since the previous scan. Only the bounds on those sides are checked,
+		and only for a request the previous scan checked as well.
+
+	TripPointCrossed - Supplies whether the scan delivers a trip point
+		crossing.
+
+	LowerBound - Supplies the lower bound threshold to adjust.
+
+	UpperBound - Supplies the upper bound threshold to adjust.
+
+	NextExpiration - Supplies the earliest expiration of the remaining
+		requests to adjust, in system time.
+
+	Request - Supplies a handle to the request.
+
+--*/
+
+{
+	ULONG BytesReturned;
+	PFDO_DATA DevExt;
+	PREAD_REQUEST_CONTEXT Context;
+	ULONG64 QpcTimeStamp;
+	WDFREQUEST RetrievedRequest;
+	NTSTATUS Status;
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s >>>",
+		"Icaros_KMD_ESP_TZ_Device.c",
+		818,
+		"CameraESPTZCheckQueuedRequest");
+
+	DevExt = GetDeviceExtension(Device);
+	Context = WdfObjectGetTypedContext(Request, READ_REQUEST_CONTEXT);
+
+	RetrievedRequest = NULL;
+
+	//
+	// The trend only says where the temperature went since the previous scan
+	// took its sample. A request that scan did not check, because it was
+	// queued behind the walk or after it, may have been satisfied before
+	// then, so both of its sides are checked on its first visit.
+	//
+
+	if ((Context->ScanGeneration == 0) ||
+		(Context->ScanGeneration != DevExt->ScanCursor.Generation - 1)) {
+
+		Trend = ESP_TZ_TREND_RISING | ESP_TZ_TREND_FALLING;
+	}
+
+	Context->ScanGeneration = DevExt->ScanCursor.Generation;
+
+	//
+	// Complete the request if:
+	//
+	// 1. The temperature has exceeded one of the request thresholds.
+	// 2. The request timeout is in the past (but not negative).
+	// 3. The temperature crossed a device trip point, and the request has
+	//    an extended result to report it in.
+	//
+	// A side the temperature has not moved towards since the previous scan
+	// is replaced with a bound it cannot reach.
+	//
+
+	if (((TripPointCrossed != FALSE) && (Context->ExtendedResult != FALSE)) ||
+		CameraESPTZAreConstraintsSatisfied(Sample->Temperature,
+		((Trend & ESP_TZ_TREND_FALLING) != 0) ? Context->LowTemperature : 0,
+		((Trend & ESP_TZ_TREND_RISING) != 0) ? Context->HighTemperature : (ULONG)-1,
+		Context->ExpirationTime)) {
+
+		Status = WdfIoQueueRetrieveFoundRequest(DevExt->PendingRequestQueue,
+			Request,
+			&RetrievedRequest);
+
+		if (!NT_SUCCESS(Status)) {
+			EspDbgPrintlEx(0, "ESP KMD TZ", "WdfIoQueueRetrieveFoundRequest() Failed. 0x%x", Status);
+
+			//
+			// Bail, likely because the request disappeared from the
+			// queue.
+			//
+
+			goto CheckQueuedRequestEnd;
+		}
+
+		if (CameraESPTZRemoveWaiters(DevExt, Context->Client, 1) != FALSE) {
+			WdfTimerStop(DevExt->DeadlineTimer, FALSE);
+		}
+
+		Status = CameraESPTZFormatReadResult(RetrievedRequest,
+			Context,
+			Sample,
+			TripPointCrossed,
+			&BytesReturned);
+
+		if (((TripPointCrossed != FALSE) && (Context->ExtendedResult != FALSE)) ||
+			(Sample->Temperature <= Context->LowTemperature) ||
+			(Sample->Temperature >= Context->HighTemperature)) {
+
+			DevExt->ScanStats.RetiredSatisfied += 1;
+			if (DevExt->ScanStats.CrossingTime != 0) {
+				CameraESPTZStatsRecordLatency(&DevExt->Stats,
+					Context->Slot,
+					EspTzLatencyCrossing,
+					KeQueryInterruptTimePrecise(&QpcTimeStamp) - DevExt->ScanStats.CrossingTime);
+			}
+
+		} else {
+			DevExt->ScanStats.RetiredExpired += 1;
+		}
+
+		WdfRequestCompleteWithInformation(RetrievedRequest,
+			Status,
+			BytesReturned);
+
+		CameraESPTZStatsRecordLatency(&DevExt->Stats,
+			Context->Slot,
+			EspTzLatencyPending,
+			KeQueryInterruptTimePrecise(&QpcTimeStamp) - Context->QueuedTime);
+
+	}
+	else {
+
+		EspDbgPrintlEx(9, "ESP KMD TZ", "%s : request remains in queue.", "CameraESPTZCheckQueuedRequest");
+
+		//
+		// The request will remain in the queue. Update the bounds accordingly.
+		//
+
+		if (*LowerBound < Context->LowTemperature) {
+			*LowerBound = Context->LowTemperature;
+		}
+
+		if (*UpperBound > Context->HighTemperature) {
+			*UpperBound = Context->HighTemperature;
+		}
+
+		if ((Context->ExpirationTime.QuadPart != -1LL /* INFINITE */) &&
+			(Context->ExpirationTime.QuadPart < *NextExpiration)) {
+
+			*NextExpiration = Context->ExpirationTime.QuadPart;
+		}
+
+		CameraESPTZClientAddBounds(Context->Client,
+			Context->LowTemperature,
+			Context->HighTemperature,
+			Context->ExpirationTime.QuadPart);
+	}
+
+CheckQueuedRequestEnd:
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s <<<",
+		"Icaros_KMD_ESP_TZ_Device.c",
+		912,
+		"CameraESPTZCheckQueuedRequest");
+
+	return;
+}
+
+VOID
+CameraESPTZAcquireQueueLock(
+	_In_ PFDO_DATA DevExt
+)
+
+/*++
+
+Routine Description:
+
+	This routine acquires the QueueLock exclusive. The lock accounts its own
+	contention and hold time.
+
+Arguments:
+
+	DevExt - Supplies the device extension.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	CameraESPTZLockAcquireExclusive(&DevExt->QueueLock);
+}
+
+VOID
+CameraESPTZReleaseQueueLock(
+	_In_ PFDO_DATA DevExt
+)
+
+/*++
+
+Routine Description:
+
+	This routine releases an exclusive hold of the QueueLock.
+
+Arguments:
+
+	DevExt - Supplies the device extension.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	CameraESPTZLockReleaseExclusive(&DevExt->QueueLock);
+}
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+CameraESPTZScanPendingQueue(
+	_In_ WDFDEVICE Device,
+	_In_ ULONG Reasons
+)
+
+/*++
+
+Routine Description:
+
+	This routine starts a scan of the device's pending queue for retirable
+	requests and runs its first slice.
+
+	N.B. This routine requires the QueueLock be held.
+
+Arguments:
+
+	Device - Supplies a handle to the device.
+
+	Reasons - Supplies the ESP_TZ_SCAN_REASON mask of the triggers served
+		by the scan.
+
+Return Value:
+
+	STATUS_MORE_PROCESSING_REQUIRED if the slice ended before the scan did,
+	in which case the caller resumes it with CameraESPTZContinueScan.
+
+--*/
+
+{
+	PESP_TZ_SCAN_CURSOR Cursor;
+	PFDO_DATA DevExt;
+	NTSTATUS Status;
+	ULONG Trigger;
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s >>>",
+		"Icaros_KMD_ESP_TZ_Device.c",
+		684,
+		"CameraESPTZScanPendingQueue");
+
+	DevExt = GetDeviceExtension(Device);
+	Cursor = &DevExt->ScanCursor;
+	for (Trigger = 0; Trigger < EspTzScanTriggerMaximum; Trigger += 1) {
+		if ((Reasons & ESP_TZ_SCAN_REASON(Trigger)) != 0) {
+			DevExt->ScanStats.Scans[Trigger] += 1;
+		}
+	}
+
+	//
+	// A scan serving an interrupt delivers the pending crossing; requests it
+	// satisfies are accounted against the time the crossing was raised. The
+	// walk itself is the same for every reason.
+	//
+
+	if ((Reasons & ESP_TZ_SCAN_REASON(EspTzScanInterrupt)) != 0) {
+		DevExt->ScanStats.CrossingTime =
+			(ULONGLONG)InterlockedExchange64(&DevExt->LoadStats.CrossingTime, 0);
+
+		Cursor->TripPointCrossed = (InterlockedExchange(&DevExt->Sensor.TripPoints.Crossed, 0) != 0) ?
+			TRUE : FALSE;
+
+		if (Cursor->TripPointCrossed != FALSE) {
+			InterlockedExchange(&DevExt->Sensor.TripPoints.CriticalCrossed, 0);
+		}
+
+	} else {
+		DevExt->ScanStats.CrossingTime = 0;
+		Cursor->TripPointCrossed = FALSE;
+	}
+
+	//
+	// Every slice checks against the sample the scan started with, so the
+	// bounds gathered across slices agree with each other.
+	//
+
+	CameraESPTZReadSampleTrend(Device, &Cursor->Sample, &Cursor->Trend);
+	Cursor->Generation += 1;
+	if (Cursor->Generation == 0) {
+		Cursor->Generation = 1;
+	}
+
+	if ((Cursor->TripPointCrossed == FALSE) &&
+		(Cursor->Trend != (ESP_TZ_TREND_RISING | ESP_TZ_TREND_FALLING))) {
+
+		DevExt->ScanStats.OneSidedScans += 1;
+	}
+
+	Cursor->Active = TRUE;
+
+	//
+	// Prime the walk by finding the first request present. If there are no
+	// requests, the slice finishes the scan immediately.
+	//
+
+	Cursor->LowerBound = 0;
+	Cursor->UpperBound = (ULONG)-1;
+	Cursor->NextExpiration = MAXLONGLONG;
+	CameraESPTZClientResetBounds(Device);
+	Status = WdfIoQueueFindRequest(DevExt->PendingRequestQueue,
+		NULL,
+		NULL,
+		NULL,
+		&Cursor->Request);
+
+	//
+	// Due to a technical limitation in SDV analysis engine, the following
+	// analysis assume has to be inserted to supress a false defect for
+	// the wdfioqueueretrievefoundrequest rule.
+	//
+
+	_Analysis_assume_(Status == STATUS_NOT_FOUND);
+
+	if (!NT_SUCCESS(Status)) {
+		Cursor->Request = NULL;
+	}
+
+	Status = CameraESPTZContinueScan(Device);
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s, RETURN: 0x%x <<<",
+		"Icaros_KMD_ESP_TZ_Device.c",
+		769,
+		"CameraESPTZScanPendingQueue",
+		Status);
+
+	return Status;
+}
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+CameraESPTZContinueScan(
+	_In_ WDFDEVICE Device
+)
+
+/*++
+
+Routine Description:
+
+	This routine runs one slice of the scan in progress, from the request
+	at its cursor. The slice ends after the scheduler's budget of waiters
+	or time; the last slice publishes the bounds gathered by the scan.
+
+	Requests queued while the lock is dropped between slices are appended
+	behind the cursor, so the scan still reaches them. A request at the
+	cursor that leaves the queue in the meantime restarts the walk, as it
+	does within a slice, and is not checked.
+
+	N.B. This routine requires the QueueLock be held.
+
+Arguments:
+
+	Device - Supplies a handle to the device.
+
+Return Value:
+
+	STATUS_MORE_PROCESSING_REQUIRED if the slice ended before the scan did.
+
+--*/
+
+{
+	PESP_TZ_SCAN_CURSOR Cursor;
+	WDFREQUEST CurrentRequest;
+	PFDO_DATA DevExt;
+	WDFREQUEST LastRequest;
+	PESP_TZ_SCAN_SCHEDULER Scheduler;
+	ULONGLONG SliceStart;
+	NTSTATUS Status;
+	ULONG Visited;
+
+	DevExt = GetDeviceExtension(Device);
+	Cursor = &DevExt->ScanCursor;
+	Scheduler = &DevExt->Scheduler;
+	Scheduler->Slices += 1;
+
+	SliceStart = KeQueryInterruptTime();
+	Visited = 0;
+	CurrentRequest = Cursor->Request;
+	Status = (CurrentRequest != NULL) ? STATUS_SUCCESS : STATUS_NO_MORE_ENTRIES;
+
+	while (NT_SUCCESS(Status)) {
+
+		//
+		// End the slice once it has made progress and spent its budget. The
+		// cursor keeps the reference the walk took on the next request.
+		//
+
+		if ((Visited != 0) &&
+			(((Scheduler->SliceBudget != 0) && (Visited >= Scheduler->SliceBudget)) ||
+			 ((Scheduler->SliceTime != 0) &&
+			  (KeQueryInterruptTime() - SliceStart >= Scheduler->SliceTime)))) {
+
+			Cursor->Request = CurrentRequest;
+			return STATUS_MORE_PROCESSING_REQUIRED;
+		}
+
+		//
+		// Walk past the current request. By walking past the current request
+		// before checking it, the walk doesn't have to restart every time a
+		// request is satisfied and removed form the queue.
+		//
+
+		LastRequest = CurrentRequest;
+		Status = WdfIoQueueFindRequest(DevExt->PendingRequestQueue,
+			LastRequest,
+			NULL,
+			NULL,
+			&CurrentRequest);
+
+		//
+		// Process the last request, unless the walk just found it gone from
+		// the queue. Between slices its client may have been cleaned up and
+		// freed; a request still queued keeps its client alive while the
+		// QueueLock is held, since file cleanup dequeues under it.
+		//
+
+		Visited += 1;
+		DevExt->ScanStats.WaitersVisited += 1;
+		if (Status != STATUS_NOT_FOUND) {
+			CameraESPTZCheckQueuedRequest(Device,
+				&Cursor->Sample,
+				Cursor->Trend,
+				Cursor->TripPointCrossed,
+				&Cursor->LowerBound,
+				&Cursor->UpperBound,
+				&Cursor->NextExpiration,
+				LastRequest);
+		}
+
+		WdfObjectDereference(LastRequest);
+
+		if (Status == STATUS_NOT_FOUND) {
+
+			EspDbgPrintlEx(9, "ESP KMD TZ", "LastRequest unexpectedly disappeared from the queue. Start over");
+
+			//
+			// LastRequest unexpectedly disappeared from the queue. Start over.
+			//
+
+			DevExt->ScanStats.Restarts += 1;
+			Cursor->LowerBound = 0;
+			Cursor->UpperBound = (ULONG)-1;
+			Cursor->NextExpiration = MAXLONGLONG;
+			CameraESPTZClientResetBounds(Device);
+			Status = WdfIoQueueFindRequest(DevExt->PendingRequestQueue,
+				NULL,
+				NULL,
+				NULL,
+				&CurrentRequest);
+
+		}
+
+	}
+
+	Cursor->Request = NULL;
+	Cursor->Active = FALSE;
+
+	//
+	// Update the thresholds based on the latest contents of the queue. A
+	// single timer, due at the earliest expiration, covers every request
+	// with a timeout.
+	//
+
+	CameraESPTZSetVirtualInterruptThresholds(Device, Cursor->LowerBound, Cursor->UpperBound);
+	CameraESPTZSetDeadline(Device, Cursor->NextExpiration);
+
+	return Status;
+}
+
+VOID
+CameraESPTZSetDeadline(
+	_In_ WDFDEVICE Device,
+	_In_ LONGLONG NextExpiration
+)
+
+/*++
+
+Routine Description:
+
+	This routine arms the deadline timer for the earliest expiration of the
+	pending requests, or stops it if none of them expires.
+
+	N.B. This routine requires the QueueLock be held.
+
+Arguments:
+
+	Device - Supplies a handle to the device.
+
+	NextExpiration - Supplies the earliest expiration, in system time, or
+		MAXLONGLONG.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	PFDO_DATA DevExt;
+
+	DevExt = GetDeviceExtension(Device);
+	if (NextExpiration != MAXLONGLONG) {
+		WdfTimerStart(DevExt->DeadlineTimer, NextExpiration);
+
+	} else {
+		WdfTimerStop(DevExt->DeadlineTimer, FALSE);
+	}
+}
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+CameraESPTZDrainPendingQueue(
+	_In_ WDFDEVICE Device
+)
+
+/*++
+
+Routine Description:
+
+	This routine retires every pending request after a critical trip point
+	crossing. The whole queue is detached under one QueueLock hold, with
+	the deadline timer stopped and no per-request checks, and the requests
+	are completed with the current temperature after the lock is dropped.
+	The work per request is a dequeue and a completion, so the time to
+	notify all waiters stays bounded.
+
+Arguments:
+
+	Device - Supplies a handle to the device.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	ULONG BytesReturned;
+	PREAD_REQUEST_CONTEXT Context;
+	ULONG Count;
+	ULONGLONG CrossingTime;
+	ULONGLONG CurrentTime;
+	PFDO_DATA DevExt;
+	WDFREQUEST Head;
+	ULONG64 QpcTimeStamp;
+	WDFREQUEST Request;
+	ESP_TZ_SAMPLE Sample;
+	NTSTATUS Status;
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s >>>",
+		"Icaros_KMD_ESP_TZ_Device.c",
+		1560,
+		"CameraESPTZDrainPendingQueue");
+
+	DevExt = GetDeviceExtension(Device);
+	Head = NULL;
+	Count = 0;
+
+	CameraESPTZAcquireQueueLock(DevExt);
+	WdfTimerStop(DevExt->DeadlineTimer, FALSE);
+	InterlockedExchange(&DevExt->Sensor.TripPoints.Crossed, 0);
+
+	for (;;) {
+		Status = WdfIoQueueRetrieveNextRequest(DevExt->PendingRequestQueue, &Request);
+		if (!NT_SUCCESS(Status)) {
+			break;
+		}
+
+		Context = WdfObjectGetTypedContext(Request, READ_REQUEST_CONTEXT);
+		CameraESPTZRemoveWaiters(DevExt, Context->Client, 1);
+		Context->Next = Head;
+		Head = Request;
+		Count += 1;
+	}
+
+	DevExt->ScanStats.RetiredSatisfied += Count;
+	CameraESPTZSetVirtualInterruptThresholds(Device, 0, (ULONG)-1);
+	CameraESPTZReleaseQueueLock(DevExt);
+
+	CameraESPTZReadSample(Device, &Sample);
+	CrossingTime = (ULONGLONG)InterlockedExchange64(&DevExt->LoadStats.CrossingTime, 0);
+	CurrentTime = KeQueryInterruptTimePrecise(&QpcTimeStamp);
+
+	EspDbgPrintlEx(9, "ESP KMD TZ", "%s : critical temperature %lu, %lu requests", "CameraESPTZDrainPendingQueue", Sample.Temperature, Count);
+
+	while (Head != NULL) {
+		Request = Head;
+		Context = WdfObjectGetTypedContext(Request, READ_REQUEST_CONTEXT);
+		Head = Context->Next;
+
+		Status = CameraESPTZFormatReadResult(Request,
+			Context,
+			&Sample,
+			TRUE,
+			&BytesReturned);
+
+		CameraESPTZStatsRecordLatency(&DevExt->Stats,
+			Context->Slot,
+			EspTzLatencyPending,
+			CurrentTime - Context->QueuedTime);
+
+		if (CrossingTime != 0) {
+			CameraESPTZStatsRecordLatency(&DevExt->Stats,
+				Context->Slot,
+				EspTzLatencyCrossing,
+				CurrentTime - CrossingTime);
+		}
+
+		WdfRequestCompleteWithInformation(Request, Status, BytesReturned);
+	}
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s <<<",
+		"Icaros_KMD_ESP_TZ_Device.c",
+		1655,
+		"CameraESPTZDrainPendingQueue");
+}
+
+VOID
+CameraESPTZInterruptWorker(
+	_In_ WDFWORKITEM WorkItem
+)
+
+/*++
+
+Routine Description:
+
+	This routine is invoked to call into the device to notify it of a
+	temperature change.
+
+Arguments:
+
+	WorkItem - Supplies a handle to this work item.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+
+	PFDO_DATA DevExt;
+	WDFDEVICE Device;
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s >>>",
+		"Icaros_KMD_ESP_TZ_Device.c",
+		644,
+		"CameraESPTZInterruptWorker");
+
+	Device = (WDFDEVICE)WdfWorkItemGetParentObject(WorkItem);
+	DevExt = GetDeviceExtension(Device);
+	InterlockedIncrement64(&DevExt->LoadStats.InterruptWorkerRuns);
+	CameraESPTZRequestScan(Device, EspTzScanInterrupt);
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s <<<",
+		"Icaros_KMD_ESP_TZ_Device.c",
+		653,
+		"CameraESPTZInterruptWorker");
+
+	return;
+}
+
+ULONG
+CameraESPTZQueryConfigurationValue(
+	_In_opt_ WDFKEY Key,
+	_In_ PCWSTR ValueName,
+	_In_ ULONG DefaultValue
+)
+
+/*++
+
+Routine Description:
+
+	This routine reads a tunable from the device hardware key. Values that
+	are absent or unreadable fall back to the supplied default.
+
+Arguments:
+
+	Key - Supplies the opened device hardware key, or NULL if it could not be
+		opened.
+
+	ValueName - Supplies the name of the REG_DWORD value to read.
+
+	DefaultValue - Supplies the value to use if the registry has none.
+
+Return Value:
+
+	The configured value.
+
+--*/
+
+{
+	NTSTATUS Status;
+	UNICODE_STRING Name;
+	ULONG Value;
+
+	if (Key == NULL) {
+		return DefaultValue;
+	}
+
+	RtlInitUnicodeString(&Name, ValueName);
+	Status = WdfRegistryQueryULong(Key, &Name, &Value);
+	if (!NT_SUCCESS(Status)) {
+		return DefaultValue;
+	}
+
+	EspDbgPrintlEx(9, "ESP KMD TZ", "%s : %ws = %lu", "CameraESPTZQueryConfigurationValue", ValueName, Value);
+	return Value;
+}
+
+VOID
+CameraESPTZReadConfiguration(
+	_In_ WDFDEVICE Device
+)
+
+/*++
+
+Routine Description:
+
+	This routine reads the device tunables from the hardware key and applies
+	them to the virtual sensor.
+
+Arguments:
+
+	Device - Supplies a handle to the device.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	PFDO_DATA DevExt;
+	WDFKEY Key;
+	NTSTATUS Status;
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s >>>",
+		"Icaros_KMD_ESP_TZ_Device.c",
+		1080,
+		"CameraESPTZReadConfiguration");
+
+	DevExt = GetDeviceExtension(Device);
+	Status = WdfDeviceOpenRegistryKey(Device,
+		PLUGPLAY_REGKEY_DEVICE,
+		KEY_READ,
+		WDF_NO_OBJECT_ATTRIBUTES,
+		&Key);
+
+	if (!NT_SUCCESS(Status)) {
+		EspDbgPrintlEx(0, "ESP KMD TZ", "WdfDeviceOpenRegistryKey() Failed, using defaults. 0x%x", Status);
+		Key = NULL;
+	}
+
+	//
+	// Start from the state saved when the device last left D0, if it is
+	// recent enough, so the filter and the model start from it too.
+	//
+
+	if (Key != NULL) {
+		CameraESPTZRestoreSensorState(DevExt,
+			Key,
+			CameraESPTZQueryConfigurationValue(Key,
+				L"SavedStateMaximumAge",
+				ESP_TZ_SAVED_STATE_DEFAULT_MAXIMUM_AGE));
+	}
+
+	CameraESPTZFilterInitialize(&DevExt->Sensor.Filter,
+		CameraESPTZQueryConfigurationValue(Key, L"FilterMode", EspTzFilterNone),
+		CameraESPTZQueryConfigurationValue(Key, L"FilterWindow", 5),
+		CameraESPTZQueryConfigurationValue(Key, L"FilterAlpha", 64),
+		CameraESPTZQueryConfigurationValue(Key, L"FilterProcessNoise", 4),
+		CameraESPTZQueryConfigurationValue(Key, L"FilterMeasurementNoise", 64));
+
+	CameraESPTZModelInitialize(&DevExt->Sensor.Model,
+		CameraESPTZQueryConfigurationValue(Key, L"ThermalModelEnabled", 0) != 0,
+		CameraESPTZQueryConfigurationValue(Key, L"ThermalModelAmbientTemperature", 2940),
+		CameraESPTZQueryConfigurationValue(Key, L"ThermalModelActiveTemperature", 3180),
+		CameraESPTZQueryConfigurationValue(Key, L"ThermalModelHeatingTimeConstant", 90000),
+		CameraESPTZQueryConfigurationValue(Key, L"ThermalModelCoolingTimeConstant", 180000),
+		DevExt->Sensor.Temperature,
+		KeQueryInterruptTime());
+
+	DevExt->LowLatency.Enabled =
+		CameraESPTZQueryConfigurationValue(Key, L"LowLatencyMode", 0) != 0;
+
+	DevExt->ClientWaiterQuota = CameraESPTZQueryConfigurationValue(Key,
+		L"ClientWaiterQuota",
+		ESP_TZ_CLIENT_DEFAULT_WAITER_QUOTA);
+
+	if (DevExt->ClientWaiterQuota == 0) {
+		DevExt->ClientWaiterQuota = ESP_TZ_CLIENT_DEFAULT_WAITER_QUOTA;
+	}
+
+	DevExt->Scheduler.Quantum = 10 * min(CameraESPTZQueryConfigurationValue(Key,
+		L"ScanQuantum",
+		ESP_TZ_SCAN_DEFAULT_QUANTUM), 1000 * 1000);
+
+	DevExt->QueueLock.SpinCount = CameraESPTZQueryConfigurationValue(Key,
+		L"QueueLockSpinCount",
+		ESP_TZ_LOCK_DEFAULT_SPIN_COUNT);
+
+	DevExt->Scheduler.SliceBudget = CameraESPTZQueryConfigurationValue(Key,
+		L"ScanSliceBudget",
+		ESP_TZ_SCAN_DEFAULT_SLICE_BUDGET);
+
+	DevExt->Scheduler.SliceTime = 10 * min(CameraESPTZQueryConfigurationValue(Key,
+		L"ScanSliceTime",
+		ESP_TZ_SCAN_DEFAULT_SLICE_TIME), 1000 * 1000);
+
+	DevExt->Idle.Timeout = CameraESPTZQueryConfigurationValue(Key,
+		L"IdleTimeout",
+		ESP_TZ_IDLE_DEFAULT_TIMEOUT);
+
+	DevExt->ClassQueues[EspTzQueueSamples].DepthLimit = CameraESPTZQueryConfigurationValue(Key,
+		L"SampleQueueDepth",
+		ESP_TZ_SAMPLE_QUEUE_DEFAULT_DEPTH);
+
+	DevExt->ClassQueues[EspTzQueueWaits].DepthLimit = CameraESPTZQueryConfigurationValue(Key,
+		L"WaitQueueDepth",
+		ESP_TZ_WAIT_QUEUE_DEFAULT_DEPTH);
+
+	DevExt->ClassQueues[EspTzQueueControl].DepthLimit = CameraESPTZQueryConfigurationValue(Key,
+		L"ControlQueueDepth",
+		ESP_TZ_CONTROL_QUEUE_DEFAULT_DEPTH);
+
+	//
+	// The recorder storage is allocated on first start, so only the
+	// capacity is taken here.
+	//
+
+	DevExt->Recorder.Capacity = CameraESPTZQueryConfigurationValue(Key,
+		L"RecorderCapacity",
+		ESP_TZ_RECORDER_DEFAULT_CAPACITY);
+
+	if ((DevExt->Recorder.Capacity == 0) ||
+		(DevExt->Recorder.Capacity > ESP_TZ_RECORDER_MAX_CAPACITY)) {
+
+		DevExt->Recorder.Capacity = ESP_TZ_RECORDER_DEFAULT_CAPACITY;
+	}
+
+	if (Key != NULL) {
+		WdfRegistryClose(Key);
+	}
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s <<<",
+		"Icaros_KMD_ESP_TZ_Device.c",
+		1104,
+		"CameraESPTZReadConfiguration");
+}
+
+NTSTATUS
+CameraESPTZInitializeLocalParams(
+	WDFDEVICE device
+)
+{
+	PFDO_DATA DevExt;
+	NTSTATUS Status;
+	WDF_OBJECT_ATTRIBUTES TimerAttributes;
+	WDF_TIMER_CONFIG TimerConfig;
+	WDF_OBJECT_ATTRIBUTES WorkitemAttributes;
+	WDF_WORKITEM_CONFIG WorkitemConfig;
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s >>>",
+		"Icaros_KMD_ESP_TZ_Device.c",
+		128,
+		"CameraESPTZInitializeLocalParams");
+
+	DevExt = GetDeviceExtension(device);
+
+	//
+	// Initilize the simulated sensor hardware.
+	//
+
+	DevExt->Sensor.LowerBound = 0;
+	DevExt->Sensor.UpperBound = (ULONG)-1;
+	DevExt->Sensor.Temperature = 2940; //TODO: VIRTUAL_SENSOR_RESET_TEMPERATURE
+	DevExt->Sensor.RawTemperature = DevExt->Sensor.Temperature;
+	DevExt->Sensor.Trend = ESP_TZ_TREND_RISING | ESP_TZ_TREND_FALLING;
+	CameraESPTZReadConfiguration(device);
+	Status = WdfWaitLockCreate(0, &DevExt->Sensor.Lock);
+
+	if (NT_SUCCESS(Status))
+	{
+		//
+		// Configure a workitem to process the simulated interrupt.
+		//
+
+		WDF_OBJECT_ATTRIBUTES_INIT(&WorkitemAttributes);
+		WorkitemAttributes.ParentObject = device;
+		WDF_WORKITEM_CONFIG_INIT(&WorkitemConfig,
+			CameraESPTZInterruptWorker);
+
+		Status = WdfWorkItemCreate(&WorkitemConfig,
+			&WorkitemAttributes,
+			&DevExt->InterruptWorker);
+
+		if (NT_SUCCESS(Status))
+		{
+			//
+			// Configure the timer which fires at the next threshold crossing
+			// predicted by the thermal model.
+			//
+
+			if (DevExt->LowLatency.Enabled != FALSE) {
+				WDF_TIMER_CONFIG_INIT(&TimerConfig, CameraESPTZEvtLowLatencyModelTimer);
+				WDF_OBJECT_ATTRIBUTES_INIT(&TimerAttributes);
+				TimerAttributes.ExecutionLevel = WdfExecutionLevelDispatch;
+
+			} else {
+				WDF_TIMER_CONFIG_INIT(&TimerConfig, CameraESPTZEvtModelCrossingTimer);
+				WDF_OBJECT_ATTRIBUTES_INIT(&TimerAttributes);
+				TimerAttributes.ExecutionLevel = WdfExecutionLevelPassive;
+			}
+
+			TimerAttributes.SynchronizationScope = WdfSynchronizationScopeNone;
+			TimerAttributes.ParentObject = device;
+			Status = WdfTimerCreate(&TimerConfig,
+				&TimerAttributes,
+				&DevExt->Sensor.ModelTimer);
+
+			if (!NT_SUCCESS(Status)) {
+				EspDbgPrintlEx(0, "ESP KMD TZ", "Model WdfTimerCreate() Failed. 0x%x", Status);
+				goto InitializeTimersEnd;
+			}
+
+			//
+			// Configure the timer which fires at the earliest expiration of
+			// the pending requests.
+			//
+
+			if (DevExt->LowLatency.Enabled != FALSE) {
+				WDF_TIMER_CONFIG_INIT(&TimerConfig, CameraESPTZEvtLowLatencyExpiredRequestTimer);
+				WDF_OBJECT_ATTRIBUTES_INIT(&TimerAttributes);
+				TimerAttributes.ExecutionLevel = WdfExecutionLevelDispatch;
+
+			} else {
+				WDF_TIMER_CONFIG_INIT(&TimerConfig, CameraESPTZEvtExpiredRequestTimer);
+				WDF_OBJECT_ATTRIBUTES_INIT(&TimerAttributes);
+				TimerAttributes.ExecutionLevel = WdfExecutionLevelPassive;
+			}
+
+			TimerAttributes.SynchronizationScope = WdfSynchronizationScopeNone;
+			TimerAttributes.ParentObject = device;
+			Status = WdfTimerCreate(&TimerConfig,
+				&TimerAttributes,
+				&DevExt->DeadlineTimer);
+
+			if (!NT_SUCCESS(Status)) {
+				EspDbgPrintlEx(0, "ESP KMD TZ", "Deadline WdfTimerCreate() Failed. 0x%x", Status);
+				goto InitializeTimersEnd;
+			}
+
+			Status = CameraESPTZSchedulerInitialize(device);
+			if (!NT_SUCCESS(Status)) {
+				EspDbgPrintlEx(0, "ESP KMD TZ", "CameraESPTZSchedulerInitialize() Failed. 0x%x", Status);
+			}
+
+		InitializeTimersEnd:
+
+			EspDbgPrintlEx(
+				9,
+				"ESP KMD TZ",
+				"File: %s, Line: %d, Function: %s <<<",
+				"Icaros_KMD_ESP_TZ_Device.c",
+				169,
+				"CameraESPTZInitializeLocalParams");
+		}
+		else
+		{
+			EspDbgPrintlEx(0, "ESP KMD TZ", "WdfWorkItemCreate() Failed. 0x%x", Status);
+			EspDbgPrintlEx(
+				9,
+				"ESP KMD TZ",
+				"File: %s, Line: %d, Function: %s <<<",
+				"Icaros_KMD_ESP_TZ_Device.c",
+				163,
+				"CameraESPTZInitializeLocalParams");
+		}
+	}
+	else
+	{
+		EspDbgPrintlEx(0, "ESP KMD TZ", "Sensor.Lock WdfWaitLockCreate() failed. 0x%x", Status);
+		EspDbgPrintlEx(
+			9,
+			"ESP KMD TZ",
+			"File: %s, Line: %d, Function: %s <<<",
+			"Icaros_KMD_ESP_TZ_Device.c",
+			141,
+			"CameraESPTZInitializeLocalParams");
+	}
+	return Status;
+}
+
+NTSTATUS
+CameraESPTZEvtDeviceSelfManagedIoInit(
+	_In_ WDFDEVICE Device
+)
+
+/*++
+
+Routine Description:
+
+	This routine is invoked once, when the device first enters D0. It starts
+	the driver-owned threads, so that they are stopped by the matching
+	self-managed I/O cleanup however the device is later torn down.
+
+Arguments:
+
+	Device - Supplies a handle to the device.
+
+Return Value:
+
+	NTSTATUS.
+
+--*/
+
+{
+	PFDO_DATA DevExt;
+	NTSTATUS Status;
+
+	PAGED_CODE();
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s >>>",
+		"Icaros_KMD_ESP_TZ_Device.c",
+		2760,
+		"CameraESPTZEvtDeviceSelfManagedIoInit");
+
+	DevExt = GetDeviceExtension(Device);
+	Status = STATUS_SUCCESS;
+
+	//
+	// Deliver virtual interrupts on a dedicated thread instead of the work
+	// item. The request and model timers were created at dispatch level and
+	// only signal this thread, so there is no falling back to the work item:
+	// without the thread the device fails to start.
+	//
+
+	if (DevExt->LowLatency.Enabled != FALSE) {
+		Status = CameraESPTZLowLatencyStart(Device);
+		if (!NT_SUCCESS(Status)) {
+			EspDbgPrintlEx(0, "ESP KMD TZ", "CameraESPTZLowLatencyStart() Failed. 0x%x", Status);
+		}
+	}
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s <<<",
+		"Icaros_KMD_ESP_TZ_Device.c",
+		2786,
+		"CameraESPTZEvtDeviceSelfManagedIoInit");
+
+	return Status;
+}
+
+VOID
+CameraESPTZEvtDeviceSelfManagedIoCleanup(
+	_In_ WDFDEVICE Device
+)
+
+/*++
+
+Routine Description:
+
+	This routine is invoked when the device is removed. It stops the
+	driver-owned threads before the device objects they use go away.
+
+Arguments:
+
+	Device - Supplies a handle to the device.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	PAGED_CODE();
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s >>>",
+		"Icaros_KMD_ESP_TZ_Device.c",
+		1760,
+		"CameraESPTZEvtDeviceSelfManagedIoCleanup");
+
+	CameraESPTZLowLatencyStop(Device);
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s <<<",
+		"Icaros_KMD_ESP_TZ_Device.c",
+		1766,
+		"CameraESPTZEvtDeviceSelfManagedIoCleanup");
+}
+
+NTSTATUS
+CameraESPTZEvtDeviceD0Entry(
+	_In_ WDFDEVICE Device,
+	_In_ WDF_POWER_DEVICE_STATE PreviousState
+)
+
+/*++
+
+Routine Description:
+
+	This routine is invoked when the device enters D0. Thermal zone
+	responses cached before the transition may no longer be current.
+
+Arguments:
+
+	Device - Supplies a handle to the device.
+
+	PreviousState - Supplies the power state the device is leaving.
+
+Return Value:
+
+	NTSTATUS.
+
+--*/
+
+{
+	PFDO_DATA DevExt;
 
-		if (NT_SUCCESS(Status) && (Length == sizeof(ULONG))) {
-			*RequestTemperature = Temperature;
-			BytesReturned = sizeof(ULONG);
+	UNREFERENCED_PARAMETER(PreviousState);
 
-		}
-		else {
+	DevExt = GetDeviceExtension(Device);
+	InterlockedIncrement64(&DevExt->Idle.PowerUps);
+	CameraESPTZCacheInvalidate(&DevExt->Cache);
+	return STATUS_SUCCESS;
+}
 
-			//
-			// The request's return buffer is malformed.
-			//
+NTSTATUS
+CameraESPTZEvtDeviceD0Exit(
+	_In_ WDFDEVICE Device,
+	_In_ WDF_POWER_DEVICE_STATE TargetState
+)
 
-			BytesReturned = 0;
-			Status = STATUS_INVALID_PARAMETER;
-			EspDbgPrintlEx(0, "ESP KMD TZ", "WdfRequestRetrieveOutputBuffer() Failed. 0x%x", -1073741811);
+/*++
 
-		}
+Routine Description:
 
-		WdfRequestCompleteWithInformation(RetrievedRequest,
-			Status,
-			BytesReturned);
+	This routine is invoked when the device leaves D0, to be powered down or
+	stopped. When the device is stopped or removed, the sensor state is
+	saved for the next start. Idle power-downs are frequent and keep the
+	device object, and its state, so they do not write to the registry.
+	See also CameraESPTZEvtDeviceD0Entry.
 
-	}
-	else {
+Arguments:
 
-		EspDbgPrintlEx(9, "ESP KMD TZ", "%s : request remains in queue.", "CameraESPTZCheckQueuedRequest");
+	Device - Supplies a handle to the device.
 
-		//
-		// The request will remain in the queue. Update the bounds accordingly.
-		//
+	TargetState - Supplies the power state the device is entering.
 
-		if (*LowerBound < Context->LowTemperature) {
-			*LowerBound = Context->LowTemperature;
-		}
+Return Value:
 
-		if (*UpperBound > Context->HighTemperature) {
-			*UpperBound = Context->HighTemperature;
-		}
-	}
+	NTSTATUS.
 
-CheckQueuedRequestEnd:
+--*/
 
-	EspDbgPrintlEx(
-		9,
-		"ESP KMD TZ",
-		"File: %s, Line: %d, Function: %s <<<",
-		"Icaros_KMD_ESP_TZ_Device.c",
-		912,
-		"CameraESPTZCheckQueuedRequest");
+{
+	if (TargetState == WdfPowerDeviceD3Final) {
+		CameraESPTZSaveSensorState(Device);
+	}
 
-	return;
+	CameraESPTZCacheInvalidate(&GetDeviceExtension(Device)->Cache);
+	return STATUS_SUCCESS;
 }
-_IRQL_requires_(PASSIVE_LEVEL)
-NTSTATUS
-CameraESPTZScanPendingQueue(
+
+VOID
+CameraESPTZAssignIdleSettings(
 	_In_ WDFDEVICE Device
 )
 
@@ -889,144 +2996,150 @@ CameraESPTZScanPendingQueue(
 
 Routine Description:
 
-	This routine scans the device's pending queue for retirable requests.
-
-	N.B. This routine requires the QueueLock be held.
+	This routine lets the framework power the device down after the
+	configured idle timeout without I/O. Waiters sit in the power-managed
+	pending queue, so the device stays in D0 while any is pending, and the
+	first request to arrive powers it back up. A device that cannot idle
+	keeps running in D0.
 
 Arguments:
 
 	Device - Supplies a handle to the device.
 
+Return Value:
+
+	None.
+
 --*/
 
 {
-	WDFREQUEST CurrentRequest;
 	PFDO_DATA DevExt;
-	WDFREQUEST LastRequest;
-	ULONG LowerBound;
+	WDF_DEVICE_POWER_POLICY_IDLE_SETTINGS IdleSettings;
 	NTSTATUS Status;
-	ULONG Temperature;
-	ULONG UpperBound;
-
-	EspDbgPrintlEx(
-		9,
-		"ESP KMD TZ",
-		"File: %s, Line: %d, Function: %s >>>",
-		"Icaros_KMD_ESP_TZ_Device.c",
-		684,
-		"CameraESPTZScanPendingQueue");
 
 	PAGED_CODE();
 
 	DevExt = GetDeviceExtension(Device);
+	if (DevExt->Idle.Timeout == 0) {
+		return;
+	}
 
-	Status = STATUS_SUCCESS;
-
-	LastRequest = NULL;
-	CurrentRequest = NULL;
-	Temperature = CameraESPTZReadTemperature(Device);
-
-	//
-	// Prime the walk by finding the first request present. If there are no
-	// requests, bail out immediately.
-	//
+	WDF_DEVICE_POWER_POLICY_IDLE_SETTINGS_INIT(&IdleSettings, IdleCannotWakeFromS0);
+	IdleSettings.IdleTimeout = DevExt->Idle.Timeout;
+	IdleSettings.UserControlOfIdleSettings = IdleDoNotAllowUserControl;
+	Status = WdfDeviceAssignS0IdleSettings(Device, &IdleSettings);
+	if (!NT_SUCCESS(Status)) {
+		EspDbgPrintlEx(0, "ESP KMD TZ", "WdfDeviceAssignS0IdleSettings() Failed. 0x%x", Status);
+	}
+}
 
-	LowerBound = 0;
-	UpperBound = (ULONG)-1;
-	Status = WdfIoQueueFindRequest(DevExt->PendingRequestQueue,
-		NULL,
-		NULL,
-		NULL,
-		&CurrentRequest);
+VOID
+CameraESPTZSaveSensorState(
+	_In_ WDFDEVICE Device
+)
 
-	//
-	// Due to a technical limitation in SDV analysis engine, the following
-	// analysis assume has to be inserted to supress a false defect for
-	// the wdfioqueueretrievefoundrequest rule.
-	//
+/*++
 
-	_Analysis_assume_(Status == STATUS_NOT_FOUND);
+Routine Description:
 
-	while (NT_SUCCESS(Status)) {
+	This routine saves the published sample to the device hardware key.
+	Nothing is saved before the first sample, so the reset temperature is
+	never taken for a real one.
 
-		//
-		// Walk past the current request. By walking past the current request
-		// before checking it, the walk doesn't have to restart every time a
-		// request is satisfied and removed form the queue.
-		//
+Arguments:
 
-		LastRequest = CurrentRequest;
-		Status = WdfIoQueueFindRequest(DevExt->PendingRequestQueue,
-			LastRequest,
-			NULL,
-			NULL,
-			&CurrentRequest);
+	Device - Supplies a handle to the device.
 
-		//
-		// Process the last request.
-		//
+Return Value:
 
-		CameraESPTZCheckQueuedRequest(Device,
-			Temperature,
-			&LowerBound,
-			&UpperBound,
-			LastRequest);
+	None.
 
-		WdfObjectDereference(LastRequest);
+--*/
 
-		if (Status == STATUS_NOT_FOUND) {
+{
+	ULONGLONG Age;
+	PFDO_DATA DevExt;
+	WDFKEY Key;
+	UNICODE_STRING Name;
+	ULONGLONG SampleTime;
+	ESP_TZ_SAVED_STATE State;
+	NTSTATUS Status;
+	LARGE_INTEGER SystemTime;
 
-			EspDbgPrintlEx(9, "ESP KMD TZ", "LastRequest unexpectedly disappeared from the queue. Start over");
+	PAGED_CODE();
 
-			//
-			// LastRequest unexpectedly disappeared from the queue. Start over.
-			//
+	DevExt = GetDeviceExtension(Device);
+	if (DevExt->Sensor.Lock == NULL) {
+		return;
+	}
 
-			LowerBound = 0;
-			UpperBound = (ULONG)-1;
-			Status = WdfIoQueueFindRequest(DevExt->PendingRequestQueue,
-				NULL,
-				NULL,
-				NULL,
-				&CurrentRequest);
+	RtlZeroMemory(&State, sizeof(State));
+	State.Version = ESP_TZ_SAVED_STATE_VERSION;
 
-		}
+	CameraESPTZAcquireSensorLock(DevExt);
+	State.Temperature = DevExt->Sensor.Temperature;
+	State.Sequence = DevExt->Sensor.Sequence;
+	SampleTime = DevExt->Sensor.SampleTime;
+	CameraESPTZReleaseSensorLock(DevExt);
 
+	if (SampleTime == 0) {
+		return;
 	}
 
 	//
-	// Update the thresholds based on the latest contents of the queue.
+	// The sample is timed in interrupt time, which restarts with the
+	// system; it is saved in system time.
 	//
 
-	CameraESPTZSetVirtualInterruptThresholds(Device, LowerBound, UpperBound);
+	KeQuerySystemTime(&SystemTime);
+	Age = KeQueryInterruptTime() - SampleTime;
+	State.SystemTime = (ULONGLONG)SystemTime.QuadPart - min(Age, (ULONGLONG)SystemTime.QuadPart);
 
-	EspDbgPrintlEx(
-		9,
-		"ESP KMD TZ",
-		"File: %s, Line: %d, Function: %s, RETURN: 0x%x <<<",
-		"Icaros_KMD_ESP_TZ_Device.c",
-		769,
-		"CameraESPTZScanPendingQueue",
-		Status);
+	Status = WdfDeviceOpenRegistryKey(Device,
+		PLUGPLAY_REGKEY_DEVICE,
+		KEY_WRITE,
+		WDF_NO_OBJECT_ATTRIBUTES,
+		&Key);
 
-	return Status;
+	if (!NT_SUCCESS(Status)) {
+		EspDbgPrintlEx(0, "ESP KMD TZ", "WdfDeviceOpenRegistryKey() Failed. 0x%x", Status);
+		return;
+	}
+
+	RtlInitUnicodeString(&Name, ESP_TZ_SAVED_STATE_VALUE);
+	Status = WdfRegistryAssignValue(Key, &Name, REG_BINARY, sizeof(State), &State);
+	if (!NT_SUCCESS(Status)) {
+		EspDbgPrintlEx(0, "ESP KMD TZ", "WdfRegistryAssignValue() Failed. 0x%x", Status);
+	}
+
+	WdfRegistryClose(Key);
 }
 
 VOID
-CameraESPTZInterruptWorker(
-	_In_ WDFWORKITEM WorkItem
+CameraESPTZRestoreSensorState(
+	_In_ PFDO_DATA DevExt,
+	_In_ WDFKEY Key,
+	_In_ ULONG MaximumAge
 )
 
 /*++
 
 Routine Description:
 
-	This routine is invoked to call into the device to notify it of a
-	temperature change.
+	This routine restores the sensor state saved by
+	CameraESPTZSaveSensorState. A state that is missing, malformed, from the
+	future or older than the maximum age is ignored, and the device keeps
+	the reset state. A state saved by an earlier version of the driver has
+	another version and is ignored too.
 
 Arguments:
 
-	WorkItem - Supplies a handle to this work item.
+	DevExt - Supplies the device extension.
+
+	Key - Supplies the opened device hardware key.
+
+	MaximumAge - Supplies the age in seconds beyond which the saved sample
+		is stale, or zero to never restore.
 
 Return Value:
 
@@ -1035,113 +3148,55 @@ Return Value:
 --*/
 
 {
+	ULONGLONG Age;
+	ULONGLONG CurrentTime;
+	ULONG Length;
+	UNICODE_STRING Name;
+	ESP_TZ_SAVED_STATE State;
+	NTSTATUS Status;
+	LARGE_INTEGER SystemTime;
+	ULONG Type;
 
-	PFDO_DATA DevExt;
-	WDFDEVICE Device;
-
-	EspDbgPrintlEx(
-		9,
-		"ESP KMD TZ",
-		"File: %s, Line: %d, Function: %s >>>",
-		"Icaros_KMD_ESP_TZ_Device.c",
-		644,
-		"CameraESPTZInterruptWorker");
-
-	Device = (WDFDEVICE)WdfWorkItemGetParentObject(WorkItem);
-	DevExt = GetDeviceExtension(Device);
-	WdfWaitLockAcquire(DevExt->QueueLock, NULL);
-	CameraESPTZScanPendingQueue(Device);
-	WdfWaitLockRelease(DevExt->QueueLock);
+	PAGED_CODE();
 
-	EspDbgPrintlEx(
-		9,
-		"ESP KMD TZ",
-		"File: %s, Line: %d, Function: %s <<<",
-		"Icaros_KMD_ESP_TZ_Device.c",
-		653,
-		"CameraESPTZInterruptWorker");
+	if (MaximumAge == 0) {
+		return;
+	}
 
-	return;
-}
+	RtlInitUnicodeString(&Name, ESP_TZ_SAVED_STATE_VALUE);
+	Status = WdfRegistryQueryValue(Key, &Name, sizeof(State), &State, &Length, &Type);
+	if (!NT_SUCCESS(Status) ||
+		(Type != REG_BINARY) ||
+		(Length != sizeof(State)) ||
+		(State.Version != ESP_TZ_SAVED_STATE_VERSION)) {
 
-NTSTATUS
-CameraESPTZInitializeLocalParams(
-	WDFDEVICE device
-)
-{
-	PFDO_DATA DevExt;
-	NTSTATUS Status;
-	WDF_OBJECT_ATTRIBUTES WorkitemAttributes;
-	WDF_WORKITEM_CONFIG WorkitemConfig;
+		return;
+	}
 
-	EspDbgPrintlEx(
-		9,
-		"ESP KMD TZ",
-		"File: %s, Line: %d, Function: %s >>>",
-		"Icaros_KMD_ESP_TZ_Device.c",
-		128,
-		"CameraESPTZInitializeLocalParams");
+	KeQuerySystemTime(&SystemTime);
+	if (State.SystemTime > (ULONGLONG)SystemTime.QuadPart) {
+		EspDbgPrintlEx(0, "ESP KMD TZ", "%s : saved state is from the future, ignored", "CameraESPTZRestoreSensorState");
+		return;
+	}
 
-	DevExt = GetDeviceExtension(device);
+	Age = (ULONGLONG)SystemTime.QuadPart - State.SystemTime;
+	if (Age > (ULONGLONG)MaximumAge * 10 * 1000 * 1000) {
+		EspDbgPrintlEx(9, "ESP KMD TZ", "%s : saved state is %lu s old, ignored", "CameraESPTZRestoreSensorState", (ULONG)(Age / (10 * 1000 * 1000)));
+		return;
+	}
 
 	//
-	// Initilize the simulated sensor hardware.
+	// Map the sample back to interrupt time. A sample older than the boot is
+	// placed at the earliest nonzero time.
 	//
 
-	DevExt->Sensor.LowerBound = 0;
-	DevExt->Sensor.UpperBound = (ULONG)-1;
-	DevExt->Sensor.Temperature = 2940; //TODO: VIRTUAL_SENSOR_RESET_TEMPERATURE
-	Status = WdfWaitLockCreate(0, &DevExt->Sensor.Lock);
-
-	if (NT_SUCCESS(Status))
-	{
-		//
-		// Configure a workitem to process the simulated interrupt.
-		//
-
-		WDF_OBJECT_ATTRIBUTES_INIT(&WorkitemAttributes);
-		WorkitemAttributes.ParentObject = device;
-		WDF_WORKITEM_CONFIG_INIT(&WorkitemConfig,
-			CameraESPTZInterruptWorker);
-
-		Status = WdfWorkItemCreate(&WorkitemConfig,
-			&WorkitemAttributes,
-			&DevExt->InterruptWorker);
+	CurrentTime = KeQueryInterruptTime();
+	DevExt->Sensor.Temperature = State.Temperature;
+	DevExt->Sensor.RawTemperature = State.Temperature;
+	DevExt->Sensor.Sequence = State.Sequence;
+	DevExt->Sensor.SampleTime = (Age < CurrentTime) ? (CurrentTime - Age) : 1;
 
-		if (NT_SUCCESS(Status))
-		{
-			EspDbgPrintlEx(
-				9,
-				"ESP KMD TZ",
-				"File: %s, Line: %d, Function: %s <<<",
-				"Icaros_KMD_ESP_TZ_Device.c",
-				169,
-				"CameraESPTZInitializeLocalParams");
-		}
-		else
-		{
-			EspDbgPrintlEx(0, "ESP KMD TZ", "WdfWorkItemCreate() Failed. 0x%x", Status);
-			EspDbgPrintlEx(
-				9,
-				"ESP KMD TZ",
-				"File: %s, Line: %d, Function: %s <<<",
-				"Icaros_KMD_ESP_TZ_Device.c",
-				163,
-				"CameraESPTZInitializeLocalParams");
-		}
-	}
-	else
-	{
-		EspDbgPrintlEx(0, "ESP KMD TZ", "Sensor.Lock WdfWaitLockCreate() failed. 0x%x", Status);
-		EspDbgPrintlEx(
-			9,
-			"ESP KMD TZ",
-			"File: %s, Line: %d, Function: %s <<<",
-			"Icaros_KMD_ESP_TZ_Device.c",
-			141,
-			"CameraESPTZInitializeLocalParams");
-	}
-	return Status;
+	EspDbgPrintlEx(9, "ESP KMD TZ", "%s : Temp %lu, %lu s old", "CameraESPTZRestoreSensorState", State.Temperature, (ULONG)(Age / (10 * 1000 * 1000)));
 }
 
 NTSTATUS
@@ -1168,11 +3223,41 @@ Return Value:
 {
 	WDF_OBJECT_ATTRIBUTES deviceAttributes;
 	WDFDEVICE Device;
+	WDF_OBJECT_ATTRIBUTES FileAttributes;
+	WDF_FILEOBJECT_CONFIG FileConfig;
+	WDF_PNPPOWER_EVENT_CALLBACKS PnpPowerCallbacks;
+	WDF_OBJECT_ATTRIBUTES RequestAttributes;
 	NTSTATUS status;
 	UNICODE_STRING SymbolicLinkName;
 
 	PAGED_CODE();
 
+	WDF_PNPPOWER_EVENT_CALLBACKS_INIT(&PnpPowerCallbacks);
+	PnpPowerCallbacks.EvtDeviceD0Entry = CameraESPTZEvtDeviceD0Entry;
+	PnpPowerCallbacks.EvtDeviceD0Exit = CameraESPTZEvtDeviceD0Exit;
+	PnpPowerCallbacks.EvtDeviceSelfManagedIoInit = CameraESPTZEvtDeviceSelfManagedIoInit;
+	PnpPowerCallbacks.EvtDeviceSelfManagedIoCleanup = CameraESPTZEvtDeviceSelfManagedIoCleanup;
+	WdfDeviceInitSetPnpPowerEventCallbacks(DeviceInit, &PnpPowerCallbacks);
+
+	//
+	// Track each open handle as a client of the pending queue.
+	//
+
+	WDF_FILEOBJECT_CONFIG_INIT(&FileConfig,
+		CameraESPTZEvtDeviceFileCreate,
+		WDF_NO_EVENT_CALLBACK,
+		CameraESPTZEvtFileCleanup);
+
+	WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&FileAttributes, ESP_TZ_CLIENT);
+	WdfDeviceInitSetFileObjectConfig(DeviceInit, &FileConfig, &FileAttributes);
+
+	//
+	// Give every request the context its class queue accounts it in.
+	//
+
+	WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&RequestAttributes, ESP_TZ_REQUEST_CONTEXT);
+	WdfDeviceInitSetRequestAttributes(DeviceInit, &RequestAttributes);
+
 	WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&deviceAttributes, FDO_DATA);
 
 	status = WdfDeviceCreate(&DeviceInit, &deviceAttributes, &Device);
@@ -1205,6 +3290,8 @@ Return Value:
 					status = CameraESPTZInitializeLocalParams(Device);
 					if (!NT_SUCCESS(status))
 						EspDbgPrintlEx(0, "ESP KMD TZ", "CameraESPTZInitializeLocalParams() failed. 0x%x", status);
+					else
+						CameraESPTZAssignIdleSettings(Device);
 				}
 			}
 		}
@@ -16,6 +16,7 @@ Environment:
 
 #include "driver.h"
 #include "Debug.h"
+#include <ntimage.h>
 
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text (INIT, DriverEntry)
@@ -23,6 +24,154 @@ Environment:
 #pragma alloc_text (PAGE, CameraESPTZEvtDriverContextCleanup)
 #endif
 
+#if DBG
+
+//
+// Routines on the per-request and per-interrupt path. These must not be
+// placed in a pageable or discardable section.
+//
+
+typedef struct _ESP_TZ_HOT_ROUTINE {
+	PVOID Routine;
+	PCSTR Name;
+} ESP_TZ_HOT_ROUTINE;
+
+#define ESP_TZ_HOT_ROUTINE_ENTRY(Routine) { (PVOID)(Routine), #Routine }
+
+static const ESP_TZ_HOT_ROUTINE CameraESPTZHotRoutines[] = {
+	ESP_TZ_HOT_ROUTINE_ENTRY(CameraESPTZEvtIoDeviceControl),
+	ESP_TZ_HOT_ROUTINE_ENTRY(CameraESPTZEvtClassIoDeviceControl),
+	ESP_TZ_HOT_ROUTINE_ENTRY(CameraESPTZRecorderLogRequest),
+	ESP_TZ_HOT_ROUTINE_ENTRY(CameraESPTZForwardRequest),
+	ESP_TZ_HOT_ROUTINE_ENTRY(CameraESPTZCacheLookup),
+	ESP_TZ_HOT_ROUTINE_ENTRY(CameraESPTZCacheInsert),
+	ESP_TZ_HOT_ROUTINE_ENTRY(CameraESPTZEvtCacheRequestCompletion),
+	ESP_TZ_HOT_ROUTINE_ENTRY(CameraESPTZAddReadRequest),
+	ESP_TZ_HOT_ROUTINE_ENTRY(CameraESPTZAreConstraintsSatisfied),
+	ESP_TZ_HOT_ROUTINE_ENTRY(CameraESPTZCheckQueuedRequest),
+	ESP_TZ_HOT_ROUTINE_ENTRY(CameraESPTZStatsRecordLatency),
+	ESP_TZ_HOT_ROUTINE_ENTRY(CameraESPTZAddWaiter),
+	ESP_TZ_HOT_ROUTINE_ENTRY(CameraESPTZRemoveWaiters),
+	ESP_TZ_HOT_ROUTINE_ENTRY(CameraESPTZLockAcquireExclusive),
+	ESP_TZ_HOT_ROUTINE_ENTRY(CameraESPTZLockReleaseExclusive),
+	ESP_TZ_HOT_ROUTINE_ENTRY(CameraESPTZRequestScan),
+	ESP_TZ_HOT_ROUTINE_ENTRY(CameraESPTZDeferScan),
+	ESP_TZ_HOT_ROUTINE_ENTRY(CameraESPTZRunScan),
+	ESP_TZ_HOT_ROUTINE_ENTRY(CameraESPTZScanPendingQueue),
+	ESP_TZ_HOT_ROUTINE_ENTRY(CameraESPTZContinueScan),
+	ESP_TZ_HOT_ROUTINE_ENTRY(CameraESPTZDrainPendingQueue),
+	ESP_TZ_HOT_ROUTINE_ENTRY(CameraESPTZEvtExpiredRequestTimer),
+	ESP_TZ_HOT_ROUTINE_ENTRY(CameraESPTZInterruptWorker),
+	ESP_TZ_HOT_ROUTINE_ENTRY(CameraESPTZTemperatureInterrupt),
+	ESP_TZ_HOT_ROUTINE_ENTRY(CameraESPTZReadSample),
+	ESP_TZ_HOT_ROUTINE_ENTRY(CameraESPTZReadSampleTrend),
+	ESP_TZ_HOT_ROUTINE_ENTRY(CameraESPTZPublishTemperature),
+	ESP_TZ_HOT_ROUTINE_ENTRY(CameraESPTZIsThresholdCrossed),
+	ESP_TZ_HOT_ROUTINE_ENTRY(CameraESPTZCheckModelCrossing),
+	ESP_TZ_HOT_ROUTINE_ENTRY(CameraESPTZHistoryRecord),
+	ESP_TZ_HOT_ROUTINE_ENTRY(CameraESPTZReadTemperature),
+	ESP_TZ_HOT_ROUTINE_ENTRY(CameraESPTZSetTemperature),
+	ESP_TZ_HOT_ROUTINE_ENTRY(CameraESPTZMailboxPost),
+	ESP_TZ_HOT_ROUTINE_ENTRY(CameraESPTZMailboxDrain),
+	ESP_TZ_HOT_ROUTINE_ENTRY(CameraESPTZMailboxPublish),
+	ESP_TZ_HOT_ROUTINE_ENTRY(CameraESPTZSetTemperatures),
+	ESP_TZ_HOT_ROUTINE_ENTRY(CameraESPTZSetVirtualInterruptThresholds),
+	ESP_TZ_HOT_ROUTINE_ENTRY(CameraESPTZTripPointsLocate),
+};
+
+static
+BOOLEAN
+CameraESPTZIsPageableCode(
+	_In_ PVOID Routine
+)
+
+/*++
+
+Routine Description:
+
+	This routine finds the image section holding a routine and reports
+	whether the section can be paged out or discarded.
+
+Arguments:
+
+	Routine - Supplies the address of the routine.
+
+Return Value:
+
+	TRUE if the routine is in a PAGE* or INIT section, FALSE otherwise.
+
+--*/
+
+{
+	PIMAGE_DOS_HEADER DosHeader;
+	PVOID ImageBase;
+	ULONG Index;
+	PIMAGE_NT_HEADERS NtHeaders;
+	ULONG_PTR Offset;
+	PIMAGE_SECTION_HEADER Section;
+
+	if (RtlPcToFileHeader(Routine, &ImageBase) == NULL) {
+		return FALSE;
+	}
+
+	DosHeader = (PIMAGE_DOS_HEADER)ImageBase;
+	NtHeaders = (PIMAGE_NT_HEADERS)((PUCHAR)ImageBase + DosHeader->e_lfanew);
+	Offset = (ULONG_PTR)Routine - (ULONG_PTR)ImageBase;
+	Section = IMAGE_FIRST_SECTION(NtHeaders);
+	for (Index = 0; Index < NtHeaders->FileHeader.NumberOfSections; Index += 1, Section += 1) {
+		if ((Offset >= Section->VirtualAddress) &&
+			(Offset < (ULONG_PTR)Section->VirtualAddress + Section->Misc.VirtualSize)) {
+
+			return (RtlCompareMemory(Section->Name, "PAGE", 4) == 4) ||
+				(RtlCompareMemory(Section->Name, "INIT", 4) == 4);
+		}
+	}
+
+	return FALSE;
+}
+
+static
+NTSTATUS
+CameraESPTZCheckCodePlacement(
+	VOID
+)
+
+/*++
+
+Routine Description:
+
+	This routine verifies that no hot routine was placed in a pageable
+	section, so a stray alloc_text fails the debug build at load instead of
+	adding page faults to thermal notifications.
+
+Arguments:
+
+	None.
+
+Return Value:
+
+	STATUS_SUCCESS, or STATUS_UNSUCCESSFUL if a hot routine is pageable.
+
+--*/
+
+{
+	ULONG Index;
+	NTSTATUS Status;
+
+	Status = STATUS_SUCCESS;
+	for (Index = 0; Index < RTL_NUMBER_OF(CameraESPTZHotRoutines); Index += 1) {
+		if (CameraESPTZIsPageableCode(CameraESPTZHotRoutines[Index].Routine) != FALSE) {
+			EspDbgPrintlEx(0, "ESP KMD TZ", "%s is in a pageable section.", CameraESPTZHotRoutines[Index].Name);
+			Status = STATUS_UNSUCCESSFUL;
+		}
+	}
+
+	NT_ASSERTMSG("Hot routine placed in a pageable section", NT_SUCCESS(Status));
+	return Status;
+}
+
+#endif
+
 NTSTATUS
 DriverEntry(
 	_In_ PDRIVER_OBJECT  DriverObject,
@@ -66,6 +215,15 @@ Return Value:
 		58,
 		"DriverEntry");
 
+#if DBG
+
+	status = CameraESPTZCheckCodePlacement();
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+#endif
+
 	//
 	// Register a cleanup callback so that we can call WPP_CLEANUP when
 	// the framework driver object is deleted during driver unload.
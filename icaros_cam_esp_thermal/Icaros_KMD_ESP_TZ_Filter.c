@@ -0,0 +1,323 @@
+/*++
+
+Module Name:
+
+	filter.c
+
+Abstract:
+
+	This file contains the sample filter applied to raw temperature pushes
+	before they are compared against the virtual interrupt thresholds.
+
+	Every filter runs in constant time per sample and uses integer fixed
+	point arithmetic only.
+
+Environment:
+
+	Kernel-mode Driver Framework
+
+--*/
+
+#include "Device.h"
+#include "Debug.h"
+
+VOID
+CameraESPTZFilterInitialize(
+	_Out_ PESP_TZ_FILTER Filter,
+	_In_ ULONG Mode,
+	_In_ ULONG Window,
+	_In_ ULONG Alpha,
+	_In_ ULONG ProcessNoise,
+	_In_ ULONG MeasurementNoise
+)
+
+/*++
+
+Routine Description:
+
+	This routine configures the sample filter. Out of range parameters are
+	clamped to the nearest supported value, and an unknown mode disables
+	filtering.
+
+Arguments:
+
+	Filter - Supplies the filter to initialize.
+
+	Mode - Supplies the filter mode, see ESP_TZ_FILTER_MODE.
+
+	Window - Supplies the median window length.
+
+	Alpha - Supplies the exponential filter weight of a new sample, in 1/256.
+
+	ProcessNoise - Supplies the Kalman filter process noise.
+
+	MeasurementNoise - Supplies the Kalman filter measurement noise.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s >>>",
+		"Icaros_KMD_ESP_TZ_Filter.c",
+		68,
+		"CameraESPTZFilterInitialize");
+
+	RtlZeroMemory(Filter, sizeof(*Filter));
+
+	if (Mode >= EspTzFilterModeMaximum) {
+		EspDbgPrintlEx(0, "ESP KMD TZ", "%s: unknown filter mode %lu, filtering disabled.", "CameraESPTZFilterInitialize", Mode);
+		Mode = EspTzFilterNone;
+	}
+
+	Filter->Mode = (ESP_TZ_FILTER_MODE)Mode;
+
+	switch (Filter->Mode) {
+	case EspTzFilterMedian:
+
+		//
+		// Only odd windows have a single middle element.
+		//
+
+		if (Window < 3) {
+			Window = 3;
+		}
+
+		if (Window > ESP_TZ_FILTER_MEDIAN_MAX_WINDOW) {
+			Window = ESP_TZ_FILTER_MEDIAN_MAX_WINDOW;
+		}
+
+		Filter->u.Median.Window = Window | 1;
+		break;
+
+	case EspTzFilterExponential:
+		if (Alpha == 0) {
+			Alpha = 1;
+		}
+
+		if (Alpha > (1 << ESP_TZ_FILTER_FRACTION_BITS)) {
+			Alpha = 1 << ESP_TZ_FILTER_FRACTION_BITS;
+		}
+
+		Filter->u.Exponential.Alpha = Alpha;
+		break;
+
+	case EspTzFilterKalman:
+		Filter->u.Kalman.ProcessNoise = ProcessNoise;
+		Filter->u.Kalman.MeasurementNoise = (MeasurementNoise != 0) ? MeasurementNoise : 1;
+		break;
+
+	default:
+		break;
+	}
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"%s : Mode = %lu, Window = %lu, Alpha = %lu, Q = %lu, R = %lu",
+		"CameraESPTZFilterInitialize",
+		(ULONG)Filter->Mode,
+		Window,
+		Alpha,
+		ProcessNoise,
+		MeasurementNoise);
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s <<<",
+		"Icaros_KMD_ESP_TZ_Filter.c",
+		135,
+		"CameraESPTZFilterInitialize");
+}
+
+VOID
+CameraESPTZFilterReset(
+	_Inout_ PESP_TZ_FILTER Filter
+)
+
+/*++
+
+Routine Description:
+
+	This routine discards the filter history while keeping its configuration.
+	The next sample primes the filter and is passed through unmodified.
+
+Arguments:
+
+	Filter - Supplies the filter to reset.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	Filter->Primed = FALSE;
+
+	if (Filter->Mode == EspTzFilterMedian) {
+		Filter->u.Median.Next = 0;
+		Filter->u.Median.Count = 0;
+	}
+}
+
+static
+ULONG
+CameraESPTZFilterMedian(
+	_Inout_ PESP_TZ_FILTER Filter,
+	_In_ ULONG Sample
+)
+{
+	ULONG Count;
+	ULONG Index;
+	ULONG Insert;
+	ULONG Sorted[ESP_TZ_FILTER_MEDIAN_MAX_WINDOW];
+	ULONG Value;
+
+	Filter->u.Median.Samples[Filter->u.Median.Next] = Sample;
+	Filter->u.Median.Next = (Filter->u.Median.Next + 1) % Filter->u.Median.Window;
+	if (Filter->u.Median.Count < Filter->u.Median.Window) {
+		Filter->u.Median.Count += 1;
+	}
+
+	//
+	// The window is bounded by ESP_TZ_FILTER_MEDIAN_MAX_WINDOW, so this
+	// insertion sort is constant time.
+	//
+
+	Count = Filter->u.Median.Count;
+	for (Index = 0; Index < Count; Index += 1) {
+		Value = Filter->u.Median.Samples[Index];
+		Insert = Index;
+		while ((Insert > 0) && (Sorted[Insert - 1] > Value)) {
+			Sorted[Insert] = Sorted[Insert - 1];
+			Insert -= 1;
+		}
+
+		Sorted[Insert] = Value;
+	}
+
+	return Sorted[(Count - 1) / 2];
+}
+
+static
+ULONG
+CameraESPTZFilterExponential(
+	_Inout_ PESP_TZ_FILTER Filter,
+	_In_ ULONG Sample
+)
+{
+	LONGLONG Measurement;
+
+	Measurement = (LONGLONG)Sample << ESP_TZ_FILTER_FRACTION_BITS;
+	if (Filter->Primed == FALSE) {
+		Filter->u.Exponential.State = Measurement;
+
+	} else {
+		Filter->u.Exponential.State +=
+			((LONGLONG)Filter->u.Exponential.Alpha *
+				(Measurement - Filter->u.Exponential.State)) >> ESP_TZ_FILTER_FRACTION_BITS;
+	}
+
+	return (ULONG)((Filter->u.Exponential.State + (1 << (ESP_TZ_FILTER_FRACTION_BITS - 1))) >>
+		ESP_TZ_FILTER_FRACTION_BITS);
+}
+
+static
+ULONG
+CameraESPTZFilterKalman(
+	_Inout_ PESP_TZ_FILTER Filter,
+	_In_ ULONG Sample
+)
+{
+	LONGLONG Gain;
+	LONGLONG Measurement;
+	LONGLONG MeasurementNoise;
+
+	Measurement = (LONGLONG)Sample << ESP_TZ_FILTER_FRACTION_BITS;
+	MeasurementNoise = (LONGLONG)Filter->u.Kalman.MeasurementNoise << ESP_TZ_FILTER_FRACTION_BITS;
+	if (Filter->Primed == FALSE) {
+		Filter->u.Kalman.Estimate = Measurement;
+		Filter->u.Kalman.Variance = MeasurementNoise;
+
+	} else {
+
+		//
+		// Predict: the temperature is modeled as constant, so only the
+		// variance grows. Update: blend in the measurement with a gain
+		// expressed in 1/65536.
+		//
+
+		Filter->u.Kalman.Variance +=
+			(LONGLONG)Filter->u.Kalman.ProcessNoise << ESP_TZ_FILTER_FRACTION_BITS;
+
+		Gain = (Filter->u.Kalman.Variance << 16) /
+			(Filter->u.Kalman.Variance + MeasurementNoise);
+
+		Filter->u.Kalman.Estimate +=
+			(Gain * (Measurement - Filter->u.Kalman.Estimate)) >> 16;
+
+		Filter->u.Kalman.Variance =
+			((65536 - Gain) * Filter->u.Kalman.Variance) >> 16;
+	}
+
+	return (ULONG)((Filter->u.Kalman.Estimate + (1 << (ESP_TZ_FILTER_FRACTION_BITS - 1))) >>
+		ESP_TZ_FILTER_FRACTION_BITS);
+}
+
+ULONG
+CameraESPTZFilterSample(
+	_Inout_ PESP_TZ_FILTER Filter,
+	_In_ ULONG Sample
+)
+
+/*++
+
+Routine Description:
+
+	This routine runs a raw sample through the configured filter.
+
+	N.B. This routine requires the Sensor.Lock be held.
+
+Arguments:
+
+	Filter - Supplies the filter state.
+
+	Sample - Supplies the raw temperature, in tenths of a Kelvin.
+
+Return Value:
+
+	The filtered temperature, in tenths of a Kelvin.
+
+--*/
+
+{
+	ULONG Filtered;
+
+	switch (Filter->Mode) {
+	case EspTzFilterMedian:
+		Filtered = CameraESPTZFilterMedian(Filter, Sample);
+		break;
+
+	case EspTzFilterExponential:
+		Filtered = CameraESPTZFilterExponential(Filter, Sample);
+		break;
+
+	case EspTzFilterKalman:
+		Filtered = CameraESPTZFilterKalman(Filter, Sample);
+		break;
+
+	default:
+		Filtered = Sample;
+		break;
+	}
+
+	Filter->Primed = TRUE;
+	return Filtered;
+}
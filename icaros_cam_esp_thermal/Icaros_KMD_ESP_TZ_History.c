@@ -0,0 +1,523 @@
+/*++
+
+Module Name:
+
+	history.c
+
+Abstract:
+
+	This file contains the temperature history store.
+
+	Every published sample is kept at full resolution in a ring of
+	delta-encoded blocks, which at a typical push rate hold a few hours in
+	32KB. Older history survives as per-minute and per-hour min/max/mean
+	summaries covering a day and a month. Queries copy the stored records
+	as they are; decoding the raw blocks is left to the caller.
+
+Environment:
+
+	Kernel-mode Driver Framework
+
+--*/
+
+#include "Device.h"
+#include "Debug.h"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, CameraESPTZHistoryInitialize)
+#endif
+
+#define ESP_TZ_HISTORY_MINUTE   (60ULL * 10 * 1000 * 1000)
+#define ESP_TZ_HISTORY_HOUR     (60ULL * ESP_TZ_HISTORY_MINUTE)
+
+NTSTATUS
+CameraESPTZHistoryInitialize(
+	_In_ WDFDEVICE Device,
+	_Out_ PESP_TZ_HISTORY History
+)
+
+/*++
+
+Routine Description:
+
+	This routine allocates an empty history store. The storage is parented
+	to the device and released with it.
+
+Arguments:
+
+	Device - Supplies a handle to the device.
+
+	History - Supplies the history store to initialize.
+
+Return Value:
+
+	NTSTATUS.
+
+--*/
+
+{
+	WDF_OBJECT_ATTRIBUTES Attributes;
+	PUCHAR Buffer;
+	size_t Length;
+	WDFMEMORY Memory;
+	NTSTATUS Status;
+
+	PAGED_CODE();
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s >>>",
+		"Icaros_KMD_ESP_TZ_History.c",
+		68,
+		"CameraESPTZHistoryInitialize");
+
+	RtlZeroMemory(History, sizeof(*History));
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&Attributes);
+	Attributes.ParentObject = Device;
+	Status = WdfSpinLockCreate(&Attributes, &History->Lock);
+	if (!NT_SUCCESS(Status)) {
+		EspDbgPrintlEx(0, "ESP KMD TZ", "History WdfSpinLockCreate() Failed. 0x%x", Status);
+		goto HistoryInitializeEnd;
+	}
+
+	Length = ESP_TZ_HISTORY_RAW_BLOCKS * sizeof(ESP_TZ_HISTORY_BLOCK) +
+		(ESP_TZ_HISTORY_MINUTE_RECORDS + ESP_TZ_HISTORY_HOUR_RECORDS) * sizeof(ESP_TZ_HISTORY_SUMMARY);
+
+	Status = WdfMemoryCreate(&Attributes,
+		NonPagedPoolNx,
+		0,
+		Length,
+		&Memory,
+		(PVOID*)&Buffer);
+
+	if (!NT_SUCCESS(Status)) {
+		EspDbgPrintlEx(0, "ESP KMD TZ", "History WdfMemoryCreate() Failed. 0x%x", Status);
+		goto HistoryInitializeEnd;
+	}
+
+	History->Blocks = (PESP_TZ_HISTORY_BLOCK)Buffer;
+	Buffer += ESP_TZ_HISTORY_RAW_BLOCKS * sizeof(ESP_TZ_HISTORY_BLOCK);
+
+	History->Tiers[ESP_TZ_HISTORY_TIER_MINUTE].Records = (PESP_TZ_HISTORY_SUMMARY)Buffer;
+	History->Tiers[ESP_TZ_HISTORY_TIER_MINUTE].Size = ESP_TZ_HISTORY_MINUTE_RECORDS;
+	History->Tiers[ESP_TZ_HISTORY_TIER_MINUTE].Period = ESP_TZ_HISTORY_MINUTE;
+	Buffer += ESP_TZ_HISTORY_MINUTE_RECORDS * sizeof(ESP_TZ_HISTORY_SUMMARY);
+
+	History->Tiers[ESP_TZ_HISTORY_TIER_HOUR].Records = (PESP_TZ_HISTORY_SUMMARY)Buffer;
+	History->Tiers[ESP_TZ_HISTORY_TIER_HOUR].Size = ESP_TZ_HISTORY_HOUR_RECORDS;
+	History->Tiers[ESP_TZ_HISTORY_TIER_HOUR].Period = ESP_TZ_HISTORY_HOUR;
+
+HistoryInitializeEnd:
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s <<<",
+		"Icaros_KMD_ESP_TZ_History.c",
+		115,
+		"CameraESPTZHistoryInitialize");
+
+	return Status;
+}
+
+static
+USHORT
+CameraESPTZHistoryEncode(
+	_Out_writes_(10) PUCHAR Data,
+	_In_ ULONGLONG Value
+)
+
+/*++
+
+Routine Description:
+
+	This routine writes a value as a varint, seven bits per byte, least
+	significant group first.
+
+Arguments:
+
+	Data - Supplies the buffer to write to.
+
+	Value - Supplies the value to encode.
+
+Return Value:
+
+	The number of bytes written.
+
+--*/
+
+{
+	USHORT Length;
+
+	Length = 0;
+	while (Value >= 0x80) {
+		Data[Length] = (UCHAR)(Value | 0x80);
+		Value >>= 7;
+		Length += 1;
+	}
+
+	Data[Length] = (UCHAR)Value;
+	return Length + 1;
+}
+
+static
+VOID
+CameraESPTZHistoryAccumulate(
+	_Inout_ PESP_TZ_HISTORY_TIER Tier,
+	_In_ ULONGLONG Time,
+	_In_ ULONG Temperature
+)
+
+/*++
+
+Routine Description:
+
+	This routine adds a sample to a summary tier, closing the pending period
+	first if the sample falls outside it.
+
+	N.B. This routine requires the history Lock be held.
+
+Arguments:
+
+	Tier - Supplies the summary tier.
+
+	Time - Supplies the system time of the sample.
+
+	Temperature - Supplies the sample.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	ULONG Index;
+	PESP_TZ_HISTORY_SUMMARY Record;
+	ULONGLONG Start;
+
+	Start = Time - (Time % Tier->Period);
+	if ((Tier->PendingCount != 0) && (Start != Tier->PendingStart)) {
+		if (Tier->Count < Tier->Size) {
+			Index = (Tier->Head + Tier->Count) % Tier->Size;
+			Tier->Count += 1;
+
+		} else {
+			Index = Tier->Head;
+			Tier->Head = (Tier->Head + 1) % Tier->Size;
+		}
+
+		Record = &Tier->Records[Index];
+		Record->StartTime = Tier->PendingStart;
+		Record->Minimum = Tier->PendingMinimum;
+		Record->Maximum = Tier->PendingMaximum;
+		Record->Mean = (ULONG)(Tier->PendingSum / Tier->PendingCount);
+		Record->Count = Tier->PendingCount;
+		Tier->PendingCount = 0;
+	}
+
+	if (Tier->PendingCount == 0) {
+		Tier->PendingStart = Start;
+		Tier->PendingSum = 0;
+		Tier->PendingMinimum = Temperature;
+		Tier->PendingMaximum = Temperature;
+	}
+
+	Tier->PendingSum += Temperature;
+	Tier->PendingMinimum = min(Tier->PendingMinimum, Temperature);
+	Tier->PendingMaximum = max(Tier->PendingMaximum, Temperature);
+	Tier->PendingCount += 1;
+}
+
+VOID
+CameraESPTZHistoryRecord(
+	_Inout_ PESP_TZ_HISTORY History,
+	_In_ ULONG Temperature,
+	_In_ ULONGLONG SampleTime
+)
+
+/*++
+
+Routine Description:
+
+	This routine appends a published sample to the history. A new block is
+	opened when the newest one cannot hold another sample, or when the
+	sample time went backwards so the delta cannot be encoded.
+
+Arguments:
+
+	History - Supplies the history store.
+
+	Temperature - Supplies the published temperature.
+
+	SampleTime - Supplies the system time the sample was taken at.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	PESP_TZ_HISTORY_BLOCK Block;
+	LONG Delta;
+	ULONG Index;
+	ULONGLONG Time;
+
+	Time = SampleTime / 10000;
+
+	WdfSpinLockAcquire(History->Lock);
+
+	Block = NULL;
+	if (History->BlockCount != 0) {
+		Block = &History->Blocks[(History->BlockHead + History->BlockCount - 1) % ESP_TZ_HISTORY_RAW_BLOCKS];
+		if ((Block->Length + ESP_TZ_HISTORY_MAX_SAMPLE_LENGTH > ESP_TZ_HISTORY_BLOCK_DATA) ||
+			(Block->Count == MAXUSHORT) ||
+			(Time < History->LastTime) ||
+			(Time - Block->StartTime / 10000 > MAXULONG)) {
+
+			Block = NULL;
+		}
+	}
+
+	if (Block == NULL) {
+		if (History->BlockCount < ESP_TZ_HISTORY_RAW_BLOCKS) {
+			Index = (History->BlockHead + History->BlockCount) % ESP_TZ_HISTORY_RAW_BLOCKS;
+			History->BlockCount += 1;
+
+		} else {
+			Index = History->BlockHead;
+			History->BlockHead = (History->BlockHead + 1) % ESP_TZ_HISTORY_RAW_BLOCKS;
+		}
+
+		Block = &History->Blocks[Index];
+		Block->StartTime = Time * 10000;
+		Block->StartTemperature = Temperature;
+		Block->Duration = 0;
+		Block->Count = 0;
+		Block->Length = 0;
+		History->LastTime = Time;
+		History->LastTemperature = Temperature;
+	}
+
+	//
+	// Zigzag the temperature change so small drops stay one byte too.
+	//
+
+	Delta = (LONG)(Temperature - History->LastTemperature);
+	Block->Length += CameraESPTZHistoryEncode(&Block->Data[Block->Length],
+		Time - History->LastTime);
+
+	Block->Length += CameraESPTZHistoryEncode(&Block->Data[Block->Length],
+		((ULONG)Delta << 1) ^ (ULONG)(Delta >> 31));
+
+	Block->Duration = (ULONG)(Time - Block->StartTime / 10000);
+	Block->Count += 1;
+	History->LastTime = Time;
+	History->LastTemperature = Temperature;
+
+	CameraESPTZHistoryAccumulate(&History->Tiers[ESP_TZ_HISTORY_TIER_MINUTE],
+		SampleTime,
+		Temperature);
+
+	CameraESPTZHistoryAccumulate(&History->Tiers[ESP_TZ_HISTORY_TIER_HOUR],
+		SampleTime,
+		Temperature);
+
+	WdfSpinLockRelease(History->Lock);
+}
+
+VOID
+CameraESPTZQueryHistory(
+	_In_ WDFDEVICE Device,
+	_In_ WDFREQUEST Request
+)
+
+/*++
+
+Routine Description:
+
+	This routine handles IOCTL_ESP_TZ_QUERY_HISTORY.
+
+	N.B. The records are copied under the history spin lock, so this
+	routine must not be pageable.
+
+Arguments:
+
+	Device - Supplies a handle to the device.
+
+	Request - Supplies a handle to the request.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	PESP_TZ_HISTORY_BLOCK Block;
+	PESP_TZ_HISTORY_BUFFER Buffer;
+	ULONG Capacity;
+	ULONG Count;
+	PFDO_DATA DevExt;
+	ULONGLONG EndTime;
+	ULONG Flags;
+	PESP_TZ_HISTORY History;
+	ULONG Index;
+	size_t Length;
+	PESP_TZ_HISTORY_QUERY Query;
+	PESP_TZ_HISTORY_SUMMARY Record;
+	size_t RecordSize;
+	ULONGLONG StartTime;
+	NTSTATUS Status;
+	PESP_TZ_HISTORY_TIER Tier;
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s >>>",
+		"Icaros_KMD_ESP_TZ_History.c",
+		376,
+		"CameraESPTZQueryHistory");
+
+	DevExt = GetDeviceExtension(Device);
+	History = &DevExt->History;
+	Length = 0;
+	Status = WdfRequestRetrieveInputBuffer(Request, sizeof(ESP_TZ_HISTORY_QUERY), &Query, NULL);
+	if (!NT_SUCCESS(Status)) {
+		EspDbgPrintlEx(0, "ESP KMD TZ", "WdfRequestRetrieveInputBuffer() Failed. 0x%x", Status);
+		goto QueryHistoryEnd;
+	}
+
+	if ((Query->Version != ESP_TZ_HISTORY_VERSION) ||
+		(Query->Tier >= ESP_TZ_HISTORY_TIERS) ||
+		(Query->StartTime > Query->EndTime)) {
+
+		Status = STATUS_INVALID_PARAMETER;
+		EspDbgPrintlEx(0, "ESP KMD TZ", "%s : Version %lu, Tier %lu rejected", "CameraESPTZQueryHistory", Query->Version, Query->Tier);
+		goto QueryHistoryEnd;
+	}
+
+	//
+	// The output buffer aliases the input buffer, capture the query first.
+	//
+
+	Index = Query->Tier;
+	StartTime = Query->StartTime;
+	EndTime = Query->EndTime;
+
+	Status = WdfRequestRetrieveOutputBuffer(Request,
+		FIELD_OFFSET(ESP_TZ_HISTORY_BUFFER, Blocks),
+		&Buffer,
+		&Length);
+
+	if (!NT_SUCCESS(Status)) {
+		EspDbgPrintlEx(0, "ESP KMD TZ", "WdfRequestRetrieveOutputBuffer() Failed. 0x%x", Status);
+		Length = 0;
+		goto QueryHistoryEnd;
+	}
+
+	RecordSize = (Index == ESP_TZ_HISTORY_TIER_RAW) ?
+		sizeof(ESP_TZ_HISTORY_BLOCK) : sizeof(ESP_TZ_HISTORY_SUMMARY);
+
+	Capacity = (ULONG)min((Length - FIELD_OFFSET(ESP_TZ_HISTORY_BUFFER, Blocks)) / RecordSize,
+		MAXULONG);
+
+	Buffer->Tier = Index;
+	Count = 0;
+	Flags = 0;
+
+	WdfSpinLockAcquire(History->Lock);
+	if (Index == ESP_TZ_HISTORY_TIER_RAW) {
+		for (Index = 0; Index < History->BlockCount; Index += 1) {
+			Block = &History->Blocks[(History->BlockHead + Index) % ESP_TZ_HISTORY_RAW_BLOCKS];
+			if (Block->StartTime + (ULONGLONG)Block->Duration * 10000 < StartTime) {
+				continue;
+			}
+
+			if (Block->StartTime > EndTime) {
+				break;
+			}
+
+			if (Count == Capacity) {
+				Flags |= ESP_TZ_HISTORY_FLAG_MORE;
+				break;
+			}
+
+			Buffer->Blocks[Count] = *Block;
+			Count += 1;
+		}
+
+	} else {
+		Tier = &History->Tiers[Index];
+
+		//
+		// The closed records are followed by the pending period.
+		//
+
+		for (Index = 0; Index <= Tier->Count; Index += 1) {
+			if (Index < Tier->Count) {
+				Record = &Tier->Records[(Tier->Head + Index) % Tier->Size];
+				if (Record->StartTime + Tier->Period <= StartTime) {
+					continue;
+				}
+
+				if (Record->StartTime > EndTime) {
+					break;
+				}
+
+				if (Count == Capacity) {
+					Flags |= ESP_TZ_HISTORY_FLAG_MORE;
+					break;
+				}
+
+				Buffer->Summaries[Count] = *Record;
+
+			} else {
+				if ((Tier->PendingCount == 0) ||
+					(Tier->PendingStart + Tier->Period <= StartTime) ||
+					(Tier->PendingStart > EndTime)) {
+
+					break;
+				}
+
+				if (Count == Capacity) {
+					Flags |= ESP_TZ_HISTORY_FLAG_MORE;
+					break;
+				}
+
+				Record = &Buffer->Summaries[Count];
+				Record->StartTime = Tier->PendingStart;
+				Record->Minimum = Tier->PendingMinimum;
+				Record->Maximum = Tier->PendingMaximum;
+				Record->Mean = (ULONG)(Tier->PendingSum / Tier->PendingCount);
+				Record->Count = Tier->PendingCount;
+			}
+
+			Count += 1;
+		}
+	}
+
+	WdfSpinLockRelease(History->Lock);
+
+	Buffer->Version = ESP_TZ_HISTORY_VERSION;
+	Buffer->Count = Count;
+	Buffer->Flags = Flags;
+	Length = FIELD_OFFSET(ESP_TZ_HISTORY_BUFFER, Blocks) + (size_t)Count * RecordSize;
+
+	EspDbgPrintlEx(9, "ESP KMD TZ", "%s : Tier %lu, %lu records, flags 0x%x", "CameraESPTZQueryHistory", Buffer->Tier, Count, Flags);
+
+QueryHistoryEnd:
+
+	WdfRequestCompleteWithInformation(Request, Status, Length);
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s <<<",
+		"Icaros_KMD_ESP_TZ_History.c",
+		515,
+		"CameraESPTZQueryHistory");
+}
@@ -0,0 +1,300 @@
+/*++
+
+Module Name:
+
+	lock.c
+
+Abstract:
+
+	This file contains the spin-then-block reader/writer lock.
+
+	The critical sections under the QueueLock on the enqueue path are a few
+	hundred instructions, but a WDFWAITLOCK acquisition that misses goes
+	straight to a kernel wait and a context switch. This lock spins for a
+	bounded number of attempts first, and only waits if the holder is still
+	there after that.
+
+Environment:
+
+	Kernel-mode Driver Framework
+
+--*/
+
+#include "Device.h"
+#include "Debug.h"
+
+static
+BOOLEAN
+CameraESPTZLockTryAcquire(
+	_Inout_ PESP_TZ_LOCK Lock,
+	_In_ BOOLEAN Exclusive
+)
+
+/*++
+
+Routine Description:
+
+	This routine makes one attempt to acquire the lock.
+
+Arguments:
+
+	Lock - Supplies the lock.
+
+	Exclusive - Supplies whether to acquire it exclusive or shared.
+
+Return Value:
+
+	TRUE if the lock was acquired.
+
+--*/
+
+{
+	LONG State;
+
+	if (Exclusive != FALSE) {
+		return (InterlockedCompareExchange(&Lock->State, -1, 0) == 0) ? TRUE : FALSE;
+	}
+
+	for (;;) {
+		State = ReadNoFence(&Lock->State);
+		if (State < 0) {
+			return FALSE;
+		}
+
+		if (InterlockedCompareExchange(&Lock->State, State + 1, State) == State) {
+			return TRUE;
+		}
+	}
+}
+
+static
+VOID
+CameraESPTZLockAcquire(
+	_Inout_ PESP_TZ_LOCK Lock,
+	_In_ BOOLEAN Exclusive
+)
+
+/*++
+
+Routine Description:
+
+	This routine acquires the lock, spinning before it blocks.
+
+	A waiter counts itself in Waiters before its last attempt, so a release
+	either sees it and sets the event or happens before that attempt, which
+	then succeeds.
+
+	Normal kernel APCs are disabled from here until the release, so the
+	holder cannot be suspended with the lock held.
+
+Arguments:
+
+	Lock - Supplies the lock.
+
+	Exclusive - Supplies whether to acquire it exclusive or shared.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	ULONG Spin;
+
+	KeEnterCriticalRegion();
+	InterlockedIncrementNoFence64(&Lock->Acquisitions);
+	if (CameraESPTZLockTryAcquire(Lock, Exclusive) != FALSE) {
+		return;
+	}
+
+	InterlockedIncrementNoFence64(&Lock->Contentions);
+	for (Spin = 0; Spin < Lock->SpinCount; Spin += 1) {
+		YieldProcessor();
+		if (CameraESPTZLockTryAcquire(Lock, Exclusive) != FALSE) {
+			InterlockedIncrementNoFence64(&Lock->SpinAcquisitions);
+			return;
+		}
+	}
+
+	InterlockedIncrement(&Lock->Waiters);
+	while (CameraESPTZLockTryAcquire(Lock, Exclusive) == FALSE) {
+		KeWaitForSingleObject(&Lock->Event,
+			Executive,
+			KernelMode,
+			FALSE,
+			NULL);
+	}
+
+	//
+	// The event wakes one waiter at a time. A shared waiter passes the wake
+	// on, since the waiters behind it may be able to share the lock too.
+	//
+
+	if ((InterlockedDecrement(&Lock->Waiters) != 0) && (Exclusive == FALSE)) {
+		KeSetEvent(&Lock->Event, IO_NO_INCREMENT, FALSE);
+	}
+}
+
+VOID
+CameraESPTZLockInitialize(
+	_Out_ PESP_TZ_LOCK Lock
+)
+
+/*++
+
+Routine Description:
+
+	This routine initializes a free lock with the default spin count.
+
+Arguments:
+
+	Lock - Supplies the lock.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	RtlZeroMemory(Lock, sizeof(*Lock));
+	Lock->SpinCount = ESP_TZ_LOCK_DEFAULT_SPIN_COUNT;
+	KeInitializeEvent(&Lock->Event, SynchronizationEvent, FALSE);
+}
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+CameraESPTZLockAcquireExclusive(
+	_Inout_ PESP_TZ_LOCK Lock
+)
+
+/*++
+
+Routine Description:
+
+	This routine acquires the lock exclusive and notes the acquisition time
+	so the hold time can be accounted on release.
+
+Arguments:
+
+	Lock - Supplies the lock.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	ULONG64 QpcTimeStamp;
+
+	CameraESPTZLockAcquire(Lock, TRUE);
+	Lock->AcquireTime = KeQueryInterruptTimePrecise(&QpcTimeStamp);
+}
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+CameraESPTZLockReleaseExclusive(
+	_Inout_ PESP_TZ_LOCK Lock
+)
+
+/*++
+
+Routine Description:
+
+	This routine records the hold time and releases an exclusive hold.
+
+Arguments:
+
+	Lock - Supplies the lock.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	ULONG Bucket;
+	ULONGLONG HoldTime;
+	ULONG64 QpcTimeStamp;
+
+	HoldTime = KeQueryInterruptTimePrecise(&QpcTimeStamp) - Lock->AcquireTime;
+	if (HoldTime > Lock->MaximumHoldTime) {
+		Lock->MaximumHoldTime = HoldTime;
+	}
+
+	Bucket = (ULONG)(RtlFindMostSignificantBit(HoldTime) + 1);
+	if (Bucket >= ESP_TZ_LOCK_HOLD_BUCKETS) {
+		Bucket = ESP_TZ_LOCK_HOLD_BUCKETS - 1;
+	}
+
+	Lock->HoldTimes[Bucket] += 1;
+
+	InterlockedExchange(&Lock->State, 0);
+	if (ReadNoFence(&Lock->Waiters) != 0) {
+		KeSetEvent(&Lock->Event, IO_NO_INCREMENT, FALSE);
+	}
+
+	KeLeaveCriticalRegion();
+}
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+CameraESPTZLockAcquireShared(
+	_Inout_ PESP_TZ_LOCK Lock
+)
+
+/*++
+
+Routine Description:
+
+	This routine acquires the lock shared.
+
+Arguments:
+
+	Lock - Supplies the lock.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	CameraESPTZLockAcquire(Lock, FALSE);
+}
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+CameraESPTZLockReleaseShared(
+	_Inout_ PESP_TZ_LOCK Lock
+)
+
+/*++
+
+Routine Description:
+
+	This routine releases a shared hold. The last holder out wakes a
+	waiter.
+
+Arguments:
+
+	Lock - Supplies the lock.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	if ((InterlockedDecrement(&Lock->State) == 0) &&
+		(ReadNoFence(&Lock->Waiters) != 0)) {
+
+		KeSetEvent(&Lock->Event, IO_NO_INCREMENT, FALSE);
+	}
+
+	KeLeaveCriticalRegion();
+}
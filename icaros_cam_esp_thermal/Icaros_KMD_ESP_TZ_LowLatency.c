@@ -0,0 +1,370 @@
+/*++
+
+Module Name:
+
+	lowlatency.c
+
+Abstract:
+
+	This file contains the low-latency notification mode.
+
+	By default a virtual interrupt is delivered through a WDF work item, and
+	the request and model timers run at passive level, so every crossing
+	waits for a system worker thread. In low-latency mode a dedicated thread
+	at LOW_REALTIME_PRIORITY does that work instead. The timers are created
+	at dispatch level and only signal the thread.
+
+Environment:
+
+	Kernel-mode Driver Framework
+
+--*/
+
+#include "Device.h"
+#include "Debug.h"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, CameraESPTZLowLatencyStart)
+#pragma alloc_text (PAGE, CameraESPTZLowLatencyStop)
+#endif
+
+static
+VOID
+CameraESPTZLowLatencyThread(
+	_In_ PVOID Context
+)
+
+/*++
+
+Routine Description:
+
+	This routine is the notification thread. It waits for work to be
+	signaled and performs it until it is told to stop, then drops the
+	device reference taken for it.
+
+Arguments:
+
+	Context - Supplies a handle to the device.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	PFDO_DATA DevExt;
+	WDFDEVICE Device;
+	LONG Reasons;
+
+	Device = (WDFDEVICE)Context;
+	DevExt = GetDeviceExtension(Device);
+	KeSetPriorityThread(KeGetCurrentThread(), LOW_REALTIME_PRIORITY);
+
+	for (;;) {
+		KeWaitForSingleObject(&DevExt->LowLatency.Event,
+			Executive,
+			KernelMode,
+			FALSE,
+			NULL);
+
+		if (DevExt->LowLatency.Stop != 0) {
+			break;
+		}
+
+		Reasons = InterlockedExchange(&DevExt->LowLatency.Reasons, 0);
+
+		//
+		// A predicted crossing that has happened raises the interrupt, which
+		// is picked up here rather than on another pass through the wait.
+		//
+
+		if ((Reasons & ESP_TZ_LOW_LATENCY_MODEL) != 0) {
+			CameraESPTZCheckModelCrossing(Device);
+			Reasons |= InterlockedExchange(&DevExt->LowLatency.Reasons, 0);
+		}
+
+		if ((Reasons & ESP_TZ_LOW_LATENCY_INTERRUPT) != 0) {
+			InterlockedIncrement64(&DevExt->LoadStats.InterruptWorkerRuns);
+			CameraESPTZRequestScan(Device, EspTzScanInterrupt);
+
+		} else if ((Reasons & ESP_TZ_LOW_LATENCY_TIMER) != 0) {
+			CameraESPTZRequestScan(Device, EspTzScanTimer);
+		}
+
+		if ((Reasons & ESP_TZ_LOW_LATENCY_SCAN) != 0) {
+			CameraESPTZRunScan(Device);
+		}
+	}
+
+	WdfObjectDereference(Device);
+	PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+NTSTATUS
+CameraESPTZLowLatencyStart(
+	_In_ WDFDEVICE Device
+)
+
+/*++
+
+Routine Description:
+
+	This routine creates the notification thread.
+
+Arguments:
+
+	Device - Supplies a handle to the device.
+
+Return Value:
+
+	NTSTATUS.
+
+--*/
+
+{
+	PFDO_DATA DevExt;
+	OBJECT_ATTRIBUTES ObjectAttributes;
+	NTSTATUS Status;
+	PKTHREAD Thread;
+	HANDLE ThreadHandle;
+
+	PAGED_CODE();
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s >>>",
+		"Icaros_KMD_ESP_TZ_LowLatency.c",
+		137,
+		"CameraESPTZLowLatencyStart");
+
+	DevExt = GetDeviceExtension(Device);
+	DevExt->LowLatency.Stop = 0;
+	DevExt->LowLatency.Reasons = 0;
+	KeInitializeEvent(&DevExt->LowLatency.Event, SynchronizationEvent, FALSE);
+
+	//
+	// The thread holds a reference on the device until it exits.
+	//
+
+	WdfObjectReference(Device);
+	InitializeObjectAttributes(&ObjectAttributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+	Status = PsCreateSystemThread(&ThreadHandle,
+		THREAD_ALL_ACCESS,
+		&ObjectAttributes,
+		NULL,
+		NULL,
+		CameraESPTZLowLatencyThread,
+		Device);
+
+	if (!NT_SUCCESS(Status)) {
+		EspDbgPrintlEx(0, "ESP KMD TZ", "PsCreateSystemThread() Failed. 0x%x", Status);
+		WdfObjectDereference(Device);
+		goto LowLatencyStartEnd;
+	}
+
+	Status = ObReferenceObjectByHandle(ThreadHandle,
+		THREAD_ALL_ACCESS,
+		*PsThreadType,
+		KernelMode,
+		(PVOID*)&Thread,
+		NULL);
+
+	//
+	// Without a reference the thread cannot be waited for at cleanup. Tell
+	// it to exit now; its own device reference keeps the event valid until
+	// it has.
+	//
+
+	if (!NT_SUCCESS(Status)) {
+		EspDbgPrintlEx(0, "ESP KMD TZ", "ObReferenceObjectByHandle() Failed. 0x%x", Status);
+		InterlockedExchange(&DevExt->LowLatency.Stop, 1);
+		KeSetEvent(&DevExt->LowLatency.Event, IO_NO_INCREMENT, FALSE);
+		ZwClose(ThreadHandle);
+		goto LowLatencyStartEnd;
+	}
+
+	ZwClose(ThreadHandle);
+
+	//
+	// Virtual interrupts may be raised on other threads, which only test the
+	// pointer to choose the thread over the work item.
+	//
+
+	WritePointerRelease((PVOID*)&DevExt->LowLatency.Thread, Thread);
+
+LowLatencyStartEnd:
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s <<<",
+		"Icaros_KMD_ESP_TZ_LowLatency.c",
+		184,
+		"CameraESPTZLowLatencyStart");
+
+	return Status;
+}
+
+VOID
+CameraESPTZLowLatencyStop(
+	_In_ WDFDEVICE Device
+)
+
+/*++
+
+Routine Description:
+
+	This routine stops the notification thread, if running, and waits for
+	it to exit.
+
+Arguments:
+
+	Device - Supplies a handle to the device.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	PFDO_DATA DevExt;
+	PKTHREAD Thread;
+
+	PAGED_CODE();
+
+	//
+	// Unpublish the thread first, so that interrupts raised from here on go
+	// through the work item. A signal that already saw the pointer only
+	// touches the event and the reason mask, which outlive the thread.
+	//
+
+	DevExt = GetDeviceExtension(Device);
+	Thread = InterlockedExchangePointer((PVOID*)&DevExt->LowLatency.Thread, NULL);
+	if (Thread == NULL) {
+		return;
+	}
+
+	InterlockedExchange(&DevExt->LowLatency.Stop, 1);
+	KeSetEvent(&DevExt->LowLatency.Event, IO_NO_INCREMENT, FALSE);
+	KeWaitForSingleObject(Thread,
+		Executive,
+		KernelMode,
+		FALSE,
+		NULL);
+
+	ObDereferenceObject(Thread);
+}
+
+VOID
+CameraESPTZLowLatencySignal(
+	_In_ PESP_TZ_LOW_LATENCY LowLatency,
+	_In_ LONG Reason
+)
+
+/*++
+
+Routine Description:
+
+	This routine requests work from the notification thread. Requests made
+	before the thread runs are merged.
+
+Arguments:
+
+	LowLatency - Supplies the low-latency state.
+
+	Reason - Supplies the ESP_TZ_LOW_LATENCY_* work to perform.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	InterlockedOr(&LowLatency->Reasons, Reason);
+	KeSetEvent(&LowLatency->Event, EVENT_INCREMENT, FALSE);
+}
+
+VOID
+CameraESPTZEvtLowLatencyExpiredRequestTimer(
+	WDFTIMER Timer
+)
+
+/*++
+
+Routine Description:
+
+	This routine is the dispatch-level request expiration timer used in
+	low-latency mode. The scan itself is left to the notification thread,
+	and skipped if the queue has emptied since the timer was armed.
+
+Arguments:
+
+	Timer - Supplies a handle to the timer which expired.
+
+--*/
+
+{
+	PFDO_DATA DevExt;
+
+	DevExt = GetDeviceExtension((WDFDEVICE)WdfTimerGetParentObject(Timer));
+	InterlockedIncrement64(&DevExt->Idle.DeadlineWakeups);
+	if (ReadNoFence(&DevExt->Idle.Waiters) != 0) {
+		CameraESPTZLowLatencySignal(&DevExt->LowLatency, ESP_TZ_LOW_LATENCY_TIMER);
+	}
+}
+
+VOID
+CameraESPTZEvtLowLatencyModelTimer(
+	WDFTIMER Timer
+)
+
+/*++
+
+Routine Description:
+
+	This routine is the dispatch-level model crossing timer used in
+	low-latency mode. The model is evaluated by the notification thread
+	since it requires the Sensor.Lock.
+
+Arguments:
+
+	Timer - Supplies a handle to the timer which expired.
+
+--*/
+
+{
+	PFDO_DATA DevExt;
+
+	DevExt = GetDeviceExtension((WDFDEVICE)WdfTimerGetParentObject(Timer));
+	InterlockedIncrement64(&DevExt->Idle.ModelWakeups);
+	CameraESPTZLowLatencySignal(&DevExt->LowLatency, ESP_TZ_LOW_LATENCY_MODEL);
+}
+
+VOID
+CameraESPTZEvtLowLatencyScanTimer(
+	WDFTIMER Timer
+)
+
+/*++
+
+Routine Description:
+
+	This routine is the dispatch-level scan scheduler timer used in
+	low-latency mode. The deferred scan is run by the notification thread.
+
+Arguments:
+
+	Timer - Supplies a handle to the timer which expired.
+
+--*/
+
+{
+	PFDO_DATA DevExt;
+
+	DevExt = GetDeviceExtension((WDFDEVICE)WdfTimerGetParentObject(Timer));
+	CameraESPTZLowLatencySignal(&DevExt->LowLatency, ESP_TZ_LOW_LATENCY_SCAN);
+}
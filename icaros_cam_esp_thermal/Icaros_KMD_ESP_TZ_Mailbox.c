@@ -0,0 +1,379 @@
+/*++
+
+Module Name:
+
+	mailbox.c
+
+Abstract:
+
+	This file contains the set-temperature sample mailbox.
+
+	Samples pushed with IOCTL_ESP_TZ_SET_TEMPERATURE used to be published
+	under the Sensor.Lock by the thread that pushed them, so every producer
+	queued behind scans and readers holding it. Producers now post their
+	sample to an interlocked list and return; one of them publishes the
+	whole batch under a single Sensor.Lock hold.
+
+Environment:
+
+	Kernel-mode Driver Framework
+
+--*/
+
+#include "Device.h"
+#include "Debug.h"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, CameraESPTZMailboxInitialize)
+#endif
+
+NTSTATUS
+CameraESPTZMailboxInitialize(
+	_In_ WDFDEVICE Device,
+	_Out_ PESP_TZ_MAILBOX Mailbox
+)
+
+/*++
+
+Routine Description:
+
+	This routine allocates the mailbox entries and puts them all on the free
+	list. The allocation is parented to the device and released with it.
+
+Arguments:
+
+	Device - Supplies a handle to the device.
+
+	Mailbox - Supplies the mailbox to initialize.
+
+Return Value:
+
+	NTSTATUS.
+
+--*/
+
+{
+	WDF_OBJECT_ATTRIBUTES Attributes;
+	PVOID Buffer;
+	PESP_TZ_MAILBOX_ENTRY Entries;
+	ULONG Index;
+	WDFMEMORY Memory;
+	NTSTATUS Status;
+
+	PAGED_CODE();
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s >>>",
+		"Icaros_KMD_ESP_TZ_Mailbox.c",
+		66,
+		"CameraESPTZMailboxInitialize");
+
+	RtlZeroMemory(Mailbox, sizeof(*Mailbox));
+	InitializeSListHead(&Mailbox->Pending);
+	InitializeSListHead(&Mailbox->Free);
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&Attributes);
+	Attributes.ParentObject = Device;
+	Status = WdfMemoryCreate(&Attributes,
+		NonPagedPoolNx,
+		0,
+		ESP_TZ_MAILBOX_ENTRIES * sizeof(ESP_TZ_MAILBOX_ENTRY),
+		&Memory,
+		&Buffer);
+
+	if (!NT_SUCCESS(Status)) {
+		EspDbgPrintlEx(0, "ESP KMD TZ", "WdfMemoryCreate() Failed. 0x%x", Status);
+		goto MailboxInitializeEnd;
+	}
+
+	Entries = (PESP_TZ_MAILBOX_ENTRY)Buffer;
+	for (Index = 0; Index < ESP_TZ_MAILBOX_ENTRIES; Index += 1) {
+		InterlockedPushEntrySList(&Mailbox->Free, &Entries[Index].Link);
+	}
+
+MailboxInitializeEnd:
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s <<<",
+		"Icaros_KMD_ESP_TZ_Mailbox.c",
+		98,
+		"CameraESPTZMailboxInitialize");
+
+	return Status;
+}
+
+BOOLEAN
+CameraESPTZMailboxPost(
+	_Inout_ PESP_TZ_MAILBOX Mailbox,
+	_In_ ULONG Temperature,
+	_Out_ PBOOLEAN Drain
+)
+
+/*++
+
+Routine Description:
+
+	This routine posts a raw sample to the mailbox without taking a lock.
+
+Arguments:
+
+	Mailbox - Supplies the mailbox.
+
+	Temperature - Supplies the raw sample.
+
+	Drain - Receives TRUE if the mailbox was empty, in which case the caller
+		must drain it with CameraESPTZMailboxDrain.
+
+Return Value:
+
+	FALSE if no entry was free. The caller publishes the sample with
+	CameraESPTZMailboxPublish instead.
+
+--*/
+
+{
+	PESP_TZ_MAILBOX_ENTRY Entry;
+	PSLIST_ENTRY Link;
+	LARGE_INTEGER SystemTime;
+
+	*Drain = FALSE;
+	Link = InterlockedPopEntrySList(&Mailbox->Free);
+	if (Link == NULL) {
+		InterlockedIncrement64(&Mailbox->Full);
+		return FALSE;
+	}
+
+	Entry = CONTAINING_RECORD(Link, ESP_TZ_MAILBOX_ENTRY, Link);
+	Entry->Temperature = Temperature;
+	KeQuerySystemTime(&SystemTime);
+	Entry->SystemTime = (ULONGLONG)SystemTime.QuadPart;
+	Entry->Time = KeQueryInterruptTime();
+
+	InterlockedIncrement64(&Mailbox->Posted);
+	if (InterlockedPushEntrySList(&Mailbox->Pending, Link) == NULL) {
+		*Drain = TRUE;
+	}
+
+	return TRUE;
+}
+
+static
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+CameraESPTZMailboxPublishBatch(
+	_In_ WDFDEVICE Device,
+	_Inout_opt_ PESP_TZ_MAILBOX_ENTRY Last
+)
+
+/*++
+
+Routine Description:
+
+	This routine publishes every sample posted so far, oldest first, under
+	one Sensor.Lock hold. Each sample goes through the noise filter and the
+	threshold check as it is published; the virtual interrupt is raised once
+	for the batch, and the history is recorded after the lock is dropped.
+
+	The batch is taken under the Sensor.Lock, so batches taken by different
+	threads are published in the order they were taken.
+
+Arguments:
+
+	Device - Supplies a handle to the device.
+
+	Last - Supplies a sample that is not in the mailbox, published after
+		the batch, or NULL. It is not returned to the free list.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	ULONG Count;
+	PFDO_DATA DevExt;
+	PESP_TZ_MAILBOX_ENTRY Entry;
+	PSLIST_ENTRY Head;
+	BOOLEAN Interrupt;
+	PSLIST_ENTRY Link;
+	PESP_TZ_MAILBOX Mailbox;
+	PSLIST_ENTRY Next;
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s >>>",
+		"Icaros_KMD_ESP_TZ_Mailbox.c",
+		196,
+		"CameraESPTZMailboxPublishBatch");
+
+	DevExt = GetDeviceExtension(Device);
+	Mailbox = &DevExt->Mailbox;
+	Interrupt = FALSE;
+	Count = 0;
+
+	CameraESPTZAcquireSensorLock(DevExt);
+
+	//
+	// The list is newest first; reverse it so samples are published in the
+	// order they were posted.
+	//
+
+	Head = NULL;
+	if (Last != NULL) {
+		Last->Link.Next = NULL;
+		Head = &Last->Link;
+	}
+
+	Link = InterlockedFlushSList(&Mailbox->Pending);
+	while (Link != NULL) {
+		Next = Link->Next;
+		Link->Next = Head;
+		Head = Link;
+		Link = Next;
+	}
+
+	for (Link = Head; Link != NULL; Link = Link->Next) {
+		Entry = CONTAINING_RECORD(Link, ESP_TZ_MAILBOX_ENTRY, Link);
+
+		//
+		// Run the raw sample through the noise filter before publishing
+		// it, so a noisy sensor hovering around a bound does not fire
+		// spurious virtual interrupts.
+		//
+
+		DevExt->Sensor.RawTemperature = Entry->Temperature;
+		CameraESPTZPublishTemperature(DevExt,
+			CameraESPTZFilterSample(&DevExt->Sensor.Filter, Entry->Temperature));
+
+		EspDbgPrintlEx(9, "ESP KMD TZ", "%s : Temp %d (raw %d)", "CameraESPTZMailboxPublishBatch", DevExt->Sensor.Temperature, DevExt->Sensor.RawTemperature);
+
+		Entry->Temperature = DevExt->Sensor.Temperature;
+		DevExt->Sensor.SampleTime = max(DevExt->Sensor.SampleTime, Entry->Time);
+		DevExt->Sensor.Sequence += 1;
+		if (CameraESPTZIsThresholdCrossed(DevExt) != FALSE) {
+			Interrupt = TRUE;
+		}
+
+		Count += 1;
+	}
+
+	//
+	// A pushed sample is ground truth for the thermal model, restart its
+	// trajectory from the newest one.
+	//
+
+	if (Count != 0) {
+		CameraESPTZModelAnchor(&DevExt->Sensor.Model,
+			DevExt->Sensor.Temperature,
+			DevExt->Sensor.SampleTime);
+
+		if (Interrupt == FALSE) {
+			CameraESPTZScheduleModelCrossing(DevExt, KeQueryInterruptTime());
+		}
+	}
+
+	CameraESPTZReleaseSensorLock(DevExt);
+
+	while (Head != NULL) {
+		Entry = CONTAINING_RECORD(Head, ESP_TZ_MAILBOX_ENTRY, Link);
+		Head = Head->Next;
+		CameraESPTZHistoryRecord(&DevExt->History,
+			Entry->Temperature,
+			Entry->SystemTime);
+
+		if (Entry != Last) {
+			InterlockedPushEntrySList(&Mailbox->Free, &Entry->Link);
+		}
+	}
+
+	if (Count != 0) {
+		InterlockedIncrement64(&Mailbox->Drains);
+	}
+
+	//
+	// Fire the virtual interrupt outside the lock, to avoid any locking issues.
+	//
+
+	if (Interrupt != FALSE) {
+		CameraESPTZTemperatureInterrupt(Device);
+	}
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s <<<",
+		"Icaros_KMD_ESP_TZ_Mailbox.c",
+		289,
+		"CameraESPTZMailboxPublishBatch");
+}
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+CameraESPTZMailboxDrain(
+	_In_ WDFDEVICE Device
+)
+
+/*++
+
+Routine Description:
+
+	This routine publishes every sample posted so far, oldest first.
+
+Arguments:
+
+	Device - Supplies a handle to the device.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	CameraESPTZMailboxPublishBatch(Device, NULL);
+}
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+CameraESPTZMailboxPublish(
+	_In_ WDFDEVICE Device,
+	_In_ ULONG Temperature
+)
+
+/*++
+
+Routine Description:
+
+	This routine publishes a sample that could not be posted because no
+	entry was free. It takes the Sensor.Lock like a drain and publishes the
+	sample behind everything posted before it, instead of waiting for a
+	drain to free an entry.
+
+Arguments:
+
+	Device - Supplies a handle to the device.
+
+	Temperature - Supplies the raw sample.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	ESP_TZ_MAILBOX_ENTRY Entry;
+	LARGE_INTEGER SystemTime;
+
+	Entry.Temperature = Temperature;
+	KeQuerySystemTime(&SystemTime);
+	Entry.SystemTime = (ULONGLONG)SystemTime.QuadPart;
+	Entry.Time = KeQueryInterruptTime();
+	CameraESPTZMailboxPublishBatch(Device, &Entry);
+}
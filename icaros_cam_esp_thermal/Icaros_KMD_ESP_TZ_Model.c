@@ -0,0 +1,472 @@
+/*++
+
+Module Name:
+
+	model.c
+
+Abstract:
+
+	This file contains the first-order RC thermal model of the camera. The
+	model is evaluated lazily from its anchor, and predicts when the modeled
+	temperature will cross the virtual interrupt thresholds so that a single
+	deadline can be scheduled instead of a polling timer.
+
+	All arithmetic is integer fixed point with 16 fractional bits.
+
+Environment:
+
+	Kernel-mode Driver Framework
+
+--*/
+
+#include "Device.h"
+#include "Debug.h"
+
+#define ESP_TZ_MODEL_ONE (1ULL << 16)
+
+//
+// log2(e) and ln(2), 16 fractional bits.
+//
+
+#define ESP_TZ_MODEL_LOG2_E 94548
+#define ESP_TZ_MODEL_LN_2 45426
+
+//
+// Past 16 time constants the decay term is below the temperature resolution.
+//
+
+#define ESP_TZ_MODEL_SETTLED_TIME_CONSTANTS 16
+
+//
+// Slack added to a predicted crossing so the fixed point approximation does
+// not wake up just short of the bound, in 100ns units.
+//
+
+#define ESP_TZ_MODEL_CROSSING_SLACK 10000
+
+//
+// 2^(-k/32) for k = 0..32, 16 fractional bits.
+//
+
+static const ULONG CameraESPTZModelExp2Table[33] = {
+	65536, 64132, 62757, 61413, 60097, 58809, 57549, 56316, 55109, 53928, 52773,
+	51642, 50535, 49452, 48393, 47356, 46341, 45348, 44376, 43425, 42495, 41584,
+	40693, 39821, 38968, 38133, 37316, 36516, 35734, 34968, 34219, 33486, 32768
+};
+
+static
+ULONG
+CameraESPTZModelExpNegative(
+	_In_ ULONGLONG Exponent
+)
+
+/*++
+
+Routine Description:
+
+	Computes exp(-Exponent) as 2^(-Exponent * log2(e)), using a table for the
+	fractional power and a shift for the integral one.
+
+Arguments:
+
+	Exponent - Supplies the exponent, 16 fractional bits.
+
+Return Value:
+
+	exp(-Exponent), 16 fractional bits.
+
+--*/
+
+{
+	ULONG Fraction;
+	ULONG Index;
+	ULONGLONG Power;
+	ULONG Value;
+
+	Power = (Exponent * ESP_TZ_MODEL_LOG2_E) >> 16;
+	if ((Power >> 16) >= 32) {
+		return 0;
+	}
+
+	Index = (ULONG)(Power >> 11) & 0x1F;
+	Fraction = (ULONG)Power & 0x7FF;
+	Value = CameraESPTZModelExp2Table[Index] -
+		(((CameraESPTZModelExp2Table[Index] - CameraESPTZModelExp2Table[Index + 1]) * Fraction) >> 11);
+
+	return Value >> (ULONG)(Power >> 16);
+}
+
+static
+ULONGLONG
+CameraESPTZModelLogarithm(
+	_In_ ULONGLONG Value
+)
+
+/*++
+
+Routine Description:
+
+	Computes ln(Value) for Value >= 1 with the bit-by-bit squaring method.
+
+Arguments:
+
+	Value - Supplies the argument, 16 fractional bits.
+
+Return Value:
+
+	ln(Value), 16 fractional bits.
+
+--*/
+
+{
+	ULONG Bit;
+	ULONGLONG Result;
+
+	Result = 0;
+	while (Value >= (2 * ESP_TZ_MODEL_ONE)) {
+		Value >>= 1;
+		Result += ESP_TZ_MODEL_ONE;
+	}
+
+	for (Bit = 1 << 15; Bit != 0; Bit >>= 1) {
+		Value = (Value * Value) >> 16;
+		if (Value >= (2 * ESP_TZ_MODEL_ONE)) {
+			Value >>= 1;
+			Result += Bit;
+		}
+	}
+
+	return (Result * ESP_TZ_MODEL_LN_2) >> 16;
+}
+
+static
+VOID
+CameraESPTZModelGetTrajectory(
+	_In_ PESP_TZ_THERMAL_MODEL Model,
+	_Out_ PULONG Target,
+	_Out_ PULONGLONG TimeConstant
+)
+{
+	if (Model->CameraOn != FALSE) {
+		*Target = Model->ActiveTemperature;
+		*TimeConstant = (ULONGLONG)Model->HeatingTimeConstant * 10000;
+
+	} else {
+		*Target = Model->AmbientTemperature;
+		*TimeConstant = (ULONGLONG)Model->CoolingTimeConstant * 10000;
+	}
+}
+
+VOID
+CameraESPTZModelInitialize(
+	_Out_ PESP_TZ_THERMAL_MODEL Model,
+	_In_ BOOLEAN Enabled,
+	_In_ ULONG AmbientTemperature,
+	_In_ ULONG ActiveTemperature,
+	_In_ ULONG HeatingTimeConstant,
+	_In_ ULONG CoolingTimeConstant,
+	_In_ ULONG Temperature,
+	_In_ ULONGLONG CurrentTime
+)
+
+/*++
+
+Routine Description:
+
+	This routine configures the thermal model. The camera is assumed off and
+	the model is anchored at the supplied temperature.
+
+Arguments:
+
+	Model - Supplies the model to initialize.
+
+	Enabled - Supplies whether the model drives the sensor temperature.
+
+	AmbientTemperature - Supplies the steady state with the camera off.
+
+	ActiveTemperature - Supplies the steady state with the camera on.
+
+	HeatingTimeConstant - Supplies the time constant with the camera on, in
+		milliseconds.
+
+	CoolingTimeConstant - Supplies the time constant with the camera off, in
+		milliseconds.
+
+	Temperature - Supplies the initial temperature.
+
+	CurrentTime - Supplies the current interrupt time.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s >>>",
+		"Icaros_KMD_ESP_TZ_Model.c",
+		211,
+		"CameraESPTZModelInitialize");
+
+	RtlZeroMemory(Model, sizeof(*Model));
+	Model->Enabled = Enabled;
+	Model->CameraOn = FALSE;
+	Model->AmbientTemperature = AmbientTemperature;
+	Model->ActiveTemperature = ActiveTemperature;
+	Model->HeatingTimeConstant = min(HeatingTimeConstant, ESP_TZ_MODEL_MAX_TIME_CONSTANT);
+	Model->CoolingTimeConstant = min(CoolingTimeConstant, ESP_TZ_MODEL_MAX_TIME_CONSTANT);
+	Model->AnchorTemperature = Temperature;
+	Model->AnchorTime = CurrentTime;
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"%s : Enabled = %d, Ambient = %lu, Active = %lu, Heating = %lu ms, Cooling = %lu ms",
+		"CameraESPTZModelInitialize",
+		Enabled,
+		AmbientTemperature,
+		ActiveTemperature,
+		Model->HeatingTimeConstant,
+		Model->CoolingTimeConstant);
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s <<<",
+		"Icaros_KMD_ESP_TZ_Model.c",
+		240,
+		"CameraESPTZModelInitialize");
+}
+
+ULONG
+CameraESPTZModelEvaluate(
+	_In_ PESP_TZ_THERMAL_MODEL Model,
+	_In_ ULONGLONG CurrentTime
+)
+
+/*++
+
+Routine Description:
+
+	This routine computes the modeled temperature in constant time.
+
+	N.B. This routine requires the Sensor.Lock be held.
+
+Arguments:
+
+	Model - Supplies the model.
+
+	CurrentTime - Supplies the current interrupt time.
+
+Return Value:
+
+	The modeled temperature, in tenths of a Kelvin.
+
+--*/
+
+{
+	LONGLONG Decayed;
+	ULONGLONG Elapsed;
+	ULONG Target;
+	ULONGLONG TimeConstant;
+
+	CameraESPTZModelGetTrajectory(Model, &Target, &TimeConstant);
+	Elapsed = (CurrentTime > Model->AnchorTime) ? (CurrentTime - Model->AnchorTime) : 0;
+	if ((TimeConstant == 0) ||
+		(Elapsed >= (ESP_TZ_MODEL_SETTLED_TIME_CONSTANTS * TimeConstant))) {
+
+		return Target;
+	}
+
+	Decayed = ((LONGLONG)Model->AnchorTemperature - (LONGLONG)Target) *
+		(LONGLONG)CameraESPTZModelExpNegative((Elapsed << 16) / TimeConstant);
+
+	//
+	// Round half away from zero so heating and cooling are symmetric.
+	//
+
+	Decayed += (Decayed < 0) ? -(LONGLONG)(ESP_TZ_MODEL_ONE / 2) : (LONGLONG)(ESP_TZ_MODEL_ONE / 2);
+	return (ULONG)((LONGLONG)Target + (Decayed / (LONGLONG)ESP_TZ_MODEL_ONE));
+}
+
+VOID
+CameraESPTZModelAnchor(
+	_Inout_ PESP_TZ_THERMAL_MODEL Model,
+	_In_ ULONG Temperature,
+	_In_ ULONGLONG CurrentTime
+)
+
+/*++
+
+Routine Description:
+
+	This routine restarts the modeled trajectory from a known temperature,
+	typically a sample pushed by the producer.
+
+	N.B. This routine requires the Sensor.Lock be held.
+
+Arguments:
+
+	Model - Supplies the model.
+
+	Temperature - Supplies the known temperature.
+
+	CurrentTime - Supplies the current interrupt time.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	Model->AnchorTemperature = Temperature;
+	Model->AnchorTime = CurrentTime;
+}
+
+VOID
+CameraESPTZModelSetCameraState(
+	_Inout_ PESP_TZ_THERMAL_MODEL Model,
+	_In_ BOOLEAN CameraOn,
+	_In_ ULONGLONG CurrentTime
+)
+
+/*++
+
+Routine Description:
+
+	This routine switches the model to the heating or cooling trajectory,
+	anchored at the temperature reached so far.
+
+	N.B. This routine requires the Sensor.Lock be held.
+
+Arguments:
+
+	Model - Supplies the model.
+
+	CameraOn - Supplies the new camera power state.
+
+	CurrentTime - Supplies the current interrupt time.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	if (Model->CameraOn == CameraOn) {
+		return;
+	}
+
+	CameraESPTZModelAnchor(Model,
+		CameraESPTZModelEvaluate(Model, CurrentTime),
+		CurrentTime);
+
+	Model->CameraOn = CameraOn;
+}
+
+ULONGLONG
+CameraESPTZModelNextCrossing(
+	_In_ PESP_TZ_THERMAL_MODEL Model,
+	_In_ ULONGLONG CurrentTime,
+	_In_ ULONG LowerBound,
+	_In_ ULONG UpperBound
+)
+
+/*++
+
+Routine Description:
+
+	This routine predicts when the modeled temperature will cross one of the
+	virtual interrupt thresholds. The trajectory is monotonic, so only the
+	bound in the direction of travel can be crossed.
+
+	N.B. This routine requires the Sensor.Lock be held.
+
+Arguments:
+
+	Model - Supplies the model.
+
+	CurrentTime - Supplies the current interrupt time.
+
+	LowerBound - Supplies the temperature at or below which an interrupt is
+		due.
+
+	UpperBound - Supplies the temperature at or above which an interrupt is
+		due.
+
+Return Value:
+
+	The interrupt time of the crossing, CurrentTime if it is already due, or
+	zero if the trajectory never crosses a bound.
+
+--*/
+
+{
+	LONGLONG AnchorDelta;
+	LONGLONG BoundDelta;
+	ULONGLONG Deadline;
+	ULONGLONG Ratio;
+	ULONG Target;
+	ULONGLONG TimeConstant;
+
+	CameraESPTZModelGetTrajectory(Model, &Target, &TimeConstant);
+
+	//
+	// Work in quarter units: a rounded temperature reaches a bound once the
+	// exact trajectory is within half a unit of it, so aim a quarter unit
+	// short of the bound to absorb the fixed point error.
+	//
+
+	AnchorDelta = 4 * ((LONGLONG)Model->AnchorTemperature - (LONGLONG)Target);
+	if (AnchorDelta < 0) {
+
+		//
+		// Heating. Only the upper bound can be crossed, and only if it is not
+		// beyond the steady state.
+		//
+
+		if ((UpperBound == (ULONG)-1) || (UpperBound > Target)) {
+			return 0;
+		}
+
+		BoundDelta = 4 * ((LONGLONG)UpperBound - (LONGLONG)Target) - 1;
+
+	} else if (AnchorDelta > 0) {
+
+		//
+		// Cooling. Only the lower bound can be crossed.
+		//
+
+		if (LowerBound < Target) {
+			return 0;
+		}
+
+		BoundDelta = 4 * ((LONGLONG)LowerBound - (LONGLONG)Target) + 1;
+
+	} else {
+		return 0;
+	}
+
+	//
+	// Both deltas have the same sign. A ratio below one means the anchor is
+	// already past the bound.
+	//
+
+	Ratio = ((ULONGLONG)(AnchorDelta < 0 ? -AnchorDelta : AnchorDelta) << 16) /
+		(ULONGLONG)(BoundDelta < 0 ? -BoundDelta : BoundDelta);
+
+	if (Ratio < ESP_TZ_MODEL_ONE) {
+		return CurrentTime;
+	}
+
+	Deadline = Model->AnchorTime +
+		((TimeConstant * CameraESPTZModelLogarithm(Ratio)) >> 16) +
+		ESP_TZ_MODEL_CROSSING_SLACK;
+
+	return max(Deadline, CurrentTime);
+}
@@ -0,0 +1,273 @@
+/*++
+
+Module Name:
+
+	multiwait.c
+
+Abstract:
+
+	This file contains the multi-condition wait.
+
+	A thermal manager watching several ranges at once can pend them as one
+	request instead of one IOCTL_THERMAL_READ_TEMPERATURE each. The request
+	enters the pending queue with the union of its conditions, the highest
+	lower bound, the lowest upper bound and the earliest expiration, so it
+	costs one context, one waiter and one visit per scan however many
+	conditions it holds.
+
+Environment:
+
+	Kernel-mode Driver Framework
+
+--*/
+
+#include "Device.h"
+#include "Debug.h"
+
+VOID
+CameraESPTZMultiWait(
+	_In_ WDFDEVICE Device,
+	_In_ WDFREQUEST Request
+)
+
+/*++
+
+Routine Description:
+
+	This routine handles IOCTL_ESP_TZ_MULTI_WAIT. If a condition is already
+	met the request is completed immediately, else it is pended.
+
+Arguments:
+
+	Device - Supplies a handle to the device.
+
+	Request - Supplies a handle to the request.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	ULONG BytesReturned;
+	PMULTI_WAIT_CONDITION Condition;
+	WDF_OBJECT_ATTRIBUTES ContextAttributes;
+	ULONG Count;
+	LARGE_INTEGER CurrentTime;
+	PFDO_DATA DevExt;
+	LARGE_INTEGER ExpirationTime;
+	ULONG HighTemperature;
+	ULONG Index;
+	size_t Length;
+	ULONG LowTemperature;
+	PMULTI_WAIT_CONTEXT MultiWait;
+	NTSTATUS Status;
+	ULONG Temperature;
+	PESP_TZ_MULTI_WAIT Wait;
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s >>>",
+		"Icaros_KMD_ESP_TZ_MultiWait.c",
+		72,
+		"CameraESPTZMultiWait");
+
+	DevExt = GetDeviceExtension(Device);
+	Status = WdfRequestRetrieveInputBuffer(Request,
+		FIELD_OFFSET(ESP_TZ_MULTI_WAIT, Conditions),
+		&Wait,
+		&Length);
+
+	if (!NT_SUCCESS(Status)) {
+		EspDbgPrintlEx(0, "ESP KMD TZ", "WdfRequestRetrieveInputBuffer() Failed. 0x%x", Status);
+		goto MultiWaitFail;
+	}
+
+	Count = Wait->Count;
+	if ((Wait->Version != ESP_TZ_MULTI_WAIT_VERSION) ||
+		(Count == 0) ||
+		(Count > ESP_TZ_MAX_WAIT_CONDITIONS) ||
+		(Length < FIELD_OFFSET(ESP_TZ_MULTI_WAIT, Conditions) + (size_t)Count * sizeof(ESP_TZ_WAIT_CONDITION))) {
+
+		Status = STATUS_INVALID_PARAMETER;
+		EspDbgPrintlEx(0, "ESP KMD TZ", "%s : Version %lu, Count %lu rejected", "CameraESPTZMultiWait", Wait->Version, Count);
+		goto MultiWaitFail;
+	}
+
+	WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&ContextAttributes, MULTI_WAIT_CONTEXT);
+	Status = WdfObjectAllocateContext(Request, &ContextAttributes, &MultiWait);
+	if (!NT_SUCCESS(Status)) {
+		EspDbgPrintlEx(0, "ESP KMD TZ", "WdfObjectAllocateContext() Failed. 0x%x", Status);
+		goto MultiWaitFail;
+	}
+
+	//
+	// Copy the conditions out of the buffered input, which the result
+	// overwrites, and build their union.
+	//
+
+	KeQuerySystemTime(&CurrentTime);
+	LowTemperature = 0;
+	HighTemperature = (ULONG)-1;
+	ExpirationTime.QuadPart = -1LL /* INFINITE */;
+	MultiWait->Count = Count;
+	for (Index = 0; Index < Count; Index += 1) {
+		Condition = &MultiWait->Conditions[Index];
+		Condition->LowTemperature = Wait->Conditions[Index].LowTemperature;
+		Condition->HighTemperature = Wait->Conditions[Index].HighTemperature;
+		if (Wait->Conditions[Index].Timeout != -1 /* INFINITE */) {
+			Condition->ExpirationTime.QuadPart = CurrentTime.QuadPart +
+				(ULONGLONG)Wait->Conditions[Index].Timeout * 10000;
+
+			if ((ExpirationTime.QuadPart == -1LL) ||
+				(Condition->ExpirationTime.QuadPart < ExpirationTime.QuadPart)) {
+
+				ExpirationTime.QuadPart = Condition->ExpirationTime.QuadPart;
+			}
+
+		} else {
+			Condition->ExpirationTime.QuadPart = -1LL /* INFINITE */;
+		}
+
+		LowTemperature = max(LowTemperature, Condition->LowTemperature);
+		HighTemperature = min(HighTemperature, Condition->HighTemperature);
+	}
+
+	Temperature = CameraESPTZReadTemperature(Device);
+	if (CameraESPTZAreConstraintsSatisfied(Temperature,
+		LowTemperature,
+		HighTemperature,
+		ExpirationTime)) {
+
+		Status = CameraESPTZMultiWaitFormatResult(Request,
+			MultiWait,
+			Temperature,
+			FALSE,
+			&BytesReturned);
+
+		InterlockedIncrement64(&DevExt->ScanStats.FastPathHits);
+		WdfRequestCompleteWithInformation(Request, Status, BytesReturned);
+
+	} else {
+		EspDbgPrintlEx(9, "ESP KMD TZ", "%s : pending %lu conditions, bounds %lu-%lu", "CameraESPTZMultiWait", Count, LowTemperature, HighTemperature);
+
+		CameraESPTZPendReadRequest(Device,
+			Request,
+			ESP_TZ_IOCTL_SLOT(IOCTL_ESP_TZ_MULTI_WAIT),
+			LowTemperature,
+			HighTemperature,
+			ExpirationTime,
+			MultiWait);
+	}
+
+	goto MultiWaitEnd;
+
+MultiWaitFail:
+
+	WdfRequestComplete(Request, Status);
+
+MultiWaitEnd:
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s <<<",
+		"Icaros_KMD_ESP_TZ_MultiWait.c",
+		181,
+		"CameraESPTZMultiWait");
+}
+
+NTSTATUS
+CameraESPTZMultiWaitFormatResult(
+	_In_ WDFREQUEST Request,
+	_In_ PMULTI_WAIT_CONTEXT MultiWait,
+	_In_ ULONG Temperature,
+	_In_ BOOLEAN TripPointCrossed,
+	_Out_ PULONG BytesReturned
+)
+
+/*++
+
+Routine Description:
+
+	This routine reports which condition of a multi-wait fired. A condition
+	whose bounds the temperature left is reported first, then a trip point
+	crossing, and otherwise the condition that expired earliest.
+
+Arguments:
+
+	Request - Supplies a handle to the request.
+
+	MultiWait - Supplies the conditions of the request.
+
+	Temperature - Supplies the temperature the request is retired with.
+
+	TripPointCrossed - Supplies whether a trip point crossing retired it.
+
+	BytesReturned - Receives the number of bytes written.
+
+Return Value:
+
+	NTSTATUS.
+
+--*/
+
+{
+	PMULTI_WAIT_CONDITION Condition;
+	LONGLONG Earliest;
+	ULONG Index;
+	size_t Length;
+	PESP_TZ_MULTI_WAIT_RESULT Result;
+	NTSTATUS Status;
+
+	*BytesReturned = 0;
+	Status = WdfRequestRetrieveOutputBuffer(Request,
+		sizeof(ESP_TZ_MULTI_WAIT_RESULT),
+		&Result,
+		&Length);
+
+	if (!NT_SUCCESS(Status)) {
+		EspDbgPrintlEx(0, "ESP KMD TZ", "WdfRequestRetrieveOutputBuffer() Failed. 0x%x", Status);
+		return Status;
+	}
+
+	Result->Temperature = Temperature;
+	for (Index = 0; Index < MultiWait->Count; Index += 1) {
+		Condition = &MultiWait->Conditions[Index];
+		if ((Temperature <= Condition->LowTemperature) ||
+			(Temperature >= Condition->HighTemperature)) {
+
+			Result->Index = Index;
+			Result->Reason = EspTzWaitSatisfied;
+			goto MultiWaitFormatResultEnd;
+		}
+	}
+
+	if (TripPointCrossed != FALSE) {
+		Result->Index = ESP_TZ_WAIT_INDEX_NONE;
+		Result->Reason = EspTzWaitTripPoint;
+		goto MultiWaitFormatResultEnd;
+	}
+
+	Result->Index = ESP_TZ_WAIT_INDEX_NONE;
+	Result->Reason = EspTzWaitExpired;
+	Earliest = MAXLONGLONG;
+	for (Index = 0; Index < MultiWait->Count; Index += 1) {
+		Condition = &MultiWait->Conditions[Index];
+		if ((Condition->ExpirationTime.QuadPart != -1LL /* INFINITE */) &&
+			(Condition->ExpirationTime.QuadPart < Earliest)) {
+
+			Earliest = Condition->ExpirationTime.QuadPart;
+			Result->Index = Index;
+		}
+	}
+
+MultiWaitFormatResultEnd:
+
+	EspDbgPrintlEx(9, "ESP KMD TZ", "%s : condition %lu, reason %lu, temp %lu", "CameraESPTZMultiWaitFormatResult", Result->Index, Result->Reason, Temperature);
+
+	*BytesReturned = sizeof(ESP_TZ_MULTI_WAIT_RESULT);
+	return STATUS_SUCCESS;
+}
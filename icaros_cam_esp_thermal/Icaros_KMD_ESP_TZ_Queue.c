@@ -19,8 +19,130 @@ Environment:
 
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text (PAGE, CameraESPTZQueueInitialize)
+#pragma alloc_text (PAGE, CameraESPTZQueryQueueStatistics)
 #endif
 
+//
+// IOCTL dispatch table, indexed by slot. The private IOCTLs are placed by
+// function code so a lookup is a bounds check and one compare.
+//
+
+#define ESP_TZ_IOCTL(IoControlCode, Handler, InputLength, OutputLength, Irql, Class)    \
+	[ESP_TZ_IOCTL_SLOT(IoControlCode)] = {                                          \
+		(IoControlCode), (Handler), (InputLength), (OutputLength), (Irql), (Class) }
+
+static const ESP_TZ_IOCTL_ENTRY CameraESPTZIoctlTable[ESP_TZ_IOCTL_SLOT_COUNT] = {
+	[ESP_TZ_IOCTL_SLOT_READ_TEMPERATURE] = {
+		IOCTL_THERMAL_READ_TEMPERATURE,
+		CameraESPTZAddReadRequest,
+		sizeof(THERMAL_WAIT_READ),
+		sizeof(ULONG),
+		PASSIVE_LEVEL,
+		EspTzQueueWaits },
+
+	ESP_TZ_IOCTL(IOCTL_ESP_TZ_SET_TEMPERATURE, CameraESPTZSetTemperature, sizeof(ULONG), 0, PASSIVE_LEVEL, EspTzQueueSamples),
+	ESP_TZ_IOCTL(IOCTL_ESP_TZ_CAMERA_ON, CameraESPTZCameraOnNotification, 0, 0, PASSIVE_LEVEL, EspTzQueueControl),
+	ESP_TZ_IOCTL(IOCTL_ESP_TZ_CAMERA_OFF, CameraESPTZCameraOffNotification, 0, 0, PASSIVE_LEVEL, EspTzQueueControl),
+	ESP_TZ_IOCTL(IOCTL_ESP_TZ_QUERY_LATENCY, CameraESPTZQueryLatency, 0,
+		FIELD_OFFSET(ESP_TZ_LATENCY_STATISTICS, Entries), PASSIVE_LEVEL, EspTzQueueControl),
+	ESP_TZ_IOCTL(IOCTL_ESP_TZ_QUERY_SCAN_STATISTICS, CameraESPTZQueryScanStatistics, 0,
+		ESP_TZ_SCAN_STATISTICS_V1_SIZE, PASSIVE_LEVEL, EspTzQueueControl),
+	ESP_TZ_IOCTL(IOCTL_ESP_TZ_RECORDER_CONTROL, CameraESPTZRecorderControl, sizeof(ULONG), 0, PASSIVE_LEVEL, EspTzQueueControl),
+	ESP_TZ_IOCTL(IOCTL_ESP_TZ_RECORDER_READ, CameraESPTZRecorderRead, 0,
+		FIELD_OFFSET(ESP_TZ_TRACE_BUFFER, Records), PASSIVE_LEVEL, EspTzQueueControl),
+	ESP_TZ_IOCTL(IOCTL_ESP_TZ_QUERY_LOAD_STATISTICS, CameraESPTZQueryLoadStatistics, 0,
+		ESP_TZ_LOAD_STATISTICS_V1_SIZE, PASSIVE_LEVEL, EspTzQueueControl),
+	ESP_TZ_IOCTL(IOCTL_ESP_TZ_SET_TRIP_POINTS, CameraESPTZSetTripPoints,
+		FIELD_OFFSET(ESP_TZ_TRIP_POINT_TABLE, Points), 0, PASSIVE_LEVEL, EspTzQueueControl),
+	ESP_TZ_IOCTL(IOCTL_ESP_TZ_QUERY_HISTORY, CameraESPTZQueryHistory, sizeof(ESP_TZ_HISTORY_QUERY),
+		FIELD_OFFSET(ESP_TZ_HISTORY_BUFFER, Blocks), PASSIVE_LEVEL, EspTzQueueControl),
+	ESP_TZ_IOCTL(IOCTL_ESP_TZ_MULTI_WAIT, CameraESPTZMultiWait,
+		FIELD_OFFSET(ESP_TZ_MULTI_WAIT, Conditions) + sizeof(ESP_TZ_WAIT_CONDITION),
+		sizeof(ESP_TZ_MULTI_WAIT_RESULT), PASSIVE_LEVEL, EspTzQueueWaits),
+	ESP_TZ_IOCTL(IOCTL_ESP_TZ_SET_TEMPERATURES, CameraESPTZSetTemperatures,
+		FIELD_OFFSET(ESP_TZ_SAMPLE_BATCH, Samples) + sizeof(ESP_TZ_TIMED_SAMPLE), 0, PASSIVE_LEVEL, EspTzQueueSamples),
+	ESP_TZ_IOCTL(IOCTL_ESP_TZ_QUERY_QUEUE_STATISTICS, CameraESPTZQueryQueueStatistics, 0,
+		FIELD_OFFSET(ESP_TZ_QUEUE_STATISTICS, Queues), PASSIVE_LEVEL, EspTzQueueControl),
+};
+
+//
+// Existing clients issue the private IOCTLs by value.
+//
+
+C_ASSERT(IOCTL_ESP_TZ_SET_TEMPERATURE == 0x222400);
+C_ASSERT(IOCTL_ESP_TZ_CAMERA_ON == 0x222404);
+C_ASSERT(IOCTL_ESP_TZ_CAMERA_OFF == 0x222408);
+
+FORCEINLINE
+ULONG
+CameraESPTZLookupIoctl(
+	_In_ ULONG IoControlCode
+)
+
+/*++
+
+Routine Description:
+
+	This routine maps an IOCTL to its dispatch table slot.
+
+Arguments:
+
+	IoControlCode - Supplies the I/O control code.
+
+Return Value:
+
+	The dispatch table slot, or ESP_TZ_IOCTL_SLOT_FORWARDED if the IOCTL is
+	not handled by this driver.
+
+--*/
+
+{
+	ULONG Slot;
+
+	if (IoControlCode == IOCTL_THERMAL_READ_TEMPERATURE) {
+		return ESP_TZ_IOCTL_SLOT_READ_TEMPERATURE;
+	}
+
+	Slot = ESP_TZ_IOCTL_SLOT(IoControlCode);
+	if ((Slot > ESP_TZ_IOCTL_SLOT_READ_TEMPERATURE) &&
+		(Slot < ESP_TZ_IOCTL_SLOT_COUNT) &&
+		(CameraESPTZIoctlTable[Slot].IoControlCode == IoControlCode)) {
+
+		return Slot;
+	}
+
+	return ESP_TZ_IOCTL_SLOT_FORWARDED;
+}
+
+ULONG
+CameraESPTZIoctlCodeFromSlot(
+	_In_ ULONG Slot
+)
+
+/*++
+
+Routine Description:
+
+	This routine maps a dispatch table slot back to its IOCTL.
+
+Arguments:
+
+	Slot - Supplies the dispatch table slot.
+
+Return Value:
+
+	The I/O control code, or zero for the forwarded slot.
+
+--*/
+
+{
+	if (Slot >= ESP_TZ_IOCTL_SLOT_COUNT) {
+		return 0;
+	}
+
+	return CameraESPTZIoctlTable[Slot].IoControlCode;
+}
+
 VOID
 CameraESPTZEvtIoInternalDeviceControl(
 	WDFQUEUE Queue,
@@ -36,16 +158,12 @@ CameraESPTZEvtIoInternalDeviceControl(
 		The system uses IoInternalDeviceControl requests to communicate with the
 		ACPI driver on the device stack. For proper operation of thermal zones,
 		these requests must be forwarded unless the driver knows how to handle
-		them.
+		them. Idempotent thermal zone queries may be answered from the
+		response cache.
 
 	--*/
 
 {
-	WDF_REQUEST_SEND_OPTIONS RequestSendOptions;
-	BOOLEAN Return;
-	NTSTATUS Status;
-
-	UNREFERENCED_PARAMETER(IoControlCode);
 	UNREFERENCED_PARAMETER(InputBufferLength);
 	UNREFERENCED_PARAMETER(OutputBufferLength);
 
@@ -57,23 +175,7 @@ CameraESPTZEvtIoInternalDeviceControl(
 		348,
 		"CameraESPTZEvtIoInternalDeviceControl");
 
-	WdfRequestFormatRequestUsingCurrentType(Request);
-
-	WDF_REQUEST_SEND_OPTIONS_INIT(
-		&RequestSendOptions,
-		WDF_REQUEST_SEND_OPTION_SEND_AND_FORGET);
-
-	Return = WdfRequestSend(
-		Request,
-		WdfDeviceGetIoTarget(WdfIoQueueGetDevice(Queue)),
-		&RequestSendOptions);
-
-	if (Return == FALSE) {
-		Status = WdfRequestGetStatus(Request);
-		EspDbgPrintlEx(0, "ESP KMD TZ", "WdfRequestSend() Failed. Request Status=0x%x\n", Status);
-
-		WdfRequestComplete(Request, Status);
-	}
+	CameraESPTZForwardRequest(WdfIoQueueGetDevice(Queue), Request, IoControlCode);
 
 	EspDbgPrintlEx(
 		9,
@@ -95,9 +197,12 @@ Routine Description:
 	 The I/O dispatch callbacks for the frameworks device object
 	 are configured in this function.
 
-	 A single default I/O Queue is configured for parallel request
-	 processing, and a driver context memory allocation is created
-	 to hold our structure QUEUE_CONTEXT.
+	 A default I/O Queue is configured for parallel request processing,
+	 and a driver context memory allocation is created to hold our
+	 structure QUEUE_CONTEXT. Handled IOCTLs are forwarded from it to one
+	 parallel queue per ESP_TZ_QUEUE_CLASS. The sample queue is parallel
+	 too, so concurrent producers reach the mailbox together and are
+	 published as one batch.
 
 Arguments:
 
@@ -112,7 +217,10 @@ Return Value:
 	WDFQUEUE queue;
 	NTSTATUS status;
 	PFDO_DATA DevExt;
+	ULONG Index;
 	WDF_IO_QUEUE_CONFIG queueConfig;
+	WDF_OBJECT_ATTRIBUTES ClassQueueAttributes;
+	WDF_IO_QUEUE_CONFIG ClassQueueConfig;
 	WDF_IO_QUEUE_CONFIG PendingRequestQueueConfig;
 
 	PAGED_CODE();
@@ -168,6 +276,44 @@ Return Value:
 		return status;
 	}
 
+	//
+	// Configure the class queues. Requests are only forwarded to them from
+	// the default queue, never dispatched to them by the framework. The
+	// handlers block on the queue lock and run pageable code, so the class
+	// queues call them at passive level whatever the level of the thread
+	// that forwarded the request.
+	//
+
+	DevExt->ClassQueues[EspTzQueueSamples].DepthLimit = ESP_TZ_SAMPLE_QUEUE_DEFAULT_DEPTH;
+	DevExt->ClassQueues[EspTzQueueWaits].DepthLimit = ESP_TZ_WAIT_QUEUE_DEFAULT_DEPTH;
+	DevExt->ClassQueues[EspTzQueueControl].DepthLimit = ESP_TZ_CONTROL_QUEUE_DEFAULT_DEPTH;
+
+	for (Index = 0; Index < EspTzQueueClassMaximum; Index += 1) {
+		WDF_IO_QUEUE_CONFIG_INIT(&ClassQueueConfig, WdfIoQueueDispatchParallel);
+		ClassQueueConfig.EvtIoDeviceControl = CameraESPTZEvtClassIoDeviceControl;
+		ClassQueueConfig.EvtIoCanceledOnQueue = CameraESPTZEvtClassIoCanceledOnQueue;
+		WDF_OBJECT_ATTRIBUTES_INIT(&ClassQueueAttributes);
+		ClassQueueAttributes.ExecutionLevel = WdfExecutionLevelPassive;
+
+		status = WdfIoQueueCreate(Device,
+			&ClassQueueConfig,
+			&ClassQueueAttributes,
+			&DevExt->ClassQueues[Index].Queue);
+
+		if (!NT_SUCCESS(status)) {
+			EspDbgPrintlEx(0, "ESP KMD TZ", "Class %d WdfIoQueueCreate() failed. 0x%x", Index, status);
+			EspDbgPrintlEx(
+				9,
+				"ESP KMD TZ",
+				"File: %s, Line: %d, Function: %s <<<",
+				"Icaros_KMD_ESP_TZ_Queue.c",
+				98,
+				"CameraESPTZQueueInitialize");
+
+			return status;
+		}
+	}
+
 	//
 	// Configure a manual dispatch queue for pending requests. This queue
 	// stores requests to read the sensor state which can't be retired
@@ -178,6 +324,7 @@ Return Value:
 		WdfIoQueueDispatchManual);
 
 	PendingRequestQueueConfig.EvtIoStop = CameraESPTZEvtIoStop;
+	PendingRequestQueueConfig.EvtIoCanceledOnQueue = CameraESPTZEvtPendingRequestCanceled;
 
 	status = WdfIoQueueCreate(Device,
 		&PendingRequestQueueConfig,
@@ -197,16 +344,83 @@ Return Value:
 		return status;
 	}
 
-	status = WdfWaitLockCreate(NULL, &DevExt->QueueLock);
+	InitializeListHead(&DevExt->ClientList);
+	CameraESPTZClientInitialize(&DevExt->DefaultClient);
+	InsertTailList(&DevExt->ClientList, &DevExt->DefaultClient.Link);
+	DevExt->ClientWaiterQuota = ESP_TZ_CLIENT_DEFAULT_WAITER_QUOTA;
+
+	CameraESPTZLockInitialize(&DevExt->QueueLock);
+
+	status = CameraESPTZStatsInitialize(Device, &DevExt->Stats);
 
 	if (!NT_SUCCESS(status)) {
-		EspDbgPrintlEx(0, "ESP KMD TZ", "Queue lock: WdfWaitLockCreate() failed. 0x%x", status);
+		EspDbgPrintlEx(0, "ESP KMD TZ", "CameraESPTZStatsInitialize() failed. 0x%x", status);
 		EspDbgPrintlEx(
 			9,
 			"ESP KMD TZ",
 			"File: %s, Line: %d, Function: %s <<<",
 			"Icaros_KMD_ESP_TZ_Queue.c",
-			121,
+			134,
+			"CameraESPTZQueueInitialize");
+
+		return status;
+	}
+
+	status = CameraESPTZRecorderInitialize(Device, &DevExt->Recorder);
+
+	if (!NT_SUCCESS(status)) {
+		EspDbgPrintlEx(0, "ESP KMD TZ", "CameraESPTZRecorderInitialize() failed. 0x%x", status);
+		EspDbgPrintlEx(
+			9,
+			"ESP KMD TZ",
+			"File: %s, Line: %d, Function: %s <<<",
+			"Icaros_KMD_ESP_TZ_Queue.c",
+			147,
+			"CameraESPTZQueueInitialize");
+
+		return status;
+	}
+
+	status = CameraESPTZCacheInitialize(Device, &DevExt->Cache);
+
+	if (!NT_SUCCESS(status)) {
+		EspDbgPrintlEx(0, "ESP KMD TZ", "CameraESPTZCacheInitialize() failed. 0x%x", status);
+		EspDbgPrintlEx(
+			9,
+			"ESP KMD TZ",
+			"File: %s, Line: %d, Function: %s <<<",
+			"Icaros_KMD_ESP_TZ_Queue.c",
+			160,
+			"CameraESPTZQueueInitialize");
+
+		return status;
+	}
+
+	status = CameraESPTZHistoryInitialize(Device, &DevExt->History);
+
+	if (!NT_SUCCESS(status)) {
+		EspDbgPrintlEx(0, "ESP KMD TZ", "CameraESPTZHistoryInitialize() failed. 0x%x", status);
+		EspDbgPrintlEx(
+			9,
+			"ESP KMD TZ",
+			"File: %s, Line: %d, Function: %s <<<",
+			"Icaros_KMD_ESP_TZ_Queue.c",
+			173,
+			"CameraESPTZQueueInitialize");
+
+		return status;
+	}
+
+	status = CameraESPTZMailboxInitialize(Device, &DevExt->Mailbox);
+
+	if (!NT_SUCCESS(status)) {
+		EspDbgPrintlEx(0, "ESP KMD TZ", "CameraESPTZMailboxInitialize() failed. 0x%x", status);
+		EspDbgPrintlEx(
+			9,
+			"ESP KMD TZ",
+			"File: %s, Line: %d, Function: %s <<<",
+			"Icaros_KMD_ESP_TZ_Queue.c",
+			186,
 			"CameraESPTZQueueInitialize");
 
 		return status;
@@ -229,6 +443,9 @@ Routine Description:
 
 	This event is invoked when the framework receives IRP_MJ_DEVICE_CONTROL request.
 
+	Handled IOCTLs are validated here and forwarded to the queue of their
+	class, which runs the handler. Anything else is forwarded down.
+
 Arguments:
 
 	Queue -  Handle to the framework queue object that is associated with the
@@ -248,13 +465,16 @@ Return Value:
 
 --*/
 {
+	PESP_TZ_CLASS_QUEUE ClassQueue;
+	PESP_TZ_REQUEST_CONTEXT Context;
+	LONG Depth;
 	WDFDEVICE Device;
-	int Status;
-	WDFIOTARGET Target;
-	WDF_REQUEST_SEND_OPTIONS Options;
-
-	UNREFERENCED_PARAMETER(InputBufferLength);
-	UNREFERENCED_PARAMETER(OutputBufferLength);
+	PFDO_DATA DevExt;
+	const ESP_TZ_IOCTL_ENTRY* Entry;
+	LONG MaximumDepth;
+	ULONG64 QpcTimeStamp;
+	ULONG Slot;
+	NTSTATUS Status;
 
 	EspDbgPrintlEx(
 		9,
@@ -264,38 +484,62 @@ Return Value:
 		172,
 		"CameraESPTZEvtIoDeviceControl");
 	Device = WdfIoQueueGetDevice(Queue);
-	if (IoControlCode > 0x222408)
+	DevExt = GetDeviceExtension(Device);
+
+	Slot = CameraESPTZLookupIoctl(IoControlCode);
+	InterlockedIncrement64(&DevExt->IoctlCounters[Slot].Requests);
+	if (Slot != ESP_TZ_IOCTL_SLOT_FORWARDED)
 	{
-		if (IoControlCode == 2703504)
+		Entry = &CameraESPTZIoctlTable[Slot];
+		if ((InputBufferLength < Entry->InputBufferLength) ||
+			(OutputBufferLength < Entry->OutputBufferLength))
 		{
-			CameraESPTZAddReadRequest(Device, Request);
-			goto LABEL_13;
+			Status = STATUS_BUFFER_TOO_SMALL;
+			goto RejectRequest;
 		}
-	}
-	else
-	{
-		switch (IoControlCode)
+
+		//
+		// Hand the request to the queue of its class. The depth is taken
+		// before forwarding, so a class at its limit is refused here and
+		// never holds up the other classes.
+		//
+
+		ClassQueue = &DevExt->ClassQueues[Entry->QueueClass];
+		Depth = InterlockedIncrement(&ClassQueue->Depth);
+		if ((ClassQueue->DepthLimit != 0) && ((ULONG)Depth > ClassQueue->DepthLimit))
 		{
-		case 0x222408u:
-			CameraESPTZCameraOffNotification(Device, Request);
-			goto LABEL_13;
-		case 0x222400u:
-			CameraESPTZSetTemperature(Device, Request);
-			goto LABEL_13;
-		case 0x222404u:
-			CameraESPTZCameraOnNotification(Device, Request);
-			goto LABEL_13;
+			InterlockedDecrement(&ClassQueue->Depth);
+			InterlockedIncrement64(&ClassQueue->Rejected);
+			Status = STATUS_DEVICE_BUSY;
+			goto RejectRequest;
 		}
-	}
-	WDF_REQUEST_SEND_OPTIONS_INIT(&Options, 8u);
-	WdfRequestFormatRequestUsingCurrentType(Request);
-	Target = WdfDeviceGetIoTarget(Device);
-	if (WdfRequestSend(Request, Target, &Options) == FALSE)
-	{
-		Status = WdfRequestGetStatus(Request);
-		EspDbgPrintlEx(0, "ESP KMD TZ", "WdfRequestSend() Failed. Request Status = 0x%x\n", Status);
+
+		MaximumDepth = ReadNoFence(&ClassQueue->MaximumDepth);
+		while (Depth > MaximumDepth)
+		{
+			MaximumDepth = InterlockedCompareExchange(&ClassQueue->MaximumDepth, Depth, MaximumDepth);
+		}
+
+		Context = WdfObjectGetTypedContext(Request, ESP_TZ_REQUEST_CONTEXT);
+		Context->ForwardTime = KeQueryInterruptTimePrecise(&QpcTimeStamp);
+		Status = WdfRequestForwardToIoQueue(Request, ClassQueue->Queue);
+		if (!NT_SUCCESS(Status))
+		{
+			EspDbgPrintlEx(0, "ESP KMD TZ", "WdfRequestForwardToIoQueue() Failed. 0x%x", Status);
+			InterlockedDecrement(&ClassQueue->Depth);
+			goto RejectRequest;
+		}
+
+		goto LABEL_13;
+
+	RejectRequest:
+		EspDbgPrintlEx(0, "ESP KMD TZ", "IOCTL 0x%x rejected. In %Iu, Out %Iu, Status 0x%x", IoControlCode, InputBufferLength, OutputBufferLength, Status);
+		InterlockedIncrement64(&DevExt->IoctlCounters[Slot].Rejected);
 		WdfRequestComplete(Request, Status);
+		goto LABEL_13;
 	}
+
+	CameraESPTZForwardRequest(Device, Request, IoControlCode);
 LABEL_13:
 	EspDbgPrintlEx(
 		9,
@@ -306,6 +550,233 @@ LABEL_13:
 		"CameraESPTZEvtIoDeviceControl");
 }
 
+VOID
+CameraESPTZEvtClassIoDeviceControl(
+	_In_ WDFQUEUE Queue,
+	_In_ WDFREQUEST Request,
+	_In_ size_t OutputBufferLength,
+	_In_ size_t InputBufferLength,
+	_In_ ULONG IoControlCode
+)
+/*++
+
+Routine Description:
+
+	This event is invoked when a class queue dispatches a request forwarded
+	to it by CameraESPTZEvtIoDeviceControl, which has already validated it.
+	It accounts the time the request waited in the queue and runs the
+	handler. The class queues run at passive level, so the IRQL check of
+	the dispatch table only catches a queue created without it.
+
+Arguments:
+
+	Queue -  Handle to the class queue.
+
+	Request - Handle to a framework request object.
+
+	OutputBufferLength - Size of the output buffer in bytes
+
+	InputBufferLength - Size of the input buffer in bytes
+
+	IoControlCode - I/O control code.
+
+Return Value:
+
+	VOID
+
+--*/
+{
+	ULONG Bucket;
+	PESP_TZ_CLASS_QUEUE ClassQueue;
+	PESP_TZ_REQUEST_CONTEXT Context;
+	WDFDEVICE Device;
+	PFDO_DATA DevExt;
+	const ESP_TZ_IOCTL_ENTRY* Entry;
+	LONG64 MaximumWaitTime;
+	ULONG64 QpcTimeStamp;
+	ULONG Slot;
+	ULONGLONG StartTime;
+	ULONGLONG WaitTime;
+
+	UNREFERENCED_PARAMETER(OutputBufferLength);
+	UNREFERENCED_PARAMETER(InputBufferLength);
+
+	Device = WdfIoQueueGetDevice(Queue);
+	DevExt = GetDeviceExtension(Device);
+	Slot = CameraESPTZLookupIoctl(IoControlCode);
+	Entry = &CameraESPTZIoctlTable[Slot];
+	ClassQueue = &DevExt->ClassQueues[Entry->QueueClass];
+
+	NT_ASSERT(KeGetCurrentIrql() <= Entry->MaximumIrql);
+	if (KeGetCurrentIrql() > Entry->MaximumIrql) {
+		EspDbgPrintlEx(0, "ESP KMD TZ", "IOCTL 0x%x dispatched at IRQL %d.", IoControlCode, KeGetCurrentIrql());
+		InterlockedIncrement64(&DevExt->IoctlCounters[Slot].Rejected);
+		InterlockedDecrement(&ClassQueue->Depth);
+		WdfRequestComplete(Request, STATUS_INVALID_DEVICE_STATE);
+		return;
+	}
+
+	StartTime = KeQueryInterruptTimePrecise(&QpcTimeStamp);
+	Context = WdfObjectGetTypedContext(Request, ESP_TZ_REQUEST_CONTEXT);
+	WaitTime = StartTime - Context->ForwardTime;
+	MaximumWaitTime = ReadNoFence64(&ClassQueue->MaximumWaitTime);
+	while ((LONG64)WaitTime > MaximumWaitTime) {
+		MaximumWaitTime = InterlockedCompareExchange64(&ClassQueue->MaximumWaitTime,
+			(LONG64)WaitTime,
+			MaximumWaitTime);
+	}
+
+	Bucket = (ULONG)(RtlFindMostSignificantBit(WaitTime) + 1);
+	if (Bucket >= ESP_TZ_LATENCY_BUCKETS) {
+		Bucket = ESP_TZ_LATENCY_BUCKETS - 1;
+	}
+
+	InterlockedIncrementNoFence64(&ClassQueue->WaitTimes[Bucket]);
+	InterlockedIncrementNoFence64(&ClassQueue->Dispatched);
+
+	CameraESPTZRecorderLogRequest(&DevExt->Recorder, Slot, Request);
+	Entry->Handler(Device, Request);
+	CameraESPTZStatsRecordLatency(&DevExt->Stats,
+		Slot,
+		EspTzLatencyService,
+		KeQueryInterruptTimePrecise(&QpcTimeStamp) - StartTime);
+
+	InterlockedDecrement(&ClassQueue->Depth);
+}
+
+VOID
+CameraESPTZEvtClassIoCanceledOnQueue(
+	_In_ WDFQUEUE Queue,
+	_In_ WDFREQUEST Request
+)
+
+/*++
+
+Routine Description:
+
+	This routine is invoked when a request is cancelled, or purged, while it
+	waits in a class queue. It releases the depth the request took when it
+	was forwarded.
+
+Arguments:
+
+	Queue - Supplies a handle to the class queue.
+
+	Request - Supplies a handle to the cancelled request.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	PFDO_DATA DevExt;
+	WDF_REQUEST_PARAMETERS Parameters;
+	ULONG Slot;
+
+	DevExt = GetDeviceExtension(WdfIoQueueGetDevice(Queue));
+	WDF_REQUEST_PARAMETERS_INIT(&Parameters);
+	WdfRequestGetParameters(Request, &Parameters);
+	Slot = CameraESPTZLookupIoctl(Parameters.Parameters.DeviceIoControl.IoControlCode);
+	InterlockedDecrement(&DevExt->ClassQueues[CameraESPTZIoctlTable[Slot].QueueClass].Depth);
+
+	WdfRequestComplete(Request, STATUS_CANCELLED);
+}
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+CameraESPTZQueryQueueStatistics(
+	_In_ WDFDEVICE Device,
+	_In_ WDFREQUEST Request
+)
+
+/*++
+
+Routine Description:
+
+	This routine handles IOCTL_ESP_TZ_QUERY_QUEUE_STATISTICS. The counters
+	are read without a lock, so they are not a snapshot.
+
+Arguments:
+
+	Device - Supplies a handle to the device.
+
+	Request - Supplies a handle to the request.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	PVOID Buffer;
+	size_t BytesReturned;
+	PESP_TZ_CLASS_QUEUE ClassQueue;
+	PESP_TZ_QUEUE_COUNTERS Counters;
+	PFDO_DATA DevExt;
+	ULONG Index;
+	size_t Length;
+	ESP_TZ_QUEUE_STATISTICS Statistics;
+	NTSTATUS Status;
+
+	PAGED_CODE();
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s >>>",
+		"Icaros_KMD_ESP_TZ_Queue.c",
+		318,
+		"CameraESPTZQueryQueueStatistics");
+
+	DevExt = GetDeviceExtension(Device);
+	BytesReturned = 0;
+	Status = WdfRequestRetrieveOutputBuffer(Request,
+		FIELD_OFFSET(ESP_TZ_QUEUE_STATISTICS, Queues),
+		&Buffer,
+		&Length);
+
+	if (!NT_SUCCESS(Status)) {
+		EspDbgPrintlEx(0, "ESP KMD TZ", "WdfRequestRetrieveOutputBuffer() Failed. 0x%x", Status);
+		goto QueryQueueStatisticsEnd;
+	}
+
+	RtlZeroMemory(&Statistics, sizeof(Statistics));
+	Statistics.Version = ESP_TZ_QUEUE_STATISTICS_VERSION;
+	Statistics.Size = sizeof(ESP_TZ_QUEUE_STATISTICS);
+	Statistics.QueueCount = EspTzQueueClassMaximum;
+	for (Index = 0; Index < EspTzQueueClassMaximum; Index += 1) {
+		ClassQueue = &DevExt->ClassQueues[Index];
+		Counters = &Statistics.Queues[Index];
+		Counters->Depth = (ULONG)ReadNoFence(&ClassQueue->Depth);
+		Counters->MaximumDepth = (ULONG)ReadNoFence(&ClassQueue->MaximumDepth);
+		Counters->DepthLimit = ClassQueue->DepthLimit;
+		Counters->Dispatched = (ULONGLONG)ClassQueue->Dispatched;
+		Counters->Rejected = (ULONGLONG)ClassQueue->Rejected;
+		Counters->MaximumWaitTime = (ULONGLONG)ClassQueue->MaximumWaitTime;
+		RtlCopyMemory(Counters->WaitTimes,
+			(PVOID)ClassQueue->WaitTimes,
+			sizeof(Counters->WaitTimes));
+	}
+
+	BytesReturned = min(Length, sizeof(ESP_TZ_QUEUE_STATISTICS));
+	RtlCopyMemory(Buffer, &Statistics, BytesReturned);
+
+QueryQueueStatisticsEnd:
+
+	WdfRequestCompleteWithInformation(Request, Status, BytesReturned);
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s <<<",
+		"Icaros_KMD_ESP_TZ_Queue.c",
+		364,
+		"CameraESPTZQueryQueueStatistics");
+}
+
 VOID
 CameraESPTZEvtIoStop(
 	_In_ WDFQUEUE Queue,
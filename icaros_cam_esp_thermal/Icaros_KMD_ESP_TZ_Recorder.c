@@ -0,0 +1,587 @@
+/*++
+
+Module Name:
+
+	recorder.c
+
+Abstract:
+
+	This file contains the IOCTL stream recorder. When started it captures
+	every sample push, read request and camera notification with its
+	interrupt time, so a production workload can be drained from the device
+	and replayed offline.
+
+Environment:
+
+	Kernel-mode Driver Framework
+
+--*/
+
+#include "Device.h"
+#include "Debug.h"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, CameraESPTZRecorderInitialize)
+#endif
+
+NTSTATUS
+CameraESPTZRecorderInitialize(
+	_In_ WDFDEVICE Device,
+	_Out_ PESP_TZ_RECORDER Recorder
+)
+
+/*++
+
+Routine Description:
+
+	This routine initializes a stopped, empty recorder with the default
+	capacity. The capacity may be changed before the first start.
+
+Arguments:
+
+	Device - Supplies a handle to the device.
+
+	Recorder - Supplies the recorder to initialize.
+
+Return Value:
+
+	NTSTATUS.
+
+--*/
+
+{
+	WDF_OBJECT_ATTRIBUTES Attributes;
+	NTSTATUS Status;
+
+	PAGED_CODE();
+
+	RtlZeroMemory(Recorder, sizeof(*Recorder));
+	Recorder->Capacity = ESP_TZ_RECORDER_DEFAULT_CAPACITY;
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&Attributes);
+	Attributes.ParentObject = Device;
+	Status = WdfSpinLockCreate(&Attributes, &Recorder->Lock);
+	if (!NT_SUCCESS(Status)) {
+		EspDbgPrintlEx(0, "ESP KMD TZ", "Recorder WdfSpinLockCreate() Failed. 0x%x", Status);
+	}
+
+	return Status;
+}
+
+static
+NTSTATUS
+CameraESPTZRecorderAllocate(
+	_In_ WDFDEVICE Device,
+	_Inout_ PESP_TZ_RECORDER Recorder
+)
+
+/*++
+
+Routine Description:
+
+	This routine allocates the record storage if it is not present yet.
+
+Arguments:
+
+	Device - Supplies a handle to the device.
+
+	Recorder - Supplies the recorder.
+
+Return Value:
+
+	NTSTATUS.
+
+--*/
+
+{
+	WDF_OBJECT_ATTRIBUTES Attributes;
+	PVOID Buffer;
+	ULONG Capacity;
+	WDFMEMORY Memory;
+	NTSTATUS Status;
+
+	if (Recorder->Records != NULL) {
+		return STATUS_SUCCESS;
+	}
+
+	Capacity = Recorder->Capacity;
+	WDF_OBJECT_ATTRIBUTES_INIT(&Attributes);
+	Attributes.ParentObject = Device;
+	Status = WdfMemoryCreate(&Attributes,
+		NonPagedPoolNx,
+		0,
+		(size_t)Capacity * sizeof(ESP_TZ_TRACE_RECORD),
+		&Memory,
+		&Buffer);
+
+	if (!NT_SUCCESS(Status)) {
+		EspDbgPrintlEx(0, "ESP KMD TZ", "Recorder WdfMemoryCreate() Failed. 0x%x", Status);
+		return Status;
+	}
+
+	//
+	// Concurrent starts may both allocate; the first one to publish wins.
+	//
+
+	WdfSpinLockAcquire(Recorder->Lock);
+	if (Recorder->Records == NULL) {
+		Recorder->Memory = Memory;
+		Recorder->Records = (PESP_TZ_TRACE_RECORD)Buffer;
+		Recorder->Size = Capacity;
+		Recorder->Head = 0;
+		Recorder->Count = 0;
+		Memory = NULL;
+	}
+
+	WdfSpinLockRelease(Recorder->Lock);
+
+	if (Memory != NULL) {
+		WdfObjectDelete(Memory);
+	}
+
+	return STATUS_SUCCESS;
+}
+
+static
+VOID
+CameraESPTZRecorderAppend(
+	_Inout_ PESP_TZ_RECORDER Recorder,
+	_Inout_ PESP_TZ_TRACE_RECORD Record
+)
+
+/*++
+
+Routine Description:
+
+	This routine appends a record to the ring, or counts it as dropped when
+	the ring is full. A record is never stamped before the newest one, so
+	the trace stays in order for the replay, which paces every record from
+	the first one.
+
+	N.B. The caller holds the recorder lock.
+
+Arguments:
+
+	Recorder - Supplies the recorder.
+
+	Record - Supplies the record. Its timestamp may be moved forward.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	if ((Recorder->Enabled == 0) || (Recorder->Records == NULL)) {
+		return;
+	}
+
+	if (Recorder->Count < Recorder->Size) {
+		Record->Timestamp = max(Record->Timestamp, Recorder->LastTimestamp);
+		Recorder->LastTimestamp = Record->Timestamp;
+		Recorder->Records[(Recorder->Head + Recorder->Count) % Recorder->Size] = *Record;
+		Recorder->Count += 1;
+
+	} else {
+		Recorder->Dropped += 1;
+	}
+}
+
+static
+VOID
+CameraESPTZRecorderLogBatch(
+	_In_ PESP_TZ_RECORDER Recorder,
+	_In_ WDFREQUEST Request
+)
+
+/*++
+
+Routine Description:
+
+	This routine appends one set temperature record per sample of an
+	IOCTL_ESP_TZ_SET_TEMPERATURES batch, stamped with the time the sample
+	will be published at. A batch the handler will reject is not recorded.
+
+Arguments:
+
+	Recorder - Supplies the recorder.
+
+	Request - Supplies a handle to the request.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	PESP_TZ_SAMPLE_BATCH Batch;
+	ULONG Count;
+	ULONGLONG CurrentTime;
+	ULONG Index;
+	size_t Length;
+	ULONGLONG Previous;
+	ULONG64 QpcTimeStamp;
+	ESP_TZ_TRACE_RECORD Record;
+	NTSTATUS Status;
+
+	Status = WdfRequestRetrieveInputBuffer(Request,
+		FIELD_OFFSET(ESP_TZ_SAMPLE_BATCH, Samples),
+		&Batch,
+		&Length);
+
+	if (!NT_SUCCESS(Status)) {
+		return;
+	}
+
+	Count = Batch->Count;
+	if ((Batch->Version != ESP_TZ_SAMPLE_BATCH_VERSION) ||
+		(Count == 0) ||
+		(Count > ESP_TZ_MAX_BATCH_SAMPLES) ||
+		(Length < FIELD_OFFSET(ESP_TZ_SAMPLE_BATCH, Samples) + (size_t)Count * sizeof(ESP_TZ_TIMED_SAMPLE))) {
+
+		return;
+	}
+
+	//
+	// Resolve the timestamps the way CameraESPTZSetTemperatures does: zero
+	// and future ones are the time of the call.
+	//
+
+	CurrentTime = KeQueryInterruptTimePrecise(&QpcTimeStamp);
+	Previous = 0;
+	for (Index = 0; Index < Count; Index += 1) {
+		if ((Batch->Samples[Index].Timestamp != 0) &&
+			(Batch->Samples[Index].Timestamp <= CurrentTime)) {
+
+			if (Batch->Samples[Index].Timestamp < Previous) {
+				return;
+			}
+
+			Previous = Batch->Samples[Index].Timestamp;
+
+		} else {
+			Previous = CurrentTime;
+		}
+	}
+
+	RtlZeroMemory(&Record, sizeof(Record));
+	Record.Type = EspTzTraceSetTemperature;
+
+	WdfSpinLockAcquire(Recorder->Lock);
+	for (Index = 0; Index < Count; Index += 1) {
+		Record.Timestamp = Batch->Samples[Index].Timestamp;
+		if ((Record.Timestamp == 0) || (Record.Timestamp > CurrentTime)) {
+			Record.Timestamp = CurrentTime;
+		}
+
+		Record.Temperature = Batch->Samples[Index].Temperature;
+		CameraESPTZRecorderAppend(Recorder, &Record);
+	}
+
+	WdfSpinLockRelease(Recorder->Lock);
+}
+
+VOID
+CameraESPTZRecorderLogRequest(
+	_In_ PESP_TZ_RECORDER Recorder,
+	_In_ ULONG Slot,
+	_In_ WDFREQUEST Request
+)
+
+/*++
+
+Routine Description:
+
+	This routine appends a record for a validated request about to be
+	dispatched. Requests that are not part of the sensor workload are not
+	recorded. When the recorder is stopped this is a single read.
+
+	A batch is recorded as one set temperature per sample. A multi-wait
+	is recorded as the read it is pended as: the union of its conditions'
+	bounds with the earliest timeout.
+
+Arguments:
+
+	Recorder - Supplies the recorder.
+
+	Slot - Supplies the IOCTL dispatch slot of the request.
+
+	Request - Supplies a handle to the request.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	PVOID Buffer;
+	ULONG Index;
+	size_t Length;
+	PESP_TZ_MULTI_WAIT MultiWait;
+	ULONG64 QpcTimeStamp;
+	ESP_TZ_TRACE_RECORD Record;
+	NTSTATUS Status;
+	PTHERMAL_WAIT_READ ThermalWaitRead;
+
+	if (Recorder->Enabled == 0) {
+		return;
+	}
+
+	RtlZeroMemory(&Record, sizeof(Record));
+	switch (Slot) {
+	case ESP_TZ_IOCTL_SLOT_READ_TEMPERATURE:
+		Status = WdfRequestRetrieveInputBuffer(Request, sizeof(THERMAL_WAIT_READ), &Buffer, NULL);
+		if (!NT_SUCCESS(Status)) {
+			return;
+		}
+
+		ThermalWaitRead = (PTHERMAL_WAIT_READ)Buffer;
+		Record.Type = EspTzTraceRead;
+		Record.Temperature = ThermalWaitRead->LowTemperature;
+		Record.HighTemperature = ThermalWaitRead->HighTemperature;
+		Record.Timeout = ThermalWaitRead->Timeout;
+		break;
+
+	case ESP_TZ_IOCTL_SLOT(IOCTL_ESP_TZ_MULTI_WAIT):
+		Status = WdfRequestRetrieveInputBuffer(Request,
+			FIELD_OFFSET(ESP_TZ_MULTI_WAIT, Conditions),
+			&Buffer,
+			&Length);
+
+		if (!NT_SUCCESS(Status)) {
+			return;
+		}
+
+		MultiWait = (PESP_TZ_MULTI_WAIT)Buffer;
+		if ((MultiWait->Version != ESP_TZ_MULTI_WAIT_VERSION) ||
+			(MultiWait->Count == 0) ||
+			(MultiWait->Count > ESP_TZ_MAX_WAIT_CONDITIONS) ||
+			(Length < FIELD_OFFSET(ESP_TZ_MULTI_WAIT, Conditions) + (size_t)MultiWait->Count * sizeof(ESP_TZ_WAIT_CONDITION))) {
+
+			return;
+		}
+
+		Record.Type = EspTzTraceRead;
+		Record.HighTemperature = (ULONG)-1;
+		Record.Timeout = (ULONG)-1 /* INFINITE */;
+		for (Index = 0; Index < MultiWait->Count; Index += 1) {
+			Record.Temperature = max(Record.Temperature, MultiWait->Conditions[Index].LowTemperature);
+			Record.HighTemperature = min(Record.HighTemperature, MultiWait->Conditions[Index].HighTemperature);
+			Record.Timeout = min(Record.Timeout, MultiWait->Conditions[Index].Timeout);
+		}
+
+		break;
+
+	case ESP_TZ_IOCTL_SLOT(IOCTL_ESP_TZ_SET_TEMPERATURE):
+		Status = WdfRequestRetrieveInputBuffer(Request, sizeof(ULONG), &Buffer, NULL);
+		if (!NT_SUCCESS(Status)) {
+			return;
+		}
+
+		Record.Type = EspTzTraceSetTemperature;
+		Record.Temperature = *(PULONG)Buffer;
+		break;
+
+	case ESP_TZ_IOCTL_SLOT(IOCTL_ESP_TZ_SET_TEMPERATURES):
+		CameraESPTZRecorderLogBatch(Recorder, Request);
+		return;
+
+	case ESP_TZ_IOCTL_SLOT(IOCTL_ESP_TZ_CAMERA_ON):
+		Record.Type = EspTzTraceCameraOn;
+		break;
+
+	case ESP_TZ_IOCTL_SLOT(IOCTL_ESP_TZ_CAMERA_OFF):
+		Record.Type = EspTzTraceCameraOff;
+		break;
+
+	default:
+		return;
+	}
+
+	Record.Timestamp = KeQueryInterruptTimePrecise(&QpcTimeStamp);
+
+	WdfSpinLockAcquire(Recorder->Lock);
+	CameraESPTZRecorderAppend(Recorder, &Record);
+	WdfSpinLockRelease(Recorder->Lock);
+}
+
+VOID
+CameraESPTZRecorderControl(
+	_In_ WDFDEVICE Device,
+	_In_ WDFREQUEST Request
+)
+
+/*++
+
+Routine Description:
+
+	This routine handles IOCTL_ESP_TZ_RECORDER_CONTROL.
+
+Arguments:
+
+	Device - Supplies a handle to the device.
+
+	Request - Supplies a handle to the request.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	PULONG Action;
+	PFDO_DATA DevExt;
+	PESP_TZ_RECORDER Recorder;
+	NTSTATUS Status;
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s >>>",
+		"Icaros_KMD_ESP_TZ_Recorder.c",
+		266,
+		"CameraESPTZRecorderControl");
+
+	DevExt = GetDeviceExtension(Device);
+	Recorder = &DevExt->Recorder;
+	Status = WdfRequestRetrieveInputBuffer(Request, sizeof(ULONG), &Action, NULL);
+	if (!NT_SUCCESS(Status)) {
+		EspDbgPrintlEx(0, "ESP KMD TZ", "WdfRequestRetrieveInputBuffer() Failed. 0x%x", Status);
+		goto RecorderControlEnd;
+	}
+
+	switch (*Action) {
+	case ESP_TZ_RECORDER_START:
+		Status = CameraESPTZRecorderAllocate(Device, Recorder);
+		if (NT_SUCCESS(Status)) {
+			InterlockedExchange(&Recorder->Enabled, 1);
+		}
+
+		break;
+
+	case ESP_TZ_RECORDER_STOP:
+		InterlockedExchange(&Recorder->Enabled, 0);
+		break;
+
+	case ESP_TZ_RECORDER_CLEAR:
+		WdfSpinLockAcquire(Recorder->Lock);
+		Recorder->Head = 0;
+		Recorder->Count = 0;
+		Recorder->Dropped = 0;
+		WdfSpinLockRelease(Recorder->Lock);
+		break;
+
+	default:
+		Status = STATUS_INVALID_PARAMETER;
+		break;
+	}
+
+	EspDbgPrintlEx(9, "ESP KMD TZ", "%s : Action %lu, Status 0x%x", "CameraESPTZRecorderControl", *Action, Status);
+
+RecorderControlEnd:
+
+	WdfRequestComplete(Request, Status);
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s <<<",
+		"Icaros_KMD_ESP_TZ_Recorder.c",
+		318,
+		"CameraESPTZRecorderControl");
+}
+
+VOID
+CameraESPTZRecorderRead(
+	_In_ WDFDEVICE Device,
+	_In_ WDFREQUEST Request
+)
+
+/*++
+
+Routine Description:
+
+	This routine handles IOCTL_ESP_TZ_RECORDER_READ. As many of the oldest
+	records as fit in the output buffer are moved into it.
+
+Arguments:
+
+	Device - Supplies a handle to the device.
+
+	Request - Supplies a handle to the request.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	PESP_TZ_TRACE_BUFFER Buffer;
+	ULONG Count;
+	PFDO_DATA DevExt;
+	ULONG Index;
+	size_t Length;
+	PESP_TZ_RECORDER Recorder;
+	NTSTATUS Status;
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s >>>",
+		"Icaros_KMD_ESP_TZ_Recorder.c",
+		350,
+		"CameraESPTZRecorderRead");
+
+	DevExt = GetDeviceExtension(Device);
+	Recorder = &DevExt->Recorder;
+	Length = 0;
+	Status = WdfRequestRetrieveOutputBuffer(Request,
+		FIELD_OFFSET(ESP_TZ_TRACE_BUFFER, Records),
+		&Buffer,
+		&Length);
+
+	if (!NT_SUCCESS(Status)) {
+		EspDbgPrintlEx(0, "ESP KMD TZ", "WdfRequestRetrieveOutputBuffer() Failed. 0x%x", Status);
+		Length = 0;
+		goto RecorderReadEnd;
+	}
+
+	Count = (ULONG)min((Length - FIELD_OFFSET(ESP_TZ_TRACE_BUFFER, Records)) /
+		sizeof(ESP_TZ_TRACE_RECORD), MAXULONG);
+
+	WdfSpinLockAcquire(Recorder->Lock);
+	if (Count > Recorder->Count) {
+		Count = Recorder->Count;
+	}
+
+	for (Index = 0; Index < Count; Index += 1) {
+		Buffer->Records[Index] = Recorder->Records[Recorder->Head];
+		Recorder->Head = (Recorder->Head + 1) % Recorder->Size;
+	}
+
+	Recorder->Count -= Count;
+	Buffer->Dropped = Recorder->Dropped;
+	Recorder->Dropped = 0;
+	WdfSpinLockRelease(Recorder->Lock);
+
+	Buffer->Version = ESP_TZ_TRACE_VERSION;
+	Buffer->Count = Count;
+	Length = FIELD_OFFSET(ESP_TZ_TRACE_BUFFER, Records) + (size_t)Count * sizeof(ESP_TZ_TRACE_RECORD);
+
+RecorderReadEnd:
+
+	WdfRequestCompleteWithInformation(Request, Status, Length);
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s <<<",
+		"Icaros_KMD_ESP_TZ_Recorder.c",
+		401,
+		"CameraESPTZRecorderRead");
+}
@@ -0,0 +1,303 @@
+/*++
+
+Module Name:
+
+	scheduler.c
+
+Abstract:
+
+	This file contains the pending queue scan scheduler.
+
+	Queued reads, virtual interrupts and the deadline timer all need the
+	pending queue scanned, and under load they arrive in bursts. Rather
+	than each taking the QueueLock for a scan of its own, they raise a
+	reason with the scheduler. At most one scan runs per quantum, doing
+	the work of every reason raised since the previous one.
+
+Environment:
+
+	Kernel-mode Driver Framework
+
+--*/
+
+#include "Device.h"
+#include "Debug.h"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, CameraESPTZSchedulerInitialize)
+#endif
+
+NTSTATUS
+CameraESPTZSchedulerInitialize(
+	_In_ WDFDEVICE Device
+)
+
+/*++
+
+Routine Description:
+
+	This routine creates the timer that runs deferred scans. The quantum
+	is read with the rest of the configuration.
+
+Arguments:
+
+	Device - Supplies a handle to the device.
+
+Return Value:
+
+	NTSTATUS.
+
+--*/
+
+{
+	PFDO_DATA DevExt;
+	NTSTATUS Status;
+	WDF_OBJECT_ATTRIBUTES TimerAttributes;
+	WDF_TIMER_CONFIG TimerConfig;
+
+	PAGED_CODE();
+
+	DevExt = GetDeviceExtension(Device);
+	DevExt->Scheduler.Reasons = 0;
+	DevExt->Scheduler.LastScanTime = 0;
+
+	//
+	// In low-latency mode the timer only hands the scan to the notification
+	// thread, like the other device timers.
+	//
+
+	if (DevExt->LowLatency.Enabled != FALSE) {
+		WDF_TIMER_CONFIG_INIT(&TimerConfig, CameraESPTZEvtLowLatencyScanTimer);
+		WDF_OBJECT_ATTRIBUTES_INIT(&TimerAttributes);
+		TimerAttributes.ExecutionLevel = WdfExecutionLevelDispatch;
+
+	} else {
+		WDF_TIMER_CONFIG_INIT(&TimerConfig, CameraESPTZEvtScanTimer);
+		WDF_OBJECT_ATTRIBUTES_INIT(&TimerAttributes);
+		TimerAttributes.ExecutionLevel = WdfExecutionLevelPassive;
+	}
+
+	TimerAttributes.SynchronizationScope = WdfSynchronizationScopeNone;
+	TimerAttributes.ParentObject = Device;
+	Status = WdfTimerCreate(&TimerConfig,
+		&TimerAttributes,
+		&DevExt->Scheduler.Timer);
+
+	if (!NT_SUCCESS(Status)) {
+		EspDbgPrintlEx(0, "ESP KMD TZ", "Scan WdfTimerCreate() Failed. 0x%x", Status);
+	}
+
+	return Status;
+}
+
+VOID
+CameraESPTZRequestScan(
+	_In_ WDFDEVICE Device,
+	_In_ ESP_TZ_SCAN_TRIGGER Trigger
+)
+
+/*++
+
+Routine Description:
+
+	This routine raises a reason to scan the pending queue. If no scan is
+	scheduled yet, one is run right away when the quantum since the last
+	scan has passed, and at its end otherwise.
+
+	N.B. This routine must not be called with the QueueLock held.
+
+Arguments:
+
+	Device - Supplies a handle to the device.
+
+	Trigger - Supplies the event that needs the scan.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	ULONGLONG CurrentTime;
+	PFDO_DATA DevExt;
+	ULONGLONG DueTime;
+	PESP_TZ_SCAN_SCHEDULER Scheduler;
+
+	DevExt = GetDeviceExtension(Device);
+	Scheduler = &DevExt->Scheduler;
+	InterlockedIncrement64(&Scheduler->Requests);
+
+	if (InterlockedOr(&Scheduler->Reasons, ESP_TZ_SCAN_REASON(Trigger)) != 0) {
+
+		//
+		// A scan is already scheduled and has not started yet; it will do
+		// this work too.
+		//
+
+		InterlockedIncrement64(&Scheduler->Merged);
+		return;
+	}
+
+	CurrentTime = KeQueryInterruptTime();
+	DueTime = ReadULong64NoFence(&Scheduler->LastScanTime) + Scheduler->Quantum;
+	if (CurrentTime >= DueTime) {
+		CameraESPTZRunScan(Device);
+
+	} else {
+		InterlockedIncrement64(&Scheduler->Deferred);
+		WdfTimerStart(Scheduler->Timer, -(LONGLONG)(DueTime - CurrentTime));
+	}
+}
+
+VOID
+CameraESPTZDeferScan(
+	_In_ WDFDEVICE Device,
+	_In_ ESP_TZ_SCAN_TRIGGER Trigger
+)
+
+/*++
+
+Routine Description:
+
+	This routine raises a reason to scan the pending queue, like
+	CameraESPTZRequestScan, but never runs the scan on the calling thread.
+	If no scan is scheduled yet, the scan timer runs one at the end of the
+	quantum, or as soon as it can if the quantum has passed.
+
+	It may be called at any IRQL up to DISPATCH_LEVEL, and from framework
+	callbacks that can run with the QueueLock held.
+
+Arguments:
+
+	Device - Supplies a handle to the device.
+
+	Trigger - Supplies the event that needs the scan.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	ULONGLONG CurrentTime;
+	PFDO_DATA DevExt;
+	ULONGLONG DueTime;
+	PESP_TZ_SCAN_SCHEDULER Scheduler;
+
+	DevExt = GetDeviceExtension(Device);
+	Scheduler = &DevExt->Scheduler;
+	InterlockedIncrement64(&Scheduler->Requests);
+
+	if (InterlockedOr(&Scheduler->Reasons, ESP_TZ_SCAN_REASON(Trigger)) != 0) {
+		InterlockedIncrement64(&Scheduler->Merged);
+		return;
+	}
+
+	CurrentTime = KeQueryInterruptTime();
+	DueTime = ReadULong64NoFence(&Scheduler->LastScanTime) + Scheduler->Quantum;
+	InterlockedIncrement64(&Scheduler->Deferred);
+	WdfTimerStart(Scheduler->Timer,
+		(CurrentTime < DueTime) ? -(LONGLONG)(DueTime - CurrentTime) : -1);
+}
+
+VOID
+CameraESPTZRunScan(
+	_In_ WDFDEVICE Device
+)
+
+/*++
+
+Routine Description:
+
+	This routine runs the scheduled scan for every reason raised so far,
+	one slice per QueueLock hold.
+
+	While a scan is between slices, triggers that find no scan scheduled
+	may try to start one here. They leave their reasons for the thread
+	running the scan, which schedules another once it is done.
+
+Arguments:
+
+	Device - Supplies a handle to the device.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	ULONGLONG CurrentTime;
+	PFDO_DATA DevExt;
+	ULONGLONG DueTime;
+	LONG Reasons;
+	PESP_TZ_SCAN_SCHEDULER Scheduler;
+	BOOLEAN Sliced;
+	NTSTATUS Status;
+
+	DevExt = GetDeviceExtension(Device);
+	Scheduler = &DevExt->Scheduler;
+
+	for (;;) {
+		CameraESPTZAcquireQueueLock(DevExt);
+		if (DevExt->ScanCursor.Active != FALSE) {
+			CameraESPTZReleaseQueueLock(DevExt);
+			break;
+		}
+
+		//
+		// Reasons raised from here on schedule the next scan.
+		//
+
+		Sliced = FALSE;
+		Reasons = InterlockedExchange(&Scheduler->Reasons, 0);
+		if (Reasons != 0) {
+			Scheduler->LastScanTime = KeQueryInterruptTime();
+			Scheduler->Runs += 1;
+			Status = CameraESPTZScanPendingQueue(Device, (ULONG)Reasons);
+			while (Status == STATUS_MORE_PROCESSING_REQUIRED) {
+				Sliced = TRUE;
+				CameraESPTZReleaseQueueLock(DevExt);
+				CameraESPTZAcquireQueueLock(DevExt);
+				Status = CameraESPTZContinueScan(Device);
+			}
+		}
+
+		CameraESPTZReleaseQueueLock(DevExt);
+
+		if ((Sliced == FALSE) || (ReadNoFence(&Scheduler->Reasons) == 0)) {
+			break;
+		}
+
+		CurrentTime = KeQueryInterruptTime();
+		DueTime = ReadULong64NoFence(&Scheduler->LastScanTime) + Scheduler->Quantum;
+		if (CurrentTime < DueTime) {
+			InterlockedIncrement64(&Scheduler->Deferred);
+			WdfTimerStart(Scheduler->Timer, -(LONGLONG)(DueTime - CurrentTime));
+			break;
+		}
+	}
+}
+
+VOID
+CameraESPTZEvtScanTimer(
+	WDFTIMER Timer
+)
+
+/*++
+
+Routine Description:
+
+	This routine is invoked at the end of a quantum to run a deferred scan.
+
+Arguments:
+
+	Timer - Supplies a handle to the timer which expired.
+
+--*/
+
+{
+	CameraESPTZRunScan((WDFDEVICE)WdfTimerGetParentObject(Timer));
+}
@@ -0,0 +1,479 @@
+/*++
+
+Module Name:
+
+	stats.c
+
+Abstract:
+
+	This file contains the per-IOCTL latency histograms and the query that
+	reports them.
+
+	Latencies are measured in interrupt time (100ns units) and recorded into
+	log2 buckets of a per-processor block, so the hot path is one bit scan and
+	one uncontended increment.
+
+Environment:
+
+	Kernel-mode Driver Framework
+
+--*/
+
+#include "Device.h"
+#include "Debug.h"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, CameraESPTZStatsInitialize)
+#pragma alloc_text (PAGE, CameraESPTZQueryLatency)
+#pragma alloc_text (PAGE, CameraESPTZQueryScanStatistics)
+#pragma alloc_text (PAGE, CameraESPTZQueryLoadStatistics)
+#endif
+
+NTSTATUS
+CameraESPTZStatsInitialize(
+	_In_ WDFDEVICE Device,
+	_Out_ PESP_TZ_STATS Stats
+)
+
+/*++
+
+Routine Description:
+
+	This routine allocates one histogram block per possible processor. The
+	allocation is parented to the device and released with it.
+
+Arguments:
+
+	Device - Supplies a handle to the device.
+
+	Stats - Supplies the statistics to initialize.
+
+Return Value:
+
+	NTSTATUS.
+
+--*/
+
+{
+	WDF_OBJECT_ATTRIBUTES Attributes;
+	PVOID Buffer;
+	WDFMEMORY Memory;
+	ULONG ProcessorCount;
+	NTSTATUS Status;
+
+	PAGED_CODE();
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s >>>",
+		"Icaros_KMD_ESP_TZ_Stats.c",
+		68,
+		"CameraESPTZStatsInitialize");
+
+	Stats->ProcessorCount = 0;
+	Stats->Processors = NULL;
+
+	ProcessorCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&Attributes);
+	Attributes.ParentObject = Device;
+	Status = WdfMemoryCreate(&Attributes,
+		NonPagedPoolNx,
+		0,
+		ProcessorCount * sizeof(ESP_TZ_STATS_PROCESSOR),
+		&Memory,
+		&Buffer);
+
+	if (!NT_SUCCESS(Status)) {
+		EspDbgPrintlEx(0, "ESP KMD TZ", "WdfMemoryCreate() Failed. 0x%x", Status);
+		goto StatsInitializeEnd;
+	}
+
+	RtlZeroMemory(Buffer, ProcessorCount * sizeof(ESP_TZ_STATS_PROCESSOR));
+	Stats->Processors = (PESP_TZ_STATS_PROCESSOR)Buffer;
+	Stats->ProcessorCount = ProcessorCount;
+
+StatsInitializeEnd:
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s <<<",
+		"Icaros_KMD_ESP_TZ_Stats.c",
+		102,
+		"CameraESPTZStatsInitialize");
+
+	return Status;
+}
+
+VOID
+CameraESPTZStatsRecordLatency(
+	_In_ PESP_TZ_STATS Stats,
+	_In_ ULONG Slot,
+	_In_ ESP_TZ_LATENCY_KIND Kind,
+	_In_ ULONGLONG Elapsed
+)
+
+/*++
+
+Routine Description:
+
+	This routine records one latency sample. It may be called at any IRQL
+	up to DISPATCH_LEVEL and takes no lock.
+
+	The caller may be rescheduled onto another processor between reading
+	the processor index and the increment, so the increment is still
+	interlocked. The line is almost always owned by the current processor,
+	which keeps it cheap.
+
+Arguments:
+
+	Stats - Supplies the statistics.
+
+	Slot - Supplies the IOCTL dispatch slot.
+
+	Kind - Supplies which latency is being recorded.
+
+	Elapsed - Supplies the latency, in 100ns units.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	ULONG Bucket;
+	ULONG Processor;
+
+	if (Stats->Processors == NULL) {
+		return;
+	}
+
+	Processor = KeGetCurrentProcessorIndex();
+	if (Processor >= Stats->ProcessorCount) {
+		Processor %= Stats->ProcessorCount;
+	}
+
+	Bucket = (ULONG)(RtlFindMostSignificantBit(Elapsed) + 1);
+	if (Bucket >= ESP_TZ_LATENCY_BUCKETS) {
+		Bucket = ESP_TZ_LATENCY_BUCKETS - 1;
+	}
+
+	InterlockedIncrementNoFence64(&Stats->Processors[Processor].Buckets[Slot][Kind][Bucket]);
+}
+
+VOID
+CameraESPTZQueryLatency(
+	_In_ WDFDEVICE Device,
+	_In_ WDFREQUEST Request
+)
+
+/*++
+
+Routine Description:
+
+	This routine handles IOCTL_ESP_TZ_QUERY_LATENCY. The per-processor
+	histograms are summed into the caller's buffer. The sum is not a
+	snapshot; samples recorded while it runs may or may not be included.
+
+Arguments:
+
+	Device - Supplies a handle to the device.
+
+	Request - Supplies a handle to the request.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	size_t BytesReturned;
+	ULONG Bucket;
+	PFDO_DATA DevExt;
+	PESP_TZ_IOCTL_LATENCY Entry;
+	size_t Length;
+	PESP_TZ_STATS_PROCESSOR Processor;
+	ULONG ProcessorIndex;
+	ULONG Required;
+	ULONG Slot;
+	PESP_TZ_LATENCY_STATISTICS Statistics;
+	NTSTATUS Status;
+
+	PAGED_CODE();
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s >>>",
+		"Icaros_KMD_ESP_TZ_Stats.c",
+		197,
+		"CameraESPTZQueryLatency");
+
+	DevExt = GetDeviceExtension(Device);
+	BytesReturned = 0;
+	Required = FIELD_OFFSET(ESP_TZ_LATENCY_STATISTICS, Entries[ESP_TZ_IOCTL_SLOT_COUNT + 1]);
+	Status = WdfRequestRetrieveOutputBuffer(Request,
+		FIELD_OFFSET(ESP_TZ_LATENCY_STATISTICS, Entries),
+		&Statistics,
+		&Length);
+
+	if (!NT_SUCCESS(Status)) {
+		EspDbgPrintlEx(0, "ESP KMD TZ", "WdfRequestRetrieveOutputBuffer() Failed. 0x%x", Status);
+		goto QueryLatencyEnd;
+	}
+
+	Statistics->Version = ESP_TZ_LATENCY_VERSION;
+	Statistics->Size = Required;
+	Statistics->BucketCount = ESP_TZ_LATENCY_BUCKETS;
+	Statistics->BucketUnit = 100;
+	Statistics->EntryCount = ESP_TZ_IOCTL_SLOT_COUNT + 1;
+	Statistics->Flags = 0;
+	if (ReadPointerAcquire((PVOID*)&DevExt->LowLatency.Thread) != NULL) {
+		Statistics->Flags |= ESP_TZ_LATENCY_FLAG_LOW_LATENCY;
+	}
+
+	if (Length < Required) {
+		Status = STATUS_BUFFER_OVERFLOW;
+		BytesReturned = FIELD_OFFSET(ESP_TZ_LATENCY_STATISTICS, Entries);
+		goto QueryLatencyEnd;
+	}
+
+	RtlZeroMemory(&Statistics->Entries[0], Required - FIELD_OFFSET(ESP_TZ_LATENCY_STATISTICS, Entries));
+	for (Slot = 0; Slot <= ESP_TZ_IOCTL_SLOT_COUNT; Slot += 1) {
+		Entry = &Statistics->Entries[Slot];
+		Entry->IoControlCode = CameraESPTZIoctlCodeFromSlot(Slot);
+		Entry->Requests = (ULONGLONG)DevExt->IoctlCounters[Slot].Requests;
+		Entry->Rejected = (ULONGLONG)DevExt->IoctlCounters[Slot].Rejected;
+		for (ProcessorIndex = 0;
+			ProcessorIndex < DevExt->Stats.ProcessorCount;
+			ProcessorIndex += 1) {
+
+			Processor = &DevExt->Stats.Processors[ProcessorIndex];
+			for (Bucket = 0; Bucket < ESP_TZ_LATENCY_BUCKETS; Bucket += 1) {
+				Entry->Service[Bucket] +=
+					(ULONGLONG)Processor->Buckets[Slot][EspTzLatencyService][Bucket];
+
+				Entry->Pending[Bucket] +=
+					(ULONGLONG)Processor->Buckets[Slot][EspTzLatencyPending][Bucket];
+
+				Entry->Crossing[Bucket] +=
+					(ULONGLONG)Processor->Buckets[Slot][EspTzLatencyCrossing][Bucket];
+			}
+		}
+	}
+
+	BytesReturned = Required;
+
+QueryLatencyEnd:
+
+	WdfRequestCompleteWithInformation(Request, Status, BytesReturned);
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s <<<",
+		"Icaros_KMD_ESP_TZ_Stats.c",
+		262,
+		"CameraESPTZQueryLatency");
+}
+
+VOID
+CameraESPTZQueryScanStatistics(
+	_In_ WDFDEVICE Device,
+	_In_ WDFREQUEST Request
+)
+
+/*++
+
+Routine Description:
+
+	This routine handles IOCTL_ESP_TZ_QUERY_SCAN_STATISTICS. The counters are
+	copied under a shared hold of the QueueLock so they are consistent with
+	each other.
+
+Arguments:
+
+	Device - Supplies a handle to the device.
+
+	Request - Supplies a handle to the request.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	PVOID Buffer;
+	size_t BytesReturned;
+	PFDO_DATA DevExt;
+	size_t Length;
+	ESP_TZ_SCAN_STATISTICS Statistics;
+	NTSTATUS Status;
+
+	PAGED_CODE();
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s >>>",
+		"Icaros_KMD_ESP_TZ_Stats.c",
+		298,
+		"CameraESPTZQueryScanStatistics");
+
+	DevExt = GetDeviceExtension(Device);
+	BytesReturned = 0;
+	Status = WdfRequestRetrieveOutputBuffer(Request,
+		ESP_TZ_SCAN_STATISTICS_V1_SIZE,
+		&Buffer,
+		&Length);
+
+	if (!NT_SUCCESS(Status)) {
+		EspDbgPrintlEx(0, "ESP KMD TZ", "WdfRequestRetrieveOutputBuffer() Failed. 0x%x", Status);
+		goto QueryScanStatisticsEnd;
+	}
+
+	RtlZeroMemory(&Statistics, sizeof(Statistics));
+	Statistics.Version = ESP_TZ_SCAN_STATISTICS_VERSION;
+	Statistics.Size = sizeof(ESP_TZ_SCAN_STATISTICS);
+	Statistics.ScanRequests = (ULONGLONG)DevExt->Scheduler.Requests;
+	Statistics.ScansMerged = (ULONGLONG)DevExt->Scheduler.Merged;
+	Statistics.ScansDeferred = (ULONGLONG)DevExt->Scheduler.Deferred;
+
+	CameraESPTZLockAcquireShared(&DevExt->QueueLock);
+	Statistics.EnqueueScans = DevExt->ScanStats.Scans[EspTzScanEnqueue];
+	Statistics.InterruptScans = DevExt->ScanStats.Scans[EspTzScanInterrupt];
+	Statistics.TimerScans = DevExt->ScanStats.Scans[EspTzScanTimer];
+	Statistics.WaitersVisited = DevExt->ScanStats.WaitersVisited;
+	Statistics.RetiredSatisfied = DevExt->ScanStats.RetiredSatisfied;
+	Statistics.RetiredExpired = DevExt->ScanStats.RetiredExpired;
+	Statistics.Restarts = DevExt->ScanStats.Restarts;
+	Statistics.FastPathHits = (ULONGLONG)DevExt->ScanStats.FastPathHits;
+	Statistics.MaximumQueueLockHoldTime = DevExt->QueueLock.MaximumHoldTime;
+	Statistics.ScansRun = DevExt->Scheduler.Runs;
+	Statistics.ScanSlices = DevExt->Scheduler.Slices;
+	Statistics.OneSidedScans = DevExt->ScanStats.OneSidedScans;
+	CameraESPTZLockReleaseShared(&DevExt->QueueLock);
+
+	BytesReturned = min(Length, sizeof(ESP_TZ_SCAN_STATISTICS));
+	RtlCopyMemory(Buffer, &Statistics, BytesReturned);
+
+QueryScanStatisticsEnd:
+
+	WdfRequestCompleteWithInformation(Request, Status, BytesReturned);
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s <<<",
+		"Icaros_KMD_ESP_TZ_Stats.c",
+		345,
+		"CameraESPTZQueryScanStatistics");
+}
+
+VOID
+CameraESPTZQueryLoadStatistics(
+	_In_ WDFDEVICE Device,
+	_In_ WDFREQUEST Request
+)
+
+/*++
+
+Routine Description:
+
+	This routine handles IOCTL_ESP_TZ_QUERY_LOAD_STATISTICS.
+
+Arguments:
+
+	Device - Supplies a handle to the device.
+
+	Request - Supplies a handle to the request.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	PVOID Buffer;
+	size_t BytesReturned;
+	PFDO_DATA DevExt;
+	size_t Length;
+	ESP_TZ_LOAD_STATISTICS Statistics;
+	NTSTATUS Status;
+
+	PAGED_CODE();
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s >>>",
+		"Icaros_KMD_ESP_TZ_Stats.c",
+		390,
+		"CameraESPTZQueryLoadStatistics");
+
+	DevExt = GetDeviceExtension(Device);
+	BytesReturned = 0;
+	Status = WdfRequestRetrieveOutputBuffer(Request,
+		ESP_TZ_LOAD_STATISTICS_V1_SIZE,
+		&Buffer,
+		&Length);
+
+	if (!NT_SUCCESS(Status)) {
+		EspDbgPrintlEx(0, "ESP KMD TZ", "WdfRequestRetrieveOutputBuffer() Failed. 0x%x", Status);
+		goto QueryLoadStatisticsEnd;
+	}
+
+	RtlZeroMemory(&Statistics, sizeof(Statistics));
+	Statistics.Version = ESP_TZ_LOAD_STATISTICS_VERSION;
+	Statistics.Size = sizeof(ESP_TZ_LOAD_STATISTICS);
+	Statistics.QueueLockContentions = (ULONGLONG)DevExt->QueueLock.Contentions;
+	Statistics.QueueLockAcquisitions = (ULONGLONG)DevExt->QueueLock.Acquisitions;
+	Statistics.QueueLockSpinAcquisitions = (ULONGLONG)DevExt->QueueLock.SpinAcquisitions;
+	Statistics.SensorLockContentions = (ULONGLONG)DevExt->LoadStats.SensorLockContentions;
+	Statistics.InterruptsRaised = (ULONGLONG)DevExt->LoadStats.InterruptsRaised;
+	Statistics.InterruptWorkerRuns = (ULONGLONG)DevExt->LoadStats.InterruptWorkerRuns;
+	Statistics.CacheHits = (ULONGLONG)DevExt->Cache.Hits;
+	Statistics.CacheMisses = (ULONGLONG)DevExt->Cache.Misses;
+	Statistics.CacheInvalidations = (ULONGLONG)DevExt->Cache.Invalidations;
+	Statistics.MailboxPosted = (ULONGLONG)DevExt->Mailbox.Posted;
+	Statistics.MailboxDrains = (ULONGLONG)DevExt->Mailbox.Drains;
+	Statistics.MailboxFull = (ULONGLONG)DevExt->Mailbox.Full;
+	Statistics.IdleEntries = (ULONGLONG)DevExt->Idle.Entries;
+	Statistics.IdleExits = (ULONGLONG)DevExt->Idle.Exits;
+	Statistics.IdleSkippedEvaluations = (ULONGLONG)DevExt->Idle.SkippedEvaluations;
+	Statistics.DeadlineTimerWakeups = (ULONGLONG)DevExt->Idle.DeadlineWakeups;
+	Statistics.ModelTimerWakeups = (ULONGLONG)DevExt->Idle.ModelWakeups;
+	Statistics.PowerUps = (ULONGLONG)DevExt->Idle.PowerUps;
+
+	CameraESPTZLockAcquireShared(&DevExt->QueueLock);
+	RtlCopyMemory(Statistics.QueueLockHoldTimes,
+		DevExt->QueueLock.HoldTimes,
+		sizeof(Statistics.QueueLockHoldTimes));
+
+	CameraESPTZLockReleaseShared(&DevExt->QueueLock);
+
+	CameraESPTZAcquireSensorLock(DevExt);
+	Statistics.MaximumSensorLockHoldTime = DevExt->LoadStats.MaximumSensorLockHoldTime;
+	CameraESPTZReleaseSensorLock(DevExt);
+
+	BytesReturned = min(Length, sizeof(ESP_TZ_LOAD_STATISTICS));
+	RtlCopyMemory(Buffer, &Statistics, BytesReturned);
+
+QueryLoadStatisticsEnd:
+
+	WdfRequestCompleteWithInformation(Request, Status, BytesReturned);
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s <<<",
+		"Icaros_KMD_ESP_TZ_Stats.c",
+		436,
+		"CameraESPTZQueryLoadStatistics");
+}
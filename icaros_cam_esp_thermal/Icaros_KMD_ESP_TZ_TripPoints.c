@@ -0,0 +1,318 @@
+/*++
+
+Module Name:
+
+	trippoints.c
+
+Abstract:
+
+	This file contains the device trip point table.
+
+	Trip points are configured once and stay in place while waiters come
+	and go. Each published sample is located in the sorted table starting
+	from the bracket of the previous sample, so a sample that stays in or
+	moves to a neighboring bracket costs a compare or two however many
+	points are configured. Only a jump over several points falls back to a
+	binary search.
+
+Environment:
+
+	Kernel-mode Driver Framework
+
+--*/
+
+#include "Device.h"
+#include "Debug.h"
+
+static
+ULONG
+CameraESPTZTripPointsSearch(
+	_In_ PESP_TZ_TRIP_POINTS TripPoints,
+	_In_ ULONG Temperature,
+	_In_ ULONG Low,
+	_In_ ULONG High
+)
+
+/*++
+
+Routine Description:
+
+	This routine binary searches the points in [Low, High) for the bracket
+	of a temperature. The caller guarantees that the points below Low are
+	at or below the temperature, and the points from High on are above it.
+
+Arguments:
+
+	TripPoints - Supplies the trip point table.
+
+	Temperature - Supplies the temperature to locate.
+
+	Low - Supplies the lowest possible bracket.
+
+	High - Supplies the highest possible bracket.
+
+Return Value:
+
+	The number of points at or below the temperature.
+
+--*/
+
+{
+	ULONG Middle;
+
+	while (Low < High) {
+		Middle = Low + (High - Low) / 2;
+		if (TripPoints->Points[Middle].Temperature <= Temperature) {
+			Low = Middle + 1;
+
+		} else {
+			High = Middle;
+		}
+	}
+
+	return Low;
+}
+
+BOOLEAN
+CameraESPTZTripPointsLocate(
+	_Inout_ PESP_TZ_TRIP_POINTS TripPoints,
+	_In_ ULONG Temperature
+)
+
+/*++
+
+Routine Description:
+
+	This routine moves the cached bracket to a newly published temperature
+	and notes a crossing if it changed. A crossing that leaves the
+	temperature at or above the critical trip point is also noted as
+	critical.
+
+	N.B. This routine requires the Sensor.Lock be held.
+
+Arguments:
+
+	TripPoints - Supplies the trip point table.
+
+	Temperature - Supplies the published temperature.
+
+Return Value:
+
+	TRUE if a trip point was crossed, FALSE otherwise.
+
+--*/
+
+{
+	ULONG Bracket;
+	ULONG Count;
+
+	Bracket = TripPoints->Bracket;
+	Count = TripPoints->Count;
+
+	if ((Bracket > 0) && (Temperature < TripPoints->Points[Bracket - 1].Temperature)) {
+		if ((Bracket == 1) || (Temperature >= TripPoints->Points[Bracket - 2].Temperature)) {
+			Bracket -= 1;
+
+		} else {
+			Bracket = CameraESPTZTripPointsSearch(TripPoints, Temperature, 0, Bracket - 2);
+		}
+
+	} else if ((Bracket < Count) && (Temperature >= TripPoints->Points[Bracket].Temperature)) {
+		if ((Bracket + 1 == Count) || (Temperature < TripPoints->Points[Bracket + 1].Temperature)) {
+			Bracket += 1;
+
+		} else {
+			Bracket = CameraESPTZTripPointsSearch(TripPoints, Temperature, Bracket + 2, Count);
+		}
+
+	} else {
+		return FALSE;
+	}
+
+	EspDbgPrintlEx(9, "ESP KMD TZ", "%s : Temp %lu, bracket %lu -> %lu", "CameraESPTZTripPointsLocate", Temperature, TripPoints->Bracket, Bracket);
+
+	TripPoints->Bracket = Bracket;
+	InterlockedExchange(&TripPoints->Crossed, 1);
+	if ((TripPoints->CriticalTemperature != 0) &&
+		(Temperature >= TripPoints->CriticalTemperature)) {
+
+		InterlockedExchange(&TripPoints->CriticalCrossed, 1);
+	}
+
+	return TRUE;
+}
+
+VOID
+CameraESPTZTripPointsBounds(
+	_In_ PESP_TZ_TRIP_POINTS TripPoints,
+	_Inout_ PULONG LowerBound,
+	_Inout_ PULONG UpperBound
+)
+
+/*++
+
+Routine Description:
+
+	This routine narrows a pair of virtual interrupt thresholds to the
+	current bracket, so a predicted crossing also covers the trip points.
+
+	N.B. This routine requires the Sensor.Lock be held.
+
+Arguments:
+
+	TripPoints - Supplies the trip point table.
+
+	LowerBound - Supplies the temperature at or below which an interrupt is
+		due, and receives the narrowed bound.
+
+	UpperBound - Supplies the temperature at or above which an interrupt is
+		due, and receives the narrowed bound.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	ULONG Bracket;
+	ULONG Temperature;
+
+	Bracket = TripPoints->Bracket;
+
+	//
+	// The lower trip point is crossed once the temperature drops below it.
+	//
+
+	if (Bracket > 0) {
+		Temperature = TripPoints->Points[Bracket - 1].Temperature;
+		if ((Temperature > 0) && (Temperature - 1 > *LowerBound)) {
+			*LowerBound = Temperature - 1;
+		}
+	}
+
+	if (Bracket < TripPoints->Count) {
+		Temperature = TripPoints->Points[Bracket].Temperature;
+		if (Temperature < *UpperBound) {
+			*UpperBound = Temperature;
+		}
+	}
+}
+
+VOID
+CameraESPTZSetTripPoints(
+	_In_ WDFDEVICE Device,
+	_In_ WDFREQUEST Request
+)
+
+/*++
+
+Routine Description:
+
+	This routine handles IOCTL_ESP_TZ_SET_TRIP_POINTS. The new table is
+	located around the current temperature without raising a crossing.
+
+Arguments:
+
+	Device - Supplies a handle to the device.
+
+	Request - Supplies a handle to the request.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	ULONG Count;
+	ULONG CriticalTemperature;
+	PFDO_DATA DevExt;
+	ULONG Index;
+	size_t Length;
+	ULONG Position;
+	ESP_TZ_TRIP_POINT Sorted[ESP_TZ_MAX_TRIP_POINTS];
+	NTSTATUS Status;
+	PESP_TZ_TRIP_POINT_TABLE Table;
+	PESP_TZ_TRIP_POINTS TripPoints;
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s >>>",
+		"Icaros_KMD_ESP_TZ_TripPoints.c",
+		221,
+		"CameraESPTZSetTripPoints");
+
+	DevExt = GetDeviceExtension(Device);
+	TripPoints = &DevExt->Sensor.TripPoints;
+	Status = WdfRequestRetrieveInputBuffer(Request,
+		FIELD_OFFSET(ESP_TZ_TRIP_POINT_TABLE, Points),
+		&Table,
+		&Length);
+
+	if (!NT_SUCCESS(Status)) {
+		EspDbgPrintlEx(0, "ESP KMD TZ", "WdfRequestRetrieveInputBuffer() Failed. 0x%x", Status);
+		goto SetTripPointsEnd;
+	}
+
+	Count = Table->Count;
+	if ((Table->Version != ESP_TZ_TRIP_POINT_VERSION) ||
+		(Count > ESP_TZ_MAX_TRIP_POINTS) ||
+		(Length < FIELD_OFFSET(ESP_TZ_TRIP_POINT_TABLE, Points) + (size_t)Count * sizeof(ESP_TZ_TRIP_POINT))) {
+
+		Status = STATUS_INVALID_PARAMETER;
+		EspDbgPrintlEx(0, "ESP KMD TZ", "%s : Version %lu, Count %lu rejected", "CameraESPTZSetTripPoints", Table->Version, Count);
+		goto SetTripPointsEnd;
+	}
+
+	//
+	// Insertion sort; the table is small and usually supplied in order.
+	//
+
+	for (Index = 0; Index < Count; Index += 1) {
+		Position = Index;
+		while ((Position > 0) &&
+			(Sorted[Position - 1].Temperature > Table->Points[Index].Temperature)) {
+
+			Sorted[Position] = Sorted[Position - 1];
+			Position -= 1;
+		}
+
+		Sorted[Position] = Table->Points[Index];
+	}
+
+	CriticalTemperature = 0;
+	for (Index = 0; Index < Count; Index += 1) {
+		if (Sorted[Index].Type == EspTzTripPointCritical) {
+			CriticalTemperature = Sorted[Index].Temperature;
+			break;
+		}
+	}
+
+	CameraESPTZAcquireSensorLock(DevExt);
+	RtlCopyMemory(TripPoints->Points, Sorted, Count * sizeof(ESP_TZ_TRIP_POINT));
+	TripPoints->Count = Count;
+	TripPoints->CriticalTemperature = CriticalTemperature;
+	TripPoints->Bracket = CameraESPTZTripPointsSearch(TripPoints,
+		DevExt->Sensor.Temperature,
+		0,
+		Count);
+
+	CameraESPTZScheduleModelCrossing(DevExt, KeQueryInterruptTime());
+	CameraESPTZReleaseSensorLock(DevExt);
+
+	EspDbgPrintlEx(9, "ESP KMD TZ", "%s : %lu trip points, bracket %lu", "CameraESPTZSetTripPoints", Count, TripPoints->Bracket);
+
+SetTripPointsEnd:
+
+	WdfRequestComplete(Request, Status);
+
+	EspDbgPrintlEx(
+		9,
+		"ESP KMD TZ",
+		"File: %s, Line: %d, Function: %s <<<",
+		"Icaros_KMD_ESP_TZ_TripPoints.c",
+		290,
+		"CameraESPTZSetTripPoints");
+}
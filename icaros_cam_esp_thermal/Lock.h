@@ -0,0 +1,77 @@
+/*++
+
+Module Name:
+
+    lock.h
+
+Abstract:
+
+    This file contains the definitions for the spin-then-block reader/writer
+    lock.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+#pragma once
+
+EXTERN_C_START
+
+#define ESP_TZ_LOCK_DEFAULT_SPIN_COUNT 1024
+
+//
+// State is zero when the lock is free, -1 when it is held exclusive, and
+// the number of holders when it is held shared. An acquisition that misses
+// spins up to SpinCount times before it waits on Event; a release with
+// waiters sets it. Shared holders are meant for readers of statistics and
+// other introspection, and are not accounted.
+//
+// Exclusive holds are accounted by the holder, in the ESP_TZ_LATENCY_BUCKETS
+// layout over ESP_TZ_LOCK_HOLD_BUCKETS buckets of 100ns units.
+//
+
+typedef struct {
+    volatile LONG State;
+    volatile LONG Waiters;
+    ULONG SpinCount;
+    KEVENT Event;
+    ULONGLONG AcquireTime;
+    volatile LONG64 Acquisitions;
+    volatile LONG64 Contentions;        // Missed on the first attempt.
+    volatile LONG64 SpinAcquisitions;   // Contended, acquired while spinning.
+    ULONGLONG MaximumHoldTime;          // 100ns units.
+    ULONGLONG HoldTimes[ESP_TZ_LOCK_HOLD_BUCKETS];
+} ESP_TZ_LOCK, * PESP_TZ_LOCK;
+
+VOID
+CameraESPTZLockInitialize(
+    _Out_ PESP_TZ_LOCK Lock
+    );
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+CameraESPTZLockAcquireExclusive(
+    _Inout_ PESP_TZ_LOCK Lock
+    );
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+CameraESPTZLockReleaseExclusive(
+    _Inout_ PESP_TZ_LOCK Lock
+    );
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+CameraESPTZLockAcquireShared(
+    _Inout_ PESP_TZ_LOCK Lock
+    );
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+CameraESPTZLockReleaseShared(
+    _Inout_ PESP_TZ_LOCK Lock
+    );
+
+EXTERN_C_END
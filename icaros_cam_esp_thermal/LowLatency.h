@@ -0,0 +1,63 @@
+/*++
+
+Module Name:
+
+    lowlatency.h
+
+Abstract:
+
+    This file contains the definitions for the low-latency notification
+    mode, which delivers virtual interrupts on a dedicated real-time
+    priority thread instead of a system work item.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+#pragma once
+
+EXTERN_C_START
+
+//
+// Work requested from the notification thread.
+//
+
+#define ESP_TZ_LOW_LATENCY_INTERRUPT    0x1     // Scan for a crossing.
+#define ESP_TZ_LOW_LATENCY_TIMER        0x2     // Scan for expired requests.
+#define ESP_TZ_LOW_LATENCY_MODEL        0x4     // Check a predicted crossing.
+#define ESP_TZ_LOW_LATENCY_SCAN         0x8     // Run a deferred scan.
+
+typedef struct {
+    BOOLEAN Enabled;
+    volatile LONG Stop;
+    volatile LONG Reasons;
+    KEVENT Event;
+    PKTHREAD Thread;
+} ESP_TZ_LOW_LATENCY, * PESP_TZ_LOW_LATENCY;
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+CameraESPTZLowLatencyStart(
+    _In_ WDFDEVICE Device
+    );
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+CameraESPTZLowLatencyStop(
+    _In_ WDFDEVICE Device
+    );
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+CameraESPTZLowLatencySignal(
+    _In_ PESP_TZ_LOW_LATENCY LowLatency,
+    _In_ LONG Reason
+    );
+
+EVT_WDF_TIMER CameraESPTZEvtLowLatencyExpiredRequestTimer;
+EVT_WDF_TIMER CameraESPTZEvtLowLatencyModelTimer;
+EVT_WDF_TIMER CameraESPTZEvtLowLatencyScanTimer;
+
+EXTERN_C_END
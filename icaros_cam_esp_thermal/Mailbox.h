@@ -0,0 +1,78 @@
+/*++
+
+Module Name:
+
+    mailbox.h
+
+Abstract:
+
+    This file contains the definitions for the set-temperature sample
+    mailbox.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+#pragma once
+
+EXTERN_C_START
+
+#define ESP_TZ_MAILBOX_ENTRIES 256
+
+//
+// A pushed sample waiting to be published. Temperature is the raw sample
+// until the drain publishes it, and the filtered value afterwards.
+//
+
+typedef struct DECLSPEC_ALIGN(MEMORY_ALLOCATION_ALIGNMENT) _ESP_TZ_MAILBOX_ENTRY {
+    SLIST_ENTRY Link;
+    ULONG Temperature;
+    ULONGLONG Time;                 // Interrupt time of the push.
+    ULONGLONG SystemTime;
+} ESP_TZ_MAILBOX_ENTRY, * PESP_TZ_MAILBOX_ENTRY;
+
+//
+// Producers take a free entry and push it on Pending without a lock. The
+// producer that finds Pending empty drains it: under the Sensor.Lock it
+// takes everything pushed so far and publishes it oldest first. Producers
+// pushing behind it return at once; their samples go with that batch or
+// the next one.
+//
+
+typedef struct {
+    SLIST_HEADER Pending;           // Newest first.
+    SLIST_HEADER Free;
+    volatile LONG64 Posted;
+    volatile LONG64 Drains;
+    volatile LONG64 Full;           // Samples published directly, no entry free.
+} ESP_TZ_MAILBOX, * PESP_TZ_MAILBOX;
+
+NTSTATUS
+CameraESPTZMailboxInitialize(
+    _In_ WDFDEVICE Device,
+    _Out_ PESP_TZ_MAILBOX Mailbox
+    );
+
+BOOLEAN
+CameraESPTZMailboxPost(
+    _Inout_ PESP_TZ_MAILBOX Mailbox,
+    _In_ ULONG Temperature,
+    _Out_ PBOOLEAN Drain
+    );
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+CameraESPTZMailboxDrain(
+    _In_ WDFDEVICE Device
+    );
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+CameraESPTZMailboxPublish(
+    _In_ WDFDEVICE Device,
+    _In_ ULONG Temperature
+    );
+
+EXTERN_C_END
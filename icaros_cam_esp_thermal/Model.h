@@ -0,0 +1,97 @@
+/*++
+
+Module Name:
+
+    model.h
+
+Abstract:
+
+    This file contains the definitions for the first-order RC thermal model
+    driven by the camera power notifications.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+#pragma once
+
+EXTERN_C_START
+
+//
+// Longest supported time constant, in milliseconds. Keeps the fixed point
+// exponent computation within 64 bits.
+//
+
+#define ESP_TZ_MODEL_MAX_TIME_CONSTANT (24UL * 60 * 60 * 1000)
+
+//
+// Shortest delay the crossing timer is armed with, in 100ns units.
+//
+
+#define ESP_TZ_MODEL_MINIMUM_DELAY 10000ULL
+
+//
+// The modeled temperature relaxes exponentially from the anchor toward the
+// steady state of the current camera power state:
+//
+//     T(t) = Target + (Anchor - Target) * exp(-(t - AnchorTime) / Tau)
+//
+// The anchor is moved on every camera power change and on every pushed
+// sample, so the temperature is evaluated on demand and no timer runs to
+// keep it current.
+//
+
+typedef struct {
+    BOOLEAN Enabled;
+    BOOLEAN CameraOn;
+    ULONG AmbientTemperature;       // Steady state with the camera off.
+    ULONG ActiveTemperature;        // Steady state with the camera on.
+    ULONG HeatingTimeConstant;      // Milliseconds.
+    ULONG CoolingTimeConstant;      // Milliseconds.
+    ULONG AnchorTemperature;
+    ULONGLONG AnchorTime;           // Interrupt time, 100ns units.
+} ESP_TZ_THERMAL_MODEL, * PESP_TZ_THERMAL_MODEL;
+
+VOID
+CameraESPTZModelInitialize(
+    _Out_ PESP_TZ_THERMAL_MODEL Model,
+    _In_ BOOLEAN Enabled,
+    _In_ ULONG AmbientTemperature,
+    _In_ ULONG ActiveTemperature,
+    _In_ ULONG HeatingTimeConstant,
+    _In_ ULONG CoolingTimeConstant,
+    _In_ ULONG Temperature,
+    _In_ ULONGLONG CurrentTime
+    );
+
+ULONG
+CameraESPTZModelEvaluate(
+    _In_ PESP_TZ_THERMAL_MODEL Model,
+    _In_ ULONGLONG CurrentTime
+    );
+
+VOID
+CameraESPTZModelAnchor(
+    _Inout_ PESP_TZ_THERMAL_MODEL Model,
+    _In_ ULONG Temperature,
+    _In_ ULONGLONG CurrentTime
+    );
+
+VOID
+CameraESPTZModelSetCameraState(
+    _Inout_ PESP_TZ_THERMAL_MODEL Model,
+    _In_ BOOLEAN CameraOn,
+    _In_ ULONGLONG CurrentTime
+    );
+
+ULONGLONG
+CameraESPTZModelNextCrossing(
+    _In_ PESP_TZ_THERMAL_MODEL Model,
+    _In_ ULONGLONG CurrentTime,
+    _In_ ULONG LowerBound,
+    _In_ ULONG UpperBound
+    );
+
+EXTERN_C_END
@@ -0,0 +1,58 @@
+/*++
+
+Module Name:
+
+    multiwait.h
+
+Abstract:
+
+    This file contains the definitions for the multi-condition wait.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+#pragma once
+
+EXTERN_C_START
+
+//
+// The conditions of a pended IOCTL_ESP_TZ_MULTI_WAIT, with the timeouts
+// turned into system time expirations, or -1 for none. The request's
+// READ_REQUEST_CONTEXT carries the union of the conditions, so the pending
+// queue scan treats it like any other wait; the conditions are only looked
+// at again to report which one fired.
+//
+
+typedef struct {
+    LARGE_INTEGER ExpirationTime;
+    ULONG LowTemperature;
+    ULONG HighTemperature;
+} MULTI_WAIT_CONDITION, * PMULTI_WAIT_CONDITION;
+
+typedef struct {
+    ULONG Count;
+    MULTI_WAIT_CONDITION Conditions[ESP_TZ_MAX_WAIT_CONDITIONS];
+} MULTI_WAIT_CONTEXT, * PMULTI_WAIT_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE(MULTI_WAIT_CONTEXT);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+CameraESPTZMultiWait(
+    _In_ WDFDEVICE Device,
+    _In_ WDFREQUEST Request
+    );
+
+NTSTATUS
+CameraESPTZMultiWaitFormatResult(
+    _In_ WDFREQUEST Request,
+    _In_ PMULTI_WAIT_CONTEXT MultiWait,
+    _In_ ULONG Temperature,
+    _In_ BOOLEAN TripPointCrossed,
+    _Out_ PULONG BytesReturned
+    );
+
+EXTERN_C_END
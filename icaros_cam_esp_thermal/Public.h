@@ -24,3 +24,447 @@ DEFINE_GUID (GUID_DEVINTERFACE_Icaros_KMD_ESP_Thermal,
     63784u,
     18120u,
     169u, 27u, 166u, 215u, 198u, 100u, 227u, 162u );
+
+//
+// Private control codes understood by the driver. The function codes are
+// contiguous from ESP_TZ_IOCTL_FUNCTION_BASE so the driver can dispatch
+// them by index.
+//
+
+#define ESP_TZ_IOCTL_FUNCTION_BASE 0x900
+
+#define ESP_TZ_CTL_CODE(Index)                                              \
+    CTL_CODE(FILE_DEVICE_UNKNOWN,                                           \
+             ESP_TZ_IOCTL_FUNCTION_BASE + (Index),                          \
+             METHOD_BUFFERED,                                               \
+             FILE_ANY_ACCESS)
+
+//
+// Input: ULONG temperature, in tenths of a Kelvin.
+//
+// The request can complete before the sample is published. Samples are
+// published in the order they were posted, right after the first request
+// of a burst completes, so IOCTL_THERMAL_READ_TEMPERATURE issued on
+// completion may still see an older sample. IOCTL_ESP_TZ_SET_TEMPERATURES
+// publishes its samples before it completes.
+//
+
+#define IOCTL_ESP_TZ_SET_TEMPERATURE        ESP_TZ_CTL_CODE(0)
+
+//
+// No input or output.
+//
+
+#define IOCTL_ESP_TZ_CAMERA_ON              ESP_TZ_CTL_CODE(1)
+#define IOCTL_ESP_TZ_CAMERA_OFF             ESP_TZ_CTL_CODE(2)
+
+//
+// Output: ESP_TZ_LATENCY_STATISTICS followed by one ESP_TZ_IOCTL_LATENCY
+// per dispatch slot. If the buffer only holds the header, the header is
+// returned with STATUS_BUFFER_OVERFLOW and Size set to the required length.
+//
+
+#define IOCTL_ESP_TZ_QUERY_LATENCY          ESP_TZ_CTL_CODE(3)
+
+#define ESP_TZ_LATENCY_VERSION 2
+
+//
+// Bucket 0 counts latencies under one unit, bucket N counts latencies in
+// [2^(N-1), 2^N) units, and the last bucket also counts everything longer.
+//
+
+#define ESP_TZ_LATENCY_BUCKETS 32
+
+//
+// Set when virtual interrupts are delivered by the low-latency thread
+// rather than the work item.
+//
+
+#define ESP_TZ_LATENCY_FLAG_LOW_LATENCY 0x1
+
+typedef struct _ESP_TZ_IOCTL_LATENCY {
+    ULONG IoControlCode;            // Zero for requests forwarded down.
+    ULONG Reserved;
+    ULONGLONG Requests;
+    ULONGLONG Rejected;
+    ULONGLONG Service[ESP_TZ_LATENCY_BUCKETS];
+    ULONGLONG Pending[ESP_TZ_LATENCY_BUCKETS];
+    ULONGLONG Crossing[ESP_TZ_LATENCY_BUCKETS];  // From the crossing to completion.
+} ESP_TZ_IOCTL_LATENCY, *PESP_TZ_IOCTL_LATENCY;
+
+typedef struct _ESP_TZ_LATENCY_STATISTICS {
+    ULONG Version;
+    ULONG Size;                     // Bytes required for all entries.
+    ULONG BucketCount;
+    ULONG BucketUnit;               // Nanoseconds per unit.
+    ULONG EntryCount;
+    ULONG Flags;                    // ESP_TZ_LATENCY_FLAG_*.
+    ESP_TZ_IOCTL_LATENCY Entries[1];
+} ESP_TZ_LATENCY_STATISTICS, *PESP_TZ_LATENCY_STATISTICS;
+
+//
+// Output: ESP_TZ_SCAN_STATISTICS. Counters only grow; Size is the length
+// of the structure returned so later versions can append fields.
+//
+// Version 2 adds the scan scheduler counters. Triggers raised within one
+// quantum share a scan, so a scan counts towards each trigger it serves and
+// ScanRequests minus ScansRun is the number of queue lock acquisitions
+// saved. A version 1 sized buffer still receives the version 1 fields.
+//
+// Version 3 adds ScanSlices. A scan visits a bounded number of waiters per
+// queue lock hold, so ScanSlices minus ScansRun is the number of times a
+// scan let other threads take the lock before going on.
+//
+// Version 4 adds OneSidedScans, the scans that checked only the upper or
+// only the lower bounds of the waiters because the temperature had moved
+// in one direction since the previous scan.
+//
+
+#define IOCTL_ESP_TZ_QUERY_SCAN_STATISTICS  ESP_TZ_CTL_CODE(4)
+
+#define ESP_TZ_SCAN_STATISTICS_VERSION 4
+
+typedef struct _ESP_TZ_SCAN_STATISTICS {
+    ULONG Version;
+    ULONG Size;
+    ULONGLONG EnqueueScans;         // Scans serving a queued read.
+    ULONGLONG InterruptScans;       // Scans serving an interrupt.
+    ULONGLONG TimerScans;           // Scans serving a request timer.
+    ULONGLONG WaitersVisited;
+    ULONGLONG RetiredSatisfied;
+    ULONGLONG RetiredExpired;
+    ULONGLONG Restarts;             // Walks restarted on STATUS_NOT_FOUND.
+    ULONGLONG FastPathHits;         // Reads completed without queueing.
+    ULONGLONG MaximumQueueLockHoldTime; // 100ns units.
+    ULONGLONG ScanRequests;         // Triggers raised.
+    ULONGLONG ScansRun;
+    ULONGLONG ScansMerged;          // Triggers joining a scheduled scan.
+    ULONGLONG ScansDeferred;        // Scans held to the end of a quantum.
+    ULONGLONG ScanSlices;           // Queue lock holds spent scanning.
+    ULONGLONG OneSidedScans;
+} ESP_TZ_SCAN_STATISTICS, *PESP_TZ_SCAN_STATISTICS;
+
+#define ESP_TZ_SCAN_STATISTICS_V1_SIZE FIELD_OFFSET(ESP_TZ_SCAN_STATISTICS, ScanRequests)
+
+//
+// IOCTL stream recorder. The control IOCTL takes a ULONG action. The read
+// IOCTL drains the oldest records into an ESP_TZ_TRACE_BUFFER sized by the
+// caller; records dropped because the recorder was full are reported once
+// and then reset. A sample batch is recorded as one set temperature per
+// sample at its timestamp, and a multi-wait as a read of the union of its
+// conditions with the earliest timeout.
+//
+
+#define IOCTL_ESP_TZ_RECORDER_CONTROL       ESP_TZ_CTL_CODE(5)
+#define IOCTL_ESP_TZ_RECORDER_READ          ESP_TZ_CTL_CODE(6)
+
+#define ESP_TZ_RECORDER_STOP    0
+#define ESP_TZ_RECORDER_START   1
+#define ESP_TZ_RECORDER_CLEAR   2
+
+#define ESP_TZ_TRACE_VERSION 1
+
+typedef enum _ESP_TZ_TRACE_TYPE {
+    EspTzTraceSetTemperature = 1,   // Temperature.
+    EspTzTraceRead = 2,             // LowTemperature, HighTemperature, Timeout.
+    EspTzTraceCameraOn = 3,
+    EspTzTraceCameraOff = 4
+} ESP_TZ_TRACE_TYPE;
+
+typedef struct _ESP_TZ_TRACE_RECORD {
+    ULONGLONG Timestamp;            // Interrupt time, 100ns units.
+    USHORT Type;
+    USHORT Reserved;
+    ULONG Temperature;              // Or LowTemperature for reads.
+    ULONG HighTemperature;
+    ULONG Timeout;                  // Milliseconds, -1 for none.
+} ESP_TZ_TRACE_RECORD, *PESP_TZ_TRACE_RECORD;
+
+typedef struct _ESP_TZ_TRACE_BUFFER {
+    ULONG Version;
+    ULONG Count;                    // Records returned.
+    ULONGLONG Dropped;              // Records lost since the last read.
+    ESP_TZ_TRACE_RECORD Records[1];
+} ESP_TZ_TRACE_BUFFER, *PESP_TZ_TRACE_BUFFER;
+
+//
+// Output: ESP_TZ_LOAD_STATISTICS. Lock contention and interrupt delivery
+// counters for sizing the driver under concurrent load. Interrupts raised
+// while the worker is already queued are coalesced, so InterruptsRaised
+// minus InterruptWorkerRuns is the number of coalesced interrupts.
+//
+// Version 2 adds the forwarded query response cache counters. A version 1
+// sized buffer still receives the version 1 fields.
+//
+// Version 3 adds the set-temperature mailbox counters. Samples are posted
+// without a lock and published in batches, so MailboxPosted divided by
+// MailboxDrains is the average batch size.
+//
+// Version 4 adds the queue lock counters. A contended acquisition spins
+// before it blocks, so QueueLockSpinAcquisitions divided by
+// QueueLockContentions is the spin success rate. QueueLockHoldTimes is a
+// histogram of exclusive hold times in 100ns units, bucketed like the
+// latency histograms.
+//
+// Version 5 adds the runtime idle counters. While no wait is pending the
+// driver stops evaluating samples against the thresholds and lets its
+// timers lapse: IdleSkippedEvaluations counts the samples not evaluated,
+// and the wakeup counters the timer callbacks that ran. IdleEntries and
+// IdleExits count transitions into and out of idle, PowerUps the times the
+// device re-entered D0.
+//
+
+#define IOCTL_ESP_TZ_QUERY_LOAD_STATISTICS  ESP_TZ_CTL_CODE(7)
+
+#define ESP_TZ_LOAD_STATISTICS_VERSION 5
+
+#define ESP_TZ_LOCK_HOLD_BUCKETS 16
+
+typedef struct _ESP_TZ_LOAD_STATISTICS {
+    ULONG Version;
+    ULONG Size;
+    ULONGLONG QueueLockContentions;
+    ULONGLONG SensorLockContentions;
+    ULONGLONG MaximumSensorLockHoldTime;    // 100ns units.
+    ULONGLONG InterruptsRaised;
+    ULONGLONG InterruptWorkerRuns;
+    ULONGLONG CacheHits;
+    ULONGLONG CacheMisses;
+    ULONGLONG CacheInvalidations;
+    ULONGLONG MailboxPosted;
+    ULONGLONG MailboxDrains;
+    ULONGLONG MailboxFull;          // Samples published directly, no entry free.
+    ULONGLONG QueueLockAcquisitions;
+    ULONGLONG QueueLockSpinAcquisitions;
+    ULONGLONG QueueLockHoldTimes[ESP_TZ_LOCK_HOLD_BUCKETS];
+    ULONGLONG IdleEntries;
+    ULONGLONG IdleExits;
+    ULONGLONG IdleSkippedEvaluations;
+    ULONGLONG DeadlineTimerWakeups;
+    ULONGLONG ModelTimerWakeups;
+    ULONGLONG PowerUps;
+} ESP_TZ_LOAD_STATISTICS, *PESP_TZ_LOAD_STATISTICS;
+
+#define ESP_TZ_LOAD_STATISTICS_V1_SIZE FIELD_OFFSET(ESP_TZ_LOAD_STATISTICS, CacheHits)
+
+//
+// Input: ESP_TZ_TRIP_POINT_TABLE. Replaces the device trip point table. A
+// sample moving the temperature across any trip point completes every
+// pending IOCTL_ESP_TZ_MULTI_WAIT, and every pending
+// IOCTL_THERMAL_READ_TEMPERATURE with an ESP_TZ_READ_RESULT output buffer,
+// whatever their own bounds, with Reason EspTzWaitTripPoint. A read with a
+// ULONG output buffer completes only on its own bounds or timeout. Reaching
+// the lowest critical point completes them all at once, before any other
+// work. A table with no points removes them all.
+//
+
+#define IOCTL_ESP_TZ_SET_TRIP_POINTS        ESP_TZ_CTL_CODE(8)
+
+#define ESP_TZ_TRIP_POINT_VERSION 1
+#define ESP_TZ_MAX_TRIP_POINTS 32
+
+typedef enum _ESP_TZ_TRIP_POINT_TYPE {
+    EspTzTripPointUser = 0,
+    EspTzTripPointPassive = 1,
+    EspTzTripPointActive = 2,
+    EspTzTripPointHot = 3,
+    EspTzTripPointCritical = 4
+} ESP_TZ_TRIP_POINT_TYPE;
+
+typedef struct _ESP_TZ_TRIP_POINT {
+    ULONG Temperature;                      // Tenths of a Kelvin.
+    ULONG Type;                             // ESP_TZ_TRIP_POINT_TYPE.
+} ESP_TZ_TRIP_POINT, *PESP_TZ_TRIP_POINT;
+
+typedef struct _ESP_TZ_TRIP_POINT_TABLE {
+    ULONG Version;
+    ULONG Count;
+    ESP_TZ_TRIP_POINT Points[1];
+} ESP_TZ_TRIP_POINT_TABLE, *PESP_TZ_TRIP_POINT_TABLE;
+
+//
+// Input: ESP_TZ_HISTORY_QUERY. Output: ESP_TZ_HISTORY_BUFFER holding the
+// records of one tier that overlap [StartTime, EndTime], oldest first, as
+// many as fit. ESP_TZ_HISTORY_FLAG_MORE is set when records were left out;
+// query again from the end of the last record returned to continue.
+//
+// Tier 0 returns the raw sample blocks as stored. Each sample is encoded as
+// two varints, least significant group first with the high bit set on all
+// but the last byte: the milliseconds since the previous sample (or since
+// StartTime for the first one), then the zigzag encoded change in tenths of
+// a Kelvin from the previous sample (or from StartTemperature). The other
+// tiers return per-minute and per-hour summaries.
+//
+
+#define IOCTL_ESP_TZ_QUERY_HISTORY          ESP_TZ_CTL_CODE(9)
+
+#define ESP_TZ_HISTORY_VERSION 1
+
+#define ESP_TZ_HISTORY_TIER_RAW     0
+#define ESP_TZ_HISTORY_TIER_MINUTE  1
+#define ESP_TZ_HISTORY_TIER_HOUR    2
+#define ESP_TZ_HISTORY_TIERS        3
+
+#define ESP_TZ_HISTORY_FLAG_MORE    0x1
+
+#define ESP_TZ_HISTORY_BLOCK_DATA   236
+
+typedef struct _ESP_TZ_HISTORY_QUERY {
+    ULONG Version;
+    ULONG Tier;                             // ESP_TZ_HISTORY_TIER_*.
+    ULONGLONG StartTime;                    // System time, 100ns units.
+    ULONGLONG EndTime;
+} ESP_TZ_HISTORY_QUERY, *PESP_TZ_HISTORY_QUERY;
+
+typedef struct _ESP_TZ_HISTORY_BLOCK {
+    ULONGLONG StartTime;                    // System time, on a millisecond.
+    ULONG StartTemperature;
+    ULONG Duration;                         // Milliseconds to the last sample.
+    USHORT Count;                           // Samples encoded.
+    USHORT Length;                          // Bytes of Data used.
+    UCHAR Data[ESP_TZ_HISTORY_BLOCK_DATA];
+} ESP_TZ_HISTORY_BLOCK, *PESP_TZ_HISTORY_BLOCK;
+
+typedef struct _ESP_TZ_HISTORY_SUMMARY {
+    ULONGLONG StartTime;                    // System time, start of the period.
+    ULONG Minimum;
+    ULONG Maximum;
+    ULONG Mean;
+    ULONG Count;                            // Samples summarized.
+} ESP_TZ_HISTORY_SUMMARY, *PESP_TZ_HISTORY_SUMMARY;
+
+typedef struct _ESP_TZ_HISTORY_BUFFER {
+    ULONG Version;
+    ULONG Tier;
+    ULONG Count;                            // Records returned.
+    ULONG Flags;                            // ESP_TZ_HISTORY_FLAG_*.
+    union {
+        ESP_TZ_HISTORY_BLOCK Blocks[1];
+        ESP_TZ_HISTORY_SUMMARY Summaries[1];
+    };
+} ESP_TZ_HISTORY_BUFFER, *PESP_TZ_HISTORY_BUFFER;
+
+//
+// Input: ESP_TZ_MULTI_WAIT. Output: ESP_TZ_MULTI_WAIT_RESULT. Each condition
+// has the meaning of a THERMAL_WAIT_READ. The request completes as soon as
+// any condition is met or times out, or a trip point is crossed, and reports
+// which condition fired and the temperature at that moment; Index is
+// ESP_TZ_WAIT_INDEX_NONE for a trip point crossing. The conditions are
+// pended as one request and count as one waiter against the client quota.
+//
+
+#define IOCTL_ESP_TZ_MULTI_WAIT             ESP_TZ_CTL_CODE(10)
+
+#define ESP_TZ_MULTI_WAIT_VERSION 1
+#define ESP_TZ_MAX_WAIT_CONDITIONS 16
+
+#define ESP_TZ_WAIT_INDEX_NONE 0xFFFFFFFF
+
+typedef enum _ESP_TZ_WAIT_REASON {
+    EspTzWaitSatisfied = 0,                 // The temperature left the bounds.
+    EspTzWaitExpired = 1,                   // The timeout elapsed.
+    EspTzWaitTripPoint = 2                  // A device trip point was crossed.
+} ESP_TZ_WAIT_REASON;
+
+typedef struct _ESP_TZ_WAIT_CONDITION {
+    ULONG Timeout;                          // Milliseconds, -1 for none.
+    ULONG LowTemperature;
+    ULONG HighTemperature;
+} ESP_TZ_WAIT_CONDITION, *PESP_TZ_WAIT_CONDITION;
+
+typedef struct _ESP_TZ_MULTI_WAIT {
+    ULONG Version;
+    ULONG Count;
+    ESP_TZ_WAIT_CONDITION Conditions[1];
+} ESP_TZ_MULTI_WAIT, *PESP_TZ_MULTI_WAIT;
+
+typedef struct _ESP_TZ_MULTI_WAIT_RESULT {
+    ULONG Index;                            // Condition that fired.
+    ULONG Reason;                           // ESP_TZ_WAIT_REASON.
+    ULONG Temperature;
+} ESP_TZ_MULTI_WAIT_RESULT, *PESP_TZ_MULTI_WAIT_RESULT;
+
+//
+// IOCTL_THERMAL_READ_TEMPERATURE chooses its output format by buffer size.
+// A ULONG output buffer receives the temperature alone. An output buffer of
+// at least sizeof(ESP_TZ_READ_RESULT) receives the full result instead.
+// CompletionTime minus SampleTime is the notification latency of a
+// crossing. A gap in Sequence between two results means samples were
+// pushed in between.
+//
+
+typedef struct _ESP_TZ_READ_RESULT {
+    ULONG Temperature;                      // Tenths of a Kelvin.
+    ULONG Reason;                           // ESP_TZ_WAIT_REASON.
+    ULONGLONG SampleTime;                   // Interrupt time, 100ns units.
+    ULONGLONG CompletionTime;               // Interrupt time, 100ns units.
+    ULONGLONG Sequence;                     // Samples pushed up to this one.
+} ESP_TZ_READ_RESULT, *PESP_TZ_READ_RESULT;
+
+//
+// Input: ESP_TZ_SAMPLE_BATCH. Pushes the samples in order, each as if sent
+// with IOCTL_ESP_TZ_SET_TEMPERATURE at its timestamp, in one sensor update.
+// A crossing anywhere in the batch raises at most one virtual interrupt,
+// delivered after the last sample; the history records every sample.
+// Timestamps must not decrease. Zero means the time of the call, and
+// later timestamps are clamped to it. Samples already in the sample mailbox
+// are published before the batch.
+//
+
+#define IOCTL_ESP_TZ_SET_TEMPERATURES       ESP_TZ_CTL_CODE(11)
+
+#define ESP_TZ_SAMPLE_BATCH_VERSION 1
+#define ESP_TZ_MAX_BATCH_SAMPLES 1024
+
+typedef struct _ESP_TZ_TIMED_SAMPLE {
+    ULONGLONG Timestamp;                    // Interrupt time, 100ns units.
+    ULONG Temperature;                      // Tenths of a Kelvin.
+    ULONG Reserved;
+} ESP_TZ_TIMED_SAMPLE, *PESP_TZ_TIMED_SAMPLE;
+
+typedef struct _ESP_TZ_SAMPLE_BATCH {
+    ULONG Version;
+    ULONG Count;
+    ESP_TZ_TIMED_SAMPLE Samples[1];
+} ESP_TZ_SAMPLE_BATCH, *PESP_TZ_SAMPLE_BATCH;
+
+//
+// Output: ESP_TZ_QUEUE_STATISTICS. Handled IOCTLs are validated on the
+// default queue and forwarded to the parallel queue of their class:
+// samples, waits, and everything else. Samples are published in the order
+// they reach the sample mailbox, not the order they were sent. A request
+// arriving while DepthLimit requests of its class are still being
+// dispatched fails with STATUS_DEVICE_BUSY and is counted in Rejected.
+// WaitTimes is a histogram of the time from forwarding to dispatch in
+// 100ns units, bucketed like the latency histograms.
+//
+
+#define IOCTL_ESP_TZ_QUERY_QUEUE_STATISTICS ESP_TZ_CTL_CODE(12)
+
+#define ESP_TZ_QUEUE_STATISTICS_VERSION 1
+
+typedef enum _ESP_TZ_QUEUE_CLASS {
+    EspTzQueueSamples = 0,
+    EspTzQueueWaits = 1,
+    EspTzQueueControl = 2,
+    EspTzQueueClassMaximum
+} ESP_TZ_QUEUE_CLASS;
+
+typedef struct _ESP_TZ_QUEUE_COUNTERS {
+    ULONG Depth;                            // Queued or in the handler.
+    ULONG MaximumDepth;
+    ULONG DepthLimit;                       // Zero for no limit.
+    ULONG Reserved;
+    ULONGLONG Dispatched;
+    ULONGLONG Rejected;
+    ULONGLONG MaximumWaitTime;              // 100ns units.
+    ULONGLONG WaitTimes[ESP_TZ_LATENCY_BUCKETS];
+} ESP_TZ_QUEUE_COUNTERS, *PESP_TZ_QUEUE_COUNTERS;
+
+typedef struct _ESP_TZ_QUEUE_STATISTICS {
+    ULONG Version;
+    ULONG Size;
+    ULONG QueueCount;
+    ULONG Reserved;
+    ESP_TZ_QUEUE_COUNTERS Queues[EspTzQueueClassMaximum];
+} ESP_TZ_QUEUE_STATISTICS, *PESP_TZ_QUEUE_STATISTICS;
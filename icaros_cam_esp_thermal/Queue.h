@@ -30,15 +30,104 @@ typedef struct _QUEUE_CONTEXT {
 
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(QUEUE_CONTEXT, QueueGetContext)
 
+//
+// IOCTL dispatch table. Slot 0 holds IOCTL_THERMAL_READ_TEMPERATURE, and the
+// private IOCTLs follow in function code order. Anything else is forwarded
+// to the lower target and accounted in the forwarded slot.
+//
+
+typedef
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+ESP_TZ_IOCTL_HANDLER(
+    _In_ WDFDEVICE Device,
+    _In_ WDFREQUEST Request
+    );
+
+typedef ESP_TZ_IOCTL_HANDLER *PFN_ESP_TZ_IOCTL_HANDLER;
+
+typedef struct _ESP_TZ_IOCTL_ENTRY {
+    ULONG IoControlCode;
+    PFN_ESP_TZ_IOCTL_HANDLER Handler;
+    ULONG InputBufferLength;    // Minimum input buffer length.
+    ULONG OutputBufferLength;   // Minimum output buffer length.
+    KIRQL MaximumIrql;
+    ESP_TZ_QUEUE_CLASS QueueClass;
+} ESP_TZ_IOCTL_ENTRY, *PESP_TZ_IOCTL_ENTRY;
+
+typedef struct _ESP_TZ_IOCTL_COUNTERS {
+    volatile LONG64 Requests;
+    volatile LONG64 Rejected;
+} ESP_TZ_IOCTL_COUNTERS, *PESP_TZ_IOCTL_COUNTERS;
+
+#define ESP_TZ_IOCTL_LAST IOCTL_ESP_TZ_QUERY_QUEUE_STATISTICS
+
+#define ESP_TZ_IOCTL_SLOT_READ_TEMPERATURE 0
+
+#define ESP_TZ_IOCTL_SLOT(IoControlCode)                                    \
+    (IoGetFunctionCodeFromCtlCode(IoControlCode) -                          \
+     ESP_TZ_IOCTL_FUNCTION_BASE + 1)
+
+#define ESP_TZ_IOCTL_SLOT_COUNT (ESP_TZ_IOCTL_SLOT(ESP_TZ_IOCTL_LAST) + 1)
+
+#define ESP_TZ_IOCTL_SLOT_FORWARDED ESP_TZ_IOCTL_SLOT_COUNT
+
+//
+// A class queue. Depth counts the requests forwarded to it that are still
+// waiting in it or in its handler, and is bounded by DepthLimit when that is
+// not zero. The counters are updated with interlocked operations.
+//
+
+#define ESP_TZ_SAMPLE_QUEUE_DEFAULT_DEPTH   256
+#define ESP_TZ_WAIT_QUEUE_DEFAULT_DEPTH     1024
+#define ESP_TZ_CONTROL_QUEUE_DEFAULT_DEPTH  64
+
+typedef struct _ESP_TZ_CLASS_QUEUE {
+    WDFQUEUE Queue;
+    ULONG DepthLimit;
+    volatile LONG Depth;
+    volatile LONG MaximumDepth;
+    volatile LONG64 Dispatched;
+    volatile LONG64 Rejected;
+    volatile LONG64 MaximumWaitTime;
+    volatile LONG64 WaitTimes[ESP_TZ_LATENCY_BUCKETS];
+} ESP_TZ_CLASS_QUEUE, *PESP_TZ_CLASS_QUEUE;
+
+//
+// Every request carries the interrupt time it was forwarded to its class
+// queue at. The context is set up for all requests of the device, so it is
+// allocated with the request rather than on the dispatch path.
+//
+
+typedef struct _ESP_TZ_REQUEST_CONTEXT {
+    ULONGLONG ForwardTime;
+} ESP_TZ_REQUEST_CONTEXT, *PESP_TZ_REQUEST_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE(ESP_TZ_REQUEST_CONTEXT);
+
+ULONG
+CameraESPTZIoctlCodeFromSlot(
+    _In_ ULONG Slot
+    );
+
 NTSTATUS
 CameraESPTZQueueInitialize(
     _In_ WDFDEVICE Device
     );
 
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+CameraESPTZQueryQueueStatistics(
+    _In_ WDFDEVICE Device,
+    _In_ WDFREQUEST Request
+    );
+
 //
 // Events from the IoQueue object
 //
 EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL CameraESPTZEvtIoDeviceControl;
+EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL CameraESPTZEvtClassIoDeviceControl;
+EVT_WDF_IO_QUEUE_IO_CANCELED_ON_QUEUE CameraESPTZEvtClassIoCanceledOnQueue;
 EVT_WDF_IO_QUEUE_IO_STOP CameraESPTZEvtIoStop;
 
 EXTERN_C_END
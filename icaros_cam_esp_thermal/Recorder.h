@@ -0,0 +1,71 @@
+/*++
+
+Module Name:
+
+    recorder.h
+
+Abstract:
+
+    This file contains the definitions for the IOCTL stream recorder.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+#pragma once
+
+EXTERN_C_START
+
+#define ESP_TZ_RECORDER_DEFAULT_CAPACITY 4096
+#define ESP_TZ_RECORDER_MAX_CAPACITY (1024 * 1024)
+
+//
+// The record storage is allocated on the first start so an idle recorder
+// costs no memory. Records are kept in a ring of Size entries starting at
+// Head; when the ring is full new records are dropped rather than
+// overwriting old ones, so a drained trace never has holes in the middle.
+//
+
+typedef struct {
+    volatile LONG Enabled;
+    ULONG Capacity;                 // Configured capacity, in records.
+    WDFSPINLOCK Lock;
+    WDFMEMORY Memory;
+    PESP_TZ_TRACE_RECORD Records;
+    ULONG Size;
+    ULONG Head;
+    ULONG Count;
+    ULONGLONG Dropped;
+    ULONGLONG LastTimestamp;        // Of the newest record ever appended.
+} ESP_TZ_RECORDER, * PESP_TZ_RECORDER;
+
+NTSTATUS
+CameraESPTZRecorderInitialize(
+    _In_ WDFDEVICE Device,
+    _Out_ PESP_TZ_RECORDER Recorder
+    );
+
+VOID
+CameraESPTZRecorderLogRequest(
+    _In_ PESP_TZ_RECORDER Recorder,
+    _In_ ULONG Slot,
+    _In_ WDFREQUEST Request
+    );
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+CameraESPTZRecorderControl(
+    _In_ WDFDEVICE Device,
+    _In_ WDFREQUEST Request
+    );
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+CameraESPTZRecorderRead(
+    _In_ WDFDEVICE Device,
+    _In_ WDFREQUEST Request
+    );
+
+EXTERN_C_END
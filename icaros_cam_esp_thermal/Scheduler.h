@@ -0,0 +1,88 @@
+/*++
+
+Module Name:
+
+    scheduler.h
+
+Abstract:
+
+    This file contains the definitions for the pending queue scan scheduler.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+#pragma once
+
+EXTERN_C_START
+
+typedef enum _ESP_TZ_SCAN_TRIGGER {
+    EspTzScanEnqueue = 0,
+    EspTzScanInterrupt = 1,
+    EspTzScanTimer = 2,
+    EspTzScanTriggerMaximum
+} ESP_TZ_SCAN_TRIGGER;
+
+#define ESP_TZ_SCAN_REASON(Trigger) (1UL << (Trigger))
+
+#define ESP_TZ_SCAN_DEFAULT_QUANTUM 500     // Microseconds.
+#define ESP_TZ_SCAN_DEFAULT_SLICE_BUDGET 64 // Waiters.
+#define ESP_TZ_SCAN_DEFAULT_SLICE_TIME 200  // Microseconds.
+
+//
+// Reasons collects the triggers raised since the last scan started. The
+// trigger that sets the first bit schedules the scan, either right away or
+// at the end of the quantum that started with the previous scan; later
+// triggers only add their bit. LastScanTime, Runs and Slices are written
+// under the QueueLock.
+//
+// A scan stops its QueueLock hold after SliceBudget waiters or SliceTime,
+// whichever comes first, and the thread running it resumes it under a new
+// hold. Zero removes either limit.
+//
+
+typedef struct {
+    volatile LONG Reasons;
+    ULONG Quantum;                  // 100ns units, zero to never defer.
+    ULONG SliceBudget;
+    ULONG SliceTime;                // 100ns units.
+    ULONGLONG LastScanTime;         // Interrupt time.
+    WDFTIMER Timer;
+    volatile LONG64 Requests;
+    volatile LONG64 Merged;
+    volatile LONG64 Deferred;
+    ULONGLONG Runs;
+    ULONGLONG Slices;
+} ESP_TZ_SCAN_SCHEDULER, * PESP_TZ_SCAN_SCHEDULER;
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+CameraESPTZSchedulerInitialize(
+    _In_ WDFDEVICE Device
+    );
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+CameraESPTZRequestScan(
+    _In_ WDFDEVICE Device,
+    _In_ ESP_TZ_SCAN_TRIGGER Trigger
+    );
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+CameraESPTZDeferScan(
+    _In_ WDFDEVICE Device,
+    _In_ ESP_TZ_SCAN_TRIGGER Trigger
+    );
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+CameraESPTZRunScan(
+    _In_ WDFDEVICE Device
+    );
+
+EVT_WDF_TIMER CameraESPTZEvtScanTimer;
+
+EXTERN_C_END
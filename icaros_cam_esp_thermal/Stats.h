@@ -0,0 +1,77 @@
+/*++
+
+Module Name:
+
+    stats.h
+
+Abstract:
+
+    This file contains the definitions for the per-IOCTL latency histograms.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+#pragma once
+
+EXTERN_C_START
+
+typedef enum _ESP_TZ_LATENCY_KIND {
+    EspTzLatencyService = 0,        // Dispatch until the handler returns.
+    EspTzLatencyPending = 1,        // Queued in PendingRequestQueue.
+    EspTzLatencyCrossing = 2,       // Crossing raised until completion.
+    EspTzLatencyKindMaximum
+} ESP_TZ_LATENCY_KIND;
+
+//
+// Histograms are kept per processor so recording never contends on a shared
+// cache line. Each block is cache aligned and summed on query.
+//
+
+typedef struct DECLSPEC_CACHEALIGN _ESP_TZ_STATS_PROCESSOR {
+    volatile LONG64 Buckets[ESP_TZ_IOCTL_SLOT_COUNT + 1][EspTzLatencyKindMaximum][ESP_TZ_LATENCY_BUCKETS];
+} ESP_TZ_STATS_PROCESSOR, * PESP_TZ_STATS_PROCESSOR;
+
+typedef struct {
+    ULONG ProcessorCount;
+    PESP_TZ_STATS_PROCESSOR Processors;
+} ESP_TZ_STATS, * PESP_TZ_STATS;
+
+NTSTATUS
+CameraESPTZStatsInitialize(
+    _In_ WDFDEVICE Device,
+    _Out_ PESP_TZ_STATS Stats
+    );
+
+VOID
+CameraESPTZStatsRecordLatency(
+    _In_ PESP_TZ_STATS Stats,
+    _In_ ULONG Slot,
+    _In_ ESP_TZ_LATENCY_KIND Kind,
+    _In_ ULONGLONG Elapsed
+    );
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+CameraESPTZQueryLatency(
+    _In_ WDFDEVICE Device,
+    _In_ WDFREQUEST Request
+    );
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+CameraESPTZQueryScanStatistics(
+    _In_ WDFDEVICE Device,
+    _In_ WDFREQUEST Request
+    );
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+CameraESPTZQueryLoadStatistics(
+    _In_ WDFDEVICE Device,
+    _In_ WDFREQUEST Request
+    );
+
+EXTERN_C_END
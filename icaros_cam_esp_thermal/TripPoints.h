@@ -0,0 +1,60 @@
+/*++
+
+Module Name:
+
+    trippoints.h
+
+Abstract:
+
+    This file contains the definitions for the device trip point table.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+#pragma once
+
+EXTERN_C_START
+
+//
+// The points are sorted by temperature. Bracket is the number of points at
+// or below the published temperature, so the temperature lies in
+// [Points[Bracket - 1], Points[Bracket]) and a trip point is crossed exactly
+// when a sample leaves that interval. Count, Points and CriticalTemperature
+// are protected by the Sensor.Lock. Crossed and CriticalCrossed are set
+// under it; Crossed is consumed by the next interrupt scan, CriticalCrossed
+// by the interrupt itself, which then drains every waiter at once.
+//
+
+typedef struct {
+    ULONG Count;
+    ULONG Bracket;
+    ULONG CriticalTemperature;      // Lowest critical point, zero if none.
+    volatile LONG Crossed;
+    volatile LONG CriticalCrossed;
+    ESP_TZ_TRIP_POINT Points[ESP_TZ_MAX_TRIP_POINTS];
+} ESP_TZ_TRIP_POINTS, * PESP_TZ_TRIP_POINTS;
+
+BOOLEAN
+CameraESPTZTripPointsLocate(
+    _Inout_ PESP_TZ_TRIP_POINTS TripPoints,
+    _In_ ULONG Temperature
+    );
+
+VOID
+CameraESPTZTripPointsBounds(
+    _In_ PESP_TZ_TRIP_POINTS TripPoints,
+    _Inout_ PULONG LowerBound,
+    _Inout_ PULONG UpperBound
+    );
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+CameraESPTZSetTripPoints(
+    _In_ WDFDEVICE Device,
+    _In_ WDFREQUEST Request
+    );
+
+EXTERN_C_END
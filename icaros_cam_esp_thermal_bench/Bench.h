@@ -0,0 +1,233 @@
+/*++
+
+Module Name:
+
+    bench.h
+
+Abstract:
+
+    This file contains the definitions shared by the commands of the bench
+    tool. The tool drives the driver through its public IOCTLs and reports
+    what it measures from user mode next to the counters the driver keeps.
+
+Environment:
+
+    User mode
+
+--*/
+
+#pragma once
+
+#include <windows.h>
+#include <winioctl.h>
+#include <cfgmgr32.h>
+#include <devpkey.h>
+#include <poclass.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "Public.h"
+
+//
+// Percentiles are given in thousandths so p99.9 can be asked for.
+//
+
+#define ESP_BENCH_P50   500
+#define ESP_BENCH_P99   990
+#define ESP_BENCH_MAX   1000
+
+//
+// How long a restarted device has to bring its interface back.
+//
+
+#define ESP_BENCH_RESTART_TIMEOUT_MS 30000
+
+//
+// A growable array of latencies in performance counter ticks. Each thread
+// fills its own and the command merges them when the run is over, so the
+// hot loops take no lock.
+//
+
+typedef struct _ESP_BENCH_SAMPLES {
+    PULONGLONG Values;
+    ULONG Count;
+    ULONG Capacity;
+    BOOLEAN Sorted;
+} ESP_BENCH_SAMPLES, *PESP_BENCH_SAMPLES;
+
+typedef
+DWORD
+ESP_BENCH_COMMAND_ROUTINE(
+    _In_ int Argc,
+    _In_reads_(Argc) char* Argv[]
+    );
+
+typedef ESP_BENCH_COMMAND_ROUTINE *PESP_BENCH_COMMAND_ROUTINE;
+
+//
+// Device access.
+//
+
+DWORD
+EspBenchGetDeviceInterface(
+    _Outptr_result_maybenull_ PWSTR* Interface
+    );
+
+DWORD
+EspBenchOpenDevice(
+    _In_ BOOLEAN Overlapped,
+    _Out_ PHANDLE Device
+    );
+
+//
+// Device node control, for measurements across a device restart. These
+// need an elevated prompt.
+//
+
+DWORD
+EspBenchLocateDevice(
+    _Out_ PDEVINST DevInst
+    );
+
+DWORD
+EspBenchRestartDevice(
+    _In_ DEVINST DevInst
+    );
+
+DWORD
+EspBenchQueryDeviceParameter(
+    _In_ DEVINST DevInst,
+    _In_z_ PCWSTR Name,
+    _Out_ PULONG Value
+    );
+
+DWORD
+EspBenchSetDeviceParameter(
+    _In_ DEVINST DevInst,
+    _In_z_ PCWSTR Name,
+    _In_opt_ const ULONG* Value
+    );
+
+DWORD
+EspBenchIoctl(
+    _In_ HANDLE Device,
+    _In_ ULONG IoControlCode,
+    _In_reads_bytes_opt_(InputLength) PVOID Input,
+    _In_ ULONG InputLength,
+    _Out_writes_bytes_opt_(OutputLength) PVOID Output,
+    _In_ ULONG OutputLength,
+    _Out_opt_ PULONG BytesReturned
+    );
+
+//
+// Timing and latency samples.
+//
+
+ULONGLONG
+EspBenchNow(
+    VOID
+    );
+
+double
+EspBenchMicroseconds(
+    _In_ ULONGLONG Ticks
+    );
+
+ULONGLONG
+EspBenchTicksFromUnits(
+    _In_ ULONGLONG Units
+    );
+
+DWORD
+EspBenchSamplesInitialize(
+    _Out_ PESP_BENCH_SAMPLES Samples,
+    _In_ ULONG Capacity
+    );
+
+VOID
+EspBenchSamplesFree(
+    _Inout_ PESP_BENCH_SAMPLES Samples
+    );
+
+VOID
+EspBenchSamplesAdd(
+    _Inout_ PESP_BENCH_SAMPLES Samples,
+    _In_ ULONGLONG Value
+    );
+
+DWORD
+EspBenchSamplesMerge(
+    _Inout_ PESP_BENCH_SAMPLES Samples,
+    _In_ PESP_BENCH_SAMPLES Other
+    );
+
+ULONGLONG
+EspBenchSamplesPercentile(
+    _Inout_ PESP_BENCH_SAMPLES Samples,
+    _In_ ULONG Permille
+    );
+
+VOID
+EspBenchPrintSamples(
+    _In_z_ PCSTR Label,
+    _Inout_ PESP_BENCH_SAMPLES Samples
+    );
+
+//
+// Driver statistics.
+//
+
+DWORD
+EspBenchQueryLatency(
+    _In_ HANDLE Device,
+    _Out_ PESP_TZ_LATENCY_STATISTICS* Statistics
+    );
+
+DWORD
+EspBenchQueryScanStatistics(
+    _In_ HANDLE Device,
+    _Out_ PESP_TZ_SCAN_STATISTICS Statistics
+    );
+
+DWORD
+EspBenchQueryQueueStatistics(
+    _In_ HANDLE Device,
+    _Out_ PESP_TZ_QUEUE_STATISTICS Statistics
+    );
+
+DWORD
+EspBenchQueryLoadStatistics(
+    _In_ HANDLE Device,
+    _Out_ PESP_TZ_LOAD_STATISTICS Statistics
+    );
+
+VOID
+EspBenchPrintLoadStatistics(
+    _In_ PESP_TZ_LOAD_STATISTICS After,
+    _In_ PESP_TZ_LOAD_STATISTICS Before
+    );
+
+VOID
+EspBenchPrintScanStatistics(
+    _In_ PESP_TZ_SCAN_STATISTICS After,
+    _In_ PESP_TZ_SCAN_STATISTICS Before
+    );
+
+VOID
+EspBenchPrintBuckets(
+    _In_z_ PCSTR Label,
+    _In_reads_(BucketCount) const ULONGLONG* Buckets,
+    _In_ ULONG BucketCount,
+    _In_ ULONG BucketUnit
+    );
+
+//
+// Commands.
+//
+
+ESP_BENCH_COMMAND_ROUTINE EspBenchLatency;
+ESP_BENCH_COMMAND_ROUTINE EspBenchRecord;
+ESP_BENCH_COMMAND_ROUTINE EspBenchReplay;
+ESP_BENCH_COMMAND_ROUTINE EspBenchLoad;
+ESP_BENCH_COMMAND_ROUTINE EspBenchHistory;
+ESP_BENCH_COMMAND_ROUTINE EspBenchResume;
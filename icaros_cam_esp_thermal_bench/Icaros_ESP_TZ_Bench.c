@@ -0,0 +1,871 @@
+/*++
+
+Module Name:
+
+	bench.c
+
+Abstract:
+
+	This file contains the entry point of the bench tool, the device
+	access helpers and the latency sample arrays shared by its commands.
+
+Environment:
+
+	User mode
+
+--*/
+
+#include <initguid.h>
+#include "Bench.h"
+
+typedef struct _ESP_BENCH_COMMAND {
+	PCSTR Name;
+	PESP_BENCH_COMMAND_ROUTINE Routine;
+	PCSTR Usage;
+} ESP_BENCH_COMMAND;
+
+static const ESP_BENCH_COMMAND EspBenchCommands[] = {
+	{ "latency", EspBenchLatency, "latency [Seconds]" },
+	{ "record", EspBenchRecord, "record <TraceFile> <Seconds>" },
+	{ "replay", EspBenchReplay, "replay <TraceFile> [Speed] [filter=median|exponential|kalman]" },
+	{ "load", EspBenchLoad, "load [threads=1,2,4,8] [seconds=10] [waiters=1024] [width=20] [timeout=500] "
+		"[wave=sine|ramp|step|walk] [base=3000] [amplitude=50] [period=1000] [rate=0] [camera=0]" },
+	{ "history", EspBenchHistory, "history dump [Tier] [Seconds] | history bench [Samples] [SpacingMs]" },
+	{ "resume", EspBenchResume, "resume [Temperature]" },
+};
+
+static LARGE_INTEGER EspBenchFrequency;
+
+DWORD
+EspBenchGetDeviceInterface(
+	_Outptr_result_maybenull_ PWSTR* Interface
+)
+
+/*++
+
+Routine Description:
+
+	This routine finds the first present ESP thermal device interface.
+
+Arguments:
+
+	Interface - Receives the interface path, to be released with free, or
+		NULL on failure. The path is the first string of a list.
+
+Return Value:
+
+	Win32 error code, ERROR_NOT_FOUND if no device is present.
+
+--*/
+
+{
+	CONFIGRET ConfigRet;
+	DWORD Error;
+	PWSTR InterfaceList;
+	ULONG Length;
+
+	*Interface = NULL;
+	InterfaceList = NULL;
+
+	//
+	// The list can grow between the two calls when a device arrives, so
+	// retry until it fits.
+	//
+
+	do {
+		ConfigRet = CM_Get_Device_Interface_List_SizeW(&Length,
+			(LPGUID)&GUID_DEVINTERFACE_Icaros_KMD_ESP_Thermal,
+			NULL,
+			CM_GET_DEVICE_INTERFACE_LIST_PRESENT);
+
+		if (ConfigRet != CR_SUCCESS) {
+			break;
+		}
+
+		free(InterfaceList);
+		InterfaceList = malloc(Length * sizeof(WCHAR));
+		if (InterfaceList == NULL) {
+			return ERROR_NOT_ENOUGH_MEMORY;
+		}
+
+		ConfigRet = CM_Get_Device_Interface_ListW((LPGUID)&GUID_DEVINTERFACE_Icaros_KMD_ESP_Thermal,
+			NULL,
+			InterfaceList,
+			Length,
+			CM_GET_DEVICE_INTERFACE_LIST_PRESENT);
+
+	} while (ConfigRet == CR_BUFFER_SMALL);
+
+	if (ConfigRet != CR_SUCCESS) {
+		Error = CM_MapCrToWin32Err(ConfigRet, ERROR_NOT_FOUND);
+		fprintf(stderr, "CM_Get_Device_Interface_ListW() Failed. 0x%lx\n", ConfigRet);
+		free(InterfaceList);
+		return Error;
+	}
+
+	if (*InterfaceList == L'\0') {
+		free(InterfaceList);
+		return ERROR_NOT_FOUND;
+	}
+
+	*Interface = InterfaceList;
+	return ERROR_SUCCESS;
+}
+
+DWORD
+EspBenchOpenDevice(
+	_In_ BOOLEAN Overlapped,
+	_Out_ PHANDLE Device
+)
+
+/*++
+
+Routine Description:
+
+	This routine opens the first present ESP thermal device interface.
+
+Arguments:
+
+	Overlapped - Supplies TRUE to open the device for overlapped I/O.
+
+	Device - Receives the handle, INVALID_HANDLE_VALUE on failure.
+
+Return Value:
+
+	Win32 error code.
+
+--*/
+
+{
+	DWORD Error;
+	PWSTR Interface;
+
+	*Device = INVALID_HANDLE_VALUE;
+	Error = EspBenchGetDeviceInterface(&Interface);
+	if (Error == ERROR_NOT_FOUND) {
+		fprintf(stderr, "No ESP thermal device is present.\n");
+	}
+
+	if (Error != ERROR_SUCCESS) {
+		return Error;
+	}
+
+	*Device = CreateFileW(Interface,
+		GENERIC_READ | GENERIC_WRITE,
+		FILE_SHARE_READ | FILE_SHARE_WRITE,
+		NULL,
+		OPEN_EXISTING,
+		Overlapped ? FILE_FLAG_OVERLAPPED : FILE_ATTRIBUTE_NORMAL,
+		NULL);
+
+	if (*Device == INVALID_HANDLE_VALUE) {
+		Error = GetLastError();
+		fprintf(stderr, "CreateFileW() Failed. %lu\n", Error);
+	}
+
+	free(Interface);
+	return Error;
+}
+
+DWORD
+EspBenchLocateDevice(
+	_Out_ PDEVINST DevInst
+)
+
+/*++
+
+Routine Description:
+
+	This routine finds the device node of the first present ESP thermal
+	device interface.
+
+Arguments:
+
+	DevInst - Receives the device node.
+
+Return Value:
+
+	Win32 error code.
+
+--*/
+
+{
+	CONFIGRET ConfigRet;
+	DWORD Error;
+	WCHAR InstanceId[MAX_DEVICE_ID_LEN];
+	PWSTR Interface;
+	ULONG Size;
+	DEVPROPTYPE Type;
+
+	Error = EspBenchGetDeviceInterface(&Interface);
+	if (Error == ERROR_NOT_FOUND) {
+		fprintf(stderr, "No ESP thermal device is present.\n");
+	}
+
+	if (Error != ERROR_SUCCESS) {
+		return Error;
+	}
+
+	Size = sizeof(InstanceId);
+	ConfigRet = CM_Get_Device_Interface_PropertyW(Interface,
+		&DEVPKEY_Device_InstanceId,
+		&Type,
+		(PBYTE)InstanceId,
+		&Size,
+		0);
+
+	free(Interface);
+	if (ConfigRet != CR_SUCCESS || Type != DEVPROP_TYPE_STRING) {
+		fprintf(stderr, "CM_Get_Device_Interface_PropertyW() Failed. 0x%lx\n", ConfigRet);
+		return CM_MapCrToWin32Err(ConfigRet, ERROR_NOT_FOUND);
+	}
+
+	ConfigRet = CM_Locate_DevNodeW(DevInst, InstanceId, CM_LOCATE_DEVNODE_NORMAL);
+	if (ConfigRet != CR_SUCCESS) {
+		fprintf(stderr, "CM_Locate_DevNodeW() Failed. 0x%lx\n", ConfigRet);
+		return CM_MapCrToWin32Err(ConfigRet, ERROR_NOT_FOUND);
+	}
+
+	return ERROR_SUCCESS;
+}
+
+DWORD
+EspBenchRestartDevice(
+	_In_ DEVINST DevInst
+)
+
+/*++
+
+Routine Description:
+
+	This routine disables and enables a device node and waits for its
+	interface to come back, so the device reads its configuration again.
+
+	N.B. Disabling a device node needs an elevated prompt, and fails while
+		any process holds a handle to the device.
+
+Arguments:
+
+	DevInst - Supplies the device node.
+
+Return Value:
+
+	Win32 error code.
+
+--*/
+
+{
+	CONFIGRET ConfigRet;
+	ULONGLONG Deadline;
+	DWORD Error;
+	PWSTR Interface;
+
+	ConfigRet = CM_Disable_DevNode(DevInst, CM_DISABLE_UI_NOT_OK);
+	if (ConfigRet != CR_SUCCESS) {
+		fprintf(stderr, "CM_Disable_DevNode() Failed. 0x%lx\n", ConfigRet);
+		return CM_MapCrToWin32Err(ConfigRet, ERROR_ACCESS_DENIED);
+	}
+
+	ConfigRet = CM_Enable_DevNode(DevInst, 0);
+	if (ConfigRet != CR_SUCCESS) {
+		fprintf(stderr, "CM_Enable_DevNode() Failed, the device is left disabled. 0x%lx\n", ConfigRet);
+		return CM_MapCrToWin32Err(ConfigRet, ERROR_NOT_READY);
+	}
+
+	Deadline = GetTickCount64() + ESP_BENCH_RESTART_TIMEOUT_MS;
+	do {
+		Error = EspBenchGetDeviceInterface(&Interface);
+		if (Error == ERROR_SUCCESS) {
+			free(Interface);
+			return ERROR_SUCCESS;
+		}
+
+		Sleep(1);
+
+	} while (GetTickCount64() < Deadline);
+
+	fprintf(stderr, "The device did not come back. %lu\n", Error);
+	return Error;
+}
+
+DWORD
+EspBenchQueryDeviceParameter(
+	_In_ DEVINST DevInst,
+	_In_z_ PCWSTR Name,
+	_Out_ PULONG Value
+)
+
+/*++
+
+Routine Description:
+
+	This routine reads a DWORD value from the device hardware key, where
+	the driver reads its configuration when the device starts.
+
+Arguments:
+
+	DevInst - Supplies the device node.
+
+	Name - Supplies the value name.
+
+	Value - Receives the value.
+
+Return Value:
+
+	Win32 error code, ERROR_FILE_NOT_FOUND if the value is not set.
+
+--*/
+
+{
+	CONFIGRET ConfigRet;
+	DWORD Error;
+	HKEY Key;
+	DWORD Size;
+	DWORD Type;
+
+	*Value = 0;
+	ConfigRet = CM_Open_DevNode_Key(DevInst,
+		KEY_QUERY_VALUE,
+		0,
+		RegDisposition_OpenExisting,
+		&Key,
+		CM_REGISTRY_HARDWARE);
+
+	if (ConfigRet != CR_SUCCESS) {
+		fprintf(stderr, "CM_Open_DevNode_Key() Failed. 0x%lx\n", ConfigRet);
+		return CM_MapCrToWin32Err(ConfigRet, ERROR_FILE_NOT_FOUND);
+	}
+
+	Size = sizeof(*Value);
+	Error = RegQueryValueExW(Key, Name, NULL, &Type, (LPBYTE)Value, &Size);
+	if (Error == ERROR_SUCCESS && Type != REG_DWORD) {
+		Error = ERROR_INVALID_DATA;
+	}
+
+	RegCloseKey(Key);
+	return Error;
+}
+
+DWORD
+EspBenchSetDeviceParameter(
+	_In_ DEVINST DevInst,
+	_In_z_ PCWSTR Name,
+	_In_opt_ const ULONG* Value
+)
+
+/*++
+
+Routine Description:
+
+	This routine writes a DWORD value to the device hardware key. The
+	driver sees it the next time the device starts.
+
+Arguments:
+
+	DevInst - Supplies the device node.
+
+	Name - Supplies the value name.
+
+	Value - Supplies the value, or NULL to delete it.
+
+Return Value:
+
+	Win32 error code.
+
+--*/
+
+{
+	CONFIGRET ConfigRet;
+	DWORD Error;
+	HKEY Key;
+
+	ConfigRet = CM_Open_DevNode_Key(DevInst,
+		KEY_SET_VALUE,
+		0,
+		RegDisposition_OpenExisting,
+		&Key,
+		CM_REGISTRY_HARDWARE);
+
+	if (ConfigRet != CR_SUCCESS) {
+		fprintf(stderr, "CM_Open_DevNode_Key() Failed. 0x%lx\n", ConfigRet);
+		return CM_MapCrToWin32Err(ConfigRet, ERROR_ACCESS_DENIED);
+	}
+
+	if (Value != NULL) {
+		Error = RegSetValueExW(Key, Name, 0, REG_DWORD, (const BYTE*)Value, sizeof(*Value));
+	}
+	else {
+		Error = RegDeleteValueW(Key, Name);
+	}
+
+	if (Error != ERROR_SUCCESS) {
+		fprintf(stderr, "Cannot write the %ls device parameter. %lu\n", Name, Error);
+	}
+
+	RegCloseKey(Key);
+	return Error;
+}
+
+DWORD
+EspBenchIoctl(
+	_In_ HANDLE Device,
+	_In_ ULONG IoControlCode,
+	_In_reads_bytes_opt_(InputLength) PVOID Input,
+	_In_ ULONG InputLength,
+	_Out_writes_bytes_opt_(OutputLength) PVOID Output,
+	_In_ ULONG OutputLength,
+	_Out_opt_ PULONG BytesReturned
+)
+
+/*++
+
+Routine Description:
+
+	This routine sends a control request on a handle opened without
+	overlapped I/O and waits for it to complete.
+
+Arguments:
+
+	Device - Supplies the device handle.
+
+	IoControlCode - Supplies the control code.
+
+	Input, InputLength - Supply the input buffer.
+
+	Output, OutputLength - Supply the output buffer.
+
+	BytesReturned - Receives the number of bytes written to Output. This is
+		also set for ERROR_MORE_DATA.
+
+Return Value:
+
+	Win32 error code.
+
+--*/
+
+{
+	DWORD Returned;
+
+	Returned = 0;
+	if (!DeviceIoControl(Device,
+		IoControlCode,
+		Input,
+		InputLength,
+		Output,
+		OutputLength,
+		&Returned,
+		NULL)) {
+
+		if (BytesReturned != NULL) {
+			*BytesReturned = Returned;
+		}
+
+		return GetLastError();
+	}
+
+	if (BytesReturned != NULL) {
+		*BytesReturned = Returned;
+	}
+
+	return ERROR_SUCCESS;
+}
+
+ULONGLONG
+EspBenchNow(
+	VOID
+)
+
+/*++
+
+Routine Description:
+
+	This routine returns the performance counter.
+
+Arguments:
+
+	None.
+
+Return Value:
+
+	Performance counter ticks.
+
+--*/
+
+{
+	LARGE_INTEGER Counter;
+
+	QueryPerformanceCounter(&Counter);
+	return (ULONGLONG)Counter.QuadPart;
+}
+
+double
+EspBenchMicroseconds(
+	_In_ ULONGLONG Ticks
+)
+
+/*++
+
+Routine Description:
+
+	This routine converts performance counter ticks to microseconds.
+
+Arguments:
+
+	Ticks - Supplies the tick count.
+
+Return Value:
+
+	Microseconds.
+
+--*/
+
+{
+	return (double)Ticks * 1000000.0 / (double)EspBenchFrequency.QuadPart;
+}
+
+ULONGLONG
+EspBenchTicksFromUnits(
+	_In_ ULONGLONG Units
+)
+
+/*++
+
+Routine Description:
+
+	This routine converts a duration in the 100ns units of the driver
+	timestamps to performance counter ticks, so driver and user mode
+	latencies can share the sample arrays.
+
+Arguments:
+
+	Units - Supplies the duration in 100ns units.
+
+Return Value:
+
+	Performance counter ticks.
+
+--*/
+
+{
+	return (ULONGLONG)((double)Units * (double)EspBenchFrequency.QuadPart / 10000000.0);
+}
+
+DWORD
+EspBenchSamplesInitialize(
+	_Out_ PESP_BENCH_SAMPLES Samples,
+	_In_ ULONG Capacity
+)
+
+/*++
+
+Routine Description:
+
+	This routine allocates an empty sample array. The array grows past its
+	initial capacity when it has to, so the capacity is only a hint that
+	keeps reallocation out of the measured loops.
+
+Arguments:
+
+	Samples - Supplies the array to initialize.
+
+	Capacity - Supplies the initial capacity.
+
+Return Value:
+
+	Win32 error code.
+
+--*/
+
+{
+	ZeroMemory(Samples, sizeof(*Samples));
+	if (Capacity == 0) {
+		Capacity = 1;
+	}
+
+	Samples->Values = malloc(Capacity * sizeof(ULONGLONG));
+	if (Samples->Values == NULL) {
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	Samples->Capacity = Capacity;
+	return ERROR_SUCCESS;
+}
+
+VOID
+EspBenchSamplesFree(
+	_Inout_ PESP_BENCH_SAMPLES Samples
+)
+
+/*++
+
+Routine Description:
+
+	This routine frees a sample array.
+
+Arguments:
+
+	Samples - Supplies the array.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	free(Samples->Values);
+	ZeroMemory(Samples, sizeof(*Samples));
+}
+
+static
+BOOLEAN
+EspBenchSamplesGrow(
+	_Inout_ PESP_BENCH_SAMPLES Samples,
+	_In_ ULONG Needed
+)
+
+/*++
+
+Routine Description:
+
+	This routine makes room for Needed more samples.
+
+Arguments:
+
+	Samples - Supplies the array.
+
+	Needed - Supplies the number of samples to make room for.
+
+Return Value:
+
+	FALSE if the array could not grow.
+
+--*/
+
+{
+	ULONG Capacity;
+	PULONGLONG Values;
+
+	if (Samples->Capacity - Samples->Count >= Needed) {
+		return TRUE;
+	}
+
+	Capacity = Samples->Capacity;
+	while (Capacity - Samples->Count < Needed) {
+		Capacity *= 2;
+	}
+
+	Values = realloc(Samples->Values, Capacity * sizeof(ULONGLONG));
+	if (Values == NULL) {
+		return FALSE;
+	}
+
+	Samples->Values = Values;
+	Samples->Capacity = Capacity;
+	return TRUE;
+}
+
+VOID
+EspBenchSamplesAdd(
+	_Inout_ PESP_BENCH_SAMPLES Samples,
+	_In_ ULONGLONG Value
+)
+
+/*++
+
+Routine Description:
+
+	This routine appends a sample. A sample that cannot be stored is
+	dropped; the count printed with the percentiles shows it.
+
+Arguments:
+
+	Samples - Supplies the array.
+
+	Value - Supplies the sample.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	if (!EspBenchSamplesGrow(Samples, 1)) {
+		return;
+	}
+
+	Samples->Values[Samples->Count] = Value;
+	Samples->Count += 1;
+	Samples->Sorted = FALSE;
+}
+
+DWORD
+EspBenchSamplesMerge(
+	_Inout_ PESP_BENCH_SAMPLES Samples,
+	_In_ PESP_BENCH_SAMPLES Other
+)
+
+/*++
+
+Routine Description:
+
+	This routine appends the samples of another array.
+
+Arguments:
+
+	Samples - Supplies the array to append to.
+
+	Other - Supplies the array to append.
+
+Return Value:
+
+	Win32 error code.
+
+--*/
+
+{
+	if (!EspBenchSamplesGrow(Samples, Other->Count)) {
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	CopyMemory(&Samples->Values[Samples->Count], Other->Values, Other->Count * sizeof(ULONGLONG));
+	Samples->Count += Other->Count;
+	Samples->Sorted = FALSE;
+	return ERROR_SUCCESS;
+}
+
+static
+int
+__cdecl
+EspBenchCompareSamples(
+	_In_ const void* Left,
+	_In_ const void* Right
+)
+{
+	ULONGLONG LeftValue;
+	ULONGLONG RightValue;
+
+	LeftValue = *(const ULONGLONG*)Left;
+	RightValue = *(const ULONGLONG*)Right;
+	return (LeftValue > RightValue) - (LeftValue < RightValue);
+}
+
+ULONGLONG
+EspBenchSamplesPercentile(
+	_Inout_ PESP_BENCH_SAMPLES Samples,
+	_In_ ULONG Permille
+)
+
+/*++
+
+Routine Description:
+
+	This routine returns the nearest-rank percentile of the samples.
+
+Arguments:
+
+	Samples - Supplies the array. It is sorted on the first call.
+
+	Permille - Supplies the percentile in thousandths, ESP_BENCH_MAX for
+		the largest sample.
+
+Return Value:
+
+	The sample at that rank, zero if the array is empty.
+
+--*/
+
+{
+	ULONGLONG Rank;
+
+	if (Samples->Count == 0) {
+		return 0;
+	}
+
+	if (!Samples->Sorted) {
+		qsort(Samples->Values, Samples->Count, sizeof(ULONGLONG), EspBenchCompareSamples);
+		Samples->Sorted = TRUE;
+	}
+
+	Rank = ((ULONGLONG)Samples->Count * Permille + 999) / 1000;
+	if (Rank == 0) {
+		Rank = 1;
+	}
+
+	return Samples->Values[Rank - 1];
+}
+
+VOID
+EspBenchPrintSamples(
+	_In_z_ PCSTR Label,
+	_Inout_ PESP_BENCH_SAMPLES Samples
+)
+
+/*++
+
+Routine Description:
+
+	This routine prints the count, median, p99 and maximum of a sample
+	array of performance counter ticks.
+
+Arguments:
+
+	Label - Supplies the line label.
+
+	Samples - Supplies the array.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	printf("  %-24s n=%-9lu p50=%10.1fus p99=%10.1fus max=%10.1fus\n",
+		Label,
+		Samples->Count,
+		EspBenchMicroseconds(EspBenchSamplesPercentile(Samples, ESP_BENCH_P50)),
+		EspBenchMicroseconds(EspBenchSamplesPercentile(Samples, ESP_BENCH_P99)),
+		EspBenchMicroseconds(EspBenchSamplesPercentile(Samples, ESP_BENCH_MAX)));
+}
+
+static
+VOID
+EspBenchUsage(
+	VOID
+)
+{
+	ULONG Index;
+
+	fprintf(stderr, "usage: espbench <command> [arguments]\n");
+	for (Index = 0; Index < ARRAYSIZE(EspBenchCommands); Index += 1) {
+		fprintf(stderr, "  %s\n", EspBenchCommands[Index].Usage);
+	}
+}
+
+int
+__cdecl
+main(
+	_In_ int Argc,
+	_In_reads_(Argc) char* Argv[]
+)
+{
+	ULONG Index;
+
+	QueryPerformanceFrequency(&EspBenchFrequency);
+
+	if (Argc < 2) {
+		EspBenchUsage();
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	for (Index = 0; Index < ARRAYSIZE(EspBenchCommands); Index += 1) {
+		if (strcmp(Argv[1], EspBenchCommands[Index].Name) == 0) {
+			return (int)EspBenchCommands[Index].Routine(Argc - 2, &Argv[2]);
+		}
+	}
+
+	EspBenchUsage();
+	return ERROR_INVALID_PARAMETER;
+}
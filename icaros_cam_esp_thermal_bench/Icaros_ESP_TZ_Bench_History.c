@@ -0,0 +1,692 @@
+/*++
+
+Module Name:
+
+	history.c
+
+Abstract:
+
+	This file contains the history command. It decodes the raw sample
+	blocks and the summaries returned by IOCTL_ESP_TZ_QUERY_HISTORY, and
+	measures the encoded size and the ingest cost of a batch of samples.
+
+Environment:
+
+	User mode
+
+--*/
+
+#include "Bench.h"
+
+//
+// Records returned per IOCTL_ESP_TZ_QUERY_HISTORY.
+//
+
+#define ESP_BENCH_HISTORY_RECORDS 64
+
+//
+// The history keeps 128 raw blocks of roughly a hundred samples each, so
+// the default benchmark fits without the oldest blocks being reused.
+//
+
+#define ESP_BENCH_HISTORY_DEFAULT_SAMPLES 8192
+
+typedef
+BOOLEAN
+ESP_BENCH_HISTORY_SAMPLE_ROUTINE(
+	_In_ PVOID Context,
+	_In_ ULONGLONG Time,
+	_In_ ULONG Temperature
+	);
+
+typedef ESP_BENCH_HISTORY_SAMPLE_ROUTINE *PESP_BENCH_HISTORY_SAMPLE_ROUTINE;
+
+typedef struct _ESP_BENCH_HISTORY_CHECK {
+	PESP_TZ_TIMED_SAMPLE Samples;
+	ULONG Count;
+	ULONG Next;                     // Next pushed sample to match.
+	ULONG Matched;
+	ULONG Mismatched;
+	ULONGLONG Offset;               // System time minus interrupt time.
+} ESP_BENCH_HISTORY_CHECK, *PESP_BENCH_HISTORY_CHECK;
+
+static
+ULONGLONG
+EspBenchSystemTime(
+	VOID
+)
+{
+	FILETIME Time;
+
+	GetSystemTimePreciseAsFileTime(&Time);
+	return ((ULONGLONG)Time.dwHighDateTime << 32) | Time.dwLowDateTime;
+}
+
+static
+BOOLEAN
+EspBenchDecodeVarint(
+	_In_reads_(Length) const UCHAR* Data,
+	_In_ ULONG Length,
+	_Inout_ PULONG Offset,
+	_Out_ PULONGLONG Value
+)
+
+/*++
+
+Routine Description:
+
+	This routine reads one varint, seven bits per byte, least significant
+	group first, with the high bit set on all but the last byte.
+
+Arguments:
+
+	Data, Length - Supply the encoded bytes.
+
+	Offset - Supplies the offset to read at, advanced past the varint.
+
+	Value - Receives the value.
+
+Return Value:
+
+	FALSE if the varint runs past Length or is longer than 64 bits.
+
+--*/
+
+{
+	UCHAR Byte;
+	ULONG Shift;
+
+	*Value = 0;
+	for (Shift = 0; Shift < 64; Shift += 7) {
+		if (*Offset >= Length) {
+			return FALSE;
+		}
+
+		Byte = Data[*Offset];
+		*Offset += 1;
+		*Value |= (ULONGLONG)(Byte & 0x7F) << Shift;
+		if ((Byte & 0x80) == 0) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static
+BOOLEAN
+EspBenchDecodeBlock(
+	_In_ PESP_TZ_HISTORY_BLOCK Block,
+	_In_ PESP_BENCH_HISTORY_SAMPLE_ROUTINE Routine,
+	_In_ PVOID Context
+)
+
+/*++
+
+Routine Description:
+
+	This routine decodes the samples of a raw history block. Each sample is
+	the milliseconds since the previous one and the zigzag encoded change
+	in tenths of a Kelvin, both relative to the block start for the first.
+
+Arguments:
+
+	Block - Supplies the block.
+
+	Routine - Supplies the routine called for each sample, with its system
+		time and temperature. Decoding stops when it returns FALSE.
+
+	Context - Supplies the routine context.
+
+Return Value:
+
+	FALSE if the block is malformed.
+
+--*/
+
+{
+	ULONGLONG Delta;
+	ULONGLONG Elapsed;
+	ULONG Index;
+	ULONG Offset;
+	ULONG Temperature;
+	ULONGLONG Time;
+
+	if (Block->Length > ESP_TZ_HISTORY_BLOCK_DATA) {
+		return FALSE;
+	}
+
+	Time = Block->StartTime;
+	Temperature = Block->StartTemperature;
+	Offset = 0;
+	for (Index = 0; Index < Block->Count; Index += 1) {
+		if (!EspBenchDecodeVarint(Block->Data, Block->Length, &Offset, &Elapsed) ||
+			!EspBenchDecodeVarint(Block->Data, Block->Length, &Offset, &Delta)) {
+
+			return FALSE;
+		}
+
+		Time += Elapsed * 10000;
+		Temperature += (ULONG)((Delta >> 1) ^ (0 - (Delta & 1)));
+		if (!Routine(Context, Time, Temperature)) {
+			break;
+		}
+	}
+
+	return (Offset == Block->Length);
+}
+
+static
+DWORD
+EspBenchQueryHistory(
+	_In_ HANDLE Device,
+	_In_ ULONG Tier,
+	_In_ ULONGLONG StartTime,
+	_In_ ULONGLONG EndTime,
+	_Out_writes_bytes_(Length) PESP_TZ_HISTORY_BUFFER Buffer,
+	_In_ ULONG Length
+)
+{
+	DWORD Error;
+	ESP_TZ_HISTORY_QUERY Query;
+
+	Query.Version = ESP_TZ_HISTORY_VERSION;
+	Query.Tier = Tier;
+	Query.StartTime = StartTime;
+	Query.EndTime = EndTime;
+	Error = EspBenchIoctl(Device, IOCTL_ESP_TZ_QUERY_HISTORY, &Query, sizeof(Query), Buffer, Length, NULL);
+	if (Error != ERROR_SUCCESS) {
+		fprintf(stderr, "IOCTL_ESP_TZ_QUERY_HISTORY Failed. %lu\n", Error);
+	}
+
+	return Error;
+}
+
+static
+BOOLEAN
+EspBenchPrintSample(
+	_In_ PVOID Context,
+	_In_ ULONGLONG Time,
+	_In_ ULONG Temperature
+)
+{
+	ULONGLONG Origin;
+
+	Origin = *(PULONGLONG)Context;
+	printf("  %12.3fs %4lu.%lu K\n",
+		(double)(LONGLONG)(Time - Origin) / 10000000.0,
+		Temperature / 10,
+		Temperature % 10);
+
+	return TRUE;
+}
+
+static
+DWORD
+EspBenchHistoryDump(
+	_In_ HANDLE Device,
+	_In_ ULONG Tier,
+	_In_ ULONG Seconds
+)
+
+/*++
+
+Routine Description:
+
+	This routine prints the history of the last Seconds from one tier:
+	every decoded sample of the raw tier, or the summaries of the others.
+	Times are printed relative to now.
+
+Arguments:
+
+	Device - Supplies a handle opened without overlapped I/O.
+
+	Tier - Supplies the tier.
+
+	Seconds - Supplies how far back to go.
+
+Return Value:
+
+	Win32 error code.
+
+--*/
+
+{
+	PESP_TZ_HISTORY_BLOCK Block;
+	PESP_TZ_HISTORY_BUFFER Buffer;
+	ULONGLONG Bytes;
+	ULONG Count;
+	ULONGLONG EndTime;
+	DWORD Error;
+	ULONG Index;
+	ULONG Length;
+	ULONGLONG Samples;
+	ULONGLONG StartTime;
+	PESP_TZ_HISTORY_SUMMARY Summary;
+
+	Length = FIELD_OFFSET(ESP_TZ_HISTORY_BUFFER, Blocks[ESP_BENCH_HISTORY_RECORDS]);
+	Buffer = malloc(Length);
+	if (Buffer == NULL) {
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	EndTime = EspBenchSystemTime();
+	StartTime = EndTime - (ULONGLONG)Seconds * 10000000;
+	Bytes = 0;
+	Samples = 0;
+	Count = 0;
+
+	do {
+		Error = EspBenchQueryHistory(Device, Tier, StartTime, EndTime, Buffer, Length);
+		if (Error != ERROR_SUCCESS) {
+			goto HistoryDumpEnd;
+		}
+
+		for (Index = 0; Index < Buffer->Count; Index += 1) {
+			if (Tier == ESP_TZ_HISTORY_TIER_RAW) {
+				Block = &Buffer->Blocks[Index];
+				if (!EspBenchDecodeBlock(Block, EspBenchPrintSample, &EndTime)) {
+					printf("  block at %llu is malformed\n", Block->StartTime);
+				}
+
+				Bytes += Block->Length;
+				Samples += Block->Count;
+				StartTime = Block->StartTime + (ULONGLONG)Block->Duration * 10000 + 1;
+			}
+			else {
+				Summary = &Buffer->Summaries[Index];
+				printf("  %12.3fs min %4lu.%lu mean %4lu.%lu max %4lu.%lu K, %lu samples\n",
+					(double)(LONGLONG)(Summary->StartTime - EndTime) / 10000000.0,
+					Summary->Minimum / 10, Summary->Minimum % 10,
+					Summary->Mean / 10, Summary->Mean % 10,
+					Summary->Maximum / 10, Summary->Maximum % 10,
+					Summary->Count);
+
+				StartTime = Summary->StartTime + 1;
+			}
+		}
+
+		Count += Buffer->Count;
+
+	} while ((Buffer->Flags & ESP_TZ_HISTORY_FLAG_MORE) != 0 && Buffer->Count != 0);
+
+	if (Tier == ESP_TZ_HISTORY_TIER_RAW && Samples != 0) {
+		printf("%lu blocks, %llu samples, %.2f encoded bytes per sample\n",
+			Count,
+			Samples,
+			(double)Bytes / (double)Samples);
+	}
+	else {
+		printf("%lu records\n", Count);
+	}
+
+HistoryDumpEnd:
+
+	free(Buffer);
+	return Error;
+}
+
+static
+BOOLEAN
+EspBenchFindLastSample(
+	_In_ PVOID Context,
+	_In_ ULONGLONG Time,
+	_In_ ULONG Temperature
+)
+{
+	UNREFERENCED_PARAMETER(Temperature);
+
+	*(PULONGLONG)Context = Time;
+	return TRUE;
+}
+
+static
+BOOLEAN
+EspBenchCheckSample(
+	_In_ PVOID Context,
+	_In_ ULONGLONG Time,
+	_In_ ULONG Temperature
+)
+
+/*++
+
+Routine Description:
+
+	This routine matches a decoded sample against the samples pushed by the
+	benchmark. Samples recorded at other times are someone else's and are
+	skipped.
+
+Arguments:
+
+	Context - Supplies the check state.
+
+	Time - Supplies the decoded system time.
+
+	Temperature - Supplies the decoded temperature.
+
+Return Value:
+
+	TRUE to go on decoding.
+
+--*/
+
+{
+	PESP_BENCH_HISTORY_CHECK Check;
+	ULONGLONG Expected;
+
+	Check = Context;
+	while (Check->Next < Check->Count) {
+
+		//
+		// The history keeps millisecond times.
+		//
+
+		Expected = (Check->Samples[Check->Next].Timestamp + Check->Offset) / 10000 * 10000;
+		if (Expected > Time) {
+			break;
+		}
+
+		if (Expected == Time) {
+			if (Check->Samples[Check->Next].Temperature == Temperature) {
+				Check->Matched += 1;
+			}
+			else {
+				Check->Mismatched += 1;
+			}
+
+			Check->Next += 1;
+			break;
+		}
+
+		Check->Next += 1;
+	}
+
+	return TRUE;
+}
+
+static
+DWORD
+EspBenchHistoryBenchmark(
+	_In_ HANDLE Device,
+	_In_ ULONG Count,
+	_In_ ULONG Spacing
+)
+
+/*++
+
+Routine Description:
+
+	This routine pushes Count samples Spacing milliseconds apart with
+	IOCTL_ESP_TZ_SET_TEMPERATURES, then reads them back from the raw tier.
+	It prints the ingest time per sample, the encoded bytes per sample and
+	whether the decoded samples match the pushed ones.
+
+	N.B. The samples are back-dated so they are recorded with their own
+		spacing. They must start after the newest sample already in the
+		history, or each one would open a block of its own, so the
+		benchmark waits until there is room behind the present.
+
+		The ingest time is measured from user mode and covers the whole
+		batch path, filtering and threshold checks included, not the
+		history alone. A FilterMode other than none makes the recorded
+		values differ from the pushed ones.
+
+Arguments:
+
+	Device - Supplies a handle opened without overlapped I/O.
+
+	Count - Supplies the number of samples.
+
+	Spacing - Supplies the milliseconds between samples.
+
+Return Value:
+
+	Win32 error code.
+
+--*/
+
+{
+	PESP_TZ_SAMPLE_BATCH Batch;
+	ULONG BatchCount;
+	ULONG BatchLength;
+	PESP_TZ_HISTORY_BLOCK Block;
+	ULONG Blocks;
+	PESP_TZ_HISTORY_BUFFER Buffer;
+	ULONGLONG Bytes;
+	ESP_BENCH_HISTORY_CHECK Check;
+	ULONGLONG Elapsed;
+	DWORD Error;
+	ULONG Index;
+	ULONGLONG InterruptTime;
+	ULONGLONG LastSample;
+	ULONG Length;
+	ULONG Offset;
+	ULONGLONG Random;
+	ULONGLONG Samples;
+	ULONGLONG Span;
+	ULONGLONG Start;
+	ULONGLONG StartTime;
+	ULONG Temperature;
+
+	ZeroMemory(&Check, sizeof(Check));
+	Length = FIELD_OFFSET(ESP_TZ_HISTORY_BUFFER, Blocks[ESP_BENCH_HISTORY_RECORDS]);
+	BatchLength = FIELD_OFFSET(ESP_TZ_SAMPLE_BATCH, Samples[ESP_TZ_MAX_BATCH_SAMPLES]);
+	Buffer = malloc(Length);
+	Batch = malloc(BatchLength);
+	Check.Samples = malloc((size_t)Count * sizeof(ESP_TZ_TIMED_SAMPLE));
+	Check.Count = Count;
+	if (Buffer == NULL || Batch == NULL || Check.Samples == NULL) {
+		Error = ERROR_NOT_ENOUGH_MEMORY;
+		goto HistoryBenchmarkEnd;
+	}
+
+	//
+	// Find the newest sample recorded within the span the benchmark needs.
+	//
+
+	Span = (ULONGLONG)Count * Spacing * 10000;
+	QueryInterruptTimePrecise(&InterruptTime);
+	Check.Offset = EspBenchSystemTime() - InterruptTime;
+	StartTime = InterruptTime + Check.Offset - Span;
+	LastSample = 0;
+
+	do {
+		Error = EspBenchQueryHistory(Device,
+			ESP_TZ_HISTORY_TIER_RAW,
+			StartTime,
+			InterruptTime + Check.Offset,
+			Buffer,
+			Length);
+
+		if (Error != ERROR_SUCCESS) {
+			goto HistoryBenchmarkEnd;
+		}
+
+		for (Index = 0; Index < Buffer->Count; Index += 1) {
+			EspBenchDecodeBlock(&Buffer->Blocks[Index], EspBenchFindLastSample, &LastSample);
+			StartTime = Buffer->Blocks[Index].StartTime + (ULONGLONG)Buffer->Blocks[Index].Duration * 10000 + 1;
+		}
+
+	} while ((Buffer->Flags & ESP_TZ_HISTORY_FLAG_MORE) != 0 && Buffer->Count != 0);
+
+	if (LastSample != 0) {
+		LastSample = LastSample - Check.Offset + 10000;
+		QueryInterruptTimePrecise(&InterruptTime);
+		if (LastSample + Span > InterruptTime) {
+			printf("Waiting %.1fs for room behind the newest recorded sample...\n",
+				(double)(LastSample + Span - InterruptTime) / 10000000.0);
+
+			Sleep((DWORD)((LastSample + Span - InterruptTime) / 10000) + 1);
+		}
+	}
+
+	//
+	// A random walk of one tenth of a Kelvin per step, like a slowly
+	// changing sensor.
+	//
+
+	QueryInterruptTimePrecise(&InterruptTime);
+	Random = InterruptTime | 1;
+	Temperature = 3000;
+
+	//
+	// Put the samples in the middle of a millisecond so the driver, which
+	// maps them to system time on its own clock reading, truncates them to
+	// the same millisecond as the check does.
+	//
+
+	Start = InterruptTime - Span;
+	Start = Start - (Start + Check.Offset) % 10000 + 5000;
+	for (Index = 0; Index < Count; Index += 1) {
+		Random ^= Random << 13;
+		Random ^= Random >> 7;
+		Random ^= Random << 17;
+		Temperature = Temperature + (ULONG)(Random % 3) - 1;
+		Check.Samples[Index].Timestamp = Start + (ULONGLONG)Index * Spacing * 10000;
+		Check.Samples[Index].Temperature = Temperature;
+		Check.Samples[Index].Reserved = 0;
+	}
+
+	Elapsed = 0;
+	for (Offset = 0; Offset < Count; Offset += BatchCount) {
+		BatchCount = min(Count - Offset, ESP_TZ_MAX_BATCH_SAMPLES);
+		Batch->Version = ESP_TZ_SAMPLE_BATCH_VERSION;
+		Batch->Count = BatchCount;
+		CopyMemory(Batch->Samples, &Check.Samples[Offset], BatchCount * sizeof(ESP_TZ_TIMED_SAMPLE));
+
+		Start = EspBenchNow();
+		Error = EspBenchIoctl(Device,
+			IOCTL_ESP_TZ_SET_TEMPERATURES,
+			Batch,
+			FIELD_OFFSET(ESP_TZ_SAMPLE_BATCH, Samples[BatchCount]),
+			NULL,
+			0,
+			NULL);
+
+		Elapsed += EspBenchNow() - Start;
+		if (Error != ERROR_SUCCESS) {
+			fprintf(stderr, "IOCTL_ESP_TZ_SET_TEMPERATURES Failed. %lu\n", Error);
+			goto HistoryBenchmarkEnd;
+		}
+	}
+
+	//
+	// Read back the blocks that start inside the benchmark span; a block
+	// holding older samples as well would skew the size.
+	//
+
+	StartTime = Check.Samples[0].Timestamp + Check.Offset;
+	Blocks = 0;
+	Bytes = 0;
+	Samples = 0;
+
+	do {
+		Error = EspBenchQueryHistory(Device,
+			ESP_TZ_HISTORY_TIER_RAW,
+			StartTime,
+			Check.Samples[Count - 1].Timestamp + Check.Offset,
+			Buffer,
+			Length);
+
+		if (Error != ERROR_SUCCESS) {
+			goto HistoryBenchmarkEnd;
+		}
+
+		for (Index = 0; Index < Buffer->Count; Index += 1) {
+			Block = &Buffer->Blocks[Index];
+			if (!EspBenchDecodeBlock(Block, EspBenchCheckSample, &Check)) {
+				printf("  block at %llu is malformed\n", Block->StartTime);
+			}
+
+			if (Block->StartTime >= Check.Samples[0].Timestamp + Check.Offset - 10000) {
+				Blocks += 1;
+				Bytes += Block->Length;
+				Samples += Block->Count;
+			}
+
+			StartTime = Block->StartTime + (ULONGLONG)Block->Duration * 10000 + 1;
+		}
+
+	} while ((Buffer->Flags & ESP_TZ_HISTORY_FLAG_MORE) != 0 && Buffer->Count != 0);
+
+	printf("History: %lu samples %lu ms apart in batches of %lu\n", Count, Spacing, (ULONG)ESP_TZ_MAX_BATCH_SAMPLES);
+	printf("  ingest: %.0f ns per sample\n", EspBenchMicroseconds(Elapsed) * 1000.0 / Count);
+	if (Samples != 0) {
+		printf("  encoded: %.2f bytes per sample, %.2f of block storage (%lu blocks)\n",
+			(double)Bytes / (double)Samples,
+			(double)Blocks * sizeof(ESP_TZ_HISTORY_BLOCK) / (double)Samples,
+			Blocks);
+	}
+
+	printf("  decoded: %lu match, %lu differ, %lu missing\n",
+		Check.Matched,
+		Check.Mismatched,
+		Count - Check.Matched - Check.Mismatched);
+
+HistoryBenchmarkEnd:
+
+	free(Check.Samples);
+	free(Batch);
+	free(Buffer);
+	return Error;
+}
+
+DWORD
+EspBenchHistory(
+	_In_ int Argc,
+	_In_reads_(Argc) char* Argv[]
+)
+
+/*++
+
+Routine Description:
+
+	This routine runs the history subcommands:
+
+		history dump [Tier] [Seconds]
+		history bench [Samples] [SpacingMs]
+
+Arguments:
+
+	Argc, Argv - Supply the subcommand and its arguments.
+
+Return Value:
+
+	Win32 error code.
+
+--*/
+
+{
+	ULONG Count;
+	HANDLE Device;
+	DWORD Error;
+	ULONG Spacing;
+
+	if (Argc < 1) {
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	Error = EspBenchOpenDevice(FALSE, &Device);
+	if (Error != ERROR_SUCCESS) {
+		return Error;
+	}
+
+	if (strcmp(Argv[0], "dump") == 0) {
+		Error = EspBenchHistoryDump(Device,
+			(Argc > 1) ? strtoul(Argv[1], NULL, 0) : ESP_TZ_HISTORY_TIER_RAW,
+			(Argc > 2) ? strtoul(Argv[2], NULL, 0) : 60);
+	}
+	else if (strcmp(Argv[0], "bench") == 0) {
+		Count = (Argc > 1) ? strtoul(Argv[1], NULL, 0) : ESP_BENCH_HISTORY_DEFAULT_SAMPLES;
+		Spacing = (Argc > 2) ? strtoul(Argv[2], NULL, 0) : 1;
+		Error = (Count != 0 && Spacing != 0) ?
+			EspBenchHistoryBenchmark(Device, Count, Spacing) :
+			ERROR_INVALID_PARAMETER;
+	}
+	else {
+		Error = ERROR_INVALID_PARAMETER;
+	}
+
+	CloseHandle(Device);
+	return Error;
+}
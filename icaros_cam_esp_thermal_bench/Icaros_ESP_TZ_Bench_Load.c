@@ -0,0 +1,1078 @@
+/*++
+
+Module Name:
+
+	load.c
+
+Abstract:
+
+	This file contains the load command. It runs producer threads pushing a
+	temperature waveform, waiter threads keeping a set number of reads
+	pending with random bounds and timeouts, and optionally a thread
+	toggling the camera, once for each thread count asked for. Each run
+	reports the throughput and latency percentiles seen from user mode
+	next to the lock and interrupt counters of the driver.
+
+Environment:
+
+	User mode
+
+--*/
+
+#include "Bench.h"
+#include <math.h>
+
+#define ESP_BENCH_MAX_THREAD_COUNTS 16
+
+//
+// Reads kept pending per handle, below the default client waiter quota
+// of 64 so a waiter thread is not rejected by its own reads.
+//
+
+#define ESP_BENCH_LOAD_READS_PER_CLIENT 48
+
+//
+// How often a waiter thread looks at the stop flag and retries the reads
+// the driver refused.
+//
+
+#define ESP_BENCH_LOAD_POLL_MS 50
+
+typedef enum _ESP_BENCH_WAVEFORM {
+	EspBenchWaveformSine,
+	EspBenchWaveformRamp,
+	EspBenchWaveformStep,
+	EspBenchWaveformWalk
+} ESP_BENCH_WAVEFORM;
+
+static const PCSTR EspBenchWaveformNames[] = { "sine", "ramp", "step", "walk" };
+
+typedef struct _ESP_BENCH_LOAD_CONFIG {
+	ULONG ThreadCounts[ESP_BENCH_MAX_THREAD_COUNTS];
+	ULONG ThreadCountCount;
+	ULONG Seconds;
+	ULONG Waiters;                  // Reads kept pending over all waiter threads.
+	ULONG Width;                    // Mean half-width of the read bounds, tenths of a Kelvin.
+	ULONG Timeout;                  // Mean read timeout in ms, -1 for none.
+	ESP_BENCH_WAVEFORM Waveform;
+	ULONG Base;                     // Waveform center, tenths of a Kelvin.
+	ULONG Amplitude;
+	ULONG Period;                   // Milliseconds.
+	ULONG Rate;                     // Samples per second per producer, zero for no pacing.
+	ULONG CameraPeriod;             // Milliseconds between camera toggles, zero for none.
+} ESP_BENCH_LOAD_CONFIG, *PESP_BENCH_LOAD_CONFIG;
+
+typedef struct _ESP_BENCH_LOAD_RUN {
+	PESP_BENCH_LOAD_CONFIG Config;
+	volatile LONG Stop;
+	volatile LONG Temperature;      // Last sample pushed by any producer.
+	ULONGLONG Start;
+} ESP_BENCH_LOAD_RUN, *PESP_BENCH_LOAD_RUN;
+
+typedef struct _ESP_BENCH_LOAD_READ {
+	OVERLAPPED Overlapped;
+	HANDLE Device;
+	THERMAL_WAIT_READ Input;
+	ESP_TZ_READ_RESULT Output;
+	ULONGLONG Issued;
+} ESP_BENCH_LOAD_READ, *PESP_BENCH_LOAD_READ;
+
+typedef struct _ESP_BENCH_LOAD_THREAD {
+	PESP_BENCH_LOAD_RUN Run;
+	HANDLE Thread;
+	ULONG Index;
+	ULONG Waiters;                  // Reads this thread keeps pending.
+	ULONGLONG Random;
+	ESP_BENCH_SAMPLES Latency;
+	ESP_BENCH_SAMPLES Crossing;
+	ULONGLONG Completed;
+	ULONGLONG Busy;                 // Refused with STATUS_DEVICE_BUSY.
+	ULONGLONG Failed;
+	DWORD Error;
+} ESP_BENCH_LOAD_THREAD, *PESP_BENCH_LOAD_THREAD;
+
+static
+ULONG
+EspBenchRandom(
+	_Inout_ PULONGLONG State
+)
+
+/*++
+
+Routine Description:
+
+	This routine returns the next value of a per-thread xorshift generator.
+
+Arguments:
+
+	State - Supplies the generator state, never zero.
+
+Return Value:
+
+	A pseudo-random 32-bit value.
+
+--*/
+
+{
+	ULONGLONG Value;
+
+	Value = *State;
+	Value ^= Value << 13;
+	Value ^= Value >> 7;
+	Value ^= Value << 17;
+	*State = Value;
+	return (ULONG)(Value >> 32);
+}
+
+static
+ULONG
+EspBenchExponential(
+	_Inout_ PULONGLONG State,
+	_In_ ULONG Mean
+)
+
+/*++
+
+Routine Description:
+
+	This routine draws from an exponential distribution, so most reads
+	time out soon and a few wait much longer than the mean.
+
+Arguments:
+
+	State - Supplies the generator state.
+
+	Mean - Supplies the mean.
+
+Return Value:
+
+	The value drawn.
+
+--*/
+
+{
+	double Uniform;
+
+	Uniform = ((double)EspBenchRandom(State) + 1.0) / 4294967297.0;
+	return (ULONG)(-log(Uniform) * (double)Mean);
+}
+
+static
+ULONG
+EspBenchWaveform(
+	_In_ PESP_BENCH_LOAD_CONFIG Config,
+	_In_ ULONGLONG Elapsed,
+	_In_ ULONG Phase,
+	_Inout_ PULONGLONG State,
+	_In_ ULONG Previous
+)
+
+/*++
+
+Routine Description:
+
+	This routine returns the next sample of the producer waveform.
+
+Arguments:
+
+	Config - Supplies the load configuration.
+
+	Elapsed - Supplies the microseconds since the run started.
+
+	Phase - Supplies the producer phase in milliseconds, so producers do
+		not push the same value at the same time.
+
+	State - Supplies the producer random state.
+
+	Previous - Supplies the previous sample of this producer.
+
+Return Value:
+
+	The temperature in tenths of a Kelvin.
+
+--*/
+
+{
+	double Angle;
+	LONG Next;
+	double Position;
+
+	Position = fmod((double)Elapsed / 1000.0 + Phase, (double)Config->Period) / (double)Config->Period;
+	switch (Config->Waveform) {
+	case EspBenchWaveformRamp:
+		return Config->Base - Config->Amplitude + (ULONG)(2.0 * Config->Amplitude * Position);
+
+	case EspBenchWaveformStep:
+		return (Position < 0.5) ? Config->Base - Config->Amplitude : Config->Base + Config->Amplitude;
+
+	case EspBenchWaveformWalk:
+		Next = (LONG)Previous + (LONG)(EspBenchRandom(State) % 3) - 1;
+		if (Next < (LONG)(Config->Base - Config->Amplitude)) {
+			Next = (LONG)(Config->Base - Config->Amplitude);
+		}
+
+		if (Next > (LONG)(Config->Base + Config->Amplitude)) {
+			Next = (LONG)(Config->Base + Config->Amplitude);
+		}
+
+		return (ULONG)Next;
+
+	default:
+		Angle = 2.0 * 3.14159265358979 * Position;
+		return (ULONG)((double)Config->Base + (double)Config->Amplitude * sin(Angle));
+	}
+}
+
+static
+DWORD
+WINAPI
+EspBenchProducerThread(
+	_In_ LPVOID Parameter
+)
+
+/*++
+
+Routine Description:
+
+	This routine pushes the waveform with IOCTL_ESP_TZ_SET_TEMPERATURE
+	until the run stops, paced to the configured rate if there is one.
+
+Arguments:
+
+	Parameter - Supplies the thread state.
+
+Return Value:
+
+	Zero.
+
+--*/
+
+{
+	PESP_BENCH_LOAD_CONFIG Config;
+	HANDLE Device;
+	ULONGLONG Due;
+	DWORD Error;
+	ULONGLONG Issued;
+	ULONGLONG Sent;
+	PESP_BENCH_LOAD_RUN Run;
+	ULONG Temperature;
+	PESP_BENCH_LOAD_THREAD Thread;
+
+	Thread = Parameter;
+	Run = Thread->Run;
+	Config = Run->Config;
+	Temperature = Config->Base;
+	Sent = 0;
+
+	Thread->Error = EspBenchOpenDevice(FALSE, &Device);
+	if (Thread->Error != ERROR_SUCCESS) {
+		return 0;
+	}
+
+	while (Run->Stop == 0) {
+		Issued = EspBenchNow();
+		Temperature = EspBenchWaveform(Config,
+			(ULONGLONG)EspBenchMicroseconds(Issued - Run->Start),
+			Thread->Index * 37,
+			&Thread->Random,
+			Temperature);
+
+		Error = EspBenchIoctl(Device, IOCTL_ESP_TZ_SET_TEMPERATURE, &Temperature, sizeof(Temperature), NULL, 0, NULL);
+		if (Error == ERROR_SUCCESS) {
+			EspBenchSamplesAdd(&Thread->Latency, EspBenchNow() - Issued);
+			Thread->Completed += 1;
+			InterlockedExchange(&Run->Temperature, (LONG)Temperature);
+		}
+		else if (Error == ERROR_BUSY) {
+			Thread->Busy += 1;
+		}
+		else {
+			Thread->Failed += 1;
+		}
+
+		Sent += 1;
+		if (Config->Rate != 0) {
+			Due = Run->Start + EspBenchTicksFromUnits(Sent * 10000000ULL / Config->Rate);
+			while (Run->Stop == 0 && EspBenchNow() < Due) {
+				if (EspBenchMicroseconds(Due - EspBenchNow()) > 2000.0) {
+					Sleep(1);
+				}
+				else {
+					YieldProcessor();
+				}
+			}
+		}
+	}
+
+	CloseHandle(Device);
+	return 0;
+}
+
+static
+BOOLEAN
+EspBenchIssueLoadRead(
+	_In_ PESP_BENCH_LOAD_THREAD Thread,
+	_Inout_ PESP_BENCH_LOAD_READ Read
+)
+
+/*++
+
+Routine Description:
+
+	This routine sends one read with bounds drawn around the last sample
+	pushed and a random timeout, without waiting for it.
+
+Arguments:
+
+	Thread - Supplies the waiter thread state.
+
+	Read - Supplies the read slot.
+
+Return Value:
+
+	TRUE if the read is pending or will be reported through the completion
+	port, FALSE if the driver refused it outright.
+
+--*/
+
+{
+	PESP_BENCH_LOAD_CONFIG Config;
+	DWORD Error;
+	ULONG Low;
+	ULONG Temperature;
+
+	Config = Thread->Run->Config;
+	Temperature = (ULONG)Thread->Run->Temperature;
+	Low = 1 + EspBenchRandom(&Thread->Random) % (2 * Config->Width);
+	Read->Input.LowTemperature = (Temperature > Low) ? Temperature - Low : 0;
+	Read->Input.HighTemperature = Temperature + 1 + EspBenchRandom(&Thread->Random) % (2 * Config->Width);
+	Read->Input.Timeout = (Config->Timeout == (ULONG)-1) ?
+		(ULONG)-1 :
+		EspBenchExponential(&Thread->Random, Config->Timeout);
+
+	ZeroMemory(&Read->Overlapped, sizeof(Read->Overlapped));
+	Read->Issued = EspBenchNow();
+	if (!DeviceIoControl(Read->Device,
+		IOCTL_THERMAL_READ_TEMPERATURE,
+		&Read->Input,
+		sizeof(Read->Input),
+		&Read->Output,
+		sizeof(Read->Output),
+		NULL,
+		&Read->Overlapped)) {
+
+		Error = GetLastError();
+		if (Error != ERROR_IO_PENDING) {
+			if (Error == ERROR_BUSY) {
+				Thread->Busy += 1;
+			}
+			else {
+				Thread->Failed += 1;
+			}
+
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static
+DWORD
+WINAPI
+EspBenchWaiterThread(
+	_In_ LPVOID Parameter
+)
+
+/*++
+
+Routine Description:
+
+	This routine keeps its share of the reads pending until the run stops.
+	A read is sent again with new bounds as soon as it completes; reads the
+	driver refused are retried on the next poll.
+
+Arguments:
+
+	Parameter - Supplies the thread state.
+
+Return Value:
+
+	Zero.
+
+--*/
+
+{
+	DWORD Bytes;
+	ULONG Client;
+	ULONG ClientCount;
+	HANDLE* Clients;
+	ULONGLONG Completed;
+	PULONG Idle;
+	ULONG IdleCount;
+	ULONG Index;
+	ULONG_PTR Key;
+	LONG Outstanding;
+	LPOVERLAPPED Overlapped;
+	HANDLE Port;
+	PESP_BENCH_LOAD_READ Read;
+	PESP_BENCH_LOAD_READ Reads;
+	BOOL Success;
+	PESP_BENCH_LOAD_THREAD Thread;
+
+	Thread = Parameter;
+	if (Thread->Waiters == 0) {
+		return 0;
+	}
+
+	ClientCount = (Thread->Waiters + ESP_BENCH_LOAD_READS_PER_CLIENT - 1) / ESP_BENCH_LOAD_READS_PER_CLIENT;
+	Clients = calloc(ClientCount, sizeof(HANDLE));
+	Reads = calloc(Thread->Waiters, sizeof(ESP_BENCH_LOAD_READ));
+	Idle = calloc(Thread->Waiters, sizeof(ULONG));
+	Outstanding = 0;
+	Port = NULL;
+	if (Clients == NULL || Reads == NULL || Idle == NULL) {
+		Thread->Error = ERROR_NOT_ENOUGH_MEMORY;
+		goto WaiterThreadEnd;
+	}
+
+	for (Client = 0; Client < ClientCount; Client += 1) {
+		Clients[Client] = INVALID_HANDLE_VALUE;
+	}
+
+	Port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+	if (Port == NULL) {
+		Thread->Error = GetLastError();
+		goto WaiterThreadEnd;
+	}
+
+	for (Client = 0; Client < ClientCount; Client += 1) {
+		Thread->Error = EspBenchOpenDevice(TRUE, &Clients[Client]);
+		if (Thread->Error != ERROR_SUCCESS) {
+			goto WaiterThreadEnd;
+		}
+
+		if (CreateIoCompletionPort(Clients[Client], Port, 0, 0) == NULL) {
+			Thread->Error = GetLastError();
+			goto WaiterThreadEnd;
+		}
+	}
+
+	IdleCount = 0;
+	for (Index = 0; Index < Thread->Waiters; Index += 1) {
+		Reads[Index].Device = Clients[Index / ESP_BENCH_LOAD_READS_PER_CLIENT];
+		Idle[IdleCount] = Index;
+		IdleCount += 1;
+	}
+
+	while (Thread->Run->Stop == 0) {
+		while (IdleCount != 0) {
+			Read = &Reads[Idle[IdleCount - 1]];
+			if (!EspBenchIssueLoadRead(Thread, Read)) {
+				break;
+			}
+
+			IdleCount -= 1;
+			Outstanding += 1;
+		}
+
+		Overlapped = NULL;
+		Success = GetQueuedCompletionStatus(Port, &Bytes, &Key, &Overlapped, ESP_BENCH_LOAD_POLL_MS);
+		if (Overlapped == NULL) {
+			continue;
+		}
+
+		Completed = EspBenchNow();
+		Outstanding -= 1;
+		Read = CONTAINING_RECORD(Overlapped, ESP_BENCH_LOAD_READ, Overlapped);
+		if (!Success) {
+			if (GetLastError() == ERROR_BUSY) {
+				Thread->Busy += 1;
+			}
+			else {
+				Thread->Failed += 1;
+			}
+		}
+		else {
+			Thread->Completed += 1;
+			EspBenchSamplesAdd(&Thread->Latency, Completed - Read->Issued);
+			if (Bytes >= sizeof(ESP_TZ_READ_RESULT) && Read->Output.Reason == EspTzWaitSatisfied) {
+				EspBenchSamplesAdd(&Thread->Crossing,
+					EspBenchTicksFromUnits(Read->Output.CompletionTime - Read->Output.SampleTime));
+			}
+		}
+
+		Idle[IdleCount] = (ULONG)(Read - Reads);
+		IdleCount += 1;
+	}
+
+	//
+	// Cancel what is still pending and wait for every slot to come back
+	// before the buffers are freed. Cancelled reads are not counted.
+	//
+
+	for (Client = 0; Client < ClientCount; Client += 1) {
+		CancelIoEx(Clients[Client], NULL);
+	}
+
+	while (Outstanding != 0) {
+		Overlapped = NULL;
+		GetQueuedCompletionStatus(Port, &Bytes, &Key, &Overlapped, INFINITE);
+		if (Overlapped != NULL) {
+			Outstanding -= 1;
+		}
+	}
+
+WaiterThreadEnd:
+
+	if (Clients != NULL) {
+		for (Client = 0; Client < ClientCount; Client += 1) {
+			if (Clients[Client] != INVALID_HANDLE_VALUE && Clients[Client] != NULL) {
+				CloseHandle(Clients[Client]);
+			}
+		}
+	}
+
+	if (Port != NULL) {
+		CloseHandle(Port);
+	}
+
+	free(Idle);
+	free(Reads);
+	free(Clients);
+	return 0;
+}
+
+static
+DWORD
+WINAPI
+EspBenchCameraThread(
+	_In_ LPVOID Parameter
+)
+
+/*++
+
+Routine Description:
+
+	This routine toggles the camera on and off at the configured period
+	until the run stops.
+
+Arguments:
+
+	Parameter - Supplies the thread state.
+
+Return Value:
+
+	Zero.
+
+--*/
+
+{
+	HANDLE Device;
+	PESP_BENCH_LOAD_THREAD Thread;
+
+	Thread = Parameter;
+	Thread->Error = EspBenchOpenDevice(FALSE, &Device);
+	if (Thread->Error != ERROR_SUCCESS) {
+		return 0;
+	}
+
+	while (Thread->Run->Stop == 0) {
+		Sleep(Thread->Run->Config->CameraPeriod);
+		if (EspBenchIoctl(Device,
+			(Thread->Completed % 2 == 0) ? IOCTL_ESP_TZ_CAMERA_ON : IOCTL_ESP_TZ_CAMERA_OFF,
+			NULL,
+			0,
+			NULL,
+			0,
+			NULL) == ERROR_SUCCESS) {
+
+			Thread->Completed += 1;
+		}
+		else {
+			Thread->Failed += 1;
+		}
+	}
+
+	if (Thread->Completed % 2 != 0) {
+		EspBenchIoctl(Device, IOCTL_ESP_TZ_CAMERA_OFF, NULL, 0, NULL, 0, NULL);
+	}
+
+	CloseHandle(Device);
+	return 0;
+}
+
+static
+DWORD
+EspBenchStartThreads(
+	_In_ PESP_BENCH_LOAD_RUN Run,
+	_Inout_updates_(Count) PESP_BENCH_LOAD_THREAD Threads,
+	_In_ ULONG Count,
+	_In_ LPTHREAD_START_ROUTINE Routine,
+	_In_ ULONG Waiters
+)
+
+/*++
+
+Routine Description:
+
+	This routine initializes and starts a group of load threads. The
+	waiters are split as evenly as possible between the threads.
+
+Arguments:
+
+	Run - Supplies the run state.
+
+	Threads, Count - Supply the thread states.
+
+	Routine - Supplies the thread routine.
+
+	Waiters - Supplies the reads to keep pending over the group.
+
+Return Value:
+
+	Win32 error code.
+
+--*/
+
+{
+	DWORD Error;
+	ULONG Index;
+
+	for (Index = 0; Index < Count; Index += 1) {
+		Threads[Index].Run = Run;
+		Threads[Index].Index = Index;
+		Threads[Index].Waiters = Waiters / Count + ((Index < Waiters % Count) ? 1 : 0);
+		Threads[Index].Random = 0x9E3779B97F4A7C15ULL * (Index + 1) ^ Run->Start;
+		if (Threads[Index].Random == 0) {
+			Threads[Index].Random = 1;
+		}
+
+		Error = EspBenchSamplesInitialize(&Threads[Index].Latency, 65536);
+		if (Error == ERROR_SUCCESS) {
+			Error = EspBenchSamplesInitialize(&Threads[Index].Crossing, 65536);
+		}
+
+		if (Error != ERROR_SUCCESS) {
+			return Error;
+		}
+
+		Threads[Index].Thread = CreateThread(NULL, 0, Routine, &Threads[Index], 0, NULL);
+		if (Threads[Index].Thread == NULL) {
+			Error = GetLastError();
+			fprintf(stderr, "CreateThread() Failed. %lu\n", Error);
+			return Error;
+		}
+	}
+
+	return ERROR_SUCCESS;
+}
+
+static
+VOID
+EspBenchCollectThreads(
+	_Inout_updates_(Count) PESP_BENCH_LOAD_THREAD Threads,
+	_In_ ULONG Count,
+	_Inout_ PESP_BENCH_LOAD_THREAD Total
+)
+
+/*++
+
+Routine Description:
+
+	This routine waits for a group of load threads, adds their samples and
+	counters to Total and frees them.
+
+Arguments:
+
+	Threads, Count - Supply the thread states.
+
+	Total - Supplies the totals, with initialized sample arrays.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	ULONG Index;
+
+	for (Index = 0; Index < Count; Index += 1) {
+		if (Threads[Index].Thread != NULL) {
+			WaitForSingleObject(Threads[Index].Thread, INFINITE);
+			CloseHandle(Threads[Index].Thread);
+		}
+
+		if (Threads[Index].Error != ERROR_SUCCESS && Total->Error == ERROR_SUCCESS) {
+			Total->Error = Threads[Index].Error;
+		}
+
+		EspBenchSamplesMerge(&Total->Latency, &Threads[Index].Latency);
+		EspBenchSamplesMerge(&Total->Crossing, &Threads[Index].Crossing);
+		Total->Completed += Threads[Index].Completed;
+		Total->Busy += Threads[Index].Busy;
+		Total->Failed += Threads[Index].Failed;
+		EspBenchSamplesFree(&Threads[Index].Latency);
+		EspBenchSamplesFree(&Threads[Index].Crossing);
+	}
+}
+
+static
+DWORD
+EspBenchLoadRun(
+	_In_ HANDLE Device,
+	_In_ PESP_BENCH_LOAD_CONFIG Config,
+	_In_ ULONG ThreadCount
+)
+
+/*++
+
+Routine Description:
+
+	This routine runs the load with ThreadCount producers and ThreadCount
+	waiter threads, or the producers alone if no waiters are asked for, and
+	prints what it measured.
+
+Arguments:
+
+	Device - Supplies a handle opened without overlapped I/O, used for the
+		driver statistics.
+
+	Config - Supplies the load configuration.
+
+	ThreadCount - Supplies the number of producer and of waiter threads.
+
+Return Value:
+
+	Win32 error code.
+
+--*/
+
+{
+	ESP_TZ_LOAD_STATISTICS After;
+	ESP_TZ_LOAD_STATISTICS Before;
+	ESP_BENCH_LOAD_THREAD Camera;
+	ULONGLONG Drains;
+	double Elapsed;
+	DWORD Error;
+	ESP_BENCH_LOAD_THREAD Producers[64];
+	ESP_BENCH_LOAD_THREAD Reads;
+	ESP_BENCH_LOAD_RUN Run;
+	ESP_BENCH_LOAD_THREAD Sets;
+	ESP_BENCH_LOAD_THREAD Waiters[64];
+
+	ZeroMemory(&Run, sizeof(Run));
+	ZeroMemory(&Camera, sizeof(Camera));
+	ZeroMemory(Producers, sizeof(Producers));
+	ZeroMemory(Waiters, sizeof(Waiters));
+	ZeroMemory(&Sets, sizeof(Sets));
+	ZeroMemory(&Reads, sizeof(Reads));
+	Run.Config = Config;
+	Run.Temperature = (LONG)Config->Base;
+
+	if ((Error = EspBenchSamplesInitialize(&Sets.Latency, 65536)) != ERROR_SUCCESS ||
+		(Error = EspBenchSamplesInitialize(&Sets.Crossing, 1)) != ERROR_SUCCESS ||
+		(Error = EspBenchSamplesInitialize(&Reads.Latency, 65536)) != ERROR_SUCCESS ||
+		(Error = EspBenchSamplesInitialize(&Reads.Crossing, 65536)) != ERROR_SUCCESS) {
+
+		goto LoadRunEnd;
+	}
+
+	Error = EspBenchQueryLoadStatistics(Device, &Before);
+	if (Error != ERROR_SUCCESS) {
+		goto LoadRunEnd;
+	}
+
+	Run.Start = EspBenchNow();
+	Error = EspBenchStartThreads(&Run, Producers, ThreadCount, EspBenchProducerThread, 0);
+	if (Error == ERROR_SUCCESS && Config->Waiters != 0) {
+		Error = EspBenchStartThreads(&Run, Waiters, ThreadCount, EspBenchWaiterThread, Config->Waiters);
+	}
+
+	if (Error == ERROR_SUCCESS && Config->CameraPeriod != 0) {
+		Camera.Run = &Run;
+		Camera.Thread = CreateThread(NULL, 0, EspBenchCameraThread, &Camera, 0, NULL);
+	}
+
+	if (Error == ERROR_SUCCESS) {
+		Sleep(Config->Seconds * 1000);
+	}
+
+	InterlockedExchange(&Run.Stop, 1);
+	EspBenchCollectThreads(Producers, ThreadCount, &Sets);
+	EspBenchCollectThreads(Waiters, ThreadCount, &Reads);
+	if (Camera.Thread != NULL) {
+		WaitForSingleObject(Camera.Thread, INFINITE);
+		CloseHandle(Camera.Thread);
+	}
+
+	Elapsed = EspBenchMicroseconds(EspBenchNow() - Run.Start) / 1000000.0;
+	if (Error == ERROR_SUCCESS) {
+		Error = (Sets.Error != ERROR_SUCCESS) ? Sets.Error : Reads.Error;
+	}
+
+	if (Error != ERROR_SUCCESS) {
+		fprintf(stderr, "The run with %lu threads Failed. %lu\n", ThreadCount, Error);
+		goto LoadRunEnd;
+	}
+
+	Error = EspBenchQueryLoadStatistics(Device, &After);
+	if (Error != ERROR_SUCCESS) {
+		goto LoadRunEnd;
+	}
+
+	printf("%lu threads, %.1fs:\n", ThreadCount, Elapsed);
+	printf("  samples: %llu (%.0f/s), %llu busy, %llu failed\n",
+		Sets.Completed,
+		(double)Sets.Completed / Elapsed,
+		Sets.Busy,
+		Sets.Failed);
+
+	if (Config->Waiters != 0) {
+		printf("  reads: %llu (%.0f/s), %llu busy, %llu failed\n",
+			Reads.Completed,
+			(double)Reads.Completed / Elapsed,
+			Reads.Busy,
+			Reads.Failed);
+	}
+
+	if (Config->CameraPeriod != 0) {
+		printf("  camera toggles: %llu, %llu failed\n", Camera.Completed, Camera.Failed);
+	}
+
+	EspBenchPrintSamples("set temperature", &Sets.Latency);
+	if (Config->Waiters != 0) {
+		EspBenchPrintSamples("read completion", &Reads.Latency);
+		EspBenchPrintSamples("crossing to completion", &Reads.Crossing);
+	}
+
+	EspBenchPrintLoadStatistics(&After, &Before);
+
+	//
+	// The mailbox is drained by one consumer at a time, so its drain rate
+	// and batch size show whether it keeps up with the producers.
+	//
+
+	Drains = After.MailboxDrains - Before.MailboxDrains;
+	printf("  mailbox: %llu posted, %llu drains (%.0f/s, %.1f samples each), %llu published directly\n",
+		After.MailboxPosted - Before.MailboxPosted,
+		Drains,
+		(double)Drains / Elapsed,
+		(Drains != 0) ? (double)(After.MailboxPosted - Before.MailboxPosted) / (double)Drains : 0.0,
+		After.MailboxFull - Before.MailboxFull);
+
+LoadRunEnd:
+
+	EspBenchSamplesFree(&Reads.Crossing);
+	EspBenchSamplesFree(&Reads.Latency);
+	EspBenchSamplesFree(&Sets.Crossing);
+	EspBenchSamplesFree(&Sets.Latency);
+	return Error;
+}
+
+static
+BOOLEAN
+EspBenchParseLoadOption(
+	_In_z_ PCSTR Argument,
+	_Inout_ PESP_BENCH_LOAD_CONFIG Config
+)
+
+/*++
+
+Routine Description:
+
+	This routine applies one name=value argument of the load command.
+
+Arguments:
+
+	Argument - Supplies the argument.
+
+	Config - Supplies the configuration to update.
+
+Return Value:
+
+	FALSE if the argument is not understood.
+
+--*/
+
+{
+	char* End;
+	ULONG Index;
+	PCSTR Value;
+
+	Value = strchr(Argument, '=');
+	if (Value == NULL) {
+		return FALSE;
+	}
+
+	Value += 1;
+	if (strncmp(Argument, "threads=", 8) == 0) {
+		Config->ThreadCountCount = 0;
+		do {
+			if (Config->ThreadCountCount == ESP_BENCH_MAX_THREAD_COUNTS) {
+				return FALSE;
+			}
+
+			Config->ThreadCounts[Config->ThreadCountCount] = strtoul(Value, &End, 0);
+			if (End == Value ||
+				Config->ThreadCounts[Config->ThreadCountCount] == 0 ||
+				Config->ThreadCounts[Config->ThreadCountCount] > 64) {
+
+				return FALSE;
+			}
+
+			Config->ThreadCountCount += 1;
+			Value = End + 1;
+
+		} while (*End == ',');
+
+		return (*End == '\0');
+	}
+
+	if (strncmp(Argument, "wave=", 5) == 0) {
+		for (Index = 0; Index < ARRAYSIZE(EspBenchWaveformNames); Index += 1) {
+			if (strcmp(Value, EspBenchWaveformNames[Index]) == 0) {
+				Config->Waveform = (ESP_BENCH_WAVEFORM)Index;
+				return TRUE;
+			}
+		}
+
+		return FALSE;
+	}
+
+	if (strncmp(Argument, "timeout=", 8) == 0) {
+		Config->Timeout = (ULONG)strtol(Value, NULL, 0);
+		return TRUE;
+	}
+
+	if (strncmp(Argument, "seconds=", 8) == 0) {
+		Config->Seconds = strtoul(Value, NULL, 0);
+	}
+	else if (strncmp(Argument, "waiters=", 8) == 0) {
+		Config->Waiters = strtoul(Value, NULL, 0);
+	}
+	else if (strncmp(Argument, "width=", 6) == 0) {
+		Config->Width = strtoul(Value, NULL, 0);
+	}
+	else if (strncmp(Argument, "base=", 5) == 0) {
+		Config->Base = strtoul(Value, NULL, 0);
+	}
+	else if (strncmp(Argument, "amplitude=", 10) == 0) {
+		Config->Amplitude = strtoul(Value, NULL, 0);
+	}
+	else if (strncmp(Argument, "period=", 7) == 0) {
+		Config->Period = strtoul(Value, NULL, 0);
+	}
+	else if (strncmp(Argument, "rate=", 5) == 0) {
+		Config->Rate = strtoul(Value, NULL, 0);
+	}
+	else if (strncmp(Argument, "camera=", 7) == 0) {
+		Config->CameraPeriod = strtoul(Value, NULL, 0);
+	}
+	else {
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+DWORD
+EspBenchLoad(
+	_In_ int Argc,
+	_In_reads_(Argc) char* Argv[]
+)
+
+/*++
+
+Routine Description:
+
+	This routine runs the synthetic load once per thread count and prints
+	the throughput, the latency percentiles and the driver counters of
+	each run.
+
+	N.B. The load drives the live driver. Thread counts above the number
+		of processors measure scheduling as much as the driver.
+
+		With waiters=0 only the producers run, unpaced unless a rate is
+		given. This is the producer stress test of the sample mailbox:
+		the set temperature p99 against the thread count, next to the
+		mailbox drain rate and batch size.
+
+		Each run prints the queue lock acquisitions, contentions, spin
+		success rate and hold time percentiles. Running the same thread
+		counts with the QueueLockSpinCount registry value set to 0, so
+		every contended acquisition blocks as the wait lock did, gives
+		the baseline to compare against. The value is read when the
+		device starts.
+
+Arguments:
+
+	Argc, Argv - Supply name=value options:
+
+		threads=1,2,4,8 seconds=10 waiters=1024 width=20 timeout=500
+		wave=sine|ramp|step|walk base=3000 amplitude=50 period=1000
+		rate=0 camera=0
+
+Return Value:
+
+	Win32 error code.
+
+--*/
+
+{
+	ESP_BENCH_LOAD_CONFIG Config;
+	HANDLE Device;
+	DWORD Error;
+	int Index;
+
+	ZeroMemory(&Config, sizeof(Config));
+	Config.ThreadCounts[0] = 1;
+	Config.ThreadCounts[1] = 2;
+	Config.ThreadCounts[2] = 4;
+	Config.ThreadCounts[3] = 8;
+	Config.ThreadCountCount = 4;
+	Config.Seconds = 10;
+	Config.Waiters = 1024;
+	Config.Width = 20;
+	Config.Timeout = 500;
+	Config.Waveform = EspBenchWaveformSine;
+	Config.Base = 3000;
+	Config.Amplitude = 50;
+	Config.Period = 1000;
+
+	for (Index = 0; Index < Argc; Index += 1) {
+		if (!EspBenchParseLoadOption(Argv[Index], &Config)) {
+			fprintf(stderr, "Unknown load option %s.\n", Argv[Index]);
+			return ERROR_INVALID_PARAMETER;
+		}
+	}
+
+	if (Config.Width == 0 || Config.Period == 0 || Config.Amplitude >= Config.Base) {
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	Error = EspBenchOpenDevice(FALSE, &Device);
+	if (Error != ERROR_SUCCESS) {
+		return Error;
+	}
+
+	printf("Load: %lu waiters, bounds +/-%lu, timeout %ld ms, %s wave %lu+/-%lu over %lu ms\n",
+		Config.Waiters,
+		Config.Width,
+		(LONG)Config.Timeout,
+		EspBenchWaveformNames[Config.Waveform],
+		Config.Base,
+		Config.Amplitude,
+		Config.Period);
+
+	for (Index = 0; Index < (int)Config.ThreadCountCount; Index += 1) {
+		Error = EspBenchLoadRun(Device, &Config, Config.ThreadCounts[Index]);
+		if (Error != ERROR_SUCCESS) {
+			break;
+		}
+	}
+
+	CloseHandle(Device);
+	return Error;
+}
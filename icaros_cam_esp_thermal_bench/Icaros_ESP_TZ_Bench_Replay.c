@@ -0,0 +1,1091 @@
+/*++
+
+Module Name:
+
+	replay.c
+
+Abstract:
+
+	This file contains the record and replay commands. Record drains the
+	driver IOCTL stream recorder into a trace file. Replay sends a trace
+	back to the device at its original pacing, or faster, and reports the
+	completion latency of the reads and the scan work they caused. Replay
+	can also run a trace twice, with the sample filter off and then on,
+	to compare the false crossings and the scans of the two runs.
+
+Environment:
+
+	User mode
+
+--*/
+
+#include "Bench.h"
+
+#define ESP_BENCH_TRACE_MAGIC 0x54505345    // 'ESPT'
+#define ESP_BENCH_TRACE_FILE_VERSION 1
+
+//
+// Records drained per IOCTL_ESP_TZ_RECORDER_READ, and how often.
+//
+
+#define ESP_BENCH_RECORD_BATCH 4096
+#define ESP_BENCH_RECORD_POLL_MS 250
+
+//
+// Reads are spread over several handles because the driver limits the
+// waiters pending per open file object (ClientWaiterQuota, 64 by default).
+//
+
+#define ESP_BENCH_REPLAY_CLIENTS 16
+
+//
+// Once the trace is sent, reads still pending after this long are
+// cancelled and reported separately.
+//
+
+#define ESP_BENCH_REPLAY_DRAIN_MS 10000
+
+//
+// A satisfied read is a false crossing when the median of the raw samples
+// sent in this much trace time after its sample is back inside its bounds:
+// the temperature did not stay across, the read was woken by noise.
+//
+
+#define ESP_BENCH_REPLAY_SETTLE_MS 1000
+
+//
+// The FilterMode registry values, in the order the driver numbers them.
+//
+
+static const PCSTR EspBenchFilterNames[] = { "none", "median", "exponential", "kalman" };
+
+typedef struct _ESP_BENCH_TRACE_FILE_HEADER {
+	ULONG Magic;
+	ULONG Version;
+	ULONGLONG Count;                // Records following the header.
+	ULONGLONG Dropped;              // Records the recorder could not keep.
+} ESP_BENCH_TRACE_FILE_HEADER, *PESP_BENCH_TRACE_FILE_HEADER;
+
+typedef struct _ESP_BENCH_REPLAY_READ {
+	OVERLAPPED Overlapped;
+	THERMAL_WAIT_READ Input;
+	ESP_TZ_READ_RESULT Output;
+	ULONGLONG Issued;
+} ESP_BENCH_REPLAY_READ, *PESP_BENCH_REPLAY_READ;
+
+typedef struct _ESP_BENCH_REPLAY_SAMPLE {
+	ULONGLONG Time;                 // Interrupt time before it was sent.
+	ULONG Temperature;
+} ESP_BENCH_REPLAY_SAMPLE, *PESP_BENCH_REPLAY_SAMPLE;
+
+typedef struct _ESP_BENCH_REPLAY_CROSSING {
+	ULONGLONG SampleTime;           // Of the sample that satisfied the read.
+	ULONG LowTemperature;
+	ULONG HighTemperature;
+} ESP_BENCH_REPLAY_CROSSING, *PESP_BENCH_REPLAY_CROSSING;
+
+typedef struct _ESP_BENCH_REPLAY {
+	HANDLE Port;
+	volatile LONG Outstanding;
+	ESP_BENCH_SAMPLES Completion;   // Issue to completion, user mode.
+	ESP_BENCH_SAMPLES Crossing;     // Sample to completion, driver clock.
+	ULONGLONG Satisfied;
+	ULONGLONG Expired;
+	ULONGLONG TripPoint;
+	ULONGLONG Cancelled;
+	ULONGLONG Failed;
+	ULONGLONG NotSent;              // Written by the sending thread only.
+	PESP_BENCH_REPLAY_SAMPLE Sent;  // Written by the sending thread only.
+	ULONG SentCount;
+	PESP_BENCH_REPLAY_CROSSING Crossings;
+	ULONG CrossingCount;
+} ESP_BENCH_REPLAY, *PESP_BENCH_REPLAY;
+
+//
+// What a filter comparison keeps of each run.
+//
+
+typedef struct _ESP_BENCH_REPLAY_SUMMARY {
+	ULONGLONG Crossings;
+	ULONGLONG FalseCrossings;
+	ULONGLONG ScansRun;
+	ULONGLONG WaitersVisited;
+} ESP_BENCH_REPLAY_SUMMARY, *PESP_BENCH_REPLAY_SUMMARY;
+
+static
+DWORD
+EspBenchRecorderControl(
+	_In_ HANDLE Device,
+	_In_ ULONG Action
+)
+{
+	DWORD Error;
+
+	Error = EspBenchIoctl(Device, IOCTL_ESP_TZ_RECORDER_CONTROL, &Action, sizeof(Action), NULL, 0, NULL);
+	if (Error != ERROR_SUCCESS) {
+		fprintf(stderr, "IOCTL_ESP_TZ_RECORDER_CONTROL(%lu) Failed. %lu\n", Action, Error);
+	}
+
+	return Error;
+}
+
+static
+DWORD
+EspBenchRecorderDrain(
+	_In_ HANDLE Device,
+	_In_ PESP_TZ_TRACE_BUFFER Buffer,
+	_In_ ULONG Length,
+	_In_ FILE* File,
+	_Inout_ PESP_BENCH_TRACE_FILE_HEADER Header
+)
+
+/*++
+
+Routine Description:
+
+	This routine drains the recorder into the trace file until it is empty.
+
+Arguments:
+
+	Device - Supplies a handle opened without overlapped I/O.
+
+	Buffer, Length - Supply the read buffer.
+
+	File - Supplies the trace file.
+
+	Header - Supplies the file header, updated with the records written.
+
+Return Value:
+
+	Win32 error code.
+
+--*/
+
+{
+	DWORD Error;
+
+	do {
+		Error = EspBenchIoctl(Device, IOCTL_ESP_TZ_RECORDER_READ, NULL, 0, Buffer, Length, NULL);
+		if (Error != ERROR_SUCCESS) {
+			fprintf(stderr, "IOCTL_ESP_TZ_RECORDER_READ Failed. %lu\n", Error);
+			return Error;
+		}
+
+		if (fwrite(Buffer->Records, sizeof(ESP_TZ_TRACE_RECORD), Buffer->Count, File) != Buffer->Count) {
+			fprintf(stderr, "fwrite() Failed.\n");
+			return ERROR_WRITE_FAULT;
+		}
+
+		Header->Count += Buffer->Count;
+		Header->Dropped += Buffer->Dropped;
+
+	} while (Buffer->Count == ESP_BENCH_RECORD_BATCH);
+
+	return ERROR_SUCCESS;
+}
+
+DWORD
+EspBenchRecord(
+	_In_ int Argc,
+	_In_reads_(Argc) char* Argv[]
+)
+
+/*++
+
+Routine Description:
+
+	This routine clears and starts the driver recorder, drains it to a
+	trace file for the given number of seconds, then stops it. The driver
+	drops records rather than overwriting them when its ring is full; the
+	number dropped is printed and kept in the file header.
+
+Arguments:
+
+	Argc, Argv - Supply the trace file name and the number of seconds.
+
+Return Value:
+
+	Win32 error code.
+
+--*/
+
+{
+	PESP_TZ_TRACE_BUFFER Buffer;
+	ULONGLONG Deadline;
+	HANDLE Device;
+	DWORD DrainError;
+	DWORD Error;
+	FILE* File;
+	ESP_BENCH_TRACE_FILE_HEADER Header;
+	ULONG Length;
+	ULONG Seconds;
+
+	if (Argc < 2) {
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	Buffer = NULL;
+	File = NULL;
+	Seconds = strtoul(Argv[1], NULL, 0);
+	Length = FIELD_OFFSET(ESP_TZ_TRACE_BUFFER, Records[ESP_BENCH_RECORD_BATCH]);
+
+	Error = EspBenchOpenDevice(FALSE, &Device);
+	if (Error != ERROR_SUCCESS) {
+		return Error;
+	}
+
+	Buffer = malloc(Length);
+	if (Buffer == NULL) {
+		Error = ERROR_NOT_ENOUGH_MEMORY;
+		goto RecordEnd;
+	}
+
+	if (fopen_s(&File, Argv[0], "wb") != 0) {
+		fprintf(stderr, "Cannot create %s.\n", Argv[0]);
+		Error = ERROR_CANNOT_MAKE;
+		goto RecordEnd;
+	}
+
+	ZeroMemory(&Header, sizeof(Header));
+	Header.Magic = ESP_BENCH_TRACE_MAGIC;
+	Header.Version = ESP_BENCH_TRACE_FILE_VERSION;
+	fwrite(&Header, sizeof(Header), 1, File);
+
+	Error = EspBenchRecorderControl(Device, ESP_TZ_RECORDER_CLEAR);
+	if (Error != ERROR_SUCCESS) {
+		goto RecordEnd;
+	}
+
+	Error = EspBenchRecorderControl(Device, ESP_TZ_RECORDER_START);
+	if (Error != ERROR_SUCCESS) {
+		goto RecordEnd;
+	}
+
+	printf("Recording for %lu seconds...\n", Seconds);
+	Deadline = GetTickCount64() + (ULONGLONG)Seconds * 1000;
+	while (GetTickCount64() < Deadline) {
+		Sleep(ESP_BENCH_RECORD_POLL_MS);
+		Error = EspBenchRecorderDrain(Device, Buffer, Length, File, &Header);
+		if (Error != ERROR_SUCCESS) {
+			break;
+		}
+	}
+
+	//
+	// Stop before the last drain so the records that arrive meanwhile are
+	// not left behind in the driver.
+	//
+
+	EspBenchRecorderControl(Device, ESP_TZ_RECORDER_STOP);
+	DrainError = EspBenchRecorderDrain(Device, Buffer, Length, File, &Header);
+	if (Error == ERROR_SUCCESS) {
+		Error = DrainError;
+	}
+
+	fseek(File, 0, SEEK_SET);
+	fwrite(&Header, sizeof(Header), 1, File);
+
+	printf("%llu records written to %s, %llu dropped by the driver.\n", Header.Count, Argv[0], Header.Dropped);
+
+RecordEnd:
+
+	if (File != NULL) {
+		fclose(File);
+	}
+
+	free(Buffer);
+	CloseHandle(Device);
+	return Error;
+}
+
+static
+DWORD
+EspBenchLoadTrace(
+	_In_z_ PCSTR FileName,
+	_Out_ PESP_TZ_TRACE_RECORD* Records,
+	_Out_ PULONG Count
+)
+
+/*++
+
+Routine Description:
+
+	This routine reads a trace file written by the record command.
+
+Arguments:
+
+	FileName - Supplies the trace file name.
+
+	Records - Receives the records, to be freed with free().
+
+	Count - Receives the number of records.
+
+Return Value:
+
+	Win32 error code.
+
+--*/
+
+{
+	DWORD Error;
+	FILE* File;
+	ESP_BENCH_TRACE_FILE_HEADER Header;
+
+	*Records = NULL;
+	*Count = 0;
+	if (fopen_s(&File, FileName, "rb") != 0) {
+		fprintf(stderr, "Cannot open %s.\n", FileName);
+		return ERROR_FILE_NOT_FOUND;
+	}
+
+	if (fread(&Header, sizeof(Header), 1, File) != 1 ||
+		Header.Magic != ESP_BENCH_TRACE_MAGIC ||
+		Header.Version != ESP_BENCH_TRACE_FILE_VERSION ||
+		Header.Count > MAXULONG / sizeof(ESP_TZ_TRACE_RECORD)) {
+
+		fprintf(stderr, "%s is not a trace file.\n", FileName);
+		Error = ERROR_INVALID_DATA;
+		goto LoadTraceEnd;
+	}
+
+	*Records = malloc((size_t)Header.Count * sizeof(ESP_TZ_TRACE_RECORD) + 1);
+	if (*Records == NULL) {
+		Error = ERROR_NOT_ENOUGH_MEMORY;
+		goto LoadTraceEnd;
+	}
+
+	if (fread(*Records, sizeof(ESP_TZ_TRACE_RECORD), (size_t)Header.Count, File) != Header.Count) {
+		fprintf(stderr, "%s is truncated.\n", FileName);
+		free(*Records);
+		*Records = NULL;
+		Error = ERROR_INVALID_DATA;
+		goto LoadTraceEnd;
+	}
+
+	*Count = (ULONG)Header.Count;
+	if (Header.Dropped != 0) {
+		printf("The recorder dropped %llu records from this trace.\n", Header.Dropped);
+	}
+
+	Error = ERROR_SUCCESS;
+
+LoadTraceEnd:
+
+	fclose(File);
+	return Error;
+}
+
+static
+DWORD
+WINAPI
+EspBenchReplayCompletionThread(
+	_In_ LPVOID Parameter
+)
+
+/*++
+
+Routine Description:
+
+	This routine collects the completed replay reads until it is woken
+	with no overlapped structure. It is the only writer of the read
+	samples and counters.
+
+Arguments:
+
+	Parameter - Supplies the replay state.
+
+Return Value:
+
+	Zero.
+
+--*/
+
+{
+	DWORD Bytes;
+	ULONGLONG Completed;
+	ULONG_PTR Key;
+	LPOVERLAPPED Overlapped;
+	PESP_BENCH_REPLAY_READ Read;
+	PESP_BENCH_REPLAY Replay;
+	BOOL Success;
+
+	Replay = Parameter;
+	for (;;) {
+		Overlapped = NULL;
+		Success = GetQueuedCompletionStatus(Replay->Port, &Bytes, &Key, &Overlapped, INFINITE);
+		if (Overlapped == NULL) {
+			break;
+		}
+
+		Completed = EspBenchNow();
+		Read = CONTAINING_RECORD(Overlapped, ESP_BENCH_REPLAY_READ, Overlapped);
+		if (!Success) {
+			if (GetLastError() == ERROR_OPERATION_ABORTED) {
+				Replay->Cancelled += 1;
+			}
+			else {
+				Replay->Failed += 1;
+			}
+		}
+		else {
+			EspBenchSamplesAdd(&Replay->Completion, Completed - Read->Issued);
+			if (Bytes >= sizeof(ESP_TZ_READ_RESULT)) {
+				switch (Read->Output.Reason) {
+				case EspTzWaitExpired:
+					Replay->Expired += 1;
+					break;
+
+				case EspTzWaitTripPoint:
+					Replay->TripPoint += 1;
+					break;
+
+				default:
+					Replay->Satisfied += 1;
+					EspBenchSamplesAdd(&Replay->Crossing,
+						EspBenchTicksFromUnits(Read->Output.CompletionTime - Read->Output.SampleTime));
+
+					Replay->Crossings[Replay->CrossingCount].SampleTime = Read->Output.SampleTime;
+					Replay->Crossings[Replay->CrossingCount].LowTemperature = Read->Input.LowTemperature;
+					Replay->Crossings[Replay->CrossingCount].HighTemperature = Read->Input.HighTemperature;
+					Replay->CrossingCount += 1;
+					break;
+				}
+			}
+		}
+
+		free(Read);
+		InterlockedDecrement(&Replay->Outstanding);
+	}
+
+	return 0;
+}
+
+static
+VOID
+EspBenchReplayRead(
+	_In_ PESP_BENCH_REPLAY Replay,
+	_In_ HANDLE Device,
+	_In_ PESP_TZ_TRACE_RECORD Record,
+	_In_ double Speed
+)
+
+/*++
+
+Routine Description:
+
+	This routine sends one recorded read without waiting for it. The
+	timeout is shortened by the replay speed so the read expires at the
+	same point of the replayed stream.
+
+Arguments:
+
+	Replay - Supplies the replay state.
+
+	Device - Supplies an overlapped handle bound to the completion port.
+
+	Record - Supplies the recorded read.
+
+	Speed - Supplies the replay speed factor.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	DWORD Error;
+	PESP_BENCH_REPLAY_READ Read;
+
+	Read = calloc(1, sizeof(*Read));
+	if (Read == NULL) {
+		Replay->NotSent += 1;
+		return;
+	}
+
+	Read->Input.LowTemperature = Record->Temperature;
+	Read->Input.HighTemperature = Record->HighTemperature;
+	Read->Input.Timeout = Record->Timeout;
+	if (Record->Timeout != (ULONG)-1) {
+		Read->Input.Timeout = (ULONG)((double)Record->Timeout / Speed);
+	}
+
+	InterlockedIncrement(&Replay->Outstanding);
+	Read->Issued = EspBenchNow();
+	if (!DeviceIoControl(Device,
+		IOCTL_THERMAL_READ_TEMPERATURE,
+		&Read->Input,
+		sizeof(Read->Input),
+		&Read->Output,
+		sizeof(Read->Output),
+		NULL,
+		&Read->Overlapped)) {
+
+		Error = GetLastError();
+		if (Error != ERROR_IO_PENDING) {
+
+			//
+			// No completion packet is queued for a request that failed
+			// before it was sent.
+			//
+
+			InterlockedDecrement(&Replay->Outstanding);
+			Replay->NotSent += 1;
+			free(Read);
+		}
+	}
+}
+
+static
+DWORD
+EspBenchCountFalseCrossings(
+	_In_ PESP_BENCH_REPLAY Replay,
+	_In_ double Speed,
+	_Out_ PULONGLONG FalseCrossings
+)
+
+/*++
+
+Routine Description:
+
+	This routine counts the satisfied reads that were false crossings: the
+	median of the raw samples sent within ESP_BENCH_REPLAY_SETTLE_MS of
+	trace time after the crossing sample lies strictly inside the bounds of
+	the read. Crossings with no sample after them are counted as real.
+
+	N.B. The times compared are both the coarse interrupt time, the one
+		the driver stamps samples with, taken here before each sample is
+		sent, so a sample is never placed before the one it follows.
+
+Arguments:
+
+	Replay - Supplies the finished replay.
+
+	Speed - Supplies the replay speed factor, which shortens the window.
+
+	FalseCrossings - Receives the number of false crossings.
+
+Return Value:
+
+	Win32 error code.
+
+--*/
+
+{
+	PESP_BENCH_REPLAY_CROSSING Crossing;
+	DWORD Error;
+	ULONG High;
+	ULONG Index;
+	ULONG Low;
+	ULONGLONG Median;
+	ULONG Middle;
+	ULONG Next;
+	ULONGLONG Settle;
+	ESP_BENCH_SAMPLES Window;
+
+	*FalseCrossings = 0;
+	Error = EspBenchSamplesInitialize(&Window, 64);
+	if (Error != ERROR_SUCCESS) {
+		return Error;
+	}
+
+	Settle = (ULONGLONG)((double)ESP_BENCH_REPLAY_SETTLE_MS * 10000.0 / Speed);
+	for (Index = 0; Index < Replay->CrossingCount; Index += 1) {
+		Crossing = &Replay->Crossings[Index];
+
+		//
+		// Find the first sample sent after the crossing one.
+		//
+
+		Low = 0;
+		High = Replay->SentCount;
+		while (Low < High) {
+			Middle = Low + (High - Low) / 2;
+			if (Replay->Sent[Middle].Time <= Crossing->SampleTime) {
+				Low = Middle + 1;
+			}
+			else {
+				High = Middle;
+			}
+		}
+
+		Window.Count = 0;
+		Window.Sorted = FALSE;
+		for (Next = Low;
+			 Next < Replay->SentCount && Replay->Sent[Next].Time <= Crossing->SampleTime + Settle;
+			 Next += 1) {
+
+			EspBenchSamplesAdd(&Window, Replay->Sent[Next].Temperature);
+		}
+
+		if (Window.Count == 0) {
+			continue;
+		}
+
+		Median = EspBenchSamplesPercentile(&Window, ESP_BENCH_P50);
+		if (Median > Crossing->LowTemperature && Median < Crossing->HighTemperature) {
+			*FalseCrossings += 1;
+		}
+	}
+
+	EspBenchSamplesFree(&Window);
+	return ERROR_SUCCESS;
+}
+
+static
+DWORD
+EspBenchReplayRun(
+	_In_reads_(Count) PESP_TZ_TRACE_RECORD Records,
+	_In_ ULONG Count,
+	_In_ double Speed,
+	_Out_opt_ PESP_BENCH_REPLAY_SUMMARY Summary
+)
+
+/*++
+
+Routine Description:
+
+	This routine sends a recorded trace to the device, keeping the recorded
+	gaps between records divided by the speed factor. Samples and camera
+	notifications are sent in line; reads are left pending and collected
+	by a completion thread. It then prints the completion latency of the
+	reads, the false crossings and the scan counters accumulated over the
+	replay.
+
+	N.B. The replay drives the live driver, so the time is the real clock
+		and a replay can only run as fast as the device keeps up. The
+		driver memory is not visible from here; the peak depth of the
+		wait queue is printed instead as the measure of pending state.
+
+		Replaying the same trace with the ScanQuantum registry value set
+		to 0, which never defers a scan, and again with the default shows
+		what the scan scheduler saves in queue lock acquisitions. The
+		value is read when the device starts.
+
+		All handles are closed on return, so the device can be restarted
+		between runs.
+
+Arguments:
+
+	Records, Count - Supply the trace.
+
+	Speed - Supplies the replay speed factor.
+
+	Summary - Receives the crossings and scans of the run, if given.
+
+Return Value:
+
+	Win32 error code.
+
+--*/
+
+{
+	ESP_TZ_SCAN_STATISTICS After;
+	ESP_TZ_SCAN_STATISTICS Before;
+	HANDLE Clients[ESP_BENCH_REPLAY_CLIENTS];
+	HANDLE Device;
+	ULONGLONG Due;
+	DWORD Error;
+	ULONGLONG FalseCrossings;
+	ULONG Index;
+	ESP_TZ_LOAD_STATISTICS LoadAfter;
+	ESP_TZ_LOAD_STATISTICS LoadBefore;
+	ULONGLONG Now;
+	ESP_TZ_QUEUE_STATISTICS Queues;
+	ULONG Reads;
+	ESP_BENCH_REPLAY Replay;
+	ESP_BENCH_SAMPLES Sets;
+	ULONGLONG Start;
+	HANDLE Thread;
+
+	ZeroMemory(&Replay, sizeof(Replay));
+	ZeroMemory(&Sets, sizeof(Sets));
+	Device = INVALID_HANDLE_VALUE;
+	Thread = NULL;
+	for (Index = 0; Index < ESP_BENCH_REPLAY_CLIENTS; Index += 1) {
+		Clients[Index] = INVALID_HANDLE_VALUE;
+	}
+
+	Replay.Sent = malloc((size_t)Count * sizeof(ESP_BENCH_REPLAY_SAMPLE));
+	Replay.Crossings = malloc((size_t)Count * sizeof(ESP_BENCH_REPLAY_CROSSING));
+	if (Replay.Sent == NULL || Replay.Crossings == NULL) {
+		Error = ERROR_NOT_ENOUGH_MEMORY;
+		goto ReplayRunEnd;
+	}
+
+	Error = EspBenchOpenDevice(FALSE, &Device);
+	if (Error != ERROR_SUCCESS) {
+		goto ReplayRunEnd;
+	}
+
+	Replay.Port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+	if (Replay.Port == NULL) {
+		Error = GetLastError();
+		fprintf(stderr, "CreateIoCompletionPort() Failed. %lu\n", Error);
+		goto ReplayRunEnd;
+	}
+
+	for (Index = 0; Index < ESP_BENCH_REPLAY_CLIENTS; Index += 1) {
+		Error = EspBenchOpenDevice(TRUE, &Clients[Index]);
+		if (Error != ERROR_SUCCESS) {
+			goto ReplayRunEnd;
+		}
+
+		if (CreateIoCompletionPort(Clients[Index], Replay.Port, 0, 0) == NULL) {
+			Error = GetLastError();
+			fprintf(stderr, "CreateIoCompletionPort() Failed. %lu\n", Error);
+			goto ReplayRunEnd;
+		}
+	}
+
+	if ((Error = EspBenchSamplesInitialize(&Replay.Completion, Count)) != ERROR_SUCCESS ||
+		(Error = EspBenchSamplesInitialize(&Replay.Crossing, Count)) != ERROR_SUCCESS ||
+		(Error = EspBenchSamplesInitialize(&Sets, Count)) != ERROR_SUCCESS) {
+
+		goto ReplayRunEnd;
+	}
+
+	Thread = CreateThread(NULL, 0, EspBenchReplayCompletionThread, &Replay, 0, NULL);
+	if (Thread == NULL) {
+		Error = GetLastError();
+		fprintf(stderr, "CreateThread() Failed. %lu\n", Error);
+		goto ReplayRunEnd;
+	}
+
+	Error = EspBenchQueryScanStatistics(Device, &Before);
+	if (Error != ERROR_SUCCESS) {
+		goto ReplayRunEnd;
+	}
+
+	Error = EspBenchQueryLoadStatistics(Device, &LoadBefore);
+	if (Error != ERROR_SUCCESS) {
+		goto ReplayRunEnd;
+	}
+
+	printf("Replaying %lu records at %.2fx...\n", Count, Speed);
+	Reads = 0;
+	Start = EspBenchNow();
+	for (Index = 0; Index < Count; Index += 1) {
+		Due = Start + EspBenchTicksFromUnits((ULONGLONG)((double)(Records[Index].Timestamp - Records[0].Timestamp) / Speed));
+
+		//
+		// Sleep through most of a long gap and spin the rest, so records a
+		// few microseconds apart keep their spacing.
+		//
+
+		Now = EspBenchNow();
+		if (Due > Now && EspBenchMicroseconds(Due - Now) > 2000.0) {
+			Sleep((DWORD)(EspBenchMicroseconds(Due - Now) / 1000.0) - 1);
+		}
+
+		while (EspBenchNow() < Due) {
+			YieldProcessor();
+		}
+
+		switch (Records[Index].Type) {
+		case EspTzTraceSetTemperature:
+			QueryInterruptTime(&Replay.Sent[Replay.SentCount].Time);
+			Now = EspBenchNow();
+			if (EspBenchIoctl(Device,
+				IOCTL_ESP_TZ_SET_TEMPERATURE,
+				&Records[Index].Temperature,
+				sizeof(ULONG),
+				NULL,
+				0,
+				NULL) == ERROR_SUCCESS) {
+
+				EspBenchSamplesAdd(&Sets, EspBenchNow() - Now);
+				Replay.Sent[Replay.SentCount].Temperature = Records[Index].Temperature;
+				Replay.SentCount += 1;
+			}
+
+			break;
+
+		case EspTzTraceRead:
+			EspBenchReplayRead(&Replay, Clients[Reads % ESP_BENCH_REPLAY_CLIENTS], &Records[Index], Speed);
+			Reads += 1;
+			break;
+
+		case EspTzTraceCameraOn:
+			EspBenchIoctl(Device, IOCTL_ESP_TZ_CAMERA_ON, NULL, 0, NULL, 0, NULL);
+			break;
+
+		case EspTzTraceCameraOff:
+			EspBenchIoctl(Device, IOCTL_ESP_TZ_CAMERA_OFF, NULL, 0, NULL, 0, NULL);
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	printf("Sent in %.1fms, %lu reads.\n", EspBenchMicroseconds(EspBenchNow() - Start) / 1000.0, Reads);
+
+	Now = GetTickCount64();
+	while (Replay.Outstanding != 0 && GetTickCount64() - Now < ESP_BENCH_REPLAY_DRAIN_MS) {
+		Sleep(10);
+	}
+
+	if (Replay.Outstanding != 0) {
+		for (Index = 0; Index < ESP_BENCH_REPLAY_CLIENTS; Index += 1) {
+			CancelIoEx(Clients[Index], NULL);
+		}
+
+		while (Replay.Outstanding != 0) {
+			Sleep(10);
+		}
+	}
+
+	Error = EspBenchQueryScanStatistics(Device, &After);
+	if (Error != ERROR_SUCCESS) {
+		goto ReplayRunEnd;
+	}
+
+	Error = EspBenchQueryLoadStatistics(Device, &LoadAfter);
+	if (Error != ERROR_SUCCESS) {
+		goto ReplayRunEnd;
+	}
+
+	//
+	// The completion thread is idle once nothing is outstanding, so its
+	// crossings can be read.
+	//
+
+	Error = EspBenchCountFalseCrossings(&Replay, Speed, &FalseCrossings);
+	if (Error != ERROR_SUCCESS) {
+		goto ReplayRunEnd;
+	}
+
+	printf("Reads: %llu satisfied (%llu false crossings), %llu expired, %llu trip point, %llu cancelled, %llu failed\n",
+		Replay.Satisfied,
+		FalseCrossings,
+		Replay.Expired,
+		Replay.TripPoint,
+		Replay.Cancelled,
+		Replay.Failed + Replay.NotSent);
+
+	EspBenchPrintSamples("set temperature", &Sets);
+	EspBenchPrintSamples("read completion", &Replay.Completion);
+	EspBenchPrintSamples("crossing to completion", &Replay.Crossing);
+	EspBenchPrintScanStatistics(&After, &Before);
+	printf("  queue lock: %llu acquisitions, %llu contended\n",
+		LoadAfter.QueueLockAcquisitions - LoadBefore.QueueLockAcquisitions,
+		LoadAfter.QueueLockContentions - LoadBefore.QueueLockContentions);
+
+	if (EspBenchQueryQueueStatistics(Device, &Queues) == ERROR_SUCCESS) {
+		printf("  wait queue: peak depth %lu since the device started\n", Queues.Queues[EspTzQueueWaits].MaximumDepth);
+	}
+
+	if (Summary != NULL) {
+		Summary->Crossings = Replay.Satisfied;
+		Summary->FalseCrossings = FalseCrossings;
+		Summary->ScansRun = After.ScansRun - Before.ScansRun;
+		Summary->WaitersVisited = After.WaitersVisited - Before.WaitersVisited;
+	}
+
+ReplayRunEnd:
+
+	if (Thread != NULL) {
+		PostQueuedCompletionStatus(Replay.Port, 0, 0, NULL);
+		WaitForSingleObject(Thread, INFINITE);
+		CloseHandle(Thread);
+	}
+
+	for (Index = 0; Index < ESP_BENCH_REPLAY_CLIENTS; Index += 1) {
+		if (Clients[Index] != INVALID_HANDLE_VALUE) {
+			CloseHandle(Clients[Index]);
+		}
+	}
+
+	if (Replay.Port != NULL) {
+		CloseHandle(Replay.Port);
+	}
+
+	if (Device != INVALID_HANDLE_VALUE) {
+		CloseHandle(Device);
+	}
+
+	EspBenchSamplesFree(&Sets);
+	EspBenchSamplesFree(&Replay.Crossing);
+	EspBenchSamplesFree(&Replay.Completion);
+	free(Replay.Crossings);
+	free(Replay.Sent);
+	return Error;
+}
+
+static
+DWORD
+EspBenchReplayCompareFilter(
+	_In_reads_(Count) PESP_TZ_TRACE_RECORD Records,
+	_In_ ULONG Count,
+	_In_ double Speed,
+	_In_ ULONG FilterMode
+)
+
+/*++
+
+Routine Description:
+
+	This routine replays a trace twice, first with the FilterMode device
+	parameter set to none and then to the given mode, restarting the device
+	before each run so the driver reads it. It prints the false crossings
+	and the scans of both runs, then puts the parameter back as it was.
+
+	N.B. This restarts the device, so it needs an elevated prompt and no
+		other process may hold the device open.
+
+Arguments:
+
+	Records, Count - Supply the trace.
+
+	Speed - Supplies the replay speed factor.
+
+	FilterMode - Supplies the filter mode of the second run.
+
+Return Value:
+
+	Win32 error code.
+
+--*/
+
+{
+	DEVINST DevInst;
+	DWORD Error;
+	BOOLEAN HadValue;
+	ULONG Modes[2];
+	ULONG Original;
+	ULONG Run;
+	DWORD RestoreError;
+	ESP_BENCH_REPLAY_SUMMARY Summaries[2];
+
+	ZeroMemory(Summaries, sizeof(Summaries));
+	Error = EspBenchLocateDevice(&DevInst);
+	if (Error != ERROR_SUCCESS) {
+		return Error;
+	}
+
+	Error = EspBenchQueryDeviceParameter(DevInst, L"FilterMode", &Original);
+	if (Error != ERROR_SUCCESS && Error != ERROR_FILE_NOT_FOUND) {
+		fprintf(stderr, "Cannot read the FilterMode device parameter. %lu\n", Error);
+		return Error;
+	}
+
+	HadValue = (Error == ERROR_SUCCESS);
+	Modes[0] = 0;
+	Modes[1] = FilterMode;
+	for (Run = 0; Run < ARRAYSIZE(Modes); Run += 1) {
+		Error = EspBenchSetDeviceParameter(DevInst, L"FilterMode", &Modes[Run]);
+		if (Error == ERROR_SUCCESS) {
+			Error = EspBenchRestartDevice(DevInst);
+		}
+
+		if (Error != ERROR_SUCCESS) {
+			break;
+		}
+
+		printf("Filter %s:\n", EspBenchFilterNames[Modes[Run]]);
+		Error = EspBenchReplayRun(Records, Count, Speed, &Summaries[Run]);
+		if (Error != ERROR_SUCCESS) {
+			break;
+		}
+	}
+
+	RestoreError = EspBenchSetDeviceParameter(DevInst, L"FilterMode", HadValue ? &Original : NULL);
+	if (RestoreError == ERROR_SUCCESS) {
+		RestoreError = EspBenchRestartDevice(DevInst);
+	}
+
+	if (Error != ERROR_SUCCESS) {
+		return Error;
+	}
+
+	printf("Filter comparison:\n");
+	for (Run = 0; Run < ARRAYSIZE(Modes); Run += 1) {
+		printf("  %-12s %8llu crossings, %8llu false, %8llu scans, %10llu waiters visited\n",
+			EspBenchFilterNames[Modes[Run]],
+			Summaries[Run].Crossings,
+			Summaries[Run].FalseCrossings,
+			Summaries[Run].ScansRun,
+			Summaries[Run].WaitersVisited);
+	}
+
+	return RestoreError;
+}
+
+DWORD
+EspBenchReplay(
+	_In_ int Argc,
+	_In_reads_(Argc) char* Argv[]
+)
+
+/*++
+
+Routine Description:
+
+	This routine replays a trace once, or twice to compare the filter off
+	with the filter mode given as filter=<mode>.
+
+Arguments:
+
+	Argc, Argv - Supply the trace file name, the optional speed and the
+		optional filter=median|exponential|kalman.
+
+Return Value:
+
+	Win32 error code.
+
+--*/
+
+{
+	ULONG Count;
+	DWORD Error;
+	ULONG FilterMode;
+	int Index;
+	PESP_TZ_TRACE_RECORD Records;
+	double Speed;
+
+	if (Argc < 1) {
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	Speed = 1.0;
+	FilterMode = 0;
+	for (Index = 1; Index < Argc; Index += 1) {
+		if (strncmp(Argv[Index], "filter=", 7) == 0) {
+			for (FilterMode = 1; FilterMode < ARRAYSIZE(EspBenchFilterNames); FilterMode += 1) {
+				if (strcmp(Argv[Index] + 7, EspBenchFilterNames[FilterMode]) == 0) {
+					break;
+				}
+			}
+
+			if (FilterMode == ARRAYSIZE(EspBenchFilterNames)) {
+				return ERROR_INVALID_PARAMETER;
+			}
+		}
+		else {
+			Speed = strtod(Argv[Index], NULL);
+		}
+	}
+
+	if (Speed <= 0.0) {
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	Error = EspBenchLoadTrace(Argv[0], &Records, &Count);
+	if (Error != ERROR_SUCCESS) {
+		return Error;
+	}
+
+	if (Count == 0) {
+		printf("The trace is empty.\n");
+	}
+	else if (FilterMode == 0) {
+		Error = EspBenchReplayRun(Records, Count, Speed, NULL);
+	}
+	else {
+		Error = EspBenchReplayCompareFilter(Records, Count, Speed, FilterMode);
+	}
+
+	free(Records);
+	return Error;
+}
@@ -0,0 +1,234 @@
+/*++
+
+Module Name:
+
+	resume.c
+
+Abstract:
+
+	This file contains the resume command. It restarts the device and
+	measures how long it takes until a read is notified against the
+	temperature published before the restart.
+
+Environment:
+
+	User mode
+
+--*/
+
+#include "Bench.h"
+
+//
+// The notification read has its upper bound this far below the published
+// temperature, so it completes at once on the right sample and reports a
+// device that started from the reset temperature as well, with that one.
+//
+
+#define ESP_BENCH_RESUME_WIDTH 20
+
+#define ESP_BENCH_RESUME_DEFAULT_TEMPERATURE 3150
+
+static
+DWORD
+EspBenchReadTemperature(
+	_In_ HANDLE Device,
+	_In_ ULONG LowTemperature,
+	_In_ ULONG HighTemperature,
+	_In_ ULONG Timeout,
+	_Out_ PESP_TZ_READ_RESULT Result
+)
+{
+	DWORD Error;
+	THERMAL_WAIT_READ Input;
+
+	Input.Timeout = Timeout;
+	Input.LowTemperature = LowTemperature;
+	Input.HighTemperature = HighTemperature;
+	ZeroMemory(Result, sizeof(*Result));
+	Error = EspBenchIoctl(Device,
+		IOCTL_THERMAL_READ_TEMPERATURE,
+		&Input,
+		sizeof(Input),
+		Result,
+		sizeof(*Result),
+		NULL);
+
+	if (Error != ERROR_SUCCESS) {
+		fprintf(stderr, "IOCTL_THERMAL_READ_TEMPERATURE Failed. %lu\n", Error);
+	}
+
+	return Error;
+}
+
+DWORD
+EspBenchResume(
+	_In_ int Argc,
+	_In_reads_(Argc) char* Argv[]
+)
+
+/*++
+
+Routine Description:
+
+	This routine publishes a temperature, disables and enables the device
+	node, and prints the time from the enable to the interface coming back
+	and to the first read notified with the temperature published before.
+	It then prints the scans the new device instance ran, which stay few
+	when the device resumed from its saved state.
+
+	N.B. Disabling a device node needs an elevated prompt, and fails while
+		any other process holds a handle to the device.
+
+		The device restores the saved sample only while it is younger
+		than SavedStateMaximumAge; a temperature equal to the reset
+		temperature of 2940 cannot tell the two apart.
+
+Arguments:
+
+	Argc, Argv - Supply the optional temperature to publish, in tenths of
+		a Kelvin.
+
+Return Value:
+
+	Win32 error code.
+
+--*/
+
+{
+	BOOLEAN Correct;
+	CONFIGRET ConfigRet;
+	DEVINST DevInst;
+	HANDLE Device;
+	ULONGLONG Enabled;
+	DWORD Error;
+	ULONG Expected;
+	PWSTR Interface;
+	ULONGLONG Notified;
+	ULONGLONG Opened;
+	ESP_TZ_READ_RESULT Result;
+	ESP_TZ_SCAN_STATISTICS Scans;
+	ULONGLONG Start;
+	ULONG Temperature;
+
+	Temperature = (Argc > 0) ? strtoul(Argv[0], NULL, 0) : ESP_BENCH_RESUME_DEFAULT_TEMPERATURE;
+	if (Temperature <= 2 * ESP_BENCH_RESUME_WIDTH) {
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	Error = EspBenchLocateDevice(&DevInst);
+	if (Error != ERROR_SUCCESS) {
+		return Error;
+	}
+
+	//
+	// Publish the temperature and read back what the device made of it,
+	// which the filter may have changed.
+	//
+
+	Error = EspBenchOpenDevice(FALSE, &Device);
+	if (Error != ERROR_SUCCESS) {
+		return Error;
+	}
+
+	Error = EspBenchIoctl(Device, IOCTL_ESP_TZ_SET_TEMPERATURE, &Temperature, sizeof(Temperature), NULL, 0, NULL);
+	if (Error != ERROR_SUCCESS) {
+		fprintf(stderr, "IOCTL_ESP_TZ_SET_TEMPERATURE Failed. %lu\n", Error);
+		goto ResumeEnd;
+	}
+
+	Error = EspBenchReadTemperature(Device, 0, MAXULONG, 0, &Result);
+	if (Error != ERROR_SUCCESS) {
+		goto ResumeEnd;
+	}
+
+	Expected = Result.Temperature;
+	CloseHandle(Device);
+	Device = INVALID_HANDLE_VALUE;
+
+	printf("Restarting the device at %lu.%lu K...\n", Expected / 10, Expected % 10);
+	ConfigRet = CM_Disable_DevNode(DevInst, CM_DISABLE_UI_NOT_OK);
+	if (ConfigRet != CR_SUCCESS) {
+		fprintf(stderr, "CM_Disable_DevNode() Failed. 0x%lx\n", ConfigRet);
+		Error = CM_MapCrToWin32Err(ConfigRet, ERROR_ACCESS_DENIED);
+		goto ResumeEnd;
+	}
+
+	Start = EspBenchNow();
+	ConfigRet = CM_Enable_DevNode(DevInst, 0);
+	if (ConfigRet != CR_SUCCESS) {
+		fprintf(stderr, "CM_Enable_DevNode() Failed, the device is left disabled. 0x%lx\n", ConfigRet);
+		Error = CM_MapCrToWin32Err(ConfigRet, ERROR_NOT_READY);
+		goto ResumeEnd;
+	}
+
+	Enabled = EspBenchNow();
+
+	//
+	// The interface is enabled once the device has started.
+	//
+
+	do {
+		Error = EspBenchGetDeviceInterface(&Interface);
+		if (Error == ERROR_SUCCESS) {
+			Device = CreateFileW(Interface,
+				GENERIC_READ | GENERIC_WRITE,
+				FILE_SHARE_READ | FILE_SHARE_WRITE,
+				NULL,
+				OPEN_EXISTING,
+				FILE_ATTRIBUTE_NORMAL,
+				NULL);
+
+			Error = (Device != INVALID_HANDLE_VALUE) ? ERROR_SUCCESS : GetLastError();
+			free(Interface);
+		}
+
+		if (Error == ERROR_SUCCESS) {
+			break;
+		}
+
+		Sleep(1);
+
+	} while (EspBenchMicroseconds(EspBenchNow() - Start) < ESP_BENCH_RESTART_TIMEOUT_MS * 1000.0);
+
+	if (Error != ERROR_SUCCESS) {
+		fprintf(stderr, "The device did not come back. %lu\n", Error);
+		goto ResumeEnd;
+	}
+
+	Opened = EspBenchNow();
+	Error = EspBenchReadTemperature(Device,
+		Expected - 2 * ESP_BENCH_RESUME_WIDTH,
+		Expected - ESP_BENCH_RESUME_WIDTH,
+		1000,
+		&Result);
+
+	if (Error != ERROR_SUCCESS) {
+		goto ResumeEnd;
+	}
+
+	Notified = EspBenchNow();
+	Correct = (Result.Reason == EspTzWaitSatisfied && Result.Temperature == Expected);
+
+	printf("  enable: %.1fms\n", EspBenchMicroseconds(Enabled - Start) / 1000.0);
+	printf("  interface open: %.1fms\n", EspBenchMicroseconds(Opened - Start) / 1000.0);
+	printf("  first notification: %.1fms, %lu.%lu K, %s\n",
+		EspBenchMicroseconds(Notified - Start) / 1000.0,
+		Result.Temperature / 10,
+		Result.Temperature % 10,
+		Correct ? "correct" : "wrong, the saved state was not restored");
+
+	if (EspBenchQueryScanStatistics(Device, &Scans) == ERROR_SUCCESS) {
+		printf("  scans since start: %llu run, %llu waiters visited, %llu fast path\n",
+			Scans.ScansRun,
+			Scans.WaitersVisited,
+			Scans.FastPathHits);
+	}
+
+ResumeEnd:
+
+	if (Device != INVALID_HANDLE_VALUE) {
+		CloseHandle(Device);
+	}
+
+	return Error;
+}
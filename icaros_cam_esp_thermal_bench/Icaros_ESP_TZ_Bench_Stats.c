@@ -0,0 +1,694 @@
+/*++
+
+Module Name:
+
+	stats.c
+
+Abstract:
+
+	This file contains the helpers that query the driver statistics and the
+	latency command, which turns the per-IOCTL latency histograms into
+	percentiles.
+
+Environment:
+
+	User mode
+
+--*/
+
+#include "Bench.h"
+
+static const PCSTR EspBenchIoctlNames[] = {
+	"SET_TEMPERATURE",
+	"CAMERA_ON",
+	"CAMERA_OFF",
+	"QUERY_LATENCY",
+	"QUERY_SCAN_STATISTICS",
+	"RECORDER_CONTROL",
+	"RECORDER_READ",
+	"QUERY_LOAD_STATISTICS",
+	"SET_TRIP_POINTS",
+	"QUERY_HISTORY",
+	"MULTI_WAIT",
+	"SET_TEMPERATURES",
+	"QUERY_QUEUE_STATISTICS",
+};
+
+static
+PCSTR
+EspBenchIoctlName(
+	_In_ ULONG IoControlCode
+)
+
+/*++
+
+Routine Description:
+
+	This routine names a control code reported by the latency query.
+
+Arguments:
+
+	IoControlCode - Supplies the control code, zero for requests forwarded
+		down the stack.
+
+Return Value:
+
+	The name.
+
+--*/
+
+{
+	ULONG Index;
+
+	if (IoControlCode == 0) {
+		return "FORWARDED";
+	}
+
+	if (IoControlCode == IOCTL_THERMAL_READ_TEMPERATURE) {
+		return "READ_TEMPERATURE";
+	}
+
+	Index = ((IoControlCode >> 2) & 0xFFF) - ESP_TZ_IOCTL_FUNCTION_BASE;
+	if (IoControlCode == ESP_TZ_CTL_CODE(Index) && Index < ARRAYSIZE(EspBenchIoctlNames)) {
+		return EspBenchIoctlNames[Index];
+	}
+
+	return "UNKNOWN";
+}
+
+DWORD
+EspBenchQueryLatency(
+	_In_ HANDLE Device,
+	_Out_ PESP_TZ_LATENCY_STATISTICS* Statistics
+)
+
+/*++
+
+Routine Description:
+
+	This routine queries the latency histograms of every IOCTL. The header
+	is queried first for the size of the entries.
+
+Arguments:
+
+	Device - Supplies a handle opened without overlapped I/O.
+
+	Statistics - Receives the statistics, to be freed with free().
+
+Return Value:
+
+	Win32 error code.
+
+--*/
+
+{
+	PESP_TZ_LATENCY_STATISTICS Buffer;
+	DWORD Error;
+	ESP_TZ_LATENCY_STATISTICS Header;
+
+	*Statistics = NULL;
+	Error = EspBenchIoctl(Device,
+		IOCTL_ESP_TZ_QUERY_LATENCY,
+		NULL,
+		0,
+		&Header,
+		FIELD_OFFSET(ESP_TZ_LATENCY_STATISTICS, Entries),
+		NULL);
+
+	if (Error != ERROR_SUCCESS && Error != ERROR_MORE_DATA) {
+		fprintf(stderr, "IOCTL_ESP_TZ_QUERY_LATENCY Failed. %lu\n", Error);
+		return Error;
+	}
+
+	if (Header.Version != ESP_TZ_LATENCY_VERSION ||
+		Header.Size < FIELD_OFFSET(ESP_TZ_LATENCY_STATISTICS, Entries)) {
+
+		fprintf(stderr, "Unexpected latency statistics version %lu.\n", Header.Version);
+		return ERROR_INVALID_DATA;
+	}
+
+	Buffer = malloc(Header.Size);
+	if (Buffer == NULL) {
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	Error = EspBenchIoctl(Device,
+		IOCTL_ESP_TZ_QUERY_LATENCY,
+		NULL,
+		0,
+		Buffer,
+		Header.Size,
+		NULL);
+
+	if (Error != ERROR_SUCCESS) {
+		fprintf(stderr, "IOCTL_ESP_TZ_QUERY_LATENCY Failed. %lu\n", Error);
+		free(Buffer);
+		return Error;
+	}
+
+	*Statistics = Buffer;
+	return ERROR_SUCCESS;
+}
+
+DWORD
+EspBenchQueryScanStatistics(
+	_In_ HANDLE Device,
+	_Out_ PESP_TZ_SCAN_STATISTICS Statistics
+)
+
+/*++
+
+Routine Description:
+
+	This routine queries the scan statistics.
+
+Arguments:
+
+	Device - Supplies a handle opened without overlapped I/O.
+
+	Statistics - Receives the statistics.
+
+Return Value:
+
+	Win32 error code.
+
+--*/
+
+{
+	DWORD Error;
+
+	ZeroMemory(Statistics, sizeof(*Statistics));
+	Error = EspBenchIoctl(Device,
+		IOCTL_ESP_TZ_QUERY_SCAN_STATISTICS,
+		NULL,
+		0,
+		Statistics,
+		sizeof(*Statistics),
+		NULL);
+
+	if (Error != ERROR_SUCCESS) {
+		fprintf(stderr, "IOCTL_ESP_TZ_QUERY_SCAN_STATISTICS Failed. %lu\n", Error);
+	}
+
+	return Error;
+}
+
+DWORD
+EspBenchQueryQueueStatistics(
+	_In_ HANDLE Device,
+	_Out_ PESP_TZ_QUEUE_STATISTICS Statistics
+)
+
+/*++
+
+Routine Description:
+
+	This routine queries the per-class queue statistics.
+
+Arguments:
+
+	Device - Supplies a handle opened without overlapped I/O.
+
+	Statistics - Receives the statistics.
+
+Return Value:
+
+	Win32 error code.
+
+--*/
+
+{
+	DWORD Error;
+
+	ZeroMemory(Statistics, sizeof(*Statistics));
+	Error = EspBenchIoctl(Device,
+		IOCTL_ESP_TZ_QUERY_QUEUE_STATISTICS,
+		NULL,
+		0,
+		Statistics,
+		sizeof(*Statistics),
+		NULL);
+
+	if (Error != ERROR_SUCCESS) {
+		fprintf(stderr, "IOCTL_ESP_TZ_QUERY_QUEUE_STATISTICS Failed. %lu\n", Error);
+	}
+
+	return Error;
+}
+
+DWORD
+EspBenchQueryLoadStatistics(
+	_In_ HANDLE Device,
+	_Out_ PESP_TZ_LOAD_STATISTICS Statistics
+)
+
+/*++
+
+Routine Description:
+
+	This routine queries the load statistics.
+
+Arguments:
+
+	Device - Supplies a handle opened without overlapped I/O.
+
+	Statistics - Receives the statistics.
+
+Return Value:
+
+	Win32 error code.
+
+--*/
+
+{
+	DWORD Error;
+
+	ZeroMemory(Statistics, sizeof(*Statistics));
+	Error = EspBenchIoctl(Device,
+		IOCTL_ESP_TZ_QUERY_LOAD_STATISTICS,
+		NULL,
+		0,
+		Statistics,
+		sizeof(*Statistics),
+		NULL);
+
+	if (Error != ERROR_SUCCESS) {
+		fprintf(stderr, "IOCTL_ESP_TZ_QUERY_LOAD_STATISTICS Failed. %lu\n", Error);
+	}
+
+	return Error;
+}
+
+VOID
+EspBenchPrintLoadStatistics(
+	_In_ PESP_TZ_LOAD_STATISTICS After,
+	_In_ PESP_TZ_LOAD_STATISTICS Before
+)
+
+/*++
+
+Routine Description:
+
+	This routine prints the lock and interrupt delivery counters
+	accumulated between two snapshots. Interrupts raised while the worker
+	was already queued are coalesced into its next run. A contended queue
+	lock acquisition that spun rather than blocked counts as a spin
+	success.
+
+Arguments:
+
+	After - Supplies the later snapshot.
+
+	Before - Supplies the earlier snapshot.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	ULONGLONG Contentions;
+	ULONGLONG Holds[ESP_TZ_LOCK_HOLD_BUCKETS];
+	ULONG Index;
+
+	printf("  contentions: queue lock %llu, sensor lock %llu (longest sensor hold %.1fus)\n",
+		After->QueueLockContentions - Before->QueueLockContentions,
+		After->SensorLockContentions - Before->SensorLockContentions,
+		(double)After->MaximumSensorLockHoldTime / 10.0);
+
+	Contentions = After->QueueLockContentions - Before->QueueLockContentions;
+	printf("  queue lock: %llu acquisitions, %llu contended, %.1f%% of those acquired spinning\n",
+		After->QueueLockAcquisitions - Before->QueueLockAcquisitions,
+		Contentions,
+		(Contentions != 0) ?
+			100.0 * (double)(After->QueueLockSpinAcquisitions - Before->QueueLockSpinAcquisitions) / (double)Contentions :
+			0.0);
+
+	for (Index = 0; Index < ESP_TZ_LOCK_HOLD_BUCKETS; Index += 1) {
+		Holds[Index] = After->QueueLockHoldTimes[Index] - Before->QueueLockHoldTimes[Index];
+	}
+
+	EspBenchPrintBuckets("queue lock hold", Holds, ESP_TZ_LOCK_HOLD_BUCKETS, 100);
+
+	printf("  interrupts: raised %llu, worker runs %llu\n",
+		After->InterruptsRaised - Before->InterruptsRaised,
+		After->InterruptWorkerRuns - Before->InterruptWorkerRuns);
+}
+
+VOID
+EspBenchPrintScanStatistics(
+	_In_ PESP_TZ_SCAN_STATISTICS After,
+	_In_ PESP_TZ_SCAN_STATISTICS Before
+)
+
+/*++
+
+Routine Description:
+
+	This routine prints the scan counters accumulated between two
+	snapshots. Triggers merged into a scheduled scan, ScanRequests minus
+	ScansRun, are queue lock acquisitions the scheduler saved. The maximum
+	queue lock hold time is a high-water mark since the device started, not
+	a difference.
+
+Arguments:
+
+	After - Supplies the later snapshot.
+
+	Before - Supplies the earlier snapshot.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	printf("  scans: enqueue %llu, interrupt %llu, timer %llu, run %llu\n",
+		After->EnqueueScans - Before->EnqueueScans,
+		After->InterruptScans - Before->InterruptScans,
+		After->TimerScans - Before->TimerScans,
+		After->ScansRun - Before->ScansRun);
+
+	printf("  scheduler: %llu triggers, %llu merged, %llu deferred, %llu slices, %llu lock acquisitions saved\n",
+		After->ScanRequests - Before->ScanRequests,
+		After->ScansMerged - Before->ScansMerged,
+		After->ScansDeferred - Before->ScansDeferred,
+		After->ScanSlices - Before->ScanSlices,
+		(After->ScanRequests - Before->ScanRequests) - (After->ScansRun - Before->ScansRun));
+
+	printf("  waiters: visited %llu, satisfied %llu, expired %llu, fast path %llu, restarts %llu\n",
+		After->WaitersVisited - Before->WaitersVisited,
+		After->RetiredSatisfied - Before->RetiredSatisfied,
+		After->RetiredExpired - Before->RetiredExpired,
+		After->FastPathHits - Before->FastPathHits,
+		After->Restarts - Before->Restarts);
+
+	printf("  queue lock: longest hold %.1fus\n", (double)After->MaximumQueueLockHoldTime / 10.0);
+}
+
+static
+ULONG
+EspBenchBucketPercentile(
+	_In_reads_(BucketCount) const ULONGLONG* Buckets,
+	_In_ ULONG BucketCount,
+	_In_ ULONG Permille,
+	_Out_ PULONGLONG Total
+)
+
+/*++
+
+Routine Description:
+
+	This routine finds the bucket holding a percentile of a histogram.
+
+Arguments:
+
+	Buckets - Supplies the histogram.
+
+	BucketCount - Supplies the number of buckets.
+
+	Permille - Supplies the percentile in thousandths.
+
+	Total - Receives the number of samples in the histogram.
+
+Return Value:
+
+	The bucket index, BucketCount if the histogram is empty.
+
+--*/
+
+{
+	ULONG Bucket;
+	ULONGLONG Rank;
+	ULONGLONG Seen;
+
+	*Total = 0;
+	for (Bucket = 0; Bucket < BucketCount; Bucket += 1) {
+		*Total += Buckets[Bucket];
+	}
+
+	if (*Total == 0) {
+		return BucketCount;
+	}
+
+	Rank = (*Total * Permille + 999) / 1000;
+	if (Rank == 0) {
+		Rank = 1;
+	}
+
+	Seen = 0;
+	for (Bucket = 0; Bucket < BucketCount; Bucket += 1) {
+		Seen += Buckets[Bucket];
+		if (Seen >= Rank) {
+			break;
+		}
+	}
+
+	return Bucket;
+}
+
+static
+VOID
+EspBenchFormatBucket(
+	_Out_writes_(Length) char* Text,
+	_In_ size_t Length,
+	_In_ ULONG Bucket,
+	_In_ ULONG BucketCount,
+	_In_ ULONG BucketUnit
+)
+
+/*++
+
+Routine Description:
+
+	This routine formats the bounds of a bucket in microseconds. Bucket N
+	holds [2^(N-1), 2^N) units, so a percentile falling in it is printed as
+	its upper bound; the last bucket is open and prints its lower bound.
+
+Arguments:
+
+	Text, Length - Supply the output string.
+
+	Bucket - Supplies the bucket index.
+
+	BucketCount - Supplies the number of buckets.
+
+	BucketUnit - Supplies the nanoseconds per unit.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	double Bound;
+
+	if (Bucket >= BucketCount) {
+		_snprintf_s(Text, Length, _TRUNCATE, "%s", "-");
+		return;
+	}
+
+	if (Bucket == BucketCount - 1) {
+		Bound = (double)(1ULL << (Bucket - 1)) * BucketUnit / 1000.0;
+		_snprintf_s(Text, Length, _TRUNCATE, ">=%.1fus", Bound);
+		return;
+	}
+
+	Bound = (double)(1ULL << Bucket) * BucketUnit / 1000.0;
+	_snprintf_s(Text, Length, _TRUNCATE, "<%.1fus", Bound);
+}
+
+VOID
+EspBenchPrintBuckets(
+	_In_z_ PCSTR Label,
+	_In_reads_(BucketCount) const ULONGLONG* Buckets,
+	_In_ ULONG BucketCount,
+	_In_ ULONG BucketUnit
+)
+
+/*++
+
+Routine Description:
+
+	This routine prints the count, median, p99 and maximum of a latency
+	histogram kept by the driver.
+
+Arguments:
+
+	Label - Supplies the line label.
+
+	Buckets - Supplies the histogram.
+
+	BucketCount - Supplies the number of buckets.
+
+	BucketUnit - Supplies the nanoseconds per unit.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	char Maximum[32];
+	char Median[32];
+	char P99[32];
+	ULONGLONG Total;
+
+	EspBenchFormatBucket(Median, sizeof(Median),
+		EspBenchBucketPercentile(Buckets, BucketCount, ESP_BENCH_P50, &Total),
+		BucketCount,
+		BucketUnit);
+
+	if (Total == 0) {
+		return;
+	}
+
+	EspBenchFormatBucket(P99, sizeof(P99),
+		EspBenchBucketPercentile(Buckets, BucketCount, ESP_BENCH_P99, &Total),
+		BucketCount,
+		BucketUnit);
+
+	EspBenchFormatBucket(Maximum, sizeof(Maximum),
+		EspBenchBucketPercentile(Buckets, BucketCount, ESP_BENCH_MAX, &Total),
+		BucketCount,
+		BucketUnit);
+
+	printf("    %-10s n=%-9llu p50=%-12s p99=%-12s max=%s\n", Label, Total, Median, P99, Maximum);
+}
+
+static
+VOID
+EspBenchSubtractLatency(
+	_Inout_ PESP_TZ_LATENCY_STATISTICS After,
+	_In_ PESP_TZ_LATENCY_STATISTICS Before
+)
+
+/*++
+
+Routine Description:
+
+	This routine turns the After counters into the counts accumulated since
+	Before. The counters only grow, so each entry is a plain difference.
+
+Arguments:
+
+	After - Supplies the later snapshot and receives the difference.
+
+	Before - Supplies the earlier snapshot.
+
+Return Value:
+
+	None.
+
+--*/
+
+{
+	ULONG Bucket;
+	PESP_TZ_IOCTL_LATENCY Entry;
+	ULONG Index;
+	PESP_TZ_IOCTL_LATENCY Previous;
+
+	for (Index = 0; Index < After->EntryCount && Index < Before->EntryCount; Index += 1) {
+		Entry = &After->Entries[Index];
+		Previous = &Before->Entries[Index];
+		Entry->Requests -= Previous->Requests;
+		Entry->Rejected -= Previous->Rejected;
+		for (Bucket = 0; Bucket < ESP_TZ_LATENCY_BUCKETS; Bucket += 1) {
+			Entry->Service[Bucket] -= Previous->Service[Bucket];
+			Entry->Pending[Bucket] -= Previous->Pending[Bucket];
+			Entry->Crossing[Bucket] -= Previous->Crossing[Bucket];
+		}
+	}
+}
+
+DWORD
+EspBenchLatency(
+	_In_ int Argc,
+	_In_reads_(Argc) char* Argv[]
+)
+
+/*++
+
+Routine Description:
+
+	This routine prints the p50, p99 and maximum of the service, pending
+	and crossing latency of every IOCTL the driver has seen. With a number
+	of seconds it prints only what accumulated over that interval.
+
+Arguments:
+
+	Argc, Argv - Supply the optional interval in seconds.
+
+Return Value:
+
+	Win32 error code.
+
+--*/
+
+{
+	PESP_TZ_LATENCY_STATISTICS Before;
+	HANDLE Device;
+	PESP_TZ_IOCTL_LATENCY Entry;
+	DWORD Error;
+	ULONG Index;
+	ULONG Seconds;
+	PESP_TZ_LATENCY_STATISTICS Statistics;
+
+	Before = NULL;
+	Statistics = NULL;
+	Seconds = (Argc > 0) ? strtoul(Argv[0], NULL, 0) : 0;
+
+	Error = EspBenchOpenDevice(FALSE, &Device);
+	if (Error != ERROR_SUCCESS) {
+		return Error;
+	}
+
+	if (Seconds != 0) {
+		Error = EspBenchQueryLatency(Device, &Before);
+		if (Error != ERROR_SUCCESS) {
+			goto LatencyEnd;
+		}
+
+		Sleep(Seconds * 1000);
+	}
+
+	Error = EspBenchQueryLatency(Device, &Statistics);
+	if (Error != ERROR_SUCCESS) {
+		goto LatencyEnd;
+	}
+
+	if (Before != NULL) {
+		EspBenchSubtractLatency(Statistics, Before);
+	}
+
+	printf("Latency, %s, %s delivery\n",
+		(Seconds != 0) ? "interval" : "since start",
+		(Statistics->Flags & ESP_TZ_LATENCY_FLAG_LOW_LATENCY) ? "low-latency thread" : "work item");
+
+	for (Index = 0; Index < Statistics->EntryCount; Index += 1) {
+		Entry = &Statistics->Entries[Index];
+		if (Entry->Requests == 0 && Entry->Rejected == 0) {
+			continue;
+		}
+
+		printf("  %s: %llu requests, %llu rejected\n",
+			EspBenchIoctlName(Entry->IoControlCode),
+			Entry->Requests,
+			Entry->Rejected);
+
+		EspBenchPrintBuckets("service", Entry->Service, Statistics->BucketCount, Statistics->BucketUnit);
+		EspBenchPrintBuckets("pending", Entry->Pending, Statistics->BucketCount, Statistics->BucketUnit);
+		EspBenchPrintBuckets("crossing", Entry->Crossing, Statistics->BucketCount, Statistics->BucketUnit);
+	}
+
+LatencyEnd:
+
+	free(Statistics);
+	free(Before);
+	CloseHandle(Device);
+	return Error;
+}